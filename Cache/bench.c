@@ -0,0 +1,293 @@
+/*
+ * bench.c
+ *
+ * Throughput benchmark of the simulator. For every replacement policy,
+ * associativity and access pattern, the accesses of the pattern are
+ * simulated on a fresh cache a number of times, and the median and
+ * percentiles of the time per access are reported as JSON on stdout.
+ *
+ * The patterns are the sumA, sumB, sumC and sumD kernels of main.c, uniform
+ * random reads, a mix of reads and writes to a hot and a cold region, and,
+ * when a trace (see trace.h) is given, its first MAX_TRACE accesses. The
+ * "victim" pattern times find_available_cache_line alone on full sets.
+ *
+ * Usage: bench [repetitions [trace]]
+ */
+#include "cache.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define ROWS 256
+#define COLS 256
+#define NUM_BYTES 32768
+#define LINE_SIZE 64
+#define MAX_ACCESSES (ROWS * COLS)
+#define MAX_TRACE (1 << 20)
+#define DEFAULT_REPETITIONS 5
+
+static int64_t __attribute__ ((aligned (1024))) test_array[ROWS * COLS];
+
+/*
+ * An access pattern: its accesses, and whether each is a write (is_write is
+ * NULL for reads only).
+ */
+typedef struct pattern_s {
+    const char *name;
+    uintptr_t *addresses;
+    uint8_t *is_write;
+    size_t n;
+} pattern_t;
+
+typedef struct policy_s {
+    const char *name;
+    uint32_t policies;
+} policy_t;
+
+static const policy_t policies[] = {
+    {"RANDOM", CACHE_REPLACEMENTPOLICY_RANDOM},
+    {"LRU", CACHE_REPLACEMENTPOLICY_LRU},
+    {"MRU", CACHE_REPLACEMENTPOLICY_MRU},
+    {"TREE_PLRU", CACHE_REPLACEMENTPOLICY_TREE_PLRU},
+    {"RANDOMIZED_MARKING", CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING},
+    {"BIT_PLRU", CACHE_REPLACEMENTPOLICY_BIT_PLRU},
+};
+
+static const size_t associativities[] = {1, 2, 4, 8, 16};
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uintptr_t element(size_t i, size_t j) {
+    return (uintptr_t) &test_array[i * COLS + j];
+}
+
+static pattern_t *pattern_new(pattern_t *patterns, size_t *num_patterns, const char *name, bool has_writes) {
+    pattern_t *pattern = &patterns[(*num_patterns)++];
+
+    pattern->name = name;
+    pattern->addresses = (uintptr_t *)malloc(MAX_ACCESSES * sizeof(uintptr_t));
+    pattern->is_write = has_writes ? (uint8_t *)calloc(MAX_ACCESSES, 1) : NULL;
+    pattern->n = 0;
+    return pattern;
+}
+
+/*
+ * Record the accesses of the kernels of main.c and of the synthetic patterns.
+ */
+static size_t build_patterns(pattern_t *patterns) {
+    size_t num_patterns = 0, i, j, k;
+    pattern_t *p;
+
+    p = pattern_new(patterns, &num_patterns, "sumA", false);
+    for (i = 0; i < ROWS; i++)
+        for (j = 0; j < COLS; j++)
+            p->addresses[p->n++] = element(i, j);
+
+    p = pattern_new(patterns, &num_patterns, "sumB", false);
+    for (j = 0; j < COLS; j++)
+        for (i = 0; i < ROWS; i++)
+            p->addresses[p->n++] = element(i, j);
+
+    p = pattern_new(patterns, &num_patterns, "sumC", false);
+    for (j = 0; j < COLS; j += 2)
+        for (i = 0; i < ROWS; i += 2) {
+            p->addresses[p->n++] = element(i, j);
+            p->addresses[p->n++] = element(i + 1, j);
+            p->addresses[p->n++] = element(i, j + 1);
+            p->addresses[p->n++] = element(i + 1, j + 1);
+        }
+
+    p = pattern_new(patterns, &num_patterns, "sumD", false);
+    for (k = 0; k < 8; k++)
+        for (i = 0; i < ROWS; i++)
+            for (j = 0; j < COLS; j += 8)
+                p->addresses[p->n++] = element(i, j + k);
+
+    p = pattern_new(patterns, &num_patterns, "random", false);
+    for (i = 0; i < ROWS * COLS; i++)
+        p->addresses[p->n++] = element(rand() % ROWS, rand() % COLS);
+
+    // Nine accesses out of ten go to the first sixteenth of the array, one in four is a write.
+    p = pattern_new(patterns, &num_patterns, "mix", true);
+    for (i = 0; i < ROWS * COLS; i++) {
+        size_t rows = rand() % 10 ? ROWS / 16 : ROWS;
+        p->is_write[p->n] = rand() % 4 == 0;
+        p->addresses[p->n++] = element(rand() % rows, rand() % COLS);
+    }
+
+    return num_patterns;
+}
+
+/*
+ * Read the first MAX_TRACE accesses of a trace into a pattern.
+ */
+static bool load_trace(pattern_t *pattern, const char *path) {
+    cache_trace_t *trace;
+
+    // cache_trace_open sets errno only when the file cannot be opened or mapped
+    errno = 0;
+    trace = cache_trace_open(path);
+    if (trace == NULL) {
+        if (errno != 0)
+            perror(path);
+        else
+            fprintf(stderr, "%s: malformed trace\n", path);
+        return false;
+    }
+
+    pattern->name = "trace";
+    pattern->addresses = (uintptr_t *)malloc(MAX_TRACE * sizeof(uintptr_t));
+    pattern->is_write = (uint8_t *)malloc(MAX_TRACE);
+    pattern->n = cache_trace_next(trace, pattern->addresses, pattern->is_write, MAX_TRACE);
+
+    bool failed = cache_trace_failed(trace);
+    if (cache_trace_out_of_memory(trace))
+        fprintf(stderr, "%s: %s\n", path, strerror(ENOMEM));
+    else if (failed)
+        fprintf(stderr, "%s: malformed trace\n", path);
+    cache_trace_close(trace);
+    return !failed && pattern->n > 0;
+}
+
+/*
+ * Simulate a pattern on a fresh cache, and return the time per access in
+ * nanoseconds. The traced addresses need not be mapped, so traces run on a
+ * tag-only cache.
+ */
+static double time_pattern(const pattern_t *pattern, uint32_t policy, size_t associativity, double *miss_rate) {
+    uint32_t flags = strcmp(pattern->name, "trace") == 0 ? CACHE_DATA_TAG_ONLY : 0;
+    cache_t *cache = cache_new(NUM_BYTES, LINE_SIZE, associativity, policy | CACHE_WRITEPOLICY_WRITEBACK | flags);
+    uint64_t sum = 0;
+
+    double start = now_ns();
+    for (size_t i = 0; i < pattern->n; i++) {
+        if (pattern->is_write != NULL && pattern->is_write[i])
+            cache_write(cache, pattern->addresses[i], i, NULL);
+        else
+            sum += cache_read(cache, pattern->addresses[i], NULL);
+    }
+    double elapsed = now_ns() - start;
+
+    // Keep the reads from being optimized away.
+    if (sum == 1)
+        fprintf(stderr, " ");
+    *miss_rate = (double) cache_miss_count(cache) / cache_access_count(cache);
+    cache_free(cache);
+    return elapsed / pattern->n;
+}
+
+/*
+ * Return the time per call, in nanoseconds, of find_available_cache_line on
+ * the full sets of a cache warmed by the random pattern.
+ */
+static double time_victims(const pattern_t *warmup, uint32_t policy, size_t associativity) {
+    cache_t *cache = cache_new(NUM_BYTES, LINE_SIZE, associativity, policy | CACHE_WRITEPOLICY_WRITEBACK);
+    size_t num_sets = cache->num_lines / associativity;
+    uintptr_t sum = 0;
+
+    for (size_t i = 0; i < warmup->n; i++)
+        cache_read(cache, warmup->addresses[i], NULL);
+
+    double start = now_ns();
+    for (size_t i = 0; i < warmup->n; i++)
+        sum += (uintptr_t) find_available_cache_line(cache, &cache->sets[i % num_sets], NULL);
+    double elapsed = now_ns() - start;
+
+    if (sum == 1)
+        fprintf(stderr, " ");
+    cache_free(cache);
+    return elapsed / warmup->n;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Return the given percentile of sorted samples, interpolating between them.
+ */
+static double percentile(const double *samples, size_t n, double p) {
+    double position = p / 100 * (n - 1);
+    size_t below = (size_t) position;
+
+    if (below + 1 >= n)
+        return samples[n - 1];
+    return samples[below] + (position - below) * (samples[below + 1] - samples[below]);
+}
+
+static void print_result(bool *first, const char *policy, size_t associativity, const char *pattern, size_t n,
+                         double *samples, size_t repetitions, double miss_rate) {
+    qsort(samples, repetitions, sizeof(double), compare_doubles);
+    double median = percentile(samples, repetitions, 50);
+
+    printf("%s    {\"name\": \"%s/%zu/%s\", \"policy\": \"%s\", \"associativity\": %zu, \"pattern\": \"%s\", "
+           "\"accesses\": %zu, \"repetitions\": %zu, \"ns_per_access_min\": %.3f, \"ns_per_access_p10\": %.3f, "
+           "\"ns_per_access_median\": %.3f, \"ns_per_access_p90\": %.3f, \"ns_per_access_max\": %.3f, "
+           "\"accesses_per_second\": %.0f",
+           *first ? "" : ",\n", policy, associativity, pattern, policy, associativity, pattern, n, repetitions,
+           samples[0], percentile(samples, repetitions, 10), median, percentile(samples, repetitions, 90),
+           samples[repetitions - 1], 1e9 / median);
+    if (miss_rate >= 0)
+        printf(", \"miss_rate\": %.6f", miss_rate);
+    printf("}");
+    *first = false;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 3) {
+        fprintf(stderr, "Usage: %s [repetitions [trace]]\n", argv[0]);
+        return 2;
+    }
+
+    size_t repetitions = argc > 1 ? strtoull(argv[1], NULL, 0) : DEFAULT_REPETITIONS;
+    if (repetitions == 0)
+        repetitions = 1;
+
+    pattern_t patterns[8];
+    srand(1);
+    for (size_t i = 0; i < ROWS * COLS; i++)
+        test_array[i] = i;
+    size_t num_patterns = build_patterns(patterns);
+    if (argc > 2) {
+        if (!load_trace(&patterns[num_patterns], argv[2]))
+            return 1;
+        num_patterns++;
+    }
+
+    double *samples = (double *)malloc(repetitions * sizeof(double));
+    bool first = true;
+
+    printf("{\n  \"context\": {\"num_bytes\": %d, \"line_size\": %d, \"write_policy\": \"WRITEBACK\"},\n"
+           "  \"benchmarks\": [\n", NUM_BYTES, LINE_SIZE);
+    for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++)
+        for (size_t a = 0; a < sizeof(associativities) / sizeof(associativities[0]); a++) {
+            for (size_t k = 0; k < num_patterns; k++) {
+                double miss_rate = 0;
+                for (size_t r = 0; r < repetitions; r++)
+                    samples[r] = time_pattern(&patterns[k], policies[p].policies, associativities[a], &miss_rate);
+                print_result(&first, policies[p].name, associativities[a], patterns[k].name, patterns[k].n,
+                             samples, repetitions, miss_rate);
+            }
+
+            // The random pattern (index 4) fills every set.
+            for (size_t r = 0; r < repetitions; r++)
+                samples[r] = time_victims(&patterns[4], policies[p].policies, associativities[a]);
+            print_result(&first, policies[p].name, associativities[a], "victim", patterns[4].n, samples,
+                         repetitions, -1);
+        }
+    printf("\n  ]\n}\n");
+
+    for (size_t k = 0; k < num_patterns; k++) {
+        free(patterns[k].addresses);
+        free(patterns[k].is_write);
+    }
+    free(samples);
+    return 0;
+}
@@ -3,22 +3,114 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#if UINTPTR_MAX == UINT64_MAX
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif
+
+/*
+ * Way index returned when no line of a set matches.
+ */
+#define CACHE_NO_WAY ((size_t)-1)
+
+/*
+ * Alignment of each region of a cache's arena (and so of the
+ * structure-of-arrays tag store), in bytes.
+ */
+#define CACHE_ARENA_ALIGNMENT 64
+
+/*
+ * Size of the huge pages backing CACHE_ARENA_HUGEPAGES arenas.
+ */
+#define CACHE_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * Return whether the cache keeps its set state in the structure-of-arrays layout.
+ */
+static inline bool cache_uses_soa(cache_t *cache) {
+    return (cache->policies & CACHE_LAYOUT_MASK) == CACHE_LAYOUT_SOA;
+}
+
+/*
+ * Return the cache line that holds the given way of a set.
+ */
+static inline cache_line_t *cache_set_line(cache_set_t *cache_set, size_t way) {
+    return &cache_set->lines[cache_set->first_index + way];
+}
+
+/*
+ * Return whether the cache keeps its LRU order in a linked list of ways.
+ */
+static inline bool cache_uses_linked_lru(cache_t *cache) {
+    return (cache->policies & CACHE_LRU_MASK) == CACHE_LRU_LINKED;
+}
+
+/*
+ * Return whether the cache only tracks tags, without any data.
+ */
+static inline bool cache_is_tag_only(cache_t *cache) {
+    return (cache->policies & CACHE_DATA_MASK) == CACHE_DATA_TAG_ONLY;
+}
+
+/*
+ * Return a mask with one bit set for each way of a set.
+ */
+static inline uint64_t cache_way_mask(size_t associativity) {
+    return associativity >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << associativity) - 1;
+}
 
 /*
  * Initialize a new cache set with the given associativity and index of the first cache line.
  */
-static void cache_set_init(cache_set_t *cache_set, size_t associativity, cache_line_t *lines, size_t first_index) {
+static void cache_set_init(cache_set_t *cache_set, size_t associativity, cache_line_t *lines, size_t first_index,
+                           uintptr_t *tags, size_t *lru_list, uint8_t *lru_links) {
     cache_set->lines = lines;
     cache_set->first_index = first_index;
-    cache_set->lru_list = malloc(associativity * sizeof(size_t));
+    cache_set->lru_list = lru_list;
     cache_set->num_marked = 0;
-    
+    cache_set->tags = tags;
+    cache_set->valid_mask = 0;
+    cache_set->dirty_mask = 0;
+    cache_set->marked_mask = 0;
+    cache_set->plru_bits = 0;
+    cache_set->rng_state = first_index;
+
+    // The linked LRU list is circular: the LRU way is lru_head, and the MRU
+    // way is the one before it.
+    cache_set->lru_head = 0;
+    cache_set->lru_prev = lru_links;
+    cache_set->lru_next = lru_links ? lru_links + associativity : NULL;
+
     for (int i = 0; i < associativity; i++) {
         cache_set->lines[first_index + i].is_valid = false;
-        cache_set->lru_list[i] = i;
+        if (lru_links) {
+            cache_set->lru_prev[i] = (i + associativity - 1) % associativity;
+            cache_set->lru_next[i] = (i + 1) % associativity;
+        } else
+            cache_set->lru_list[i] = i;
     }
 }
 
+/*
+ * Return a random number from the given generator, or from the set's own
+ * generator (splitmix64) if it is NULL.
+ */
+static inline size_t cache_set_random(cache_set_t *cache_set, func_t generate_random_number) {
+    if (generate_random_number != NULL)
+        return generate_random_number();
+
+    uint64_t z = cache_set->rng_state += 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return (z ^ (z >> 31)) >> 33;
+}
+
 /*
  * Given a value n which is a power of 2 (for example, a block size or a
  * number of sets in a cache), calculate log_2 of n.
@@ -32,6 +124,43 @@ static size_t logbase2(size_t value) {
     return ans;
 }
 
+/*
+ * Round a size or offset in a cache's arena up to CACHE_ARENA_ALIGNMENT.
+ */
+static inline size_t cache_arena_align(size_t size) {
+    return (size + CACHE_ARENA_ALIGNMENT - 1) & ~(size_t)(CACHE_ARENA_ALIGNMENT - 1);
+}
+
+/*
+ * Allocate an arena of *size bytes. With huge pages, arenas of at least one
+ * huge page are mapped directly, rounded up to whole huge pages (and *size
+ * updated), and the kernel is asked to back them with huge pages;
+ * *is_mapped is then set. mmap only aligns to a base page, so a huge page
+ * more is mapped and the ends trimmed to leave the arena huge-page aligned.
+ * Returns NULL if the memory cannot be allocated.
+ */
+static uint8_t *cache_arena_alloc(size_t *size, bool use_huge_pages, bool *is_mapped) {
+    *is_mapped = false;
+    if (use_huge_pages && *size >= CACHE_HUGE_PAGE_SIZE) {
+        size_t mapped_size = (*size + CACHE_HUGE_PAGE_SIZE - 1) & ~(size_t)(CACHE_HUGE_PAGE_SIZE - 1);
+        void *mapping = mmap(NULL, mapped_size + CACHE_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping != MAP_FAILED) {
+            uint8_t *arena = (uint8_t *)(((uintptr_t)mapping + CACHE_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(CACHE_HUGE_PAGE_SIZE - 1));
+            size_t head = arena - (uint8_t *)mapping;
+            if (head)
+                munmap(mapping, head);
+            munmap(arena + mapped_size, CACHE_HUGE_PAGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+            madvise(arena, mapped_size, MADV_HUGEPAGE);
+#endif
+            *size = mapped_size;
+            *is_mapped = true;
+            return arena;
+        }
+    }
+    return (uint8_t *)aligned_alloc(CACHE_ARENA_ALIGNMENT, *size);
+}
+
 /*
  * Given a number of bits, return a mask that many bits wide.
  */
@@ -39,24 +168,291 @@ static uint64_t maskbits(int nbits) {
     return (1L << nbits) - 1;
 }
 
+/*
+ * Marks the end of a chain or of the list of the shadow cache.
+ */
+#define CACHE_SHADOW_NONE UINT32_MAX
+
+/*
+ * Entry of the fully associative LRU shadow cache used to classify misses.
+ */
+typedef struct cache_shadow_node_s {
+    uintptr_t block;
+    uint32_t prev, next, chain;
+} cache_shadow_node_t;
+
+/*
+ * State of CACHE_STATS_DETAILED caches.
+ */
+typedef struct cache_detailed_stats_s {
+    uint64_t compulsory_misses, capacity_misses, conflict_misses, evictions;
+    uint64_t *set_hits, *set_misses;
+    size_t num_sets;
+
+    /* Blocks accessed so far: open addressing on block number + 1. */
+    uintptr_t *seen;
+    size_t seen_capacity, seen_count;
+
+    /* Fully associative LRU cache with as many lines as the cache: its
+     * entries, from most (mru) to least (lru) recently used, and hash
+     * chains of entries. */
+    cache_shadow_node_t *shadow;
+    uint32_t *buckets;
+    size_t shadow_capacity, shadow_count, bucket_mask;
+    uint32_t mru, lru;
+} cache_detailed_stats_t;
+
+/*
+ * Hash a block number.
+ */
+static inline size_t cache_hash_block(uintptr_t block) {
+    return (size_t)((block * 0x9e3779b97f4a7c15ull) >> 17);
+}
+
+/*
+ * Empty the detailed statistics.
+ */
+static void cache_detailed_stats_clear(cache_detailed_stats_t *stats) {
+    stats->compulsory_misses = stats->capacity_misses = stats->conflict_misses = stats->evictions = 0;
+    memset(stats->set_hits, 0, stats->num_sets * sizeof(uint64_t));
+    memset(stats->set_misses, 0, stats->num_sets * sizeof(uint64_t));
+    memset(stats->seen, 0, stats->seen_capacity * sizeof(uintptr_t));
+    stats->seen_count = 0;
+    for (size_t i = 0; i <= stats->bucket_mask; i++)
+        stats->buckets[i] = CACHE_SHADOW_NONE;
+    stats->shadow_count = 0;
+    stats->mru = stats->lru = CACHE_SHADOW_NONE;
+}
+
+/*
+ * Return the number of hash chains of the shadow cache of a cache with the
+ * given number of lines: a power of 2, at least 2.
+ */
+static size_t cache_shadow_num_buckets(size_t num_lines) {
+    size_t num_buckets = 2;
+    while (num_buckets < num_lines)
+        num_buckets <<= 1;
+    return num_buckets;
+}
+
+/*
+ * Set up the detailed statistics of a cache with the given numbers of lines
+ * and sets, whose per-set counters, shadow entries and hash chains are
+ * regions of its arena. Only the table of blocks seen, which grows, is
+ * allocated apart. Returns false if it cannot be allocated.
+ */
+static bool cache_detailed_stats_init(cache_detailed_stats_t *stats, size_t num_lines, size_t num_sets,
+                                      uint64_t *set_counters, cache_shadow_node_t *shadow, uint32_t *buckets) {
+    stats->num_sets = num_sets;
+    stats->set_hits = set_counters;
+    stats->set_misses = set_counters + num_sets;
+    stats->seen_capacity = 1024;
+    stats->seen = (uintptr_t *)malloc(stats->seen_capacity * sizeof(uintptr_t));
+    if (stats->seen == NULL)
+        return false;
+    stats->shadow_capacity = num_lines;
+    stats->shadow = shadow;
+    stats->buckets = buckets;
+    stats->bucket_mask = cache_shadow_num_buckets(num_lines) - 1;
+
+    cache_detailed_stats_clear(stats);
+    return true;
+}
+
+/*
+ * Add a block to the set of blocks accessed so far, and return whether it
+ * was already there. If the table cannot grow it fills up instead, and once
+ * it is full new blocks count as seen.
+ */
+static bool cache_stats_see(cache_detailed_stats_t *stats, uintptr_t block) {
+    uintptr_t *grown;
+    if (2 * (stats->seen_count + 1) > stats->seen_capacity &&
+        (grown = (uintptr_t *)calloc(2 * stats->seen_capacity, sizeof(uintptr_t))) != NULL) {
+        uintptr_t *seen = stats->seen;
+        size_t capacity = stats->seen_capacity;
+
+        stats->seen_capacity *= 2;
+        stats->seen = grown;
+        for (size_t i = 0; i < capacity; i++) {
+            if (seen[i] == 0)
+                continue;
+            size_t slot = cache_hash_block(seen[i]) & (stats->seen_capacity - 1);
+            while (stats->seen[slot] != 0)
+                slot = (slot + 1) & (stats->seen_capacity - 1);
+            stats->seen[slot] = seen[i];
+        }
+        free(seen);
+    }
+
+    size_t slot = cache_hash_block(block + 1) & (stats->seen_capacity - 1);
+    while (stats->seen[slot] != 0) {
+        if (stats->seen[slot] == block + 1)
+            return true;
+        slot = (slot + 1) & (stats->seen_capacity - 1);
+    }
+    if (stats->seen_count + 1 >= stats->seen_capacity)
+        return true;
+    stats->seen[slot] = block + 1;
+    stats->seen_count++;
+    return false;
+}
+
+/*
+ * Unlink an entry of the shadow cache from its LRU list.
+ */
+static inline void cache_shadow_unlink(cache_detailed_stats_t *stats, uint32_t node) {
+    cache_shadow_node_t *entry = &stats->shadow[node];
+
+    if (entry->prev != CACHE_SHADOW_NONE)
+        stats->shadow[entry->prev].next = entry->next;
+    else
+        stats->mru = entry->next;
+    if (entry->next != CACHE_SHADOW_NONE)
+        stats->shadow[entry->next].prev = entry->prev;
+    else
+        stats->lru = entry->prev;
+}
+
+/*
+ * Make an entry of the shadow cache its most recently used one.
+ */
+static inline void cache_shadow_push(cache_detailed_stats_t *stats, uint32_t node) {
+    stats->shadow[node].prev = CACHE_SHADOW_NONE;
+    stats->shadow[node].next = stats->mru;
+    if (stats->mru != CACHE_SHADOW_NONE)
+        stats->shadow[stats->mru].prev = node;
+    else
+        stats->lru = node;
+    stats->mru = node;
+}
+
+/*
+ * Access a block in the shadow cache, and return whether it hit.
+ */
+static bool cache_shadow_access(cache_detailed_stats_t *stats, uintptr_t block) {
+    uint32_t *bucket = &stats->buckets[cache_hash_block(block) & stats->bucket_mask];
+
+    for (uint32_t node = *bucket; node != CACHE_SHADOW_NONE; node = stats->shadow[node].chain) {
+        if (stats->shadow[node].block == block) {
+            cache_shadow_unlink(stats, node);
+            cache_shadow_push(stats, node);
+            return true;
+        }
+    }
+
+    // On a miss, reuse the least recently used entry once the cache is full.
+    uint32_t node;
+    if (stats->shadow_count < stats->shadow_capacity)
+        node = stats->shadow_count++;
+    else {
+        node = stats->lru;
+        cache_shadow_unlink(stats, node);
+        uint32_t *link = &stats->buckets[cache_hash_block(stats->shadow[node].block) & stats->bucket_mask];
+        while (*link != node)
+            link = &stats->shadow[*link].chain;
+        *link = stats->shadow[node].chain;
+    }
+
+    stats->shadow[node].block = block;
+    stats->shadow[node].chain = *bucket;
+    *bucket = node;
+    cache_shadow_push(stats, node);
+    return false;
+}
+
+/*
+ * Return whether the cache collects detailed statistics.
+ */
+static inline bool cache_has_detailed_stats(cache_t *cache) {
+    return (cache->policies & CACHE_STATS_MASK) == CACHE_STATS_DETAILED;
+}
+
+/*
+ * Record an access to a set in the detailed statistics, before the cache is
+ * updated. Every access marks its block seen, hit or miss, so that a miss is
+ * compulsory only on the first access to the block: a block that a prefetch
+ * brought in, then hit, then lost, misses again for lack of room.
+ */
+static void cache_stats_record(cache_t *cache, cache_set_t *cache_set, uintptr_t address, bool is_hit) {
+    cache_detailed_stats_t *stats = cache->detailed_stats;
+    uintptr_t block = address >> cache->cache_index_shift;
+    size_t set_index = cache_set - cache->sets;
+    bool is_shadow_hit = cache_shadow_access(stats, block);
+    bool is_first_access = !cache_stats_see(stats, block);
+
+    if (is_hit) {
+        stats->set_hits[set_index]++;
+        return;
+    }
+
+    stats->set_misses[set_index]++;
+    if (is_first_access)
+        stats->compulsory_misses++;
+    else if (!is_shadow_hit)
+        stats->capacity_misses++;
+    else
+        stats->conflict_misses++;
+}
+
 /*
  * Create a new cache that contains a total of num_bytes bytes, divided into
  * lines each of which is block_size bytes long, with the given associativity,
  * and the given set of cache policies for replacement and write operations.
  */
-cache_t *cache_new(size_t num_bytes, size_t block_size, size_t associativity, uint8_t policies) {
+cache_t *cache_new(size_t num_bytes, size_t block_size, size_t associativity, uint32_t policies) {
+
+    // The bitmasks of the structure-of-arrays layout hold at most 64 ways,
+    // and the links of the linked LRU list are one byte wide.
+    if (associativity > CACHE_SOA_MAX_ASSOCIATIVITY)
+        policies = (policies & ~CACHE_LAYOUT_MASK) | CACHE_LAYOUT_LINES;
+    if (associativity > CACHE_LRU_LINKED_MAX_ASSOCIATIVITY)
+        policies = (policies & ~CACHE_LRU_MASK) | CACHE_LRU_SHIFTING;
+
+    // The pseudo-LRU state of a set is one 64-bit word.
+    uint8_t replacement = policies & CACHE_REPLACEMENTPOLICY_MASK;
+    if ((replacement == CACHE_REPLACEMENTPOLICY_TREE_PLRU || replacement == CACHE_REPLACEMENTPOLICY_BIT_PLRU) &&
+        associativity > CACHE_PLRU_MAX_ASSOCIATIVITY)
+        policies = (policies & ~CACHE_REPLACEMENTPOLICY_MASK) | CACHE_REPLACEMENTPOLICY_LRU;
+
+    // Lay out the cache structure, its sets and lines, their replacement
+    // state, the tag store, the data and the detailed statistics in one
+    // arena, each region aligned.
+    size_t num_lines = num_bytes / block_size, num_sets = num_lines / associativity;
+    bool uses_soa = (policies & CACHE_LAYOUT_MASK) == CACHE_LAYOUT_SOA;
+    bool uses_linked_lru = (policies & CACHE_LRU_MASK) == CACHE_LRU_LINKED;
+    bool is_tag_only = (policies & CACHE_DATA_MASK) == CACHE_DATA_TAG_ONLY;
+    bool is_detailed = (policies & CACHE_STATS_MASK) == CACHE_STATS_DETAILED;
+
+    size_t sets_offset = cache_arena_align(sizeof(cache_t));
+    size_t lines_offset = cache_arena_align(sets_offset + num_sets * sizeof(cache_set_t));
+    size_t lru_lists_offset = cache_arena_align(lines_offset + num_lines * sizeof(cache_line_t));
+    size_t lru_links_offset = cache_arena_align(lru_lists_offset + (uses_linked_lru ? 0 : num_lines * sizeof(size_t)));
+    size_t tags_offset = cache_arena_align(lru_links_offset + (uses_linked_lru ? 2 * num_lines : 0));
+    size_t memory_offset = cache_arena_align(tags_offset + (uses_soa ? num_lines * sizeof(uintptr_t) : 0));
+    size_t stats_offset = cache_arena_align(memory_offset + (is_tag_only ? 0 : num_bytes));
+    size_t set_counters_offset = cache_arena_align(stats_offset + (is_detailed ? sizeof(cache_detailed_stats_t) : 0));
+    size_t shadow_offset = cache_arena_align(set_counters_offset + (is_detailed ? 2 * num_sets * sizeof(uint64_t) : 0));
+    size_t buckets_offset = cache_arena_align(shadow_offset + (is_detailed ? num_lines * sizeof(cache_shadow_node_t) : 0));
+    size_t arena_size = cache_arena_align(buckets_offset + (is_detailed ? cache_shadow_num_buckets(num_lines) * sizeof(uint32_t) : 0));
+
+    bool is_mapped = false;
+    uint8_t *arena = cache_arena_alloc(&arena_size, (policies & CACHE_ARENA_MASK) == CACHE_ARENA_HUGEPAGES, &is_mapped);
+    if (arena == NULL)
+        return NULL;
+    memset(arena, 0, memory_offset);
 
     // Create the cache and initialize constant fields.
-    cache_t *cache = (cache_t *)malloc(sizeof(cache_t));
-    cache->access_count = 0;
-    cache->miss_count = 0;
+    cache_t *cache = (cache_t *)arena;
+    cache->arena = arena;
+    cache->arena_size = arena_size;
+    cache->arena_is_mapped = is_mapped;
     cache->policies = policies;
 
     // Initialize size fields.
     cache->line_size = block_size;
-    cache->num_lines = num_bytes / block_size;
+    cache->num_lines = num_lines;
     cache->associativity = associativity;
-    cache->num_sets = cache->num_lines / associativity;
+    cache->num_sets = num_sets;
 
     // Initialize shifts and masks in cache structure
     uint64_t offset_mask, index_mask;
@@ -76,51 +472,100 @@ cache_t *cache_new(size_t num_bytes, size_t block_size, size_t associativity, ui
     // We shift by the number of offset bits and index bits
     // to get the tag bits.
     cache->tag_shift = offset_bits + index_bits;
-    cache->tag_mask = maskbits(sizeof(uintptr_t) - cache->tag_shift) << cache->tag_shift;
+    cache->tag_mask = ~(uintptr_t)0 << cache->tag_shift;
 
-    // Allocate the cache memory
-    cache->memory = malloc(num_bytes);
-    uint8_t *memory = cache->memory;
+    // Point at the regions of the arena. The cache memory, the tag store
+    // and the links of the linked LRU lists only exist when they are used.
+    cache->sets = (cache_set_t *)(arena + sets_offset);
+    cache->lines = (cache_line_t *)(arena + lines_offset);
+    cache->lru_lists = uses_linked_lru ? NULL : (size_t *)(arena + lru_lists_offset);
+    cache->lru_links = uses_linked_lru ? arena + lru_links_offset : NULL;
+    cache->tags = uses_soa ? (uintptr_t *)(arena + tags_offset) : NULL;
+    cache->memory = is_tag_only ? NULL : arena + memory_offset;
 
-    // Initialize cache lines.
-    cache->lines = (cache_line_t *)calloc(cache->num_lines, sizeof(cache_line_t));
-    for (size_t i = 0; i < cache->num_lines; i++) {
+    uint8_t *memory = cache->memory;
+    for (size_t i = 0; i < cache->num_lines && memory != NULL; i++) {
         cache->lines[i].block = memory;
 	memory += cache->line_size;
     }
-    
-    // Initialize cache sets.
-    cache->sets = (cache_set_t *)calloc(cache->num_sets, sizeof(cache_set_t));
-    size_t first_index = 0;
-    for (size_t i = 0; i < cache->num_sets; i++) {
-        cache_set_init(&cache->sets[i], associativity, cache->lines, first_index);
-	first_index += associativity;
+
+    cache->detailed_stats = NULL;
+    if (is_detailed) {
+        cache->detailed_stats = (cache_detailed_stats_t *)(arena + stats_offset);
+        if (!cache_detailed_stats_init(cache->detailed_stats, num_lines, num_sets, (uint64_t *)(arena + set_counters_offset),
+                                       (cache_shadow_node_t *)(arena + shadow_offset), (uint32_t *)(arena + buckets_offset))) {
+            cache->detailed_stats = NULL;
+            cache_free(cache);
+            return NULL;
+        }
     }
 
+    cache_reset(cache);
     return cache;
 }
 
+/*
+ * Empty a cache and clear its statistics.
+ */
+void cache_reset(cache_t *cache) {
+    cache->access_count = 0;
+    cache->miss_count = 0;
+    cache->writeback_count = 0;
+    cache->memory_read_bytes = 0;
+    cache->memory_write_bytes = 0;
+    if (cache->detailed_stats != NULL)
+        cache_detailed_stats_clear(cache->detailed_stats);
+
+    // Initialize cache lines and sets.
+    for (size_t i = 0; i < cache->num_lines; i++) {
+        cache->lines[i].is_valid = false;
+        cache->lines[i].is_dirty = false;
+        cache->lines[i].is_marked = false;
+        cache->lines[i].coherence_state = 0;
+        cache->lines[i].tag = 0;
+    }
+
+    size_t first_index = 0;
+    for (size_t i = 0; i < cache->num_sets; i++) {
+        cache_set_init(&cache->sets[i], cache->associativity, cache->lines, first_index,
+                       cache->tags ? cache->tags + first_index : NULL,
+                       cache->lru_lists ? cache->lru_lists + first_index : NULL,
+                       cache->lru_links ? cache->lru_links + 2 * first_index : NULL);
+	first_index += cache->associativity;
+    }
+}
+
 /**
  * Frees all memory allocated for a cache.
  */
 void cache_free(cache_t *cache) {
-    /* TO BE COMPLETED BY THE STUDENT */
+    if (cache == NULL)
+        return;
+
+    if (cache->detailed_stats != NULL)
+        free(cache->detailed_stats->seen);
+
+    // The cache structure lives in its own arena.
+    if (cache->arena_is_mapped)
+        munmap(cache->arena, cache->arena_size);
+    else
+        free(cache->arena);
 }
 
 /*
  * Determine whether or not a cache line is valid for a given tag.
  */
 bool cache_line_check_validity_and_tag(cache_line_t *cache_line, uintptr_t tag) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    return 0; // Added to remove warning; remove once function is implemented.
+    return cache_line->is_valid && cache_line->tag == tag;
 }
 
 /*
  * Return uint64_t integer data from a cache line.
  */
 uint64_t cache_line_retrieve_data(cache_line_t *cache_line, size_t offset) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    return 0; // Added to remove warning; remove once function is implemented.
+    uint64_t data;
+    memcpy(&data, cache_line->block + offset, sizeof(data));
+    return data;
 }
 
 /*
@@ -146,15 +591,309 @@ static void cache_line_make_mru(cache_t *cache, cache_set_t *cache_set, size_t l
     cache_set->lru_list[cache->associativity - 1] = line_index;
 }
 
+/*
+ * Make the given way the most recently used one of a linked LRU list, in
+ * constant time: the way is unlinked and reinserted just before the head.
+ */
+static inline void cache_set_linked_make_mru(cache_set_t *cache_set, size_t way) {
+    uint8_t *prev = cache_set->lru_prev, *next = cache_set->lru_next;
+    uint8_t head = cache_set->lru_head;
+
+    if (way == head) {
+        cache_set->lru_head = next[head];
+        return;
+    }
+    if (prev[head] == way)
+        return;
+
+    next[prev[way]] = next[way];
+    prev[next[way]] = prev[way];
+
+    prev[way] = prev[head];
+    next[way] = head;
+    next[prev[head]] = way;
+    prev[head] = way;
+}
+
+/*
+ * Mark the given way as the most recently used one of its set.
+ */
+static inline void cache_set_make_mru(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    if (cache_uses_linked_lru(cache))
+        cache_set_linked_make_mru(cache_set, way);
+    else
+        cache_line_make_mru(cache, cache_set, way);
+}
+
+/*
+ * Return the least recently used way of a set.
+ */
+static inline size_t cache_set_lru_way(cache_t *cache, cache_set_t *cache_set) {
+    return cache_uses_linked_lru(cache) ? cache_set->lru_head : cache_set->lru_list[0];
+}
+
+/*
+ * Return the most recently used way of a set.
+ */
+static inline size_t cache_set_mru_way(cache_t *cache, cache_set_t *cache_set) {
+    if (cache_uses_linked_lru(cache))
+        return cache_set->lru_prev[cache_set->lru_head];
+    return cache_set->lru_list[cache->associativity - 1];
+}
+
+/*
+ * Store the ways of a set in order of use into order, from the least
+ * recently used one to the most recently used one, as in lru_list.
+ */
+void cache_set_lru_order(cache_t *cache, cache_set_t *cache_set, size_t *order) {
+    if (!cache_uses_linked_lru(cache)) {
+        memcpy(order, cache_set->lru_list, cache->associativity * sizeof(size_t));
+        return;
+    }
+
+    size_t way = cache_set->lru_head;
+    for (size_t i = 0; i < cache->associativity; i++) {
+        order[i] = way;
+        way = cache_set->lru_next[way];
+    }
+}
+
+/*
+ * Return the number of levels of the pseudo-LRU tree of a set.
+ */
+static inline unsigned int cache_plru_tree_levels(size_t associativity) {
+    unsigned int levels = 0;
+    while (((size_t)1 << levels) < associativity)
+        levels++;
+    return levels;
+}
+
+/*
+ * Point every tree node on the path to the given way away from it.
+ */
+static inline void cache_set_tree_plru_touch(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    uint64_t bits = cache_set->plru_bits;
+    size_t node = 1;
+
+    for (int level = cache_plru_tree_levels(cache->associativity) - 1; level >= 0; level--) {
+        size_t direction = (way >> level) & 1;
+        if (direction)
+            bits &= ~((uint64_t)1 << node);
+        else
+            bits |= (uint64_t)1 << node;
+        node = 2 * node + direction;
+    }
+    cache_set->plru_bits = bits;
+}
+
+/*
+ * Follow the tree nodes from the root to the pseudo-LRU way. When the
+ * associativity is not a power of two, subtrees holding no way are skipped.
+ */
+static inline size_t cache_set_tree_plru_victim(cache_t *cache, cache_set_t *cache_set) {
+    unsigned int levels = cache_plru_tree_levels(cache->associativity);
+    size_t node = 1, way = 0;
+
+    for (int level = levels - 1; level >= 0; level--) {
+        size_t direction = (cache_set->plru_bits >> node) & 1;
+        if (((2 * way + 1) << level) >= cache->associativity)
+            direction = 0;
+        way = 2 * way + direction;
+        node = 2 * node + direction;
+    }
+    return way;
+}
+
+/*
+ * Set the bit of the given way, starting over when every bit is set.
+ */
+static inline void cache_set_bit_plru_touch(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    uint64_t bits = cache_set->plru_bits | ((uint64_t)1 << way);
+
+    if (bits == cache_way_mask(cache->associativity))
+        bits = (uint64_t)1 << way;
+    cache_set->plru_bits = bits;
+}
+
+/*
+ * Return the first way whose bit is clear.
+ */
+static inline size_t cache_set_bit_plru_victim(cache_t *cache, cache_set_t *cache_set) {
+    uint64_t clear = ~cache_set->plru_bits & cache_way_mask(cache->associativity);
+    return clear ? (size_t)__builtin_ctzll(clear) : 0;
+}
+
+/*
+ * Return the tag held by a way of a set.
+ */
+static inline uintptr_t cache_way_tag(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    return cache_uses_soa(cache) ? cache_set->tags[way] : cache_set_line(cache_set, way)->tag;
+}
+
+/*
+ * Return the data block held by a way of a set.
+ */
+static inline uint8_t *cache_way_block(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    if (cache_is_tag_only(cache))
+        return NULL;
+    if (cache_uses_soa(cache))
+        return cache->memory + (cache_set->first_index + way) * cache->line_size;
+    return cache_set_line(cache_set, way)->block;
+}
+
+/*
+ * Return whether a way of a set holds a valid block.
+ */
+static inline bool cache_way_is_valid(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    if (cache_uses_soa(cache))
+        return (cache_set->valid_mask >> way) & 1;
+    return cache_set_line(cache_set, way)->is_valid;
+}
+
+/*
+ * Return whether a way of a set holds a dirty block.
+ */
+static inline bool cache_way_is_dirty(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    if (cache_uses_soa(cache))
+        return (cache_set->dirty_mask >> way) & 1;
+    return cache_set_line(cache_set, way)->is_dirty;
+}
+
+/*
+ * Set the valid and dirty bits of a way of a set.
+ */
+static inline void cache_way_set_state(cache_t *cache, cache_set_t *cache_set, size_t way, bool is_valid, bool is_dirty) {
+    if (cache_uses_soa(cache)) {
+        uint64_t bit = (uint64_t)1 << way;
+        cache_set->valid_mask = is_valid ? cache_set->valid_mask | bit : cache_set->valid_mask & ~bit;
+        cache_set->dirty_mask = is_dirty ? cache_set->dirty_mask | bit : cache_set->dirty_mask & ~bit;
+    } else {
+        cache_line_t *line = cache_set_line(cache_set, way);
+        line->is_valid = is_valid;
+        line->is_dirty = is_dirty;
+    }
+}
+
+/*
+ * Return the address of the first byte of the block held by a way of a set.
+ */
+static inline uintptr_t cache_way_address(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    uintptr_t set_index = cache_set->first_index / cache->associativity;
+    return (cache_way_tag(cache, cache_set, way) << cache->tag_shift) | (set_index << cache->cache_index_shift);
+}
+
+/*
+ * Return whether a way of a set is marked (for randomized marking).
+ */
+static inline bool cache_way_is_marked(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    if (cache_uses_soa(cache))
+        return (cache_set->marked_mask >> way) & 1;
+    return cache_set_line(cache_set, way)->is_marked;
+}
+
+/*
+ * Mark a way of a set, if it is not marked already.
+ */
+static inline void cache_way_mark(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    if (cache_way_is_marked(cache, cache_set, way))
+        return;
+    if (cache_uses_soa(cache))
+        cache_set->marked_mask |= (uint64_t)1 << way;
+    else
+        cache_set_line(cache_set, way)->is_marked = true;
+    cache_set->num_marked++;
+}
+
+/*
+ * Compare the first ways entries of tags against tag, one at a time.
+ */
+uint64_t cache_tags_match_mask_scalar(const uintptr_t *tags, size_t ways, uintptr_t tag) {
+    uint64_t mask = 0;
+
+    for (size_t way = 0; way < ways; way++)
+        mask |= (uint64_t)(tags[way] == tag) << way;
+    return mask;
+}
+
+/*
+ * Compare the first ways entries of tags against tag using the widest vector
+ * compare the target supports (AVX2 or SSE2 on x86-64, NEON on AArch64). Ways
+ * that do not fill a whole vector are compared by the scalar loop.
+ */
+uint64_t cache_tags_match_mask(const uintptr_t *tags, size_t ways, uintptr_t tag) {
+    uint64_t mask = 0;
+    size_t way = 0;
+
+#if UINTPTR_MAX == UINT64_MAX && defined(__AVX2__)
+    __m256i probe = _mm256_set1_epi64x((long long)tag);
+    for (; way + 4 <= ways; way += 4) {
+        __m256i eq = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i *)(tags + way)), probe);
+        mask |= (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(eq)) << way;
+    }
+#endif
+#if UINTPTR_MAX == UINT64_MAX && defined(__SSE2__)
+    // SSE2 has no 64-bit compare: a quadword matches when both of its halves do.
+    __m128i probe2 = _mm_set1_epi64x((long long)tag);
+    for (; way + 2 <= ways; way += 2) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *)(tags + way)), probe2);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= (uint64_t)_mm_movemask_pd(_mm_castsi128_pd(eq)) << way;
+    }
+#elif UINTPTR_MAX == UINT64_MAX && defined(__ARM_NEON) && defined(__aarch64__)
+    uint64x2_t probe2 = vdupq_n_u64(tag);
+    for (; way + 2 <= ways; way += 2) {
+        uint64x2_t eq = vceqq_u64(vld1q_u64((const uint64_t *)(tags + way)), probe2);
+        mask |= ((vgetq_lane_u64(eq, 0) & 1) | (vgetq_lane_u64(eq, 1) & 2)) << way;
+    }
+#endif
+
+    for (; way < ways; way++)
+        mask |= (uint64_t)(tags[way] == tag) << way;
+    return mask;
+}
+
+/*
+ * Return the way of a set that is valid and holds the given tag, or
+ * CACHE_NO_WAY. The replacement state is not updated.
+ */
+static size_t cache_set_find_way(cache_t *cache, cache_set_t *cache_set, uintptr_t tag) {
+    if (cache_uses_soa(cache)) {
+        uint64_t hits = cache_tags_match_mask(cache_set->tags, cache->associativity, tag) & cache_set->valid_mask;
+        return hits ? (size_t)__builtin_ctzll(hits) : CACHE_NO_WAY;
+    }
+
+    for (size_t way = 0; way < cache->associativity; way++)
+        if (cache_line_check_validity_and_tag(cache_set_line(cache_set, way), tag))
+            return way;
+    return CACHE_NO_WAY;
+}
+
+/*
+ * Update the replacement state of a set after a hit on the given way.
+ */
+static inline void cache_set_touch(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    uint8_t policy = cache->policies & CACHE_REPLACEMENTPOLICY_MASK;
+
+    if (policy == CACHE_REPLACEMENTPOLICY_LRU || policy == CACHE_REPLACEMENTPOLICY_MRU)
+        cache_set_make_mru(cache, cache_set, way);
+    else if (policy == CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING)
+        cache_way_mark(cache, cache_set, way);
+    else if (policy == CACHE_REPLACEMENTPOLICY_TREE_PLRU)
+        cache_set_tree_plru_touch(cache, cache_set, way);
+    else if (policy == CACHE_REPLACEMENTPOLICY_BIT_PLRU)
+        cache_set_bit_plru_touch(cache, cache_set, way);
+}
+
 /*
  * Retrieve a matching cache line from a set, if one exists.
  */
 cache_line_t *cache_set_find_matching_line(cache_t *cache, cache_set_t *cache_set, uintptr_t tag) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    /* If the cache replacement is LRU or and you find a matching cache line,
-     * don't forget to call cache_line_make_mru(cache, cache_set, i)
-     */
-    return NULL; // Added to remove warning; remove once function is implemented.
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+
+    if (way == CACHE_NO_WAY)
+        return NULL;
+    cache_set_touch(cache, cache_set, way);
+    return cache_set_line(cache_set, way);
 }
 
 /*
@@ -162,62 +901,601 @@ cache_line_t *cache_set_find_matching_line(cache_t *cache, cache_set_t *cache_se
  * marked, then it unmarks them all first.
  */
 size_t choose_unmarked_cache_line(cache_t *cache, cache_set_t *cache_set, func_t generate_random_number) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    return 0; // Added to remove warning; remove once function is implemented.
+
+    // Start a new phase once every line has been marked.
+    if (cache_set->num_marked == cache->associativity) {
+        cache_set->num_marked = 0;
+        if (cache_uses_soa(cache))
+            cache_set->marked_mask = 0;
+        else
+            for (size_t i = 0; i < cache->associativity; i++)
+                cache_set_line(cache_set, i)->is_marked = false;
+    }
+
+    // Pick the n'th unmarked line, where n is uniform over the unmarked lines.
+    size_t n = cache_set_random(cache_set, generate_random_number) % (cache->associativity - cache_set->num_marked);
+    for (size_t i = 0; i < cache->associativity; i++) {
+        if (!cache_way_is_marked(cache, cache_set, i) && n-- == 0) {
+            cache_way_mark(cache, cache_set, i);
+            return i;
+        }
+    }
+    return 0;
 }
-    
+
+/*
+ * Return the first invalid way of a set, or CACHE_NO_WAY if every way is valid.
+ */
+static size_t cache_set_find_invalid_way(cache_t *cache, cache_set_t *cache_set) {
+    if (cache_uses_soa(cache)) {
+        uint64_t invalid = ~cache_set->valid_mask & cache_way_mask(cache->associativity);
+        return invalid ? (size_t)__builtin_ctzll(invalid) : CACHE_NO_WAY;
+    }
+
+    for (size_t way = 0; way < cache->associativity; way++)
+        if (!cache_set_line(cache_set, way)->is_valid)
+            return way;
+    return CACHE_NO_WAY;
+}
+
+/*
+ * Choose the way of a set that receives new data and update the replacement
+ * state accordingly. Uses either a way not being used, or a suitable way to
+ * be replaced, based on the cache's replacement policy.
+ */
+static size_t cache_set_choose_way(cache_t *cache, cache_set_t *cache_set, func_t generate_random_number) {
+    uint8_t policy = cache->policies & CACHE_REPLACEMENTPOLICY_MASK;
+
+    // Use an invalid line if there is one.
+    size_t way = cache_set_find_invalid_way(cache, cache_set);
+    if (way != CACHE_NO_WAY) {
+        if (policy == CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING)
+            cache_way_mark(cache, cache_set, way);
+    }
+
+    // Otherwise pick a victim according to the replacement policy.
+    else {
+        switch (policy) {
+        case CACHE_REPLACEMENTPOLICY_LRU:
+            way = cache_set_lru_way(cache, cache_set);
+            break;
+        case CACHE_REPLACEMENTPOLICY_MRU:
+            way = cache_set_mru_way(cache, cache_set);
+            break;
+        case CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING:
+            way = choose_unmarked_cache_line(cache, cache_set, generate_random_number);
+            break;
+        case CACHE_REPLACEMENTPOLICY_TREE_PLRU:
+            way = cache_set_tree_plru_victim(cache, cache_set);
+            break;
+        case CACHE_REPLACEMENTPOLICY_BIT_PLRU:
+            way = cache_set_bit_plru_victim(cache, cache_set);
+            break;
+        default:
+            way = cache_set_random(cache_set, generate_random_number) % cache->associativity;
+            break;
+        }
+
+        if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY) {
+            unsigned int set_index = cache_set->first_index / cache->associativity;
+            uintptr_t address = cache_way_address(cache, cache_set, way);
+            fprintf(stderr, "Rep line %zu in set %3u was address 0x%lx\n", way, set_index, (unsigned long)address);
+        }
+    }
+
+    if (policy == CACHE_REPLACEMENTPOLICY_LRU || policy == CACHE_REPLACEMENTPOLICY_MRU)
+        cache_set_make_mru(cache, cache_set, way);
+    else if (policy == CACHE_REPLACEMENTPOLICY_TREE_PLRU)
+        cache_set_tree_plru_touch(cache, cache_set, way);
+    else if (policy == CACHE_REPLACEMENTPOLICY_BIT_PLRU)
+        cache_set_bit_plru_touch(cache, cache_set, way);
+
+    return way;
+}
+
 /*
  * Function to find a cache line to use for new data. Uses either a
  * line not being used, or a suitable line to be replaced, based on
  * the cache's replacement policy.
  */
 cache_line_t *find_available_cache_line(cache_t *cache, cache_set_t *cache_set, func_t generate_random_number) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    /* If the cache replacement policy is LRU, don't forget to call
-     * cache_line_make_mru(cache, cache_set, i) once you have selected the
-     * cache line to use. If the cache replacement is RANDOMIZED_MARKING 
-     * then don't forget to mark the line. To generate a random number in 
-     * the range [0, n), use "generate_random_number() % n".
-     */
-    return NULL; // Added to remove warning; remove once function is implemented.
+    return cache_set_line(cache_set, cache_set_choose_way(cache, cache_set, generate_random_number));
+}
+
+/*
+ * Describe the block held by a way of a set in *evicted, before it is
+ * replaced or invalidated.
+ */
+static void cache_way_describe(cache_t *cache, cache_set_t *cache_set, size_t way, cache_eviction_t *evicted) {
+    evicted->is_valid = cache_way_is_valid(cache, cache_set, way);
+    evicted->is_dirty = evicted->is_valid && cache_way_is_dirty(cache, cache_set, way);
+    evicted->address = evicted->is_valid ? cache_way_address(cache, cache_set, way) : 0;
+    if (evicted->is_valid && evicted->block != NULL && !cache_is_tag_only(cache))
+        memcpy(evicted->block, cache_way_block(cache, cache_set, way), cache->line_size);
+}
+
+/*
+ * Write the block held by a way of a set back to memory if it is dirty.
+ */
+static void cache_way_write_back(cache_t *cache, cache_set_t *cache_set, size_t way) {
+    if (!cache_way_is_valid(cache, cache_set, way) || !cache_way_is_dirty(cache, cache_set, way))
+        return;
+
+    if (!cache_is_tag_only(cache))
+        memcpy((void *)cache_way_address(cache, cache_set, way), cache_way_block(cache, cache_set, way), cache->line_size);
+    cache->writeback_count++;
+    cache->memory_write_bytes += cache->line_size;
 }
 
 /*
- * Add a block to a given cache set.
+ * Add a block to a given cache set, and return the way that now holds it.
+ * The block's data is copied from data, or from memory at address if data is
+ * NULL. If evicted is not NULL, the replaced block is described in it. If
+ * write_back is true, the replaced block is written back to memory if it is
+ * dirty.
  */
-static cache_line_t *cache_set_add(cache_t *cache, cache_set_t *cache_set, uintptr_t address, uintptr_t tag, func_t generate_random_number) {
+static size_t cache_set_install(cache_t *cache, cache_set_t *cache_set, uintptr_t address, uintptr_t tag,
+                                const uint8_t *data, bool is_dirty, func_t generate_random_number,
+                                cache_eviction_t *evicted, bool write_back) {
 
     // First locate the cache line to use.
-    cache_line_t *line = find_available_cache_line(cache, cache_set, generate_random_number);
+    size_t way = cache_set_choose_way(cache, cache_set, generate_random_number);
+    if (cache_has_detailed_stats(cache) && cache_way_is_valid(cache, cache_set, way))
+        cache->detailed_stats->evictions++;
+    if (evicted != NULL)
+        cache_way_describe(cache, cache_set, way, evicted);
+    if (write_back)
+        cache_way_write_back(cache, cache_set, way);
 
     // Now set it up.
-    line->tag = tag;
-    line->is_valid = true;
-    memcpy(line->block, (void *)(address & ~cache->block_offset_mask), cache->line_size);
+    if (cache_uses_soa(cache))
+        cache_set->tags[way] = tag;
+    else
+        cache_set_line(cache_set, way)->tag = tag;
+    cache_way_set_state(cache, cache_set, way, true, is_dirty);
+    if (data == NULL) {
+        data = (const uint8_t *)(address & ~cache->block_offset_mask);
+        cache->memory_read_bytes += cache->line_size;
+    }
+    if (!cache_is_tag_only(cache))
+        memcpy(cache_way_block(cache, cache_set, way), data, cache->line_size);
 
     // And return it.
-    return line;
+    return way;
+}
+
+/*
+ * Add a block read from memory to a given cache set, and return the way that now holds it.
+ */
+static size_t cache_set_add(cache_t *cache, cache_set_t *cache_set, uintptr_t address, uintptr_t tag, func_t generate_random_number) {
+    return cache_set_install(cache, cache_set, address, tag, NULL, false, generate_random_number, NULL, true);
+}
+
+/*
+ * Find the set and tag of an address.
+ */
+static inline cache_set_t *cache_decode(cache_t *cache, uintptr_t address, uintptr_t *tag) {
+    *tag = (address & cache->tag_mask) >> cache->tag_shift;
+    return &cache->sets[(address & cache->cache_index_mask) >> cache->cache_index_shift];
+}
+
+/*
+ * Look up the block containing an address without touching the statistics.
+ */
+bool cache_lookup(cache_t *cache, uintptr_t address, bool update_replacement, uint8_t **block) {
+    uintptr_t tag;
+    cache_set_t *cache_set = cache_decode(cache, address, &tag);
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+
+    if (way == CACHE_NO_WAY)
+        return false;
+    if (update_replacement)
+        cache_set_touch(cache, cache_set, way);
+    if (block != NULL)
+        *block = cache_way_block(cache, cache_set, way);
+    return true;
+}
+
+/*
+ * Install the block containing an address without touching the statistics.
+ */
+uint8_t *cache_fill(cache_t *cache, uintptr_t address, const uint8_t *data, bool is_dirty,
+                    func_t generate_random_number, cache_eviction_t *evicted) {
+    uintptr_t tag;
+    cache_set_t *cache_set = cache_decode(cache, address, &tag);
+    size_t way = cache_set_install(cache, cache_set, address, tag, data, is_dirty, generate_random_number, evicted,
+                                   evicted == NULL);
+
+    return cache_way_block(cache, cache_set, way);
+}
+
+/*
+ * Remove the block containing an address from the cache.
+ */
+bool cache_invalidate(cache_t *cache, uintptr_t address, cache_eviction_t *evicted) {
+    uintptr_t tag;
+    cache_set_t *cache_set = cache_decode(cache, address, &tag);
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+
+    if (way == CACHE_NO_WAY) {
+        if (evicted != NULL)
+            evicted->is_valid = evicted->is_dirty = false;
+        return false;
+    }
+    if (evicted != NULL)
+        cache_way_describe(cache, cache_set, way, evicted);
+    cache_way_set_state(cache, cache_set, way, false, false);
+    return true;
+}
+
+/*
+ * Mark the block containing an address as dirty.
+ */
+bool cache_mark_dirty(cache_t *cache, uintptr_t address) {
+    uintptr_t tag;
+    cache_set_t *cache_set = cache_decode(cache, address, &tag);
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+
+    if (way == CACHE_NO_WAY)
+        return false;
+    cache_way_set_state(cache, cache_set, way, true, true);
+    return true;
+}
+
+/*
+ * Mark the block containing an address as clean.
+ */
+bool cache_mark_clean(cache_t *cache, uintptr_t address) {
+    uintptr_t tag;
+    cache_set_t *cache_set = cache_decode(cache, address, &tag);
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+
+    if (way == CACHE_NO_WAY)
+        return false;
+    cache_way_set_state(cache, cache_set, way, true, false);
+    return true;
+}
+
+/*
+ * Find the line holding the block containing an address.
+ */
+cache_line_t *cache_find_line(cache_t *cache, uintptr_t address) {
+    uintptr_t tag;
+    cache_set_t *cache_set = cache_decode(cache, address, &tag);
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+
+    return way == CACHE_NO_WAY ? NULL : cache_set_line(cache_set, way);
+}
+
+/*
+ * Bring the block containing an address into the cache for a prefetcher.
+ */
+bool cache_prefetch(cache_t *cache, uintptr_t address, func_t generate_random_number, cache_eviction_t *evicted) {
+    uintptr_t tag;
+    cache_set_t *cache_set = cache_decode(cache, address, &tag);
+
+    if (evicted != NULL)
+        evicted->is_valid = evicted->is_dirty = false;
+    if (cache_set_find_way(cache, cache_set, tag) != CACHE_NO_WAY)
+        return false;
+
+    cache_set_install(cache, cache_set, address, tag, NULL, false, generate_random_number, evicted, true);
+    return true;
+}
+
+/*
+ * Write a single integer to memory. If value is NULL only the traffic is counted.
+ */
+static void cache_write_memory(cache_t *cache, uintptr_t address, const uint64_t *value) {
+    if (value != NULL && !cache_is_tag_only(cache))
+        memcpy((void *)address, value, sizeof(*value));
+    cache->memory_write_bytes += sizeof(*value);
+}
+
+/*
+ * Write a single integer to a set, following the cache's write policies.
+ * way is the way holding the address, or CACHE_NO_WAY on a miss. If value is
+ * NULL the cache state and the statistics are updated but no data is changed.
+ */
+static void cache_set_write(cache_t *cache, cache_set_t *cache_set, size_t way, uintptr_t address, uintptr_t tag,
+                            const uint64_t *value, func_t generate_random_number) {
+    bool is_writeback = (cache->policies & CACHE_WRITEPOLICY_WRITEBACK) == CACHE_WRITEPOLICY_WRITEBACK;
+    bool is_allocate = (cache->policies & CACHE_WRITEPOLICY_WRITENOALLOCATE) == CACHE_WRITEPOLICY_WRITEALLOCATE;
+
+    if (way != CACHE_NO_WAY)
+        cache_set_touch(cache, cache_set, way);
+    else if (is_allocate)
+        way = cache_set_add(cache, cache_set, address, tag, generate_random_number);
+
+    // Update the line if there is one; a writeback cache stops there.
+    if (way != CACHE_NO_WAY) {
+        if (value != NULL && !cache_is_tag_only(cache))
+            memcpy(cache_way_block(cache, cache_set, way) + (address & cache->block_offset_mask), value, sizeof(*value));
+        if (is_writeback) {
+            cache_way_set_state(cache, cache_set, way, true, true);
+            return;
+        }
+    }
+
+    cache_write_memory(cache, address, value);
 }
 
 /*
  * Read a single uint64_t integer from the cache.
  */
 uint64_t cache_read(cache_t *cache, uintptr_t address, func_t generate_random_number) {
-    /* TO BE COMPLETED BY THE STUDENT */
-    return 0; // Added to remove warning; remove once function is implemented.
+    uintptr_t index = (address & cache->cache_index_mask) >> cache->cache_index_shift;
+    uintptr_t tag = (address & cache->tag_mask) >> cache->tag_shift;
+    cache_set_t *cache_set = &cache->sets[index];
+    uint64_t data;
+
+    cache->access_count++;
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+    if (cache_has_detailed_stats(cache))
+        cache_stats_record(cache, cache_set, address, way != CACHE_NO_WAY);
+    if (way == CACHE_NO_WAY) {
+        cache->miss_count++;
+        if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY)
+            fprintf(stderr, "Cache miss in set %3u for address 0x%lx\n", (unsigned int)index, (unsigned long)address);
+        way = cache_set_add(cache, cache_set, address, tag, generate_random_number);
+    } else {
+        if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY)
+            fprintf(stderr, "Cache  hit in set %3u for address 0x%lx\n", (unsigned int)index, (unsigned long)address);
+        cache_set_touch(cache, cache_set, way);
+    }
+
+    if (cache_is_tag_only(cache))
+        return 0;
+    memcpy(&data, cache_way_block(cache, cache_set, way) + (address & cache->block_offset_mask), sizeof(data));
+    return data;
+}
+
+/*
+ * Simulate n accesses in a single call. The addresses are decoded into set
+ * indices and tags one block at a time, so the per-access work is only the
+ * set lookup, and the statistics are updated once for the whole batch.
+ */
+size_t cache_access_batch(cache_t *cache, const uintptr_t *addresses, const uint8_t *is_write, size_t n,
+                          uint8_t *hits, func_t generate_random_number) {
+    uintptr_t index[CACHE_BATCH_SIZE], tag[CACHE_BATCH_SIZE];
+    uintptr_t index_mask = cache->cache_index_mask, tag_mask = cache->tag_mask;
+    unsigned int index_shift = cache->cache_index_shift, tag_shift = cache->tag_shift;
+    bool tracing = (cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY;
+    bool detailed = cache_has_detailed_stats(cache);
+    size_t misses = 0;
+
+    for (size_t base = 0; base < n; base += CACHE_BATCH_SIZE) {
+        size_t count = n - base < CACHE_BATCH_SIZE ? n - base : CACHE_BATCH_SIZE;
+        const uintptr_t *block = addresses + base;
+        uint64_t hit_bits = 0;
+
+        for (size_t i = 0; i < count; i++) {
+            index[i] = (block[i] & index_mask) >> index_shift;
+            tag[i] = (block[i] & tag_mask) >> tag_shift;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            cache_set_t *cache_set = &cache->sets[index[i]];
+            size_t way = cache_set_find_way(cache, cache_set, tag[i]);
+
+            if (detailed)
+                cache_stats_record(cache, cache_set, block[i], way != CACHE_NO_WAY);
+            if (way != CACHE_NO_WAY) {
+                hit_bits |= (uint64_t)1 << i;
+                if (tracing)
+                    fprintf(stderr, "Cache  hit in set %3u for address 0x%lx\n", (unsigned int)index[i], (unsigned long)block[i]);
+            } else {
+                misses++;
+                if (tracing)
+                    fprintf(stderr, "Cache miss in set %3u for address 0x%lx\n", (unsigned int)index[i], (unsigned long)block[i]);
+            }
+
+            if (is_write != NULL && is_write[base + i])
+                cache_set_write(cache, cache_set, way, block[i], tag[i], NULL, generate_random_number);
+            else if (way != CACHE_NO_WAY)
+                cache_set_touch(cache, cache_set, way);
+            else
+                cache_set_add(cache, cache_set, block[i], tag[i], generate_random_number);
+        }
+
+        if (hits != NULL)
+            for (size_t i = 0; i < count; i += 8)
+                hits[(base + i) / 8] = (uint8_t)(hit_bits >> i);
+    }
+
+    cache->access_count += n;
+    cache->miss_count += misses;
+    return misses;
 }
 
 /*
  * Write a single integer to the cache.
  */
 void cache_write(cache_t *cache, uintptr_t address, uint64_t value, func_t generate_random_number) {
-    /* OPTIONAL FUNCTION, YOU ARE NOT REQUIRED TO IMPLEMENT IT */
+    uintptr_t index = (address & cache->cache_index_mask) >> cache->cache_index_shift;
+    uintptr_t tag = (address & cache->tag_mask) >> cache->tag_shift;
+    cache_set_t *cache_set = &cache->sets[index];
+
+    cache->access_count++;
+    size_t way = cache_set_find_way(cache, cache_set, tag);
+    if (cache_has_detailed_stats(cache))
+        cache_stats_record(cache, cache_set, address, way != CACHE_NO_WAY);
+    if (way == CACHE_NO_WAY) {
+        cache->miss_count++;
+        if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY)
+            fprintf(stderr, "Cache miss in set %3u for address 0x%lx\n", (unsigned int)index, (unsigned long)address);
+    } else if ((cache->policies & CACHE_TRACE_MASK) == CACHE_TRACEPOLICY)
+        fprintf(stderr, "Cache  hit in set %3u for address 0x%lx\n", (unsigned int)index, (unsigned long)address);
+
+    cache_set_write(cache, cache_set, way, address, tag, &value, generate_random_number);
+}
+
+/*
+ * State shared by the threads of cache_access_parallel.
+ */
+typedef struct cache_parallel_s {
+    cache_t *cache;
+    const uintptr_t *addresses;
+    const uint8_t *is_write;
+    size_t n, num_shards;
+
+    /* counts[slice * num_shards + shard]: accesses of an input slice to a
+     * shard, then where the slice's first such access goes in the shards. */
+    size_t *counts;
+
+    /* The accesses of each shard, shard by shard; shard s starts at shard_start[s]. */
+    size_t *shard_start;
+    uintptr_t *shard_addresses;
+    uint8_t *shard_writes;
+
+    pthread_barrier_t barrier;
+
+    /* Held by the calling thread until num_shards is final. */
+    pthread_mutex_t start;
+} cache_parallel_t;
+
+/*
+ * State of one thread of cache_access_parallel. The thread simulates on a
+ * private copy of the cache structure, which shares the sets and lines but
+ * has its own counters.
+ */
+typedef struct cache_shard_s {
+    cache_parallel_t *run;
+    size_t id;
+    cache_t cache;
+    size_t misses;
+    pthread_t thread;
+} cache_shard_t;
+
+/*
+ * Return the shard that owns the set of an address.
+ */
+static inline size_t cache_parallel_shard(cache_parallel_t *run, uintptr_t address) {
+    size_t index = (address & run->cache->cache_index_mask) >> run->cache->cache_index_shift;
+    return index * run->num_shards / run->cache->num_sets;
+}
+
+/*
+ * Partition a slice of the accesses by shard, then simulate one shard.
+ */
+static void *cache_parallel_worker(void *arg) {
+    cache_shard_t *shard = (cache_shard_t *)arg;
+    cache_parallel_t *run = shard->run;
+    pthread_mutex_lock(&run->start);
+    pthread_mutex_unlock(&run->start);
+    size_t num_shards = run->num_shards;
+    size_t begin = run->n * shard->id / num_shards, end = run->n * (shard->id + 1) / num_shards;
+    size_t *counts = run->counts + shard->id * num_shards;
+
+    for (size_t i = begin; i < end; i++)
+        counts[cache_parallel_shard(run, run->addresses[i])]++;
+    pthread_barrier_wait(&run->barrier);
+
+    // Lay the shards out one after the other, each slice's accesses after
+    // those of the slices before it, so every shard keeps the input order.
+    if (shard->id == 0) {
+        size_t position = 0;
+        for (size_t s = 0; s < num_shards; s++) {
+            run->shard_start[s] = position;
+            for (size_t slice = 0; slice < num_shards; slice++) {
+                size_t count = run->counts[slice * num_shards + s];
+                run->counts[slice * num_shards + s] = position;
+                position += count;
+            }
+        }
+        run->shard_start[num_shards] = position;
+    }
+    pthread_barrier_wait(&run->barrier);
+
+    for (size_t i = begin; i < end; i++) {
+        size_t position = counts[cache_parallel_shard(run, run->addresses[i])]++;
+        run->shard_addresses[position] = run->addresses[i];
+        run->shard_writes[position] = run->is_write != NULL && run->is_write[i];
+    }
+    pthread_barrier_wait(&run->barrier);
+
+    size_t start = run->shard_start[shard->id];
+    shard->misses = cache_access_batch(&shard->cache, run->shard_addresses + start, run->shard_writes + start,
+                                       run->shard_start[shard->id + 1] - start, NULL, NULL);
+    return NULL;
+}
+
+/*
+ * Simulate n accesses on several threads, each owning a range of sets.
+ */
+size_t cache_access_parallel(cache_t *cache, const uintptr_t *addresses, const uint8_t *is_write, size_t n,
+                             size_t num_threads) {
+    if (cache_has_detailed_stats(cache))
+        num_threads = 1;
+    if (num_threads > cache->num_sets)
+        num_threads = cache->num_sets;
+    if (num_threads <= 1)
+        return cache_access_batch(cache, addresses, is_write, n, NULL, NULL);
+
+    cache_parallel_t run;
+    run.cache = cache;
+    run.addresses = addresses;
+    run.is_write = is_write;
+    run.n = n;
+    run.num_shards = num_threads;
+    run.counts = (size_t *)calloc(num_threads * num_threads, sizeof(size_t));
+    run.shard_start = (size_t *)malloc((num_threads + 1) * sizeof(size_t));
+    run.shard_addresses = (uintptr_t *)malloc(n * sizeof(uintptr_t));
+    run.shard_writes = (uint8_t *)malloc(n);
+
+    cache_shard_t *shards = (cache_shard_t *)malloc(num_threads * sizeof(cache_shard_t));
+    for (size_t i = 0; i < num_threads; i++) {
+        shards[i].run = &run;
+        shards[i].id = i;
+        shards[i].cache = *cache;
+        shards[i].cache.access_count = 0;
+        shards[i].cache.miss_count = 0;
+        shards[i].cache.writeback_count = 0;
+        shards[i].cache.memory_read_bytes = 0;
+        shards[i].cache.memory_write_bytes = 0;
+    }
+
+    // The calling thread runs the first shard. The shards pass the barrier
+    // together, so one whose thread cannot be created cannot run afterwards:
+    // the sets are split among the threads that were created instead, which
+    // wait until then to read num_shards.
+    pthread_mutex_init(&run.start, NULL);
+    pthread_mutex_lock(&run.start);
+    size_t created = 1;
+    while (created < num_threads &&
+           pthread_create(&shards[created].thread, NULL, cache_parallel_worker, &shards[created]) == 0)
+        created++;
+    run.num_shards = created;
+    pthread_barrier_init(&run.barrier, NULL, created);
+    pthread_mutex_unlock(&run.start);
+    cache_parallel_worker(&shards[0]);
+
+    size_t misses = 0;
+    for (size_t i = 0; i < created; i++) {
+        if (i > 0)
+            pthread_join(shards[i].thread, NULL);
+        misses += shards[i].misses;
+        cache->access_count += shards[i].cache.access_count;
+        cache->miss_count += shards[i].cache.miss_count;
+        cache->writeback_count += shards[i].cache.writeback_count;
+        cache->memory_read_bytes += shards[i].cache.memory_read_bytes;
+        cache->memory_write_bytes += shards[i].cache.memory_write_bytes;
+    }
+
+    pthread_barrier_destroy(&run.barrier);
+    pthread_mutex_destroy(&run.start);
+    free(shards);
+    free(run.counts);
+    free(run.shard_start);
+    free(run.shard_addresses);
+    free(run.shard_writes);
+    return misses;
 }
 
 /*
  * Return the number of cache misses since the cache was created.
  */
-uint32_t cache_miss_count(cache_t *cache) {
+uint64_t cache_miss_count(cache_t *cache) {
 
     return cache->miss_count;
 }
@@ -225,8 +1503,55 @@ uint32_t cache_miss_count(cache_t *cache) {
 /*
  * Return the number of cache accesses since the cache was created.
  */
-uint32_t cache_access_count(cache_t *cache) {
+uint64_t cache_access_count(cache_t *cache) {
 
     return cache->access_count;
 }
 
+/*
+ * Return the number of dirty lines written back to memory since the cache was created.
+ */
+uint64_t cache_writeback_count(cache_t *cache) {
+
+    return cache->writeback_count;
+}
+
+/*
+ * Return the number of bytes read from memory since the cache was created.
+ */
+uint64_t cache_memory_read_bytes(cache_t *cache) {
+
+    return cache->memory_read_bytes;
+}
+
+/*
+ * Return the number of bytes written to memory since the cache was created.
+ */
+uint64_t cache_memory_write_bytes(cache_t *cache) {
+
+    return cache->memory_write_bytes;
+}
+
+/*
+ * Store a snapshot of the statistics of a cache.
+ */
+void cache_get_stats(cache_t *cache, cache_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->accesses = cache->access_count;
+    stats->misses = cache->miss_count;
+    stats->hits = cache->access_count - cache->miss_count;
+    stats->writebacks = cache->writeback_count;
+    stats->memory_read_bytes = cache->memory_read_bytes;
+    stats->memory_write_bytes = cache->memory_write_bytes;
+
+    cache_detailed_stats_t *detailed = cache->detailed_stats;
+    if (detailed == NULL)
+        return;
+    stats->compulsory_misses = detailed->compulsory_misses;
+    stats->capacity_misses = detailed->capacity_misses;
+    stats->conflict_misses = detailed->conflict_misses;
+    stats->evictions = detailed->evictions;
+    stats->num_sets = detailed->num_sets;
+    stats->set_hits = detailed->set_hits;
+    stats->set_misses = detailed->set_misses;
+}
@@ -14,18 +14,28 @@
 
 /*
  * Replacement policies. The MASK defines which bits are used to
- * represent policies. As we have three policies, we assign
- * them the values 0, 1 and 2.
+ * represent policies. As we have six policies, we assign
+ * them the values 0 to 5.
  *
  * Therefore, you can check for a specific policy using:
  * if (policy & CACHE_REPLACEMENTPOLICY_MASK == CACHE_REPLACEMENTPOLICY_LRU) { ... }
+ *
+ * TREE_PLRU keeps a binary tree of associativity - 1 bits per set, each
+ * pointing towards the less recently used half below it. BIT_PLRU keeps one
+ * bit per way, set on use and cleared for all other ways once every bit is
+ * set; the victim is the first way whose bit is clear. Both support at most
+ * CACHE_PLRU_MAX_ASSOCIATIVITY ways, and fall back to LRU above that.
  */
 #define CACHE_REPLACEMENTPOLICY_MASK               0b00011100
 
 #define CACHE_REPLACEMENTPOLICY_RANDOM             0b00000000
 #define CACHE_REPLACEMENTPOLICY_LRU                0b00000100
 #define CACHE_REPLACEMENTPOLICY_MRU                0b00001000
+#define CACHE_REPLACEMENTPOLICY_TREE_PLRU          0b00001100
 #define CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING 0b00010000
+#define CACHE_REPLACEMENTPOLICY_BIT_PLRU           0b00010100
+
+#define CACHE_PLRU_MAX_ASSOCIATIVITY 64
 
 /*
  * Write policies: We use two bits to indicate the write policy.
@@ -46,6 +56,74 @@
 #define CACHE_TRACE_MASK  0b00100000
 #define CACHE_TRACEPOLICY 0b00100000
 
+/*
+ * Layout policies: by default the state of each line (valid, dirty and
+ * marked bits, and the tag) is stored in its cache_line_t. With the SOA
+ * layout each set instead keeps its tags in one contiguous, aligned array
+ * and its valid/dirty/marked bits in bitmasks, so a lookup only touches the
+ * set's tag array. In that layout a cache_line_t only provides the block
+ * pointer and the coherence state. Caches with more than CACHE_SOA_MAX_ASSOCIATIVITY ways always
+ * use the line layout.
+ */
+#define CACHE_LAYOUT_MASK  0b01000000
+
+#define CACHE_LAYOUT_LINES 0b00000000
+#define CACHE_LAYOUT_SOA   0b01000000
+
+#define CACHE_SOA_MAX_ASSOCIATIVITY 64
+
+/*
+ * LRU implementations: by default the LRU order of a set is kept in its
+ * lru_list array, which is shifted on every update. With LRU_LINKED the
+ * order is kept in a circular doubly linked list of way indices instead, so
+ * it is updated in constant time; cache_set_lru_order reports the order in
+ * the lru_list form for either implementation. Caches with more than
+ * CACHE_LRU_LINKED_MAX_ASSOCIATIVITY ways always use the shifting list.
+ */
+#define CACHE_LRU_MASK     0b10000000
+
+#define CACHE_LRU_SHIFTING 0b00000000
+#define CACHE_LRU_LINKED   0b10000000
+
+#define CACHE_LRU_LINKED_MAX_ASSOCIATIVITY 256
+
+/*
+ * Data policies: by default every line holds a copy of its block. With
+ * TAG_ONLY the cache only tracks tags and replacement state: it allocates no
+ * block storage, every block pointer is NULL, and memory is never read or
+ * written, so the simulated addresses need not be valid in this process.
+ * cache_read then returns 0, and writes and writebacks only update the
+ * statistics.
+ */
+#define CACHE_DATA_MASK     0b100000000
+
+#define CACHE_DATA_COPY     0b000000000
+#define CACHE_DATA_TAG_ONLY 0b100000000
+
+/*
+ * Arena policies: a cache and all of its state are allocated as one arena.
+ * With HUGEPAGES an arena of at least 2 MB is mapped directly, in whole huge
+ * pages, and the kernel is asked to back it with transparent huge pages.
+ */
+#define CACHE_ARENA_MASK      0b1000000000
+
+#define CACHE_ARENA_HEAP      0b0000000000
+#define CACHE_ARENA_HUGEPAGES 0b1000000000
+
+/*
+ * Statistics policies: by default a cache only counts accesses, misses,
+ * writebacks and memory traffic. With DETAILED it also counts evictions,
+ * hits and misses per set, and classifies every miss as compulsory (first
+ * access to the block), capacity (the block would also have missed in a
+ * fully associative LRU cache with as many lines) or conflict (any other
+ * miss), all reported by cache_get_stats. Only cache_read, cache_write and
+ * the batch functions are counted, not the hierarchy primitives.
+ */
+#define CACHE_STATS_MASK     0b10000000000
+
+#define CACHE_STATS_BASIC    0b00000000000
+#define CACHE_STATS_DETAILED 0b10000000000
+
 /*
  * Structure used to store a single cache line.
  */
@@ -65,6 +143,9 @@ typedef struct cache_line_s {
   
     /* The cache block as bytes */
     uint8_t *block;
+
+    /* The MESI/MOESI state, only maintained by coherence.c (see coherence.h). */
+    uint8_t coherence_state;
   
 } cache_line_t;
 
@@ -77,6 +158,20 @@ typedef struct cache_set_s {
     size_t first_index;
     size_t *lru_list;
     size_t num_marked;
+
+    /* SOA layout only: the tags of the set and one state bit per way. */
+    uintptr_t *tags;
+    uint64_t valid_mask, dirty_mask, marked_mask;
+
+    /* LRU_LINKED only: the links of the LRU list and its least recently used way. */
+    uint8_t *lru_prev, *lru_next;
+    uint8_t lru_head;
+
+    /* TREE_PLRU: node n of the tree is bit n (the root is bit 1). BIT_PLRU: bit i is way i. */
+    uint64_t plru_bits;
+
+    /* State of the set's own random number generator (see cache_access_parallel). */
+    uint64_t rng_state;
 } cache_set_t;
 
 /*
@@ -110,56 +205,220 @@ typedef struct cache_s {
     /* Shift for tag. */
     uint8_t tag_shift;
   
-    /* Replacement and write policies. */
-    uint8_t policies;
+    /* Replacement, write, layout and data policies. */
+    uint32_t policies;
   
     /* All the memory in the cache */
     uint8_t *memory;
 
     /* Array of lines, each of which is an array of bytes. */
     cache_line_t *lines;
+
+    /* Tags of all lines, set by set (SOA layout only). */
+    uintptr_t *tags;
+
+    /* Shifting LRU lists of all sets, set by set (not LRU_LINKED). */
+    size_t *lru_lists;
+
+    /* Links of all LRU lists, set by set (LRU_LINKED only). */
+    uint8_t *lru_links;
   
     /* Array of sets, each of which refers to its lines */
     cache_set_t *sets;
   
     /* Statistics about cache usage. */
-    uint32_t access_count, miss_count;
+    uint64_t access_count, miss_count;
+
+    /* Number of dirty lines written back to memory on eviction. */
+    uint64_t writeback_count;
+
+    /* Traffic between the cache and memory, in bytes. */
+    uint64_t memory_read_bytes, memory_write_bytes;
+
+    /* Detailed statistics (STATS_DETAILED only). */
+    struct cache_detailed_stats_s *detailed_stats;
+
+    /* The arena holding this structure and everything it points to, and how it was allocated. */
+    void *arena;
+    size_t arena_size;
+    bool arena_is_mapped;
 } cache_t;
 
+/*
+ * Random number generator used by the RANDOM and RANDOMIZED_MARKING
+ * policies. Every function taking one also accepts NULL, in which case each
+ * set draws from its own deterministic generator instead, so the victims
+ * chosen in a set only depend on the accesses to that set.
+ */
 typedef int (*func_t)(void);
 
+/*
+ * Description of a block removed from a cache by cache_fill or
+ * cache_invalidate. The caller sets block to a buffer of line_size bytes
+ * that receives the removed data, or to NULL if the data is not needed.
+ */
+typedef struct cache_eviction_s {
+    /* Whether a valid block was removed, and whether it was dirty. */
+    bool is_valid, is_dirty;
+
+    /* Address of the first byte of the removed block. */
+    uintptr_t address;
+
+    /* The removed data. */
+    uint8_t *block;
+} cache_eviction_t;
+
+/*
+ * Snapshot of the statistics of a cache. The fields below the line are
+ * only collected with CACHE_STATS_DETAILED, and are 0 (or NULL) otherwise.
+ */
+typedef struct cache_stats_s {
+    uint64_t accesses, hits, misses;
+    uint64_t writebacks;
+    uint64_t memory_read_bytes, memory_write_bytes;
+
+    uint64_t compulsory_misses, capacity_misses, conflict_misses;
+    uint64_t evictions;
+
+    /* Hits and misses of each of the num_sets sets. These point into the
+     * cache, and are valid until it is reset or freed. */
+    size_t num_sets;
+    const uint64_t *set_hits, *set_misses;
+} cache_stats_t;
+
 /* Public functions */
 
 /*
  * Create a new cache that contains a total of num_bytes line, each of which is block_size
- * bytes long, with the given associativity and policies.
+ * bytes long, with the given associativity and policies. Returns NULL if the
+ * memory cannot be allocated.
  */
-cache_t *cache_new(size_t num_bytes, size_t block_size, size_t associativity, uint8_t policies);
+cache_t *cache_new(size_t num_bytes, size_t block_size, size_t associativity, uint32_t policies);
 
 /*
  * Frees all memory allocated for the given cache.
  */
 void cache_free(cache_t *cache);
 
+/*
+ * Invalidate every line of the given cache, restore its replacement state
+ * and clear its statistics, as if it had just been created, without
+ * reallocating it.
+ */
+void cache_reset(cache_t *cache);
+
 /*
  * Read a single long integer from the cache.
  */
 uint64_t cache_read(cache_t *cache, uintptr_t address, func_t generate_random_number);
 
 /*
- * Write a single long integer to memory and/or the cache.
+ * Write a single long integer to memory and/or the cache. With WRITEBACK the
+ * line is marked dirty and written to memory when it is evicted; with
+ * WRITETHROUGH the value is also written to memory. On a miss, WRITEALLOCATE
+ * first reads the line into the cache, while WRITENOALLOCATE only writes the
+ * value to memory.
  */
 void cache_write(cache_t *cache, uintptr_t address, uint64_t value, func_t generate_random_number);
 
+/*
+ * Primitives used to build cache hierarchies. None of them update the
+ * access or miss counts.
+ *
+ * cache_lookup returns whether the block containing address is present,
+ * updating the replacement state if update_replacement is true and storing
+ * a pointer to the block's data in *block if block is not NULL.
+ *
+ * cache_fill installs the block containing address (which must not be
+ * present), copying its data from data or, if data is NULL, from memory at
+ * address. The replaced block is described in *evicted if evicted is not
+ * NULL; otherwise a dirty replaced block is written back to memory. Returns
+ * a pointer to the installed data (NULL for TAG_ONLY caches).
+ *
+ * cache_invalidate removes the block containing address, describing it in
+ * *evicted if evicted is not NULL, and returns whether it was present.
+ *
+ * cache_mark_dirty and cache_mark_clean set and clear the dirty bit of the
+ * block containing address and return whether it was present.
+ */
+bool cache_lookup(cache_t *cache, uintptr_t address, bool update_replacement, uint8_t **block);
+uint8_t *cache_fill(cache_t *cache, uintptr_t address, const uint8_t *data, bool is_dirty,
+                    func_t generate_random_number, cache_eviction_t *evicted);
+bool cache_invalidate(cache_t *cache, uintptr_t address, cache_eviction_t *evicted);
+bool cache_mark_dirty(cache_t *cache, uintptr_t address);
+bool cache_mark_clean(cache_t *cache, uintptr_t address);
+
+/*
+ * Return the line holding the block containing address, without touching
+ * the replacement state or the statistics, or NULL if it is not present.
+ */
+cache_line_t *cache_find_line(cache_t *cache, uintptr_t address);
+
+/*
+ * Bring the block containing address into the cache from memory, as a
+ * prefetch: the line is filled like on a read miss (writing back a dirty
+ * victim), but the access and miss counts are not updated. The replaced
+ * block, if any, is described in *evicted if evicted is not NULL (set its
+ * block to NULL when the data is not needed). Returns false, doing nothing,
+ * if the block is already present.
+ */
+bool cache_prefetch(cache_t *cache, uintptr_t address, func_t generate_random_number, cache_eviction_t *evicted);
+
+/*
+ * Number of accesses decoded together by cache_access_batch.
+ */
+#define CACHE_BATCH_SIZE 64
+
+/*
+ * Simulate n accesses to the given addresses. Access i is a write if is_write
+ * is not NULL and is_write[i] is non-zero; writes follow the write policies
+ * like cache_write, but do not change any data. If hits is not NULL it must hold at least (n + 7) / 8 bytes, and bit
+ * (i % 8) of hits[i / 8] is set when access i hits. Returns the number of
+ * misses in the batch.
+ */
+size_t cache_access_batch(cache_t *cache, const uintptr_t *addresses, const uint8_t *is_write, size_t n,
+                          uint8_t *hits, func_t generate_random_number);
+
+/*
+ * Simulate n accesses like cache_access_batch, on num_threads threads, or on
+ * as many as can be created. The sets are split into one contiguous range
+ * per thread; the accesses are
+ * partitioned by the range of their set, keeping their order, and each
+ * thread then simulates the accesses to its own sets with private counters
+ * that are merged at the end. It uses the per-set random number generators,
+ * so the result is identical to cache_access_batch with a NULL generator.
+ * Trace output, if enabled, is interleaved between threads. A cache with
+ * CACHE_STATS_DETAILED classifies misses in access order, so it is simulated
+ * on the calling thread only. Returns the number of misses.
+ */
+size_t cache_access_parallel(cache_t *cache, const uintptr_t *addresses, const uint8_t *is_write, size_t n,
+                             size_t num_threads);
+
 /*
  * Return the number of cache misses since the cache was created.
  */
-uint32_t cache_miss_count(cache_t *cache);
+uint64_t cache_miss_count(cache_t *cache);
 
 /*
  * Return the number of cache accesses since the cache was created.
  */
-uint32_t cache_access_count(cache_t *cache);
+uint64_t cache_access_count(cache_t *cache);
+
+/*
+ * Return the number of dirty lines written back to memory since the cache was created.
+ */
+uint64_t cache_writeback_count(cache_t *cache);
+
+/*
+ * Return the number of bytes read from and written to memory since the cache was created.
+ */
+uint64_t cache_memory_read_bytes(cache_t *cache);
+uint64_t cache_memory_write_bytes(cache_t *cache);
+
+/*
+ * Store a snapshot of the statistics of a cache in *stats.
+ */
+void cache_get_stats(cache_t *cache, cache_stats_t *stats);
 
 /*
  *  Helpers
@@ -169,5 +428,14 @@ uint64_t cache_line_retrieve_data(cache_line_t *cache_line, size_t offset);
 cache_line_t *cache_set_find_matching_line(cache_t *cache, cache_set_t *cache_set, uintptr_t tag);
 size_t choose_unmarked_cache_line(cache_t *cache, cache_set_t *cache_set, func_t generate_random_number);
 cache_line_t *find_available_cache_line(cache_t *cache, cache_set_t *cache_set, func_t generate_random_number);
+void cache_set_lru_order(cache_t *cache, cache_set_t *cache_set, size_t *order);
+
+/*
+ * Compare the first ways tags of a SOA tag array against tag, and return a
+ * mask with bit i set when tags[i] == tag. The scalar version is the fallback
+ * used when no vector unit is available.
+ */
+uint64_t cache_tags_match_mask(const uintptr_t *tags, size_t ways, uintptr_t tag);
+uint64_t cache_tags_match_mask_scalar(const uintptr_t *tags, size_t ways, uintptr_t tag);
 
 #endif
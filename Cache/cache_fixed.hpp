@@ -0,0 +1,212 @@
+/*
+ * cache_fixed.hpp
+ *
+ * Caches specialized at compile time for one geometry and replacement
+ * policy. The masks and shifts are constants, the loops over the ways of a
+ * set have a constant trip count (and are unrolled by the compiler), and the
+ * policy is chosen when the template is instantiated, so an access has no
+ * policy branches.
+ *
+ * A cache_fixed only tracks tags and replacement state, like a TAG_ONLY
+ * cache_t, and simulates every access as a read; with WRITEALLOCATE a write
+ * hits and misses exactly like a read, so the counts match those of a
+ * cache_t with the same geometry and replacement policy. Configurations
+ * outside the instantiated ones use cache_new and cache_access_batch.
+ */
+#ifndef CACHE_FIXED_HPP
+#define CACHE_FIXED_HPP
+
+#include <memory>
+extern "C"
+{
+#include "cache.h"
+}
+
+namespace cache_fixed_detail {
+
+/*
+ * Return log_2 of n rounded up, for n a power of 2 or the number of ways of
+ * a tree.
+ */
+constexpr unsigned int log2_ceil(size_t n) {
+    return n <= 1 ? 0 : 1 + log2_ceil((n + 1) / 2);
+}
+
+constexpr bool is_power_of_two(size_t n) {
+    return n != 0 && (n & (n - 1)) == 0;
+}
+
+}
+
+template <size_t NumBytes, size_t BlockSize, size_t Associativity, uint32_t ReplacementPolicy>
+class cache_fixed {
+public:
+    static constexpr size_t num_sets = NumBytes / (BlockSize * Associativity);
+    static constexpr unsigned int offset_bits = cache_fixed_detail::log2_ceil(BlockSize);
+    static constexpr unsigned int index_bits = cache_fixed_detail::log2_ceil(num_sets);
+    static constexpr unsigned int tree_levels = cache_fixed_detail::log2_ceil(Associativity);
+    static constexpr uint64_t way_mask = Associativity >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << Associativity) - 1;
+
+    static_assert(cache_fixed_detail::is_power_of_two(BlockSize), "the block size must be a power of 2");
+    static_assert(cache_fixed_detail::is_power_of_two(num_sets), "the number of sets must be a power of 2");
+    static_assert(Associativity >= 1 && Associativity <= 64, "the associativity must be between 1 and 64");
+    static_assert(ReplacementPolicy == CACHE_REPLACEMENTPOLICY_RANDOM || ReplacementPolicy == CACHE_REPLACEMENTPOLICY_LRU ||
+                  ReplacementPolicy == CACHE_REPLACEMENTPOLICY_TREE_PLRU ||
+                  ReplacementPolicy == CACHE_REPLACEMENTPOLICY_BIT_PLRU,
+                  "the replacement policy must be RANDOM, LRU, TREE_PLRU or BIT_PLRU");
+
+    cache_fixed() : sets(new set_t[num_sets]()), accesses(0), misses(0) {
+        for (size_t index = 0; index < num_sets; index++) {
+            for (size_t way = 0; way < Associativity; way++)
+                sets[index].rank[way] = way;
+            sets[index].rng_state = index * Associativity;
+        }
+    }
+
+    /*
+     * Return whether a cache_t has this geometry and replacement policy, and
+     * so gives the same results.
+     */
+    static bool matches(const cache_t *cache) {
+        return cache->num_lines * cache->line_size == NumBytes && cache->line_size == BlockSize &&
+               cache->associativity == Associativity &&
+               (cache->policies & CACHE_REPLACEMENTPOLICY_MASK) == ReplacementPolicy &&
+               (cache->policies & CACHE_WRITEPOLICY_WRITENOALLOCATE) == CACHE_WRITEPOLICY_WRITEALLOCATE;
+    }
+
+    /*
+     * Simulate an access, and return whether it hit.
+     */
+    bool access(uintptr_t address, func_t generate_random_number) {
+        set_t &set = sets[(address >> offset_bits) & (num_sets - 1)];
+        uintptr_t tag = address >> (offset_bits + index_bits);
+
+        uint64_t hits = 0;
+        for (size_t way = 0; way < Associativity; way++)
+            hits |= (uint64_t)(set.tags[way] == tag) << way;
+        hits &= set.valid;
+
+        accesses++;
+        if (hits) {
+            touch(set, __builtin_ctzll(hits));
+            return true;
+        }
+
+        misses++;
+        uint64_t invalid = ~set.valid & way_mask;
+        size_t way = invalid ? __builtin_ctzll(invalid) : victim(set, generate_random_number);
+        set.tags[way] = tag;
+        set.valid |= (uint64_t)1 << way;
+        touch(set, way);
+        return false;
+    }
+
+    /*
+     * Simulate n accesses, and return the number of misses.
+     */
+    size_t access_batch(const uintptr_t *addresses, size_t n, func_t generate_random_number) {
+        uint64_t before = misses;
+        for (size_t i = 0; i < n; i++)
+            access(addresses[i], generate_random_number);
+        return misses - before;
+    }
+
+    uint64_t access_count() const { return accesses; }
+    uint64_t miss_count() const { return misses; }
+
+private:
+    /*
+     * A set: its tags, valid bits, and replacement state. For LRU, rank[i] is
+     * the number of ways used since way i (0 for the most recently used).
+     * rng_state is the set's own generator, seeded like those of cache_t.
+     */
+    struct set_t {
+        uintptr_t tags[Associativity];
+        uint64_t valid;
+        uint64_t plru_bits;
+        uint64_t rng_state;
+        uint8_t rank[Associativity];
+    };
+
+    /*
+     * Return a random number from the given generator, or from the set's own
+     * generator if it is NULL.
+     */
+    static size_t random(set_t &set, func_t generate_random_number) {
+        if (generate_random_number != NULL)
+            return generate_random_number();
+
+        uint64_t z = set.rng_state += 0x9e3779b97f4a7c15;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return (z ^ (z >> 31)) >> 33;
+    }
+
+    void touch(set_t &set, size_t way) {
+        switch (ReplacementPolicy) {
+        case CACHE_REPLACEMENTPOLICY_LRU: {
+            uint8_t rank = set.rank[way];
+            for (size_t i = 0; i < Associativity; i++)
+                set.rank[i] += set.rank[i] < rank;
+            set.rank[way] = 0;
+            break;
+        }
+        case CACHE_REPLACEMENTPOLICY_TREE_PLRU: {
+            size_t node = 1;
+            for (int level = tree_levels - 1; level >= 0; level--) {
+                size_t direction = (way >> level) & 1;
+                set.plru_bits = (set.plru_bits & ~((uint64_t)1 << node)) | (uint64_t)(direction ^ 1) << node;
+                node = 2 * node + direction;
+            }
+            break;
+        }
+        case CACHE_REPLACEMENTPOLICY_BIT_PLRU:
+            set.plru_bits |= (uint64_t)1 << way;
+            if (set.plru_bits == way_mask)
+                set.plru_bits = (uint64_t)1 << way;
+            break;
+        default:
+            break;
+        }
+    }
+
+    size_t victim(set_t &set, func_t generate_random_number) {
+        switch (ReplacementPolicy) {
+        case CACHE_REPLACEMENTPOLICY_LRU: {
+            size_t way = 0;
+            for (size_t i = 0; i < Associativity; i++)
+                if (set.rank[i] == Associativity - 1)
+                    way = i;
+            return way;
+        }
+        case CACHE_REPLACEMENTPOLICY_TREE_PLRU: {
+            size_t node = 1, way = 0;
+            for (int level = tree_levels - 1; level >= 0; level--) {
+                size_t direction = (set.plru_bits >> node) & 1;
+                if (((2 * way + 1) << level) >= Associativity)
+                    direction = 0;
+                way = 2 * way + direction;
+                node = 2 * node + direction;
+            }
+            return way;
+        }
+        case CACHE_REPLACEMENTPOLICY_BIT_PLRU: {
+            uint64_t clear = ~set.plru_bits & way_mask;
+            return clear ? __builtin_ctzll(clear) : 0;
+        }
+        default:
+            return random(set, generate_random_number) % Associativity;
+        }
+    }
+
+    std::unique_ptr<set_t[]> sets;
+    uint64_t accesses, misses;
+};
+
+/*
+ * The production geometries: a 32K, 8-way L1 and a 1M, 16-way L2, with 64-byte lines.
+ */
+typedef cache_fixed<32768, 64, 8, CACHE_REPLACEMENTPOLICY_LRU> cache_fixed_l1_t;
+typedef cache_fixed<1048576, 64, 16, CACHE_REPLACEMENTPOLICY_LRU> cache_fixed_l2_t;
+
+#endif
@@ -0,0 +1,354 @@
+#include "coherence.h"
+#include <string.h>
+
+/*
+ * Number of entries of the invalidated tables per L1 line.
+ */
+#define CACHE_COHERENCE_TABLE_RATIO 4
+
+/*
+ * Increment a counter shared between the host threads.
+ */
+static inline void coherence_count(uint64_t *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Return whether a cache can be part of a coherent system.
+ */
+static bool coherence_accepts(cache_t *cache, size_t line_size) {
+    return cache != NULL && cache->line_size == line_size && (cache->policies & CACHE_DATA_TAG_ONLY) &&
+           !(cache->policies & CACHE_STATS_DETAILED);
+}
+
+/*
+ * Create a coherent system.
+ */
+cache_coherence_t *cache_coherence_new(cache_t **l1s, size_t num_cores, cache_t *llc, uint8_t protocol) {
+    if (num_cores == 0 || llc == NULL)
+        return NULL;
+
+    size_t line_size = llc->line_size;
+    if (!coherence_accepts(llc, line_size) || llc->num_sets < l1s[0]->num_sets)
+        return NULL;
+    for (size_t c = 0; c < num_cores; c++)
+        if (!coherence_accepts(l1s[c], line_size) || l1s[c]->num_sets != l1s[0]->num_sets)
+            return NULL;
+
+    cache_coherence_t *system = (cache_coherence_t *)calloc(1, sizeof(cache_coherence_t));
+    system->num_cores = num_cores;
+    system->l1s = (cache_t **)malloc(num_cores * sizeof(cache_t *));
+    memcpy(system->l1s, l1s, num_cores * sizeof(cache_t *));
+    system->llc = llc;
+    system->protocol = protocol;
+    system->core_stats = (cache_core_stats_t *)calloc(num_cores, sizeof(cache_core_stats_t));
+
+    // The number of locks divides the number of L1 sets, so that a lock covers whole sets.
+    size_t num_locks = l1s[0]->num_sets < CACHE_COHERENCE_MAX_LOCKS ? l1s[0]->num_sets : CACHE_COHERENCE_MAX_LOCKS;
+    system->lock_mask = num_locks - 1;
+    system->locks = (pthread_mutex_t *)malloc(num_locks * sizeof(pthread_mutex_t));
+    for (size_t i = 0; i < num_locks; i++)
+        pthread_mutex_init(&system->locks[i], NULL);
+
+    // A power of two multiple of the number of L1 sets, so that an entry is only used under one lock.
+    size_t table_size = l1s[0]->num_sets;
+    while (table_size < CACHE_COHERENCE_TABLE_RATIO * l1s[0]->num_lines)
+        table_size *= 2;
+    system->invalidated_mask = table_size - 1;
+    system->invalidated = (uintptr_t *)calloc(num_cores * table_size, sizeof(uintptr_t));
+
+    system->scratch = (uint8_t *)calloc(1, line_size);
+    return system;
+}
+
+/*
+ * Frees all memory allocated for a coherent system.
+ */
+void cache_coherence_free(cache_coherence_t *system) {
+    if (system == NULL)
+        return;
+
+    for (size_t c = 0; c < system->num_cores; c++)
+        cache_free(system->l1s[c]);
+    cache_free(system->llc);
+    for (size_t i = 0; i <= system->lock_mask; i++)
+        pthread_mutex_destroy(&system->locks[i]);
+    free(system->locks);
+    free(system->l1s);
+    free(system->core_stats);
+    free(system->invalidated);
+    free(system->scratch);
+    free(system);
+}
+
+/*
+ * Return the block number of an address.
+ */
+static inline uintptr_t coherence_block(cache_coherence_t *system, uintptr_t address) {
+    return address / system->llc->line_size;
+}
+
+/*
+ * Return the lock guarding the sets of an address.
+ */
+static inline pthread_mutex_t *coherence_lock(cache_coherence_t *system, uintptr_t address) {
+    cache_t *l1 = system->l1s[0];
+    size_t index = (address & l1->cache_index_mask) >> l1->cache_index_shift;
+    return &system->locks[index & system->lock_mask];
+}
+
+/*
+ * Return the entry of the invalidated table of a core for an address.
+ */
+static inline uintptr_t *coherence_invalidated(cache_coherence_t *system, size_t core, uintptr_t address) {
+    uintptr_t block = coherence_block(system, address);
+    return &system->invalidated[core * (system->invalidated_mask + 1) + (block & system->invalidated_mask)];
+}
+
+/*
+ * Set the state of the L1 line holding address, and its dirty bit.
+ */
+static void coherence_set_state(cache_t *l1, cache_line_t *line, uintptr_t address, uint8_t state) {
+    line->coherence_state = state;
+    if (state == CACHE_COHERENCE_MODIFIED || state == CACHE_COHERENCE_OWNED)
+        cache_mark_dirty(l1, address);
+    else
+        cache_mark_clean(l1, address);
+}
+
+/*
+ * Make sure the LLC holds the block containing address, reading it from
+ * memory on a miss. The block evicted to make room is invalidated in all L1s
+ * and written to memory if any copy of it was dirty.
+ */
+static void coherence_llc_fetch(cache_coherence_t *system, uintptr_t address) {
+    cache_eviction_t evicted = {0};
+
+    coherence_count(&system->llc_accesses);
+    if (cache_lookup(system->llc, address, true, NULL))
+        return;
+
+    coherence_count(&system->llc_misses);
+    coherence_count(&system->memory_reads);
+    cache_fill(system->llc, address, system->scratch, false, NULL, &evicted);
+    if (!evicted.is_valid)
+        return;
+
+    bool is_dirty = evicted.is_dirty;
+    for (size_t c = 0; c < system->num_cores; c++) {
+        cache_eviction_t copy = {0};
+        if (cache_invalidate(system->l1s[c], evicted.address, &copy)) {
+            coherence_count(&system->back_invalidations);
+            is_dirty |= copy.is_dirty;
+        }
+    }
+    if (is_dirty)
+        coherence_count(&system->memory_writes);
+}
+
+/*
+ * Write a dirty L1 block back to the LLC.
+ */
+static void coherence_write_back(cache_coherence_t *system, size_t core, uintptr_t address) {
+    cache_mark_dirty(system->llc, address);
+    coherence_count(&system->core_stats[core].writebacks);
+}
+
+/*
+ * Install a block in the L1 of a core in the given state. A dirty victim is
+ * written back to the LLC, which holds it as it is inclusive.
+ */
+static void coherence_l1_fill(cache_coherence_t *system, size_t core, uintptr_t address, uint8_t state) {
+    cache_t *l1 = system->l1s[core];
+    cache_eviction_t evicted = {0};
+
+    cache_fill(l1, address, system->scratch, false, NULL, &evicted);
+    if (evicted.is_valid && evicted.is_dirty)
+        coherence_write_back(system, core, evicted.address);
+    coherence_set_state(l1, cache_find_line(l1, address), address, state);
+}
+
+/*
+ * Invalidate the copies of a block in the L1s of all cores but one, after
+ * a write of that core. Returns whether one of them was dirty.
+ */
+static bool coherence_invalidate_others(cache_coherence_t *system, size_t core, uintptr_t address) {
+    uintptr_t block = coherence_block(system, address);
+    bool is_dirty = false;
+
+    for (size_t c = 0; c < system->num_cores; c++) {
+        cache_eviction_t copy = {0};
+        if (c == core || !cache_invalidate(system->l1s[c], address, &copy))
+            continue;
+
+        is_dirty |= copy.is_dirty;
+        *coherence_invalidated(system, c, address) = block + 1;
+        coherence_count(&system->core_stats[core].invalidations_sent);
+        coherence_count(&system->core_stats[c].invalidations_received);
+    }
+    return is_dirty;
+}
+
+/*
+ * Count an L1 miss of a core, and whether it is a coherence miss.
+ */
+static void coherence_count_miss(cache_coherence_t *system, size_t core, uintptr_t address) {
+    uintptr_t *entry = coherence_invalidated(system, core, address);
+
+    coherence_count(&system->core_stats[core].misses);
+    if (*entry == coherence_block(system, address) + 1) {
+        *entry = 0;
+        coherence_count(&system->core_stats[core].coherence_misses);
+    }
+}
+
+/*
+ * Simulate a read by a core.
+ */
+void cache_coherence_read(cache_coherence_t *system, size_t core, uintptr_t address) {
+    pthread_mutex_t *lock = coherence_lock(system, address);
+    cache_core_stats_t *stats = &system->core_stats[core];
+
+    pthread_mutex_lock(lock);
+    coherence_count(&stats->reads);
+    if (cache_lookup(system->l1s[core], address, true, NULL)) {
+        coherence_count(&stats->hits);
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    coherence_count_miss(system, core, address);
+
+    // Snoop the other L1s: a Modified, Owned or Exclusive copy supplies the block.
+    bool is_shared = false, is_supplied = false;
+    for (size_t c = 0; c < system->num_cores; c++) {
+        cache_line_t *line = c == core ? NULL : cache_find_line(system->l1s[c], address);
+        if (line == NULL)
+            continue;
+
+        is_shared = true;
+        switch (line->coherence_state) {
+        case CACHE_COHERENCE_MODIFIED:
+            if (system->protocol == CACHE_PROTOCOL_MOESI)
+                line->coherence_state = CACHE_COHERENCE_OWNED;
+            else {
+                coherence_write_back(system, c, address);
+                coherence_set_state(system->l1s[c], line, address, CACHE_COHERENCE_SHARED);
+            }
+            is_supplied = true;
+            break;
+        case CACHE_COHERENCE_EXCLUSIVE:
+            line->coherence_state = CACHE_COHERENCE_SHARED;
+            is_supplied = true;
+            break;
+        case CACHE_COHERENCE_OWNED:
+            is_supplied = true;
+            break;
+        }
+    }
+
+    if (is_supplied)
+        coherence_count(&stats->transfers);
+    else
+        coherence_llc_fetch(system, address);
+    coherence_l1_fill(system, core, address, is_shared ? CACHE_COHERENCE_SHARED : CACHE_COHERENCE_EXCLUSIVE);
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * Simulate a write by a core.
+ */
+void cache_coherence_write(cache_coherence_t *system, size_t core, uintptr_t address) {
+    pthread_mutex_t *lock = coherence_lock(system, address);
+    cache_core_stats_t *stats = &system->core_stats[core];
+    cache_t *l1 = system->l1s[core];
+
+    pthread_mutex_lock(lock);
+    coherence_count(&stats->writes);
+    if (cache_lookup(l1, address, true, NULL)) {
+        cache_line_t *line = cache_find_line(l1, address);
+
+        coherence_count(&stats->hits);
+        if (line->coherence_state == CACHE_COHERENCE_SHARED || line->coherence_state == CACHE_COHERENCE_OWNED) {
+            coherence_count(&stats->upgrades);
+            coherence_invalidate_others(system, core, address);
+        }
+        coherence_set_state(l1, line, address, CACHE_COHERENCE_MODIFIED);
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    coherence_count_miss(system, core, address);
+
+    // Read for ownership: a dirty copy hands the block over, otherwise it comes from the LLC.
+    if (coherence_invalidate_others(system, core, address))
+        coherence_count(&stats->transfers);
+    else
+        coherence_llc_fetch(system, address);
+    coherence_l1_fill(system, core, address, CACHE_COHERENCE_MODIFIED);
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * Return the state of a block in the L1 of a core.
+ */
+uint8_t cache_coherence_state(cache_coherence_t *system, size_t core, uintptr_t address) {
+    pthread_mutex_t *lock = coherence_lock(system, address);
+
+    pthread_mutex_lock(lock);
+    cache_line_t *line = cache_find_line(system->l1s[core], address);
+    uint8_t state = line == NULL ? CACHE_COHERENCE_INVALID : line->coherence_state;
+    pthread_mutex_unlock(lock);
+    return state;
+}
+
+/*
+ * Trace replayed by one host thread.
+ */
+typedef struct coherence_worker_s {
+    cache_coherence_t *system;
+    size_t core;
+    const uintptr_t *addresses;
+    const uint8_t *is_write;
+    size_t n;
+    bool started;
+} coherence_worker_t;
+
+static void *coherence_worker(void *arg) {
+    coherence_worker_t *worker = (coherence_worker_t *)arg;
+
+    for (size_t i = 0; i < worker->n; i++) {
+        if (worker->is_write != NULL && worker->is_write[i])
+            cache_coherence_write(worker->system, worker->core, worker->addresses[i]);
+        else
+            cache_coherence_read(worker->system, worker->core, worker->addresses[i]);
+    }
+    return NULL;
+}
+
+/*
+ * Replay one trace per core, each on its own thread.
+ */
+void cache_coherence_run(cache_coherence_t *system, const uintptr_t *const *addresses,
+                         const uint8_t *const *is_write, const size_t *counts) {
+    coherence_worker_t *workers = (coherence_worker_t *)malloc(system->num_cores * sizeof(coherence_worker_t));
+    pthread_t *threads = (pthread_t *)malloc(system->num_cores * sizeof(pthread_t));
+
+    for (size_t c = 0; c < system->num_cores; c++) {
+        workers[c].system = system;
+        workers[c].core = c;
+        workers[c].addresses = addresses[c];
+        workers[c].is_write = is_write != NULL ? is_write[c] : NULL;
+        workers[c].n = counts[c];
+        workers[c].started = pthread_create(&threads[c], NULL, coherence_worker, &workers[c]) == 0;
+    }
+    // The trace of a core whose thread could not be created is replayed by the
+    // calling thread, concurrently with the others.
+    for (size_t c = 0; c < system->num_cores; c++)
+        if (!workers[c].started)
+            coherence_worker(&workers[c]);
+    for (size_t c = 0; c < system->num_cores; c++)
+        if (workers[c].started)
+            pthread_join(threads[c], NULL);
+
+    free(threads);
+    free(workers);
+}
@@ -0,0 +1,133 @@
+/*
+ * coherence.h
+ *
+ * Model of private L1 caches kept coherent over a shared, inclusive last
+ * level cache, with MESI or MOESI states, for replaying one trace per core
+ * on as many host threads.
+ *
+ * The L1s snoop each other: a read miss is served by a core holding the
+ * block Modified, Owned or Exclusive (a transfer), and otherwise by the LLC
+ * or memory; a write invalidates every other copy. With MESI a Modified
+ * block that is read by another core is written back to the LLC and becomes
+ * Shared; with MOESI it becomes Owned and stays dirty. Dirty L1 victims are
+ * written back to the LLC, and blocks evicted from the LLC are invalidated
+ * in every L1 (back-invalidation). The state of a line is kept in its
+ * coherence_state, and its dirty bit is set in the Modified and Owned states.
+ *
+ * Concurrency: an access only touches sets with the same L1 set index in
+ * every cache, so accesses are serialized by one of up to
+ * CACHE_COHERENCE_MAX_LOCKS locks chosen by that index, and accesses to
+ * different sets run in parallel. Every counter is updated atomically. Each
+ * cache is used through the hierarchy primitives only, so its own counters
+ * are not updated.
+ *
+ * A coherence miss is a miss to a block that was invalidated in that L1 by
+ * a write of another core; with false sharing most misses are coherence
+ * misses. Invalidated blocks are remembered in a table of 4 entries per L1
+ * line, so the count is approximate when tags collide.
+ */
+#ifndef COHERENCE_H
+#define COHERENCE_H
+
+#include "cache.h"
+#include <pthread.h>
+
+#define CACHE_COHERENCE_INVALID   0
+#define CACHE_COHERENCE_SHARED    1
+#define CACHE_COHERENCE_EXCLUSIVE 2
+#define CACHE_COHERENCE_OWNED     3
+#define CACHE_COHERENCE_MODIFIED  4
+
+#define CACHE_PROTOCOL_MESI  0
+#define CACHE_PROTOCOL_MOESI 1
+
+#define CACHE_COHERENCE_MAX_LOCKS 1024
+
+/*
+ * Statistics about one core.
+ */
+typedef struct cache_core_stats_s {
+    /* Accesses of the core, and the L1 hits and misses. */
+    uint64_t reads, writes, hits, misses;
+
+    /* Misses to blocks invalidated by another core. */
+    uint64_t coherence_misses;
+
+    /* Write hits to Shared or Owned blocks, which invalidate the other copies. */
+    uint64_t upgrades;
+
+    /* Copies invalidated by this core's writes, and copies of this core invalidated by others. */
+    uint64_t invalidations_sent, invalidations_received;
+
+    /* Misses served by another core. */
+    uint64_t transfers;
+
+    /* Dirty blocks written back to the LLC. */
+    uint64_t writebacks;
+} cache_core_stats_t;
+
+/*
+ * Structure used to store a coherent system.
+ */
+typedef struct cache_coherence_s {
+    /* Number of cores, their L1s and the shared LLC. */
+    size_t num_cores;
+    cache_t **l1s;
+    cache_t *llc;
+
+    /* Coherence protocol. */
+    uint8_t protocol;
+
+    /* Statistics, one entry per core. */
+    cache_core_stats_t *core_stats;
+
+    /* Accesses to the LLC and misses, memory reads and writes, and back-invalidated L1 copies. */
+    uint64_t llc_accesses, llc_misses, memory_reads, memory_writes, back_invalidations;
+
+    /* Locks guarding the sets, by L1 set index. */
+    pthread_mutex_t *locks;
+    size_t lock_mask;
+
+    /* Blocks (number + 1) invalidated by another core, per core; each table has invalidated_mask + 1 entries. */
+    uintptr_t *invalidated;
+    size_t invalidated_mask;
+
+    /* Block handed to the fills (never read, as the caches are TAG_ONLY). */
+    uint8_t *scratch;
+} cache_coherence_t;
+
+/*
+ * Create a coherent system of num_cores L1s over an LLC. All the caches
+ * must be TAG_ONLY, share their line size and not use STATS_DETAILED, the
+ * L1s must have the same number of sets, and the LLC at least as many. The
+ * system owns the caches from then on. Returns NULL if the caches do not match.
+ */
+cache_coherence_t *cache_coherence_new(cache_t **l1s, size_t num_cores, cache_t *llc, uint8_t protocol);
+
+/*
+ * Frees the system and all of its caches.
+ */
+void cache_coherence_free(cache_coherence_t *system);
+
+/*
+ * Simulate a read or a write by a core. The accesses of a core must not
+ * be made by several threads at the same time.
+ */
+void cache_coherence_read(cache_coherence_t *system, size_t core, uintptr_t address);
+void cache_coherence_write(cache_coherence_t *system, size_t core, uintptr_t address);
+
+/*
+ * Return the state of the block containing address in the L1 of a core.
+ */
+uint8_t cache_coherence_state(cache_coherence_t *system, size_t core, uintptr_t address);
+
+/*
+ * Replay one trace per core, each on its own thread: core c makes the
+ * counts[c] accesses of addresses[c] (writes where is_write[c] is non-zero,
+ * reads only if is_write or is_write[c] is NULL). The trace of a core whose
+ * thread cannot be created is replayed on the calling thread.
+ */
+void cache_coherence_run(cache_coherence_t *system, const uintptr_t *const *addresses,
+                         const uint8_t *const *is_write, const size_t *counts);
+
+#endif
@@ -0,0 +1,276 @@
+#include "hierarchy.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Return the buffer holding the block evicted from a level.
+ */
+static inline uint8_t *victim_buffer(cache_hierarchy_t *hierarchy, size_t level) {
+    return hierarchy->buffers + level * hierarchy->levels[0]->line_size;
+}
+
+/*
+ * Return the buffer holding a block moving up out of a level (exclusive hierarchies).
+ */
+static inline uint8_t *moving_buffer(cache_hierarchy_t *hierarchy, size_t level) {
+    return hierarchy->buffers + (hierarchy->num_levels + level) * hierarchy->levels[0]->line_size;
+}
+
+/*
+ * Return the buffer holding a block removed by a back-invalidation.
+ */
+static inline uint8_t *scratch_buffer(cache_hierarchy_t *hierarchy) {
+    return hierarchy->buffers + 2 * hierarchy->num_levels * hierarchy->levels[0]->line_size;
+}
+
+/*
+ * Return whether the hierarchy only tracks tags, without any data.
+ */
+static inline bool hierarchy_is_tag_only(cache_hierarchy_t *hierarchy) {
+    return (hierarchy->levels[0]->policies & CACHE_DATA_MASK) == CACHE_DATA_TAG_ONLY;
+}
+
+/*
+ * Create a hierarchy of the given caches.
+ */
+cache_hierarchy_t *cache_hierarchy_new(cache_t **levels, size_t num_levels, uint8_t inclusion) {
+    for (size_t i = 1; i < num_levels; i++)
+        if (levels[i]->line_size != levels[0]->line_size ||
+            (levels[i]->policies & CACHE_DATA_MASK) != (levels[0]->policies & CACHE_DATA_MASK))
+            return NULL;
+
+    cache_hierarchy_t *hierarchy = (cache_hierarchy_t *)malloc(sizeof(cache_hierarchy_t));
+    hierarchy->num_levels = num_levels;
+    hierarchy->levels = (cache_t **)malloc(num_levels * sizeof(cache_t *));
+    memcpy(hierarchy->levels, levels, num_levels * sizeof(cache_t *));
+    hierarchy->inclusion = inclusion;
+    hierarchy->stats = (cache_level_stats_t *)calloc(num_levels, sizeof(cache_level_stats_t));
+    hierarchy->memory_reads = 0;
+    hierarchy->memory_writes = 0;
+    hierarchy->buffers = (uint8_t *)malloc((2 * num_levels + 1) * levels[0]->line_size);
+
+    return hierarchy;
+}
+
+/*
+ * Frees the hierarchy and all of its caches.
+ */
+void cache_hierarchy_free(cache_hierarchy_t *hierarchy) {
+    if (hierarchy == NULL)
+        return;
+
+    for (size_t i = 0; i < hierarchy->num_levels; i++)
+        cache_free(hierarchy->levels[i]);
+    free(hierarchy->levels);
+    free(hierarchy->stats);
+    free(hierarchy->buffers);
+    free(hierarchy);
+}
+
+/*
+ * Write a block back to memory.
+ */
+static void hierarchy_write_memory(cache_hierarchy_t *hierarchy, uintptr_t address, const uint8_t *data, size_t size) {
+    hierarchy->memory_writes++;
+    if (!hierarchy_is_tag_only(hierarchy))
+        memcpy((void *)address, data, size);
+}
+
+static void hierarchy_evict(cache_hierarchy_t *hierarchy, size_t level, cache_eviction_t *evicted,
+                            func_t generate_random_number);
+
+/*
+ * Install a block in a level, and send the block it replaces down the
+ * hierarchy. Returns a pointer to the installed data.
+ */
+static uint8_t *hierarchy_place(cache_hierarchy_t *hierarchy, size_t level, uintptr_t address, const uint8_t *data,
+                                bool is_dirty, func_t generate_random_number) {
+    cache_eviction_t evicted;
+    evicted.block = victim_buffer(hierarchy, level);
+
+    uint8_t *block = cache_fill(hierarchy->levels[level], address, data, is_dirty, generate_random_number, &evicted);
+    if (evicted.is_valid) {
+        hierarchy->stats[level].evictions++;
+        hierarchy_evict(hierarchy, level, &evicted, generate_random_number);
+    }
+    return block;
+}
+
+/*
+ * Handle a block evicted from a level: invalidate it above if the hierarchy
+ * is inclusive, then write it to the next level or to memory as required.
+ */
+static void hierarchy_evict(cache_hierarchy_t *hierarchy, size_t level, cache_eviction_t *evicted,
+                            func_t generate_random_number) {
+    size_t line_size = hierarchy->levels[0]->line_size;
+    bool is_last = level + 1 == hierarchy->num_levels;
+
+    // Levels above hold newer data than this one if their copy is dirty.
+    if (hierarchy->inclusion == CACHE_INCLUSION_INCLUSIVE) {
+        for (size_t above = 0; above < level; above++) {
+            cache_eviction_t removed;
+            removed.block = scratch_buffer(hierarchy);
+            if (cache_invalidate(hierarchy->levels[above], evicted->address, &removed)) {
+                hierarchy->stats[above].back_invalidations++;
+                if (removed.is_dirty) {
+                    hierarchy->stats[above].writebacks++;
+                    if (!hierarchy_is_tag_only(hierarchy))
+                        memcpy(evicted->block, removed.block, line_size);
+                    evicted->is_dirty = true;
+                }
+            }
+        }
+    }
+
+    // In an exclusive hierarchy every victim moves down a level.
+    if (hierarchy->inclusion == CACHE_INCLUSION_EXCLUSIVE) {
+        if (evicted->is_dirty)
+            hierarchy->stats[level].writebacks++;
+        if (!is_last)
+            hierarchy_place(hierarchy, level + 1, evicted->address, evicted->block, evicted->is_dirty, generate_random_number);
+        else if (evicted->is_dirty)
+            hierarchy_write_memory(hierarchy, evicted->address, evicted->block, line_size);
+        return;
+    }
+
+    // Otherwise only dirty victims need to go anywhere.
+    if (!evicted->is_dirty)
+        return;
+
+    hierarchy->stats[level].writebacks++;
+    if (is_last) {
+        hierarchy_write_memory(hierarchy, evicted->address, evicted->block, line_size);
+        return;
+    }
+
+    uint8_t *block;
+    cache_t *next = hierarchy->levels[level + 1];
+    if (cache_lookup(next, evicted->address, false, &block)) {
+        if (!hierarchy_is_tag_only(hierarchy))
+            memcpy(block, evicted->block, line_size);
+        cache_mark_dirty(next, evicted->address);
+    } else
+        hierarchy_place(hierarchy, level + 1, evicted->address, evicted->block, true, generate_random_number);
+}
+
+/*
+ * Look up an access in a level, and on a miss fetch the block from the
+ * levels below. Returns a pointer to the block's data, or NULL if it is to
+ * be read from memory. *is_dirty is set if the block moved out of a lower
+ * level of an exclusive hierarchy while dirty.
+ */
+static const uint8_t *hierarchy_fetch(cache_hierarchy_t *hierarchy, size_t level, uintptr_t address,
+                                      func_t generate_random_number, bool *is_dirty) {
+    *is_dirty = false;
+    if (level == hierarchy->num_levels) {
+        hierarchy->memory_reads++;
+        return NULL;
+    }
+
+    cache_t *cache = hierarchy->levels[level];
+    cache_level_stats_t *stats = &hierarchy->stats[level];
+    bool moves_up = hierarchy->inclusion == CACHE_INCLUSION_EXCLUSIVE && level > 0;
+    uint8_t *block;
+
+    stats->accesses++;
+    cache->access_count++;
+    if (cache_lookup(cache, address, !moves_up, &block)) {
+        stats->hits++;
+        if (!moves_up)
+            return block;
+
+        cache_eviction_t removed;
+        removed.block = moving_buffer(hierarchy, level);
+        cache_invalidate(cache, address, &removed);
+        *is_dirty = removed.is_dirty;
+        return removed.block;
+    }
+
+    stats->misses++;
+    cache->miss_count++;
+    const uint8_t *data = hierarchy_fetch(hierarchy, level + 1, address, generate_random_number, is_dirty);
+    if (moves_up)
+        return data;
+
+    block = hierarchy_place(hierarchy, level, address, data, *is_dirty, generate_random_number);
+    *is_dirty = false;
+    return block;
+}
+
+/*
+ * Read a single uint64_t integer through the hierarchy.
+ */
+uint64_t cache_hierarchy_read(cache_hierarchy_t *hierarchy, uintptr_t address, func_t generate_random_number) {
+    bool is_dirty;
+    const uint8_t *block = hierarchy_fetch(hierarchy, 0, address, generate_random_number, &is_dirty);
+    uint64_t data;
+
+    if (hierarchy_is_tag_only(hierarchy))
+        return 0;
+    memcpy(&data, block + (address & hierarchy->levels[0]->block_offset_mask), sizeof(data));
+    return data;
+}
+
+/*
+ * Write a single integer to a level, following its write policy.
+ */
+static void hierarchy_write_level(cache_hierarchy_t *hierarchy, size_t level, uintptr_t address, uint64_t value,
+                                  func_t generate_random_number) {
+    if (level == hierarchy->num_levels) {
+        hierarchy->memory_writes++;
+        if (!hierarchy_is_tag_only(hierarchy))
+            memcpy((void *)address, &value, sizeof(value));
+        return;
+    }
+
+    cache_t *cache = hierarchy->levels[level];
+    cache_level_stats_t *stats = &hierarchy->stats[level];
+    bool allocate = (cache->policies & CACHE_WRITEPOLICY_WRITENOALLOCATE) == CACHE_WRITEPOLICY_WRITEALLOCATE &&
+                    !(hierarchy->inclusion == CACHE_INCLUSION_EXCLUSIVE && level > 0);
+    uint8_t *block;
+
+    if (allocate) {
+        bool is_dirty;
+        block = (uint8_t *)hierarchy_fetch(hierarchy, level, address, generate_random_number, &is_dirty);
+    } else {
+        stats->accesses++;
+        cache->access_count++;
+        if (!cache_lookup(cache, address, true, &block)) {
+            stats->misses++;
+            cache->miss_count++;
+            hierarchy_write_level(hierarchy, level + 1, address, value, generate_random_number);
+            return;
+        }
+        stats->hits++;
+    }
+
+    if (!hierarchy_is_tag_only(hierarchy))
+        memcpy(block + (address & cache->block_offset_mask), &value, sizeof(value));
+    if ((cache->policies & CACHE_WRITEPOLICY_WRITEBACK) == CACHE_WRITEPOLICY_WRITEBACK)
+        cache_mark_dirty(cache, address);
+    else {
+        stats->writethroughs++;
+        hierarchy_write_level(hierarchy, level + 1, address, value, generate_random_number);
+    }
+}
+
+/*
+ * Write a single integer through the hierarchy.
+ */
+void cache_hierarchy_write(cache_hierarchy_t *hierarchy, uintptr_t address, uint64_t value, func_t generate_random_number) {
+    hierarchy_write_level(hierarchy, 0, address, value, generate_random_number);
+}
+
+/*
+ * Return the average memory access time of the hierarchy.
+ */
+double cache_hierarchy_amat(cache_hierarchy_t *hierarchy, const double *hit_times, double memory_time) {
+    double amat = memory_time;
+
+    for (size_t level = hierarchy->num_levels; level-- > 0;) {
+        cache_level_stats_t *stats = &hierarchy->stats[level];
+        double miss_rate = stats->accesses ? (double)stats->misses / stats->accesses : 0.0;
+        amat = hit_times[level] + miss_rate * amat;
+    }
+    return amat;
+}
@@ -0,0 +1,100 @@
+/*
+ * hierarchy.h
+ *
+ * Definition of the structure used to represent a hierarchy of caches.
+ */
+#ifndef HIERARCHY_H
+#define HIERARCHY_H
+
+#include "cache.h"
+
+/*
+ * Inclusion policies between the levels of a hierarchy.
+ *
+ * NINE: a level neither forces blocks into nor out of the levels above
+ * it. Misses fill every level on the way to the processor.
+ *
+ * INCLUSIVE: every block of a level is also in all the levels below it.
+ * Removing a block from a level also invalidates it in the levels above
+ * (back-invalidation).
+ *
+ * EXCLUSIVE: a block is in at most one level. Misses fill the first level
+ * only, a hit in a lower level moves the block up, and blocks evicted from
+ * a level move down into the next one.
+ */
+#define CACHE_INCLUSION_NINE      0
+#define CACHE_INCLUSION_INCLUSIVE 1
+#define CACHE_INCLUSION_EXCLUSIVE 2
+
+/*
+ * Statistics about one level of a hierarchy.
+ */
+typedef struct cache_level_stats_s {
+    /* Accesses that reached this level, and how many of them hit or missed. */
+    uint64_t accesses, hits, misses;
+
+    /* Valid blocks replaced by new blocks. */
+    uint64_t evictions;
+
+    /* Dirty blocks written to the next level or to memory (writeback caches). */
+    uint64_t writebacks;
+
+    /* Writes forwarded to the next level or to memory (writethrough caches). */
+    uint64_t writethroughs;
+
+    /* Blocks invalidated to keep the hierarchy inclusive. */
+    uint64_t back_invalidations;
+} cache_level_stats_t;
+
+/*
+ * Structure used to store a hierarchy of caches. levels[0] is the level
+ * closest to the processor; misses in the last level go to memory.
+ */
+typedef struct cache_hierarchy_s {
+    /* Number of levels, and the cache of each level. */
+    size_t num_levels;
+    cache_t **levels;
+
+    /* Inclusion policy. */
+    uint8_t inclusion;
+
+    /* Statistics, one entry per level. */
+    cache_level_stats_t *stats;
+
+    /* Number of blocks read from memory, and of writes to memory. */
+    uint64_t memory_reads, memory_writes;
+
+    /* Buffers for blocks in transit: one victim and one moving block per level, and a scratch block. */
+    uint8_t *buffers;
+} cache_hierarchy_t;
+
+/*
+ * Create a hierarchy of the given caches, which must all have the same line
+ * size and either all or none be TAG_ONLY. The hierarchy owns the caches from
+ * then on. Returns NULL if the caches do not match.
+ */
+cache_hierarchy_t *cache_hierarchy_new(cache_t **levels, size_t num_levels, uint8_t inclusion);
+
+/*
+ * Frees the hierarchy and all of its caches.
+ */
+void cache_hierarchy_free(cache_hierarchy_t *hierarchy);
+
+/*
+ * Read a single long integer through the hierarchy (0 if its caches are TAG_ONLY).
+ */
+uint64_t cache_hierarchy_read(cache_hierarchy_t *hierarchy, uintptr_t address, func_t generate_random_number);
+
+/*
+ * Write a single long integer through the hierarchy. Each level handles the
+ * write according to its own write policy.
+ */
+void cache_hierarchy_write(cache_hierarchy_t *hierarchy, uintptr_t address, uint64_t value, func_t generate_random_number);
+
+/*
+ * Return the average memory access time given the hit time of each level
+ * and the memory access time, using the local miss rate of each level.
+ */
+double cache_hierarchy_amat(cache_hierarchy_t *hierarchy, const double *hit_times, double memory_time);
+
+#endif
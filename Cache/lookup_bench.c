@@ -0,0 +1,73 @@
+/*
+ * lookup_bench.c
+ *
+ * Micro-benchmark of the tag comparison used by set lookups in the SOA
+ * layout: the vector cache_tags_match_mask against the scalar loop, for
+ * sets of 1 to 32 ways.
+ */
+#include "cache.h"
+#include <stdio.h>
+#include <time.h>
+
+#define NUM_SETS    1024
+#define NUM_PROBES  (1 << 16)
+#define REPETITIONS 64
+#define MAX_WAYS    32
+
+static uintptr_t __attribute__ ((aligned (64))) tags[NUM_SETS * MAX_WAYS];
+static uintptr_t probes[NUM_PROBES];
+static size_t probe_sets[NUM_PROBES];
+
+typedef uint64_t (*match_t)(const uintptr_t *, size_t, uintptr_t);
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Return the time per lookup, in nanoseconds, of the given match function.
+ */
+static double time_lookups(match_t match, size_t ways, uint64_t *checksum) {
+    double start = now_ns();
+    uint64_t sum = 0;
+
+    for (int r = 0; r < REPETITIONS; r++)
+        for (size_t i = 0; i < NUM_PROBES; i++)
+            sum += match(&tags[probe_sets[i] * ways], ways, probes[i]);
+
+    *checksum = sum;
+    return (now_ns() - start) / ((double) REPETITIONS * NUM_PROBES);
+}
+
+int main() {
+    size_t ways[] = {1, 2, 4, 8, 16, 32};
+
+    srand(1);
+    printf("%6s %12s %12s %8s\n", "ways", "scalar ns", "simd ns", "speedup");
+
+    for (size_t w = 0; w < sizeof(ways) / sizeof(ways[0]); w++) {
+        size_t associativity = ways[w];
+
+        // Half of the probes hit a random way of their set.
+        for (size_t i = 0; i < NUM_SETS * associativity; i++)
+            tags[i] = rand();
+        for (size_t i = 0; i < NUM_PROBES; i++) {
+            probe_sets[i] = rand() % NUM_SETS;
+            probes[i] = rand() % 2 ? tags[probe_sets[i] * associativity + rand() % associativity] : (uintptr_t) -1;
+        }
+
+        uint64_t scalar_sum, simd_sum;
+        double scalar = time_lookups(cache_tags_match_mask_scalar, associativity, &scalar_sum);
+        double simd = time_lookups(cache_tags_match_mask, associativity, &simd_sum);
+
+        if (scalar_sum != simd_sum) {
+            fprintf(stderr, "Mismatch for %zu ways\n", associativity);
+            return 1;
+        }
+        printf("%6zu %12.2f %12.2f %7.2fx\n", associativity, scalar, simd, scalar / simd);
+    }
+
+    return 0;
+}
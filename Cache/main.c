@@ -126,17 +126,17 @@ int main() {
     print_stats();
     cache_free(cache);
 
-    cache = cache_new(16384, 64, 8, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING);
+    cache = cache_new(16384, 64, 8, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING | CACHE_LAYOUT_SOA);
     printf("Sum = %lld\n", sumD(test_array, 12, 256, 5));
     print_stats();
     cache_free(cache);
 
-    cache = cache_new(16384, 64, 8, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING);
+    cache = cache_new(16384, 64, 8, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING | CACHE_LAYOUT_SOA);
     printf("Sum = %lld\n", sumD(test_array, 12, 256, 5));
     print_stats();
     cache_free(cache);
 
-    cache = cache_new(16384, 64, 8, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING);
+    cache = cache_new(16384, 64, 8, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING | CACHE_LAYOUT_SOA);
     printf("Sum = %lld\n", sumD(test_array, 12, 256, 5));
     print_stats();
     cache_free(cache);
@@ -0,0 +1,242 @@
+#include "prefetch.h"
+#include <string.h>
+
+/*
+ * Prefetches never leave the page of the access that triggered them.
+ */
+#define CACHE_PREFETCH_PAGE_SIZE 4096
+
+/*
+ * Number of entries of the prefetched and evicted tables per cache line.
+ */
+#define CACHE_PREFETCH_TABLE_RATIO 4
+
+/*
+ * Create a prefetcher.
+ */
+cache_prefetcher_t *cache_prefetcher_new(cache_t *cache, uint8_t kind, size_t degree) {
+    cache_prefetcher_t *prefetcher = (cache_prefetcher_t *)calloc(1, sizeof(cache_prefetcher_t));
+    size_t table_size = 1;
+
+    while (table_size < CACHE_PREFETCH_TABLE_RATIO * cache->num_lines)
+        table_size *= 2;
+
+    prefetcher->cache = cache;
+    prefetcher->kind = kind;
+    prefetcher->degree = degree;
+    prefetcher->table_mask = table_size - 1;
+    prefetcher->prefetched = (uintptr_t *)calloc(table_size, sizeof(uintptr_t));
+    prefetcher->evicted = (uintptr_t *)calloc(table_size, sizeof(uintptr_t));
+
+    return prefetcher;
+}
+
+/*
+ * Frees all memory allocated for a prefetcher.
+ */
+void cache_prefetcher_free(cache_prefetcher_t *prefetcher) {
+    if (prefetcher == NULL)
+        return;
+
+    free(prefetcher->prefetched);
+    free(prefetcher->evicted);
+    free(prefetcher);
+}
+
+/*
+ * Return the slot of the prefetched and evicted tables for a block number.
+ */
+static inline size_t prefetch_slot(cache_prefetcher_t *prefetcher, uintptr_t block) {
+    return (size_t)((block * 0x9e3779b97f4a7c15ull) >> 20) & prefetcher->table_mask;
+}
+
+/*
+ * Return the block number of an address.
+ */
+static inline uintptr_t prefetch_block(cache_prefetcher_t *prefetcher, uintptr_t address) {
+    return address / prefetcher->cache->line_size;
+}
+
+/*
+ * Prefetch the block containing address, unless it is on another page than
+ * trigger. Returns whether a block was brought into the cache.
+ */
+static bool prefetch_issue(cache_prefetcher_t *prefetcher, uintptr_t trigger, uintptr_t address,
+                           func_t generate_random_number) {
+    cache_eviction_t evicted = {0};
+
+    if (address / CACHE_PREFETCH_PAGE_SIZE != trigger / CACHE_PREFETCH_PAGE_SIZE)
+        return false;
+    if (!cache_prefetch(prefetcher->cache, address, generate_random_number, &evicted))
+        return false;
+
+    uintptr_t block = prefetch_block(prefetcher, address);
+    prefetcher->stats.issued++;
+    prefetcher->prefetched[prefetch_slot(prefetcher, block)] = block + 1;
+    if (evicted.is_valid) {
+        uintptr_t victim = prefetch_block(prefetcher, evicted.address);
+        size_t slot = prefetch_slot(prefetcher, victim);
+        if (prefetcher->prefetched[slot] == victim + 1)
+            prefetcher->prefetched[slot] = 0;
+        prefetcher->evicted[slot] = victim + 1;
+    }
+    return true;
+}
+
+/*
+ * Prefetch the degree blocks after the one containing address, stride bytes apart.
+ */
+static void prefetch_ahead(cache_prefetcher_t *prefetcher, uintptr_t address, intptr_t stride,
+                           func_t generate_random_number) {
+    for (size_t i = 1; i <= prefetcher->degree; i++)
+        prefetch_issue(prefetcher, address, address + i * stride, generate_random_number);
+}
+
+/*
+ * Train a STRIDE prefetcher on an access, and prefetch along the stride of
+ * its stream once it is confirmed.
+ */
+static void prefetch_stride(cache_prefetcher_t *prefetcher, uintptr_t address, uintptr_t pc,
+                            func_t generate_random_number) {
+    cache_stride_entry_t *entry = &prefetcher->strides[(pc ^ (pc >> 6)) % CACHE_PREFETCH_TABLE_SIZE];
+
+    if (entry->pc != pc || entry->confidence == 0) {
+        entry->pc = pc;
+        entry->stride = 0;
+        entry->confidence = 1;
+    } else {
+        intptr_t stride = (intptr_t)(address - entry->last_address);
+        if (stride == entry->stride && stride != 0) {
+            if (entry->confidence < 3)
+                entry->confidence++;
+        } else {
+            entry->stride = stride;
+            entry->confidence = 1;
+        }
+    }
+    entry->last_address = address;
+
+    if (entry->confidence >= 2) {
+        // Fetch whole blocks ahead even when the stride is smaller than a block.
+        intptr_t stride = entry->stride;
+        intptr_t line_size = (intptr_t)prefetcher->cache->line_size;
+        if (stride > 0 && stride < line_size)
+            stride = line_size;
+        else if (stride < 0 && stride > -line_size)
+            stride = -line_size;
+        prefetch_ahead(prefetcher, address, stride, generate_random_number);
+    }
+}
+
+/*
+ * Train a STREAM prefetcher on an access.
+ */
+static void prefetch_stream(cache_prefetcher_t *prefetcher, uintptr_t address, bool is_hit,
+                            func_t generate_random_number) {
+    uintptr_t block = prefetch_block(prefetcher, address);
+    size_t line_size = prefetcher->cache->line_size;
+    cache_stream_t *oldest = &prefetcher->streams[0];
+
+    prefetcher->now++;
+    for (size_t i = 0; i < CACHE_PREFETCH_NUM_STREAMS; i++) {
+        cache_stream_t *stream = &prefetcher->streams[i];
+        if (stream->last_use != 0 && block >= stream->first && block < stream->next) {
+            // Slide the window to just after the block and top it up.
+            stream->last_use = prefetcher->now;
+            while (stream->first <= block) {
+                stream->first++;
+                prefetch_issue(prefetcher, address, stream->next * line_size, generate_random_number);
+                stream->next++;
+            }
+            return;
+        }
+        if (stream->last_use < oldest->last_use)
+            oldest = stream;
+    }
+
+    if (is_hit)
+        return;
+    oldest->first = block + 1;
+    oldest->next = block + 1 + prefetcher->degree;
+    oldest->last_use = prefetcher->now;
+    prefetch_ahead(prefetcher, address, (intptr_t)line_size, generate_random_number);
+}
+
+/*
+ * Update the statistics and the prefetcher after a demand access.
+ */
+static void prefetch_train(cache_prefetcher_t *prefetcher, uintptr_t address, uintptr_t pc, bool is_hit,
+                           func_t generate_random_number) {
+    uintptr_t block = prefetch_block(prefetcher, address);
+    size_t slot = prefetch_slot(prefetcher, block);
+    bool was_prefetched = prefetcher->prefetched[slot] == block + 1;
+
+    prefetcher->stats.accesses++;
+    if (was_prefetched) {
+        prefetcher->prefetched[slot] = 0;
+        prefetcher->stats.useful += is_hit;
+    }
+    if (!is_hit) {
+        prefetcher->stats.misses++;
+        if (prefetcher->evicted[slot] == block + 1) {
+            prefetcher->evicted[slot] = 0;
+            prefetcher->stats.pollution++;
+        }
+    }
+
+    switch (prefetcher->kind) {
+    case CACHE_PREFETCH_NEXT_LINE:
+        if (!is_hit || was_prefetched)
+            prefetch_ahead(prefetcher, address, (intptr_t)prefetcher->cache->line_size, generate_random_number);
+        break;
+    case CACHE_PREFETCH_STRIDE:
+        prefetch_stride(prefetcher, address, pc, generate_random_number);
+        break;
+    case CACHE_PREFETCH_STREAM:
+        prefetch_stream(prefetcher, address, is_hit, generate_random_number);
+        break;
+    }
+}
+
+/*
+ * Read a single long integer through a prefetcher.
+ */
+uint64_t cache_prefetch_read(cache_prefetcher_t *prefetcher, uintptr_t address, uintptr_t pc,
+                             func_t generate_random_number) {
+    uint64_t misses = cache_miss_count(prefetcher->cache);
+    uint64_t value = cache_read(prefetcher->cache, address, generate_random_number);
+
+    prefetch_train(prefetcher, address, pc, cache_miss_count(prefetcher->cache) == misses, generate_random_number);
+    return value;
+}
+
+/*
+ * Write a single long integer through a prefetcher.
+ */
+void cache_prefetch_write(cache_prefetcher_t *prefetcher, uintptr_t address, uintptr_t pc, uint64_t value,
+                          func_t generate_random_number) {
+    uint64_t misses = cache_miss_count(prefetcher->cache);
+
+    cache_write(prefetcher->cache, address, value, generate_random_number);
+    prefetch_train(prefetcher, address, pc, cache_miss_count(prefetcher->cache) == misses, generate_random_number);
+}
+
+/*
+ * Return the accuracy of a prefetcher.
+ */
+double cache_prefetch_accuracy(cache_prefetcher_t *prefetcher) {
+    if (prefetcher->stats.issued == 0)
+        return 0;
+    return (double)prefetcher->stats.useful / prefetcher->stats.issued;
+}
+
+/*
+ * Return the coverage of a prefetcher.
+ */
+double cache_prefetch_coverage(cache_prefetcher_t *prefetcher) {
+    uint64_t total = prefetcher->stats.useful + prefetcher->stats.misses;
+
+    if (total == 0)
+        return 0;
+    return (double)prefetcher->stats.useful / total;
+}
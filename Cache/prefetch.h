@@ -0,0 +1,125 @@
+/*
+ * prefetch.h
+ *
+ * Models of hardware prefetchers placed in front of a cache. Demand
+ * accesses go through the prefetcher, which passes them on to the cache,
+ * trains on them, and brings the blocks it predicts into the cache with
+ * cache_prefetch. Prefetches never cross a 4 KB page.
+ *
+ * Kinds of prefetcher:
+ *
+ * NEXT_LINE: on a miss, or on the first hit to a prefetched block, fetch
+ * the next degree blocks.
+ *
+ * STRIDE: a table of CACHE_PREFETCH_TABLE_SIZE entries, one per stream,
+ * remembers the last address and stride of each stream. Once the same
+ * stride has been seen twice in a row, every access fetches the next degree
+ * blocks along it. The stream of an access is its pc argument: the address
+ * of the instruction for a per-PC prefetcher, or any other stream id (all
+ * accesses with pc 0 form a single stream).
+ *
+ * STREAM: up to CACHE_PREFETCH_NUM_STREAMS ascending streams are tracked.
+ * A miss that does not belong to any stream allocates one (replacing the
+ * least recently used) and fetches the next degree blocks; an access to a
+ * block of a stream's window slides the window just past it, fetching as
+ * many new blocks at its end.
+ *
+ * Statistics: a prefetched block is useful if a demand access hits it
+ * before it is evicted. Accuracy is useful / issued prefetches, coverage is
+ * useful / (useful + demand misses), and pollution counts the demand misses
+ * to blocks that a prefetch evicted. Prefetched and evicted blocks are
+ * remembered in tables of 4 entries per cache line, so the counts are
+ * approximate when tags collide.
+ */
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "cache.h"
+
+#define CACHE_PREFETCH_NEXT_LINE 0
+#define CACHE_PREFETCH_STRIDE    1
+#define CACHE_PREFETCH_STREAM    2
+
+#define CACHE_PREFETCH_TABLE_SIZE  64
+#define CACHE_PREFETCH_NUM_STREAMS 8
+
+/*
+ * Statistics about a prefetcher.
+ */
+typedef struct cache_prefetch_stats_s {
+    /* Demand accesses, and those that missed. */
+    uint64_t accesses, misses;
+
+    /* Prefetches that filled a block, and prefetched blocks later hit by a demand access. */
+    uint64_t issued, useful;
+
+    /* Demand misses to blocks evicted by a prefetch. */
+    uint64_t pollution;
+} cache_prefetch_stats_t;
+
+/*
+ * Entry of the table of a STRIDE prefetcher.
+ */
+typedef struct cache_stride_entry_s {
+    uintptr_t pc, last_address;
+    intptr_t stride;
+    uint8_t confidence;
+} cache_stride_entry_t;
+
+/*
+ * A stream of a STREAM prefetcher: the first block of its window and the
+ * block after its end, and when it was last used.
+ */
+typedef struct cache_stream_s {
+    uintptr_t first, next;
+    uint64_t last_use;
+} cache_stream_t;
+
+/*
+ * Structure used to store a prefetcher.
+ */
+typedef struct cache_prefetcher_s {
+    cache_t *cache;
+    uint8_t kind;
+    size_t degree;
+
+    /* Blocks (number + 1) that are prefetched and not used yet, and that
+     * prefetches evicted. Both tables have table_mask + 1 entries. */
+    uintptr_t *prefetched, *evicted;
+    size_t table_mask;
+
+    /* STRIDE and STREAM state. */
+    cache_stride_entry_t strides[CACHE_PREFETCH_TABLE_SIZE];
+    cache_stream_t streams[CACHE_PREFETCH_NUM_STREAMS];
+    uint64_t now;
+
+    cache_prefetch_stats_t stats;
+} cache_prefetcher_t;
+
+/*
+ * Create a prefetcher of the given kind that fetches degree blocks ahead
+ * into cache. The cache is not owned by the prefetcher.
+ */
+cache_prefetcher_t *cache_prefetcher_new(cache_t *cache, uint8_t kind, size_t degree);
+
+/*
+ * Frees the prefetcher (but not its cache).
+ */
+void cache_prefetcher_free(cache_prefetcher_t *prefetcher);
+
+/*
+ * Read or write a single long integer through the prefetcher. pc identifies
+ * the instruction or stream making the access (see STRIDE above).
+ */
+uint64_t cache_prefetch_read(cache_prefetcher_t *prefetcher, uintptr_t address, uintptr_t pc,
+                             func_t generate_random_number);
+void cache_prefetch_write(cache_prefetcher_t *prefetcher, uintptr_t address, uintptr_t pc, uint64_t value,
+                          func_t generate_random_number);
+
+/*
+ * Return the accuracy and coverage of a prefetcher, between 0 and 1.
+ */
+double cache_prefetch_accuracy(cache_prefetcher_t *prefetcher);
+double cache_prefetch_coverage(cache_prefetcher_t *prefetcher);
+
+#endif
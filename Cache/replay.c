@@ -0,0 +1,94 @@
+/*
+ * replay.c
+ *
+ * Replay a binary trace (see trace.h) on a tag-only LRU cache and print its
+ * miss rate. With more than one thread the accesses are simulated with
+ * cache_access_parallel, a large block of the trace at a time.
+ *
+ * Usage: replay trace [num_bytes [line_size [associativity [threads]]]]
+ */
+#include "cache.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Number of accesses decoded at a time when replaying on several threads.
+ */
+#define PARALLEL_BLOCK (1 << 22)
+
+/*
+ * Replay a trace with cache_access_parallel, and return the number of accesses.
+ */
+static size_t replay_parallel(cache_trace_t *trace, cache_t *cache, size_t num_threads) {
+    uintptr_t *addresses = (uintptr_t *)malloc(PARALLEL_BLOCK * sizeof(uintptr_t));
+    uint8_t *is_write = (uint8_t *)malloc(PARALLEL_BLOCK);
+    size_t total = 0, n;
+
+    // Without room for a block, replay on this thread, one chunk at a time.
+    if (addresses == NULL || is_write == NULL) {
+        free(addresses);
+        free(is_write);
+        return cache_trace_replay(trace, cache, rand);
+    }
+
+    while ((n = cache_trace_next(trace, addresses, is_write, PARALLEL_BLOCK)) > 0) {
+        cache_access_parallel(cache, addresses, is_write, n, num_threads);
+        total += n;
+    }
+
+    free(addresses);
+    free(is_write);
+    return total;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 6) {
+        fprintf(stderr, "Usage: %s trace [num_bytes [line_size [associativity [threads]]]]\n", argv[0]);
+        return 2;
+    }
+
+    size_t num_bytes = argc > 2 ? strtoull(argv[2], NULL, 0) : 1 << 20;
+    size_t line_size = argc > 3 ? strtoull(argv[3], NULL, 0) : 64;
+    size_t associativity = argc > 4 ? strtoull(argv[4], NULL, 0) : 16;
+    size_t num_threads = argc > 5 ? strtoull(argv[5], NULL, 0) : 1;
+
+    // cache_trace_open sets errno only when the file cannot be opened or mapped
+    errno = 0;
+    cache_trace_t *trace = cache_trace_open(argv[1]);
+    if (trace == NULL) {
+        if (errno != 0)
+            perror(argv[1]);
+        else
+            fprintf(stderr, "%s: malformed trace\n", argv[1]);
+        return 1;
+    }
+
+    cache_t *cache = cache_new(num_bytes, line_size, associativity,
+                               CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK | CACHE_DATA_TAG_ONLY);
+    if (cache == NULL) {
+        fprintf(stderr, "%s: cannot allocate a %zu-byte cache of %zu-byte lines, %zu-way\n", argv[0], num_bytes,
+                line_size, associativity);
+        cache_trace_close(trace);
+        return 1;
+    }
+    size_t accesses = num_threads > 1 ? replay_parallel(trace, cache, num_threads) : cache_trace_replay(trace, cache, rand);
+    int status = 0;
+
+    if (cache_trace_out_of_memory(trace)) {
+        fprintf(stderr, "%s: %s after %zu accesses\n", argv[1], strerror(ENOMEM), accesses);
+        status = 1;
+    } else if (cache_trace_failed(trace)) {
+        fprintf(stderr, "%s: malformed trace after %zu accesses\n", argv[1], accesses);
+        status = 1;
+    }
+    if (accesses == 0)
+        printf("The cache wasn't used.\n");
+    else
+        printf("Accesses = %zu\nMiss rate = %8.4f\n", accesses, (double) cache_miss_count(cache) / accesses);
+
+    cache_free(cache);
+    cache_trace_close(trace);
+    return status;
+}
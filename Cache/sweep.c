@@ -0,0 +1,271 @@
+#include "sweep.h"
+#include <string.h>
+
+/*
+ * Number of accesses handed to each cache at a time by cache_access_fanout.
+ */
+#define CACHE_FANOUT_BLOCK 4096
+
+/*
+ * Initial number of entries of the block table, and of nodes of the pool.
+ */
+#define CACHE_SWEEP_INITIAL_CAPACITY 1024
+
+/*
+ * Create a sweep.
+ */
+cache_sweep_t *cache_sweep_new(size_t line_size, const size_t *set_counts, size_t num_set_counts,
+                               size_t max_associativity) {
+    cache_sweep_t *sweep = (cache_sweep_t *)calloc(1, sizeof(cache_sweep_t));
+
+    sweep->line_shift = __builtin_ctzll(line_size);
+    sweep->num_set_counts = num_set_counts;
+    sweep->set_counts = (size_t *)malloc(num_set_counts * sizeof(size_t));
+    memcpy(sweep->set_counts, set_counts, num_set_counts * sizeof(size_t));
+    sweep->max_associativity = max_associativity;
+    sweep->histograms = (uint64_t *)calloc(num_set_counts * (max_associativity + 1), sizeof(uint64_t));
+
+    sweep->table_capacity = CACHE_SWEEP_INITIAL_CAPACITY;
+    sweep->blocks = (uintptr_t *)calloc(sweep->table_capacity, sizeof(uintptr_t));
+    sweep->last_times = (uint64_t *)malloc(sweep->table_capacity * sizeof(uint64_t));
+
+    sweep->roots = (uint32_t **)malloc(num_set_counts * sizeof(uint32_t *));
+    for (size_t k = 0; k < num_set_counts; k++)
+        sweep->roots[k] = (uint32_t *)calloc(set_counts[k], sizeof(uint32_t));
+
+    // Node 0 stands for the empty tree.
+    sweep->node_capacity = CACHE_SWEEP_INITIAL_CAPACITY;
+    sweep->nodes = (cache_sweep_node_t *)calloc(sweep->node_capacity, sizeof(cache_sweep_node_t));
+    sweep->node_count = 1;
+    sweep->priority_state = 2463534242u;
+
+    return sweep;
+}
+
+/*
+ * Frees all memory allocated for a sweep.
+ */
+void cache_sweep_free(cache_sweep_t *sweep) {
+    if (sweep == NULL)
+        return;
+
+    for (size_t k = 0; k < sweep->num_set_counts; k++)
+        free(sweep->roots[k]);
+    free(sweep->roots);
+    free(sweep->nodes);
+    free(sweep->blocks);
+    free(sweep->last_times);
+    free(sweep->histograms);
+    free(sweep->set_counts);
+    free(sweep);
+}
+
+/*
+ * Return the slot of the table that holds key, or the empty slot where it
+ * belongs.
+ */
+static inline size_t sweep_table_slot(cache_sweep_t *sweep, uintptr_t key) {
+    size_t mask = sweep->table_capacity - 1;
+    size_t slot = (size_t)((key * 0x9e3779b97f4a7c15ull) >> 20) & mask;
+
+    while (sweep->blocks[slot] != 0 && sweep->blocks[slot] != key)
+        slot = (slot + 1) & mask;
+    return slot;
+}
+
+/*
+ * Double the capacity of the table.
+ */
+static void sweep_table_grow(cache_sweep_t *sweep) {
+    uintptr_t *blocks = sweep->blocks;
+    uint64_t *last_times = sweep->last_times;
+    size_t capacity = sweep->table_capacity;
+
+    sweep->table_capacity = 2 * capacity;
+    sweep->blocks = (uintptr_t *)calloc(sweep->table_capacity, sizeof(uintptr_t));
+    sweep->last_times = (uint64_t *)malloc(sweep->table_capacity * sizeof(uint64_t));
+    for (size_t i = 0; i < capacity; i++) {
+        if (blocks[i] != 0) {
+            size_t slot = sweep_table_slot(sweep, blocks[i]);
+            sweep->blocks[slot] = blocks[i];
+            sweep->last_times[slot] = last_times[i];
+        }
+    }
+
+    free(blocks);
+    free(last_times);
+}
+
+/*
+ * Treap helpers. All keys of the left subtree of a node are smaller than its
+ * own, and its priority is at least that of its children.
+ */
+static inline uint32_t treap_size(cache_sweep_node_t *nodes, uint32_t node) {
+    return node ? nodes[node].size : 0;
+}
+
+static inline void treap_update(cache_sweep_node_t *nodes, uint32_t node) {
+    nodes[node].size = 1 + treap_size(nodes, nodes[node].left) + treap_size(nodes, nodes[node].right);
+}
+
+/*
+ * Merge two treaps, all of whose keys in a are smaller than those in b.
+ */
+static uint32_t treap_merge(cache_sweep_node_t *nodes, uint32_t a, uint32_t b) {
+    if (a == 0)
+        return b;
+    if (b == 0)
+        return a;
+
+    if (nodes[a].priority > nodes[b].priority) {
+        nodes[a].right = treap_merge(nodes, nodes[a].right, b);
+        treap_update(nodes, a);
+        return a;
+    }
+    nodes[b].left = treap_merge(nodes, a, nodes[b].left);
+    treap_update(nodes, b);
+    return b;
+}
+
+/*
+ * Remove the node with the given key, which must be present, storing its
+ * index in *removed. Returns the new root.
+ */
+static uint32_t treap_erase(cache_sweep_node_t *nodes, uint32_t root, uint64_t time, uint32_t *removed) {
+    if (nodes[root].time == time) {
+        *removed = root;
+        return treap_merge(nodes, nodes[root].left, nodes[root].right);
+    }
+
+    if (time < nodes[root].time)
+        nodes[root].left = treap_erase(nodes, nodes[root].left, time, removed);
+    else
+        nodes[root].right = treap_erase(nodes, nodes[root].right, time, removed);
+    treap_update(nodes, root);
+    return root;
+}
+
+/*
+ * Return the number of keys of a treap greater than time.
+ */
+static inline uint32_t treap_count_greater(cache_sweep_node_t *nodes, uint32_t root, uint64_t time) {
+    uint32_t count = 0;
+
+    while (root != 0) {
+        if (nodes[root].time > time) {
+            count += 1 + treap_size(nodes, nodes[root].right);
+            root = nodes[root].left;
+        } else
+            root = nodes[root].right;
+    }
+    return count;
+}
+
+/*
+ * Return a fresh node of the pool.
+ */
+static uint32_t sweep_new_node(cache_sweep_t *sweep) {
+    if (sweep->node_count == sweep->node_capacity) {
+        sweep->node_capacity *= 2;
+        sweep->nodes = (cache_sweep_node_t *)realloc(sweep->nodes, sweep->node_capacity * sizeof(cache_sweep_node_t));
+    }
+    return sweep->node_count++;
+}
+
+/*
+ * Record an access.
+ */
+void cache_sweep_access(cache_sweep_t *sweep, uintptr_t address) {
+    uintptr_t block = address >> sweep->line_shift;
+    size_t histogram_size = sweep->max_associativity + 1;
+
+    if (2 * (sweep->table_count + 1) > sweep->table_capacity)
+        sweep_table_grow(sweep);
+    size_t slot = sweep_table_slot(sweep, block + 1);
+    bool is_cold = sweep->blocks[slot] == 0;
+    uint64_t last_time = sweep->last_times[slot];
+
+    sweep->access_count++;
+    if (is_cold) {
+        sweep->cold_miss_count++;
+        sweep->blocks[slot] = block + 1;
+        sweep->table_count++;
+    }
+    sweep->last_times[slot] = sweep->now;
+
+    for (size_t k = 0; k < sweep->num_set_counts; k++) {
+        uint32_t *root = &sweep->roots[k][block & (sweep->set_counts[k] - 1)];
+        uint32_t node;
+
+        // The distance is the number of blocks of the set used since last_time.
+        if (is_cold)
+            node = sweep_new_node(sweep);
+        else {
+            uint32_t distance = treap_count_greater(sweep->nodes, *root, last_time);
+            if (distance > sweep->max_associativity)
+                distance = sweep->max_associativity;
+            sweep->histograms[k * histogram_size + distance]++;
+            *root = treap_erase(sweep->nodes, *root, last_time, &node);
+        }
+
+        // The block becomes the most recently used one of its set.
+        cache_sweep_node_t *nodes = sweep->nodes;
+        sweep->priority_state ^= sweep->priority_state << 13;
+        sweep->priority_state ^= sweep->priority_state >> 17;
+        sweep->priority_state ^= sweep->priority_state << 5;
+        nodes[node].time = sweep->now;
+        nodes[node].priority = sweep->priority_state;
+        nodes[node].left = nodes[node].right = 0;
+        nodes[node].size = 1;
+        *root = treap_merge(nodes, *root, node);
+    }
+
+    sweep->now++;
+}
+
+/*
+ * Record a batch of accesses.
+ */
+void cache_sweep_access_batch(cache_sweep_t *sweep, const uintptr_t *addresses, size_t n) {
+    for (size_t i = 0; i < n; i++)
+        cache_sweep_access(sweep, addresses[i]);
+}
+
+/*
+ * Return the number of misses of one configuration.
+ */
+uint64_t cache_sweep_miss_count(cache_sweep_t *sweep, size_t num_sets, size_t associativity) {
+    if (associativity == 0 || associativity > sweep->max_associativity)
+        return sweep->access_count;
+
+    for (size_t k = 0; k < sweep->num_set_counts; k++) {
+        if (sweep->set_counts[k] != num_sets)
+            continue;
+
+        const uint64_t *histogram = sweep->histograms + k * (sweep->max_associativity + 1);
+        uint64_t misses = sweep->cold_miss_count;
+        for (size_t distance = associativity; distance <= sweep->max_associativity; distance++)
+            misses += histogram[distance];
+        return misses;
+    }
+    return sweep->access_count;
+}
+
+/*
+ * Simulate the same accesses on several caches.
+ */
+void cache_access_fanout(cache_t **caches, size_t num_caches, const uintptr_t *addresses, const uint8_t *is_write,
+                         size_t n, size_t *misses, func_t generate_random_number) {
+    if (misses != NULL)
+        memset(misses, 0, num_caches * sizeof(size_t));
+
+    for (size_t base = 0; base < n; base += CACHE_FANOUT_BLOCK) {
+        size_t count = n - base < CACHE_FANOUT_BLOCK ? n - base : CACHE_FANOUT_BLOCK;
+        for (size_t c = 0; c < num_caches; c++) {
+            size_t block_misses = cache_access_batch(caches[c], addresses + base, is_write ? is_write + base : NULL,
+                                                     count, NULL, generate_random_number);
+            if (misses != NULL)
+                misses[c] += block_misses;
+        }
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * sweep.h
+ *
+ * Single-pass evaluation of many cache configurations.
+ *
+ * For LRU, a sweep computes stack distances (Mattson et al.): the distance
+ * of an access is the number of distinct blocks of the same set used since
+ * the last access to its block. An LRU cache with a given number of sets
+ * misses exactly when that distance is at least its associativity, so one
+ * histogram of distances per number of sets gives the misses of every
+ * associativity from one pass over the accesses. The blocks of each set are
+ * kept in an order-statistics treap keyed by their last access time.
+ *
+ * Policies that are not stack algorithms (RANDOM, RANDOMIZED_MARKING, ...)
+ * can instead be evaluated with cache_access_fanout, which feeds the same
+ * decoded accesses to several caches.
+ */
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "cache.h"
+
+/*
+ * Node of a treap, in a pool shared by all the treaps of a sweep. Index 0 is
+ * the empty tree.
+ */
+typedef struct cache_sweep_node_s {
+    uint64_t time;
+    uint32_t priority, size, left, right;
+} cache_sweep_node_t;
+
+/*
+ * Structure used to store a sweep.
+ */
+typedef struct cache_sweep_s {
+    /* log2 of the line size shared by all configurations. */
+    unsigned int line_shift;
+
+    /* Numbers of sets evaluated (powers of two), and the largest associativity. */
+    size_t num_set_counts;
+    size_t *set_counts;
+    size_t max_associativity;
+
+    /* Number of accesses, and of first accesses to a block. */
+    uint64_t access_count, cold_miss_count;
+
+    /* One histogram of distances per number of sets: entry d counts the
+     * distances d < max_associativity, entry max_associativity the others. */
+    uint64_t *histograms;
+
+    /* Open-addressing table from block number + 1 to its last access time. */
+    uintptr_t *blocks;
+    uint64_t *last_times;
+    size_t table_capacity, table_count;
+
+    /* Treap roots, set by set for each number of sets, and the node pool. */
+    uint32_t **roots;
+    cache_sweep_node_t *nodes;
+    uint32_t node_capacity, node_count;
+
+    /* Time of the next access, and state of the treap priorities. */
+    uint64_t now;
+    uint32_t priority_state;
+} cache_sweep_t;
+
+/*
+ * Create a sweep over LRU caches with the given line size, each of the given
+ * numbers of sets (powers of two), and every associativity up to
+ * max_associativity.
+ */
+cache_sweep_t *cache_sweep_new(size_t line_size, const size_t *set_counts, size_t num_set_counts,
+                               size_t max_associativity);
+
+/*
+ * Frees all memory allocated for the given sweep.
+ */
+void cache_sweep_free(cache_sweep_t *sweep);
+
+/*
+ * Record accesses to the given addresses.
+ */
+void cache_sweep_access(cache_sweep_t *sweep, uintptr_t address);
+void cache_sweep_access_batch(cache_sweep_t *sweep, const uintptr_t *addresses, size_t n);
+
+/*
+ * Return the number of misses an LRU cache with num_sets sets (one of the
+ * sweep's) and the given associativity (at most max_associativity) would
+ * have had on the accesses so far, or the number of accesses if the
+ * configuration is not covered.
+ */
+uint64_t cache_sweep_miss_count(cache_sweep_t *sweep, size_t num_sets, size_t associativity);
+
+/*
+ * Simulate n accesses on each of num_caches caches. The accesses are handed
+ * to the caches one block at a time, so each block is read from memory once.
+ * misses, if not NULL, receives the number of misses of each cache.
+ */
+void cache_access_fanout(cache_t **caches, size_t num_caches, const uintptr_t *addresses, const uint8_t *is_write,
+                         size_t n, size_t *misses, func_t generate_random_number);
+
+#endif
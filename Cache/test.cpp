@@ -1,7 +1,15 @@
 #include "catch.hpp"
+#include "cache_fixed.hpp"
+#include <unistd.h>
+#include <vector>
 extern "C"
 {
 #include "cache.h"
+#include "hierarchy.h"
+#include "trace.h"
+#include "sweep.h"
+#include "prefetch.h"
+#include "coherence.h"
 }
 
 TEST_CASE("cache_line_check_validity_and_tag", "[weight=1][part=test]")
@@ -441,3 +449,965 @@ TEST_CASE("find_available_cache_line::RANDOM", "[weight=1][part=test]")
     ASSERT_EQUAL(lines[3].is_marked, 1);
 }
 
+
+TEST_CASE("cache_access_batch", "[weight=1][part=test]")
+{
+    static uint64_t data[4096] __attribute__ ((aligned (1024)));
+    uintptr_t addresses[300];
+    for (size_t i = 0; i < 300; i++)
+        addresses[i] = (uintptr_t) &data[(i * 67) % 4096];
+
+    cache_t *reference = cache_new(1024, 64, 4, CACHE_REPLACEMENTPOLICY_LRU);
+    cache_t *cache = cache_new(1024, 64, 4, CACHE_REPLACEMENTPOLICY_LRU);
+
+    uint8_t hits[(300 + 7) / 8];
+    size_t misses = cache_access_batch(cache, addresses, NULL, 300, hits, [](){ return 1; });
+
+    for (size_t i = 0; i < 300; i++) {
+        uint32_t before = cache_miss_count(reference);
+        cache_read(reference, addresses[i], [](){ return 1; });
+        bool hit = cache_miss_count(reference) == before;
+        ASSERT_EQUAL(hit, (bool) ((hits[i / 8] >> (i % 8)) & 1));
+    }
+
+    ASSERT_EQUAL(misses, cache_miss_count(reference));
+    ASSERT_EQUAL(cache_miss_count(cache), cache_miss_count(reference));
+    ASSERT_EQUAL(cache_access_count(cache), 300);
+
+    cache_free(reference);
+    cache_free(cache);
+}
+
+TEST_CASE("cache_layout_soa", "[weight=1][part=test]")
+{
+    static uint64_t data[8192] __attribute__ ((aligned (1024)));
+    for (size_t i = 0; i < 8192; i++)
+        data[i] = i;
+
+    uint8_t policies[] = {CACHE_REPLACEMENTPOLICY_RANDOM, CACHE_REPLACEMENTPOLICY_LRU,
+                          CACHE_REPLACEMENTPOLICY_MRU, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING};
+    size_t ways[] = {1, 2, 8, 16};
+
+    for (uint8_t policy : policies) {
+        for (size_t associativity : ways) {
+            cache_t *lines = cache_new(2048, 64, associativity, policy | CACHE_LAYOUT_LINES);
+            cache_t *soa = cache_new(2048, 64, associativity, policy | CACHE_LAYOUT_SOA);
+
+            for (size_t i = 0; i < 5000; i++) {
+                uintptr_t address = (uintptr_t) &data[(i * 37 + (i >> 3) * 512) % 8192];
+                ASSERT_EQUAL(cache_read(lines, address, [](){ return 3; }), cache_read(soa, address, [](){ return 3; }));
+            }
+            ASSERT_EQUAL(cache_miss_count(soa), cache_miss_count(lines));
+
+            cache_free(lines);
+            cache_free(soa);
+        }
+    }
+}
+
+TEST_CASE("cache_tags_match_mask", "[weight=1][part=test]")
+{
+    uintptr_t tags[64];
+    for (size_t i = 0; i < 64; i++)
+        tags[i] = i % 5 == 0 ? 42 : i | ((uintptr_t) 42 << 32);
+
+    for (size_t ways = 1; ways <= 64; ways++) {
+        uint64_t expected = 0;
+        for (size_t i = 0; i < ways; i++)
+            if (i % 5 == 0)
+                expected |= (uint64_t) 1 << i;
+        ASSERT_EQUAL(cache_tags_match_mask_scalar(tags, ways, 42), expected);
+        ASSERT_EQUAL(cache_tags_match_mask(tags, ways, 42), expected);
+    }
+}
+
+TEST_CASE("cache_set_lru_order::LINKED", "[weight=1][part=test]")
+{
+    static uint64_t data[8192] __attribute__ ((aligned (1024)));
+
+    uint8_t policies[] = {CACHE_REPLACEMENTPOLICY_LRU, CACHE_REPLACEMENTPOLICY_MRU};
+    for (uint8_t policy : policies) {
+        cache_t *shifting = cache_new(4096, 64, 8, policy | CACHE_LRU_SHIFTING);
+        cache_t *linked = cache_new(4096, 64, 8, policy | CACHE_LRU_LINKED | CACHE_LAYOUT_SOA);
+        size_t expected[8], actual[8];
+
+        srand(7);
+        for (size_t i = 0; i < 4000; i++) {
+            uintptr_t address = (uintptr_t) &data[rand() % 8192];
+            size_t index = (address & shifting->cache_index_mask) >> shifting->cache_index_shift;
+
+            cache_read(shifting, address, rand);
+            cache_read(linked, address, rand);
+
+            cache_set_lru_order(shifting, &shifting->sets[index], expected);
+            cache_set_lru_order(linked, &linked->sets[index], actual);
+            for (size_t way = 0; way < 8; way++)
+                ASSERT_EQUAL(actual[way], expected[way]);
+        }
+        ASSERT_EQUAL(cache_miss_count(linked), cache_miss_count(shifting));
+
+        cache_free(shifting);
+        cache_free(linked);
+    }
+}
+
+TEST_CASE("find_available_cache_line::TREE_PLRU", "[weight=1][part=test]")
+{
+    cache_t cache;
+    cache.policies = CACHE_REPLACEMENTPOLICY_TREE_PLRU;
+    cache.num_lines = 16;
+    cache.num_sets = 4;
+    cache.associativity = cache.num_lines / cache.num_sets;
+
+    cache_set_t cache_set;
+    cache_line_t lines[] = {{true, false, false, 10}, {true, false, false, 11}, {true, false, false, 12}, {true, false, false, 13}};
+    cache_set.lines = lines;
+    cache_set.first_index = 0;
+    cache_set.plru_bits = 0;
+
+    cache_line_t *actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[0]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b0110);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[2]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1100);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[1]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1010);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[3]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b0000);
+
+    actual = cache_set_find_matching_line(&cache, &cache_set, 10);
+    ASSERT_EQUAL(actual, &lines[0]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b0110);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[2]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1100);
+
+    lines[1].is_valid = false;
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[1]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1010);
+}
+
+TEST_CASE("find_available_cache_line::BIT_PLRU", "[weight=1][part=test]")
+{
+    cache_t cache;
+    cache.policies = CACHE_REPLACEMENTPOLICY_BIT_PLRU;
+    cache.num_lines = 16;
+    cache.num_sets = 4;
+    cache.associativity = cache.num_lines / cache.num_sets;
+
+    cache_set_t cache_set;
+    cache_line_t lines[] = {{true, false, false, 10}, {true, false, false, 11}, {true, false, false, 12}, {true, false, false, 13}};
+    cache_set.lines = lines;
+    cache_set.first_index = 0;
+    cache_set.plru_bits = 0;
+
+    cache_line_t *actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[0]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b0001);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[1]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b0011);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[2]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b0111);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[3]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1000);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[0]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1001);
+
+    actual = cache_set_find_matching_line(&cache, &cache_set, 13);
+    ASSERT_EQUAL(actual, &lines[3]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1001);
+
+    actual = cache_set_find_matching_line(&cache, &cache_set, 11);
+    ASSERT_EQUAL(actual, &lines[1]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b1011);
+
+    actual = find_available_cache_line(&cache, &cache_set, [](){ return 1; });
+    ASSERT_EQUAL(actual, &lines[2]);
+    ASSERT_EQUAL(cache_set.plru_bits, 0b0100);
+}
+
+TEST_CASE("cache_read::PLRU", "[weight=1][part=test]")
+{
+    static uint64_t data[8192] __attribute__ ((aligned (1024)));
+    for (size_t i = 0; i < 8192; i++)
+        data[i] = i * 3;
+
+    // A 3-way tree skips the subtree of the missing fourth way.
+    uint8_t policies[] = {CACHE_REPLACEMENTPOLICY_TREE_PLRU, CACHE_REPLACEMENTPOLICY_BIT_PLRU};
+    size_t ways[] = {1, 3, 8, 64};
+    for (uint8_t policy : policies) {
+        for (size_t associativity : ways) {
+            cache_t *cache = cache_new(64 * 64 * associativity, 64, associativity, policy | CACHE_LAYOUT_SOA);
+
+            srand(3);
+            for (size_t i = 0; i < 20000; i++) {
+                uintptr_t address = (uintptr_t) &data[rand() % 8192];
+                ASSERT_EQUAL(cache_read(cache, address, rand), *(uint64_t *) address);
+            }
+            REQUIRE(cache_miss_count(cache) < cache_access_count(cache));
+
+            for (size_t set = 0; set < cache->num_sets; set++)
+                if (policy == CACHE_REPLACEMENTPOLICY_BIT_PLRU && associativity < 64)
+                    REQUIRE(cache->sets[set].plru_bits >> associativity == 0);
+            cache_free(cache);
+        }
+    }
+}
+
+TEST_CASE("cache_hierarchy", "[weight=1][part=test]")
+{
+    static uint64_t data[8192] __attribute__ ((aligned (1024)));
+    static uint64_t shadow[8192];
+
+    uint8_t inclusions[] = {CACHE_INCLUSION_NINE, CACHE_INCLUSION_INCLUSIVE, CACHE_INCLUSION_EXCLUSIVE};
+    uint8_t write_policies[] = {
+        CACHE_WRITEPOLICY_WRITEBACK | CACHE_WRITEPOLICY_WRITEALLOCATE,
+        CACHE_WRITEPOLICY_WRITEBACK | CACHE_WRITEPOLICY_WRITENOALLOCATE,
+        CACHE_WRITEPOLICY_WRITETHROUGH | CACHE_WRITEPOLICY_WRITEALLOCATE,
+        CACHE_WRITEPOLICY_WRITETHROUGH | CACHE_WRITEPOLICY_WRITENOALLOCATE,
+    };
+    for (uint8_t inclusion : inclusions) {
+        for (uint8_t write_policy : write_policies) {
+            for (size_t i = 0; i < 8192; i++)
+                data[i] = shadow[i] = i * 3;
+
+            cache_t *levels[] = {
+                cache_new(4096, 64, 2, CACHE_REPLACEMENTPOLICY_LRU | write_policy),
+                cache_new(16384, 64, 4, CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK),
+            };
+            cache_hierarchy_t *hierarchy = cache_hierarchy_new(levels, 2, inclusion);
+
+            srand(5);
+            for (size_t i = 0; i < 50000; i++) {
+                size_t index = rand() % 8192;
+                uintptr_t address = (uintptr_t) &data[index];
+                if (rand() % 4 == 0) {
+                    shadow[index] = rand();
+                    cache_hierarchy_write(hierarchy, address, shadow[index], rand);
+                } else
+                    ASSERT_EQUAL(cache_hierarchy_read(hierarchy, address, rand), shadow[index]);
+            }
+
+            // Check the inclusion property on every block of the array.
+            for (size_t i = 0; i < 8192; i += 8) {
+                uint8_t *block;
+                bool in_l1 = cache_lookup(levels[0], (uintptr_t) &data[i], false, &block);
+                bool in_l2 = cache_lookup(levels[1], (uintptr_t) &data[i], false, &block);
+                if (inclusion == CACHE_INCLUSION_INCLUSIVE && in_l1)
+                    REQUIRE(in_l2);
+                if (inclusion == CACHE_INCLUSION_EXCLUSIVE)
+                    REQUIRE(!(in_l1 && in_l2));
+            }
+
+            cache_level_stats_t *stats = hierarchy->stats;
+            ASSERT_EQUAL(stats[0].hits + stats[0].misses, stats[0].accesses);
+            ASSERT_EQUAL(stats[1].hits + stats[1].misses, stats[1].accesses);
+            ASSERT_EQUAL(cache_access_count(levels[0]), stats[0].accesses);
+            if (write_policy == (CACHE_WRITEPOLICY_WRITEBACK | CACHE_WRITEPOLICY_WRITEALLOCATE))
+                ASSERT_EQUAL(stats[1].accesses, stats[0].misses);
+            if (inclusion == CACHE_INCLUSION_INCLUSIVE)
+                REQUIRE(stats[0].back_invalidations > 0);
+
+            double hit_times[] = {1, 10};
+            double l1_miss_rate = (double) stats[0].misses / stats[0].accesses;
+            double l2_miss_rate = (double) stats[1].misses / stats[1].accesses;
+            REQUIRE(cache_hierarchy_amat(hierarchy, hit_times, 100) ==
+                    Approx(1 + l1_miss_rate * (10 + l2_miss_rate * 100)));
+
+            cache_hierarchy_free(hierarchy);
+        }
+    }
+
+    cache_t *mismatched[] = {cache_new(4096, 64, 2, 0), cache_new(16384, 32, 4, 0)};
+    REQUIRE(cache_hierarchy_new(mismatched, 2, CACHE_INCLUSION_NINE) == NULL);
+    cache_free(mismatched[0]);
+    cache_free(mismatched[1]);
+}
+
+TEST_CASE("cache_write", "[weight=1][part=test]")
+{
+    static uint64_t data[8192] __attribute__ ((aligned (1024)));
+    static uint64_t other[8192] __attribute__ ((aligned (1024)));
+    static uint64_t shadow[8192];
+
+    uint8_t write_policies[] = {
+        CACHE_WRITEPOLICY_WRITEBACK | CACHE_WRITEPOLICY_WRITEALLOCATE,
+        CACHE_WRITEPOLICY_WRITEBACK | CACHE_WRITEPOLICY_WRITENOALLOCATE,
+        CACHE_WRITEPOLICY_WRITETHROUGH | CACHE_WRITEPOLICY_WRITEALLOCATE,
+        CACHE_WRITEPOLICY_WRITETHROUGH | CACHE_WRITEPOLICY_WRITENOALLOCATE,
+    };
+    for (uint8_t write_policy : write_policies) {
+        bool is_writeback = write_policy & CACHE_WRITEPOLICY_WRITEBACK;
+        for (size_t i = 0; i < 8192; i++)
+            data[i] = shadow[i] = i * 3;
+
+        cache_t *cache = cache_new(8192, 64, 4, CACHE_REPLACEMENTPOLICY_LRU | write_policy);
+        size_t writes = 0;
+
+        srand(7);
+        for (size_t i = 0; i < 50000; i++) {
+            size_t index = rand() % 8192;
+            uintptr_t address = (uintptr_t) &data[index];
+            if (rand() % 3 == 0) {
+                shadow[index] = rand();
+                cache_write(cache, address, shadow[index], rand);
+                writes++;
+            } else
+                ASSERT_EQUAL(cache_read(cache, address, rand), shadow[index]);
+        }
+        ASSERT_EQUAL(cache_access_count(cache), 50000);
+
+        if (is_writeback) {
+            REQUIRE(cache_writeback_count(cache) > 0);
+
+            // Reading another array evicts every dirty line back to memory.
+            for (size_t i = 0; i < 8192; i += 8)
+                cache_read(cache, (uintptr_t) &other[i], rand);
+            if (write_policy & CACHE_WRITEPOLICY_WRITENOALLOCATE)
+                REQUIRE(cache_memory_write_bytes(cache) > cache_writeback_count(cache) * 64);
+            else
+                ASSERT_EQUAL(cache_memory_write_bytes(cache), cache_writeback_count(cache) * 64);
+        } else {
+            ASSERT_EQUAL(cache_writeback_count(cache), 0);
+            ASSERT_EQUAL(cache_memory_write_bytes(cache), writes * sizeof(uint64_t));
+        }
+        ASSERT_EQUAL(cache_memory_read_bytes(cache) % 64, 0);
+        for (size_t i = 0; i < 8192; i++)
+            ASSERT_EQUAL(data[i], shadow[i]);
+
+        cache_free(cache);
+    }
+
+    // Batched writes dirty their lines without changing any data.
+    cache_t *cache = cache_new(4096, 64, 2, CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK);
+    uintptr_t addresses[] = {(uintptr_t) &data[0], (uintptr_t) &data[8], (uintptr_t) &other[0]};
+    uint8_t is_write[] = {1, 0, 1};
+    cache_access_batch(cache, addresses, is_write, 3, NULL, rand);
+    REQUIRE(cache_mark_dirty(cache, (uintptr_t) &data[8]));
+    ASSERT_EQUAL(cache_memory_write_bytes(cache), 0);
+    ASSERT_EQUAL(data[0], shadow[0]);
+    cache_free(cache);
+}
+
+TEST_CASE("cache_tag_only", "[weight=1][part=test]")
+{
+    static uint64_t data[8192] __attribute__ ((aligned (1024)));
+
+    uint32_t layouts[] = {CACHE_LAYOUT_LINES, CACHE_LAYOUT_SOA};
+    for (uint32_t layout : layouts) {
+        uint32_t policies = CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK | layout;
+        cache_t *copying = cache_new(8192, 64, 4, policies);
+        cache_t *tag_only = cache_new(8192, 64, 4, policies | CACHE_DATA_TAG_ONLY);
+        REQUIRE(tag_only->memory == NULL);
+
+        // The same accesses hit and miss alike, whether or not the addresses can be dereferenced.
+        srand(11);
+        for (size_t i = 0; i < 20000; i++) {
+            uintptr_t address = (uintptr_t) &data[rand() % 8192];
+            if (rand() % 4 == 0) {
+                cache_write(copying, address, i, rand);
+                cache_write(tag_only, address, i, rand);
+            } else {
+                cache_read(copying, address, rand);
+                ASSERT_EQUAL(cache_read(tag_only, address, rand), 0);
+            }
+        }
+        ASSERT_EQUAL(cache_miss_count(tag_only), cache_miss_count(copying));
+        ASSERT_EQUAL(cache_writeback_count(tag_only), cache_writeback_count(copying));
+        ASSERT_EQUAL(cache_memory_write_bytes(tag_only), cache_memory_write_bytes(copying));
+
+        for (size_t i = 0; i < 20000; i++)
+            cache_write(tag_only, (uintptr_t) 0xdead0000 + rand() % (1 << 20), i, rand);
+        uint8_t *block = (uint8_t *) data;
+        cache_write(tag_only, (uintptr_t) 0xdead0000, 0, rand);
+        REQUIRE(cache_lookup(tag_only, (uintptr_t) 0xdead0000 + 8, false, &block));
+        REQUIRE(block == NULL);
+
+        cache_free(copying);
+        cache_free(tag_only);
+    }
+
+    // A hierarchy must not mix tag-only caches with copying ones.
+    cache_t *mixed[] = {cache_new(4096, 64, 2, CACHE_DATA_TAG_ONLY), cache_new(16384, 64, 4, 0)};
+    REQUIRE(cache_hierarchy_new(mixed, 2, CACHE_INCLUSION_NINE) == NULL);
+    cache_free(mixed[1]);
+
+    cache_t *levels[] = {mixed[0], cache_new(16384, 64, 4, CACHE_WRITEPOLICY_WRITEBACK | CACHE_DATA_TAG_ONLY)};
+    cache_hierarchy_t *hierarchy = cache_hierarchy_new(levels, 2, CACHE_INCLUSION_INCLUSIVE);
+    REQUIRE(hierarchy != NULL);
+    srand(13);
+    for (size_t i = 0; i < 20000; i++) {
+        uintptr_t address = (uintptr_t) 0xbeef0000 + rand() % (1 << 18);
+        if (rand() % 2)
+            cache_hierarchy_write(hierarchy, address, i, rand);
+        else
+            ASSERT_EQUAL(cache_hierarchy_read(hierarchy, address, rand), 0);
+    }
+    REQUIRE(hierarchy->memory_writes > 0);
+    cache_hierarchy_free(hierarchy);
+}
+
+TEST_CASE("cache_trace", "[weight=1][part=test]")
+{
+    static uint64_t data[8192] __attribute__ ((aligned (1024)));
+    const size_t n = 3 * CACHE_TRACE_CHUNK_RECORDS + 123;
+    static uintptr_t addresses[3 * CACHE_TRACE_CHUNK_RECORDS + 123], decoded[3 * CACHE_TRACE_CHUNK_RECORDS + 123];
+    static uint8_t is_write[3 * CACHE_TRACE_CHUNK_RECORDS + 123], decoded_write[3 * CACHE_TRACE_CHUNK_RECORDS + 123];
+    const char *path = "test-trace.bin";
+
+    // Mostly nearby accesses, with the odd jump across the address space.
+    srand(17);
+    for (size_t i = 0; i < n; i++) {
+        addresses[i] = rand() % 64 == 0 ? ((uintptr_t) rand() << 30 ^ rand()) & (((uintptr_t) 1 << 62) - 1)
+                                        : (uintptr_t) &data[rand() % 8192];
+        is_write[i] = rand() % 4 == 0;
+    }
+
+    uint32_t encodings[] = {CACHE_TRACE_RAW, CACHE_TRACE_ZLIB};
+    for (uint32_t encoding : encodings) {
+        cache_trace_writer_t *writer = cache_trace_writer_open(path, encoding);
+        REQUIRE(writer != NULL);
+        for (size_t i = 0; i < n; i++)
+            cache_trace_writer_append(writer, addresses[i], is_write[i]);
+        ASSERT_EQUAL(cache_trace_writer_close(writer), 0);
+
+        // Decode in pieces that do not line up with the chunks.
+        cache_trace_t *trace = cache_trace_open(path);
+        REQUIRE(trace != NULL);
+        size_t count = 0, got;
+        while ((got = cache_trace_next(trace, decoded + count, decoded_write + count, 1000)) > 0)
+            count += got;
+        REQUIRE(!cache_trace_failed(trace));
+        ASSERT_EQUAL(count, n);
+        for (size_t i = 0; i < n; i++) {
+            ASSERT_EQUAL(decoded[i], addresses[i]);
+            ASSERT_EQUAL(decoded_write[i], is_write[i]);
+        }
+        cache_trace_close(trace);
+
+        // Replaying the trace gives the same statistics as simulating the accesses directly.
+        uint32_t policies = CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK | CACHE_DATA_TAG_ONLY;
+        cache_t *direct = cache_new(16384, 64, 4, policies);
+        cache_t *replayed = cache_new(16384, 64, 4, policies);
+        cache_access_batch(direct, addresses, is_write, n, NULL, rand);
+        trace = cache_trace_open(path);
+        ASSERT_EQUAL(cache_trace_replay(trace, replayed, rand), n);
+        ASSERT_EQUAL(cache_miss_count(replayed), cache_miss_count(direct));
+        ASSERT_EQUAL(cache_writeback_count(replayed), cache_writeback_count(direct));
+        cache_trace_close(trace);
+        cache_free(direct);
+        cache_free(replayed);
+    }
+
+    // A truncated trace is reported as malformed.
+    FILE *file = fopen(path, "r+b");
+    fseek(file, 0, SEEK_END);
+    REQUIRE(ftruncate(fileno(file), ftell(file) - 5) == 0);
+    fclose(file);
+    cache_trace_t *trace = cache_trace_open(path);
+    size_t count = 0, got;
+    while ((got = cache_trace_next(trace, decoded, NULL, 1000)) > 0)
+        count += got;
+    REQUIRE(cache_trace_failed(trace));
+    REQUIRE(count < n);
+    cache_trace_close(trace);
+
+    // So is a chunk that claims to inflate to more than a chunk can hold.
+    const uint32_t oversized[] = {CACHE_TRACE_MAGIC, CACHE_TRACE_VERSION, 1, CACHE_TRACE_ZLIB, 4, UINT32_MAX, 0};
+    file = fopen(path, "wb");
+    fwrite(oversized, sizeof(oversized), 1, file);
+    fclose(file);
+    trace = cache_trace_open(path);
+    ASSERT_EQUAL(cache_trace_next(trace, decoded, NULL, 1000), 0);
+    REQUIRE(cache_trace_failed(trace));
+    REQUIRE(!cache_trace_out_of_memory(trace));
+    cache_trace_close(trace);
+
+    // So is a file that is not a trace.
+    file = fopen(path, "wb");
+    fputs("not a trace", file);
+    fclose(file);
+    REQUIRE(cache_trace_open(path) == NULL);
+    remove(path);
+}
+
+TEST_CASE("cache_access_parallel", "[weight=1][part=test]")
+{
+    static uint64_t data[65536] __attribute__ ((aligned (1024)));
+    const size_t n = 200000;
+    static uintptr_t addresses[200000];
+    static uint8_t is_write[200000];
+
+    srand(19);
+    for (size_t i = 0; i < n; i++) {
+        addresses[i] = (uintptr_t) &data[rand() % 65536];
+        is_write[i] = rand() % 3 == 0;
+    }
+
+    uint32_t policies[] = {
+        CACHE_REPLACEMENTPOLICY_RANDOM | CACHE_WRITEPOLICY_WRITEBACK,
+        CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING | CACHE_WRITEPOLICY_WRITETHROUGH | CACHE_LAYOUT_SOA,
+        CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK | CACHE_LRU_LINKED | CACHE_DATA_TAG_ONLY,
+    };
+    size_t threads[] = {1, 2, 3, 8, 1000};
+    for (uint32_t policy : policies) {
+        cache_t *serial = cache_new(32768, 64, 4, policy);
+        size_t serial_misses = cache_access_batch(serial, addresses, is_write, n, NULL, NULL);
+
+        for (size_t num_threads : threads) {
+            cache_t *parallel = cache_new(32768, 64, 4, policy);
+            ASSERT_EQUAL(cache_access_parallel(parallel, addresses, is_write, n, num_threads), serial_misses);
+            ASSERT_EQUAL(cache_access_count(parallel), n);
+            ASSERT_EQUAL(cache_miss_count(parallel), cache_miss_count(serial));
+            ASSERT_EQUAL(cache_writeback_count(parallel), cache_writeback_count(serial));
+            ASSERT_EQUAL(cache_memory_write_bytes(parallel), cache_memory_write_bytes(serial));
+
+            // Every set ends up holding the same blocks.
+            for (size_t i = 0; i < 65536; i += 8) {
+                uintptr_t address = (uintptr_t) &data[i];
+                ASSERT_EQUAL(cache_lookup(parallel, address, false, NULL), cache_lookup(serial, address, false, NULL));
+            }
+            cache_free(parallel);
+        }
+        cache_free(serial);
+    }
+}
+
+TEST_CASE("cache_sweep", "[weight=1][part=test]")
+{
+    static uint64_t data[65536] __attribute__ ((aligned (1024)));
+    const size_t n = 100000;
+    static uintptr_t addresses[100000];
+
+    // Skewed accesses, so that every capacity sees both hits and misses.
+    srand(23);
+    for (size_t i = 0; i < n; i++)
+        addresses[i] = (uintptr_t) &data[(rand() % 65536) & (rand() % 65536)];
+
+    size_t set_counts[] = {1, 4, 16, 64};
+    size_t ways[] = {1, 2, 3, 4, 8, 16};
+    cache_sweep_t *sweep = cache_sweep_new(64, set_counts, 4, 16);
+    cache_sweep_access_batch(sweep, addresses, n);
+
+    // One pass gives the misses of every LRU configuration.
+    for (size_t num_sets : set_counts) {
+        for (size_t associativity : ways) {
+            cache_t *cache = cache_new(num_sets * associativity * 64, 64, associativity,
+                                       CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATA_TAG_ONLY);
+            size_t misses = cache_access_batch(cache, addresses, NULL, n, NULL, rand);
+            ASSERT_EQUAL(cache_sweep_miss_count(sweep, num_sets, associativity), misses);
+            cache_free(cache);
+        }
+    }
+    ASSERT_EQUAL(cache_sweep_miss_count(sweep, 8, 4), n);
+    ASSERT_EQUAL(cache_sweep_miss_count(sweep, 4, 32), n);
+    cache_sweep_free(sweep);
+
+    // Fanning out gives each cache the same result as simulating it on its own.
+    uint32_t policies[] = {CACHE_REPLACEMENTPOLICY_RANDOM, CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING,
+                           CACHE_REPLACEMENTPOLICY_BIT_PLRU};
+    cache_t *caches[3];
+    size_t misses[3];
+    for (size_t c = 0; c < 3; c++)
+        caches[c] = cache_new(16384, 64, 4, policies[c] | CACHE_DATA_TAG_ONLY);
+    cache_access_fanout(caches, 3, addresses, NULL, n, misses, NULL);
+    for (size_t c = 0; c < 3; c++) {
+        cache_t *alone = cache_new(16384, 64, 4, policies[c] | CACHE_DATA_TAG_ONLY);
+        ASSERT_EQUAL(cache_access_batch(alone, addresses, NULL, n, NULL, NULL), misses[c]);
+        ASSERT_EQUAL(cache_miss_count(caches[c]), misses[c]);
+        cache_free(alone);
+        cache_free(caches[c]);
+    }
+}
+
+/*
+ * Check that a fixed cache gives the same results as the generic one.
+ */
+template <typename Fixed>
+static void check_cache_fixed(size_t num_bytes, size_t associativity, uint32_t policy, const uintptr_t *addresses, size_t n)
+{
+    Fixed fixed;
+    cache_t *generic = cache_new(num_bytes, 64, associativity, policy | CACHE_LAYOUT_SOA | CACHE_DATA_TAG_ONLY);
+    REQUIRE(Fixed::matches(generic));
+
+    for (size_t i = 0; i < n; i += 1000) {
+        size_t generic_misses = cache_access_batch(generic, addresses + i, NULL, 1000, NULL, NULL);
+        ASSERT_EQUAL(fixed.access_batch(addresses + i, 1000, NULL), generic_misses);
+    }
+    ASSERT_EQUAL(fixed.access_count(), cache_access_count(generic));
+    ASSERT_EQUAL(fixed.miss_count(), cache_miss_count(generic));
+    cache_free(generic);
+}
+
+TEST_CASE("cache_fixed", "[weight=1][part=test]")
+{
+    const size_t n = 200000;
+    static uintptr_t addresses[200000];
+
+    srand(29);
+    for (size_t i = 0; i < n; i++)
+        addresses[i] = (uintptr_t) (rand() % (1 << 22)) & (uintptr_t) (rand() % (1 << 22)) << 3;
+
+    check_cache_fixed<cache_fixed_l1_t>(32768, 8, CACHE_REPLACEMENTPOLICY_LRU, addresses, n);
+    check_cache_fixed<cache_fixed_l2_t>(1048576, 16, CACHE_REPLACEMENTPOLICY_LRU, addresses, n);
+    check_cache_fixed<cache_fixed<16384, 64, 4, CACHE_REPLACEMENTPOLICY_RANDOM> >(16384, 4, CACHE_REPLACEMENTPOLICY_RANDOM, addresses, n);
+    check_cache_fixed<cache_fixed<24576, 64, 3, CACHE_REPLACEMENTPOLICY_TREE_PLRU> >(24576, 3, CACHE_REPLACEMENTPOLICY_TREE_PLRU, addresses, n);
+    check_cache_fixed<cache_fixed<32768, 64, 8, CACHE_REPLACEMENTPOLICY_TREE_PLRU> >(32768, 8, CACHE_REPLACEMENTPOLICY_TREE_PLRU, addresses, n);
+    check_cache_fixed<cache_fixed<65536, 64, 16, CACHE_REPLACEMENTPOLICY_BIT_PLRU> >(65536, 16, CACHE_REPLACEMENTPOLICY_BIT_PLRU, addresses, n);
+
+    cache_t *other = cache_new(32768, 64, 4, CACHE_REPLACEMENTPOLICY_LRU);
+    REQUIRE(!cache_fixed_l1_t::matches(other));
+    cache_free(other);
+}
+
+TEST_CASE("cache_arena", "[weight=1][part=test]")
+{
+    static uint64_t data[65536] __attribute__ ((aligned (1024)));
+    const size_t n = 50000;
+    static uintptr_t addresses[50000];
+
+    srand(31);
+    for (size_t i = 0; i < n; i++)
+        addresses[i] = (uintptr_t) &data[rand() % 65536];
+
+    uint32_t policies[] = {
+        CACHE_REPLACEMENTPOLICY_LRU,
+        CACHE_REPLACEMENTPOLICY_RANDOMIZED_MARKING | CACHE_LAYOUT_SOA,
+        CACHE_REPLACEMENTPOLICY_LRU | CACHE_LRU_LINKED | CACHE_ARENA_HUGEPAGES,
+        CACHE_REPLACEMENTPOLICY_TREE_PLRU | CACHE_DATA_TAG_ONLY | CACHE_ARENA_HUGEPAGES,
+    };
+    for (uint32_t policy : policies) {
+        cache_t *cache = cache_new(4 << 20, 64, 16, policy | CACHE_WRITEPOLICY_WRITEBACK);
+        REQUIRE(cache != NULL);
+
+        // Everything the cache points to is inside its arena.
+        uint8_t *begin = (uint8_t *) cache->arena, *end = begin + cache->arena_size;
+        REQUIRE((uint8_t *) cache == begin);
+        REQUIRE((uint8_t *) cache->sets > begin);
+        REQUIRE((uint8_t *) (cache->lines + cache->num_lines) <= end);
+        if (cache->memory != NULL)
+            REQUIRE(cache->memory + 4 * 1024 * 1024 <= end);
+        if (cache->tags != NULL)
+            REQUIRE((uintptr_t) cache->tags % 64 == 0);
+        if (policy & CACHE_ARENA_HUGEPAGES) {
+            REQUIRE(cache->arena_size % (2 * 1024 * 1024) == 0);
+            REQUIRE((uintptr_t) cache->arena % (2 * 1024 * 1024) == 0);
+        }
+
+        // A reset cache behaves like a new one.
+        size_t misses = cache_access_batch(cache, addresses, NULL, n, NULL, NULL);
+        cache_reset(cache);
+        ASSERT_EQUAL(cache_access_count(cache), 0);
+        REQUIRE(!cache_lookup(cache, addresses[n - 1], false, NULL));
+        ASSERT_EQUAL(cache_access_batch(cache, addresses, NULL, n, NULL, NULL), misses);
+        cache_free(cache);
+    }
+}
+
+TEST_CASE("cache_get_stats", "[weight=1][part=test]")
+{
+    static uint64_t data[65536] __attribute__ ((aligned (1024)));
+    cache_stats_t stats;
+
+    // Two blocks that map to the same set of a direct-mapped cache only conflict.
+    cache_t *cache = cache_new(4096, 64, 1, CACHE_REPLACEMENTPOLICY_LRU | CACHE_STATS_DETAILED);
+    for (size_t i = 0; i < 10; i++)
+        cache_read(cache, (uintptr_t) &data[(i % 2) * 512], rand);
+    cache_get_stats(cache, &stats);
+    ASSERT_EQUAL(stats.accesses, 10);
+    ASSERT_EQUAL(stats.misses, 10);
+    ASSERT_EQUAL(stats.compulsory_misses, 2);
+    ASSERT_EQUAL(stats.capacity_misses, 0);
+    ASSERT_EQUAL(stats.conflict_misses, 8);
+    ASSERT_EQUAL(stats.evictions, 9);
+    ASSERT_EQUAL(stats.num_sets, 64);
+    size_t set_index = ((uintptr_t) &data[0] >> 6) % 64;
+    ASSERT_EQUAL(stats.set_misses[set_index], 10);
+    ASSERT_EQUAL(stats.set_hits[set_index], 0);
+
+    // A block brought in by a prefetch and then hit is not compulsory when it misses later.
+    cache_reset(cache);
+    cache_prefetch(cache, (uintptr_t) &data[0], rand, NULL);
+    cache_read(cache, (uintptr_t) &data[0], rand);
+    cache_read(cache, (uintptr_t) &data[512], rand);
+    cache_read(cache, (uintptr_t) &data[0], rand);
+    cache_get_stats(cache, &stats);
+    ASSERT_EQUAL(stats.misses, 2);
+    ASSERT_EQUAL(stats.compulsory_misses, 1);
+    ASSERT_EQUAL(stats.conflict_misses, 1);
+
+    // Sweeping over twice the capacity only misses for lack of capacity.
+    cache_reset(cache);
+    for (size_t pass = 0; pass < 3; pass++)
+        for (size_t i = 0; i < 1024; i += 8)
+            cache_read(cache, (uintptr_t) &data[i], rand);
+    cache_get_stats(cache, &stats);
+    ASSERT_EQUAL(stats.compulsory_misses, 128);
+    ASSERT_EQUAL(stats.capacity_misses, 256);
+    ASSERT_EQUAL(stats.conflict_misses, 0);
+    cache_free(cache);
+
+    // The classification and the histograms add up on random accesses.
+    cache = cache_new(16384, 64, 4, CACHE_REPLACEMENTPOLICY_RANDOM | CACHE_WRITEPOLICY_WRITEBACK | CACHE_STATS_DETAILED);
+    srand(37);
+    for (size_t i = 0; i < 50000; i++) {
+        uintptr_t address = (uintptr_t) &data[(rand() % 65536) & (rand() % 65536)];
+        if (i % 3 == 0)
+            cache_write(cache, address, data[(address - (uintptr_t) data) / 8], rand);
+        else
+            cache_read(cache, address, rand);
+    }
+    cache_get_stats(cache, &stats);
+    ASSERT_EQUAL(stats.accesses, 50000);
+    ASSERT_EQUAL(stats.hits + stats.misses, stats.accesses);
+    ASSERT_EQUAL(stats.compulsory_misses + stats.capacity_misses + stats.conflict_misses, stats.misses);
+    REQUIRE(stats.capacity_misses > 0);
+    REQUIRE(stats.conflict_misses > 0);
+    ASSERT_EQUAL(stats.evictions, stats.misses - cache->num_lines);
+    ASSERT_EQUAL(stats.writebacks, cache_writeback_count(cache));
+    uint64_t set_hits = 0, set_misses = 0;
+    for (size_t set = 0; set < stats.num_sets; set++) {
+        set_hits += stats.set_hits[set];
+        set_misses += stats.set_misses[set];
+    }
+    ASSERT_EQUAL(set_hits, stats.hits);
+    ASSERT_EQUAL(set_misses, stats.misses);
+    cache_free(cache);
+
+    // Without detailed statistics only the basic counters are reported, and they do not wrap at 32 bits.
+    cache = cache_new(16384, 64, 4, CACHE_REPLACEMENTPOLICY_LRU);
+    cache->access_count = UINT32_MAX;
+    cache_read(cache, (uintptr_t) &data[0], rand);
+    cache_get_stats(cache, &stats);
+    ASSERT_EQUAL(stats.accesses, (uint64_t) UINT32_MAX + 1);
+    ASSERT_EQUAL(stats.misses, 1);
+    ASSERT_EQUAL(stats.compulsory_misses, 0);
+    REQUIRE(stats.set_hits == NULL);
+    cache_free(cache);
+}
+
+TEST_CASE("cache_prefetcher", "[weight=1][part=test]")
+{
+    static uint64_t data[64 * 64] __attribute__ ((aligned (4096)));
+    cache_prefetcher_t *prefetcher;
+    cache_t *cache;
+
+    for (size_t i = 0; i < 64 * 64; i++)
+        data[i] = i;
+
+    // A sequential walk with a next-line prefetcher only misses on the first block of each page.
+    cache = cache_new(16384, 64, 1, CACHE_REPLACEMENTPOLICY_LRU);
+    prefetcher = cache_prefetcher_new(cache, CACHE_PREFETCH_NEXT_LINE, 1);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < 64 * 64; i++)
+        sum += cache_prefetch_read(prefetcher, (uintptr_t) &data[i], 0, rand);
+    ASSERT_EQUAL(sum, (uint64_t) 64 * 64 * (64 * 64 - 1) / 2);
+    ASSERT_EQUAL(prefetcher->stats.accesses, 64 * 64);
+    ASSERT_EQUAL(prefetcher->stats.misses, sizeof(data) / 4096);
+    ASSERT_EQUAL(prefetcher->stats.misses, cache_miss_count(cache));
+    ASSERT_EQUAL(prefetcher->stats.issued, sizeof(data) / 64 - sizeof(data) / 4096);
+    ASSERT_EQUAL(prefetcher->stats.useful, prefetcher->stats.issued);
+    ASSERT_EQUAL(prefetcher->stats.pollution, 0);
+    REQUIRE(cache_prefetch_accuracy(prefetcher) == 1);
+    cache_prefetcher_free(prefetcher);
+    cache_free(cache);
+
+    // The column-major walk of sumB misses on every access without a prefetcher...
+    cache = cache_new(16384, 64, 1, CACHE_REPLACEMENTPOLICY_LRU);
+    for (size_t j = 0; j < 64; j++)
+        for (size_t i = 0; i < 64; i++)
+            cache_read(cache, (uintptr_t) &data[i * 64 + j], rand);
+    uint64_t baseline = cache_miss_count(cache);
+    ASSERT_EQUAL(baseline, 64 * 64);
+    cache_free(cache);
+
+    // ... and a stride prefetcher covers most of them, but not the first rows of each page.
+    uint8_t kinds[] = {CACHE_PREFETCH_STRIDE, CACHE_PREFETCH_STREAM};
+    for (size_t k = 0; k < 2; k++) {
+        cache = cache_new(16384, 64, 1, CACHE_REPLACEMENTPOLICY_LRU);
+        prefetcher = cache_prefetcher_new(cache, kinds[k], 4);
+        sum = 0;
+        for (size_t j = 0; j < 64; j++)
+            for (size_t i = 0; i < 64; i++)
+                sum += cache_prefetch_read(prefetcher, (uintptr_t) &data[i * 64 + j], 0x400, rand);
+        ASSERT_EQUAL(sum, (uint64_t) 64 * 64 * (64 * 64 - 1) / 2);
+        ASSERT_EQUAL(prefetcher->stats.misses, cache_miss_count(cache));
+        ASSERT_EQUAL(prefetcher->stats.accesses, cache_access_count(cache));
+        REQUIRE(prefetcher->stats.useful <= prefetcher->stats.issued);
+        REQUIRE(prefetcher->stats.pollution <= prefetcher->stats.misses);
+        REQUIRE(cache_prefetch_coverage(prefetcher) >= 0);
+        REQUIRE(cache_prefetch_coverage(prefetcher) <= 1);
+        if (kinds[k] == CACHE_PREFETCH_STRIDE) {
+            REQUIRE(cache_miss_count(cache) < baseline / 2);
+            REQUIRE(cache_prefetch_accuracy(prefetcher) > 0.5);
+        } else {
+            // Streams are ascending blocks, so they do not help a 512-byte stride.
+            ASSERT_EQUAL(prefetcher->stats.useful, 0);
+        }
+        cache_prefetcher_free(prefetcher);
+        cache_free(cache);
+    }
+
+    // Prefetches do not leave the page of the access that triggered them.
+    cache = cache_new(16384, 64, 4, CACHE_REPLACEMENTPOLICY_LRU);
+    prefetcher = cache_prefetcher_new(cache, CACHE_PREFETCH_NEXT_LINE, 8);
+    cache_prefetch_read(prefetcher, (uintptr_t) &data[512 - 1], 0, rand);
+    ASSERT_EQUAL(prefetcher->stats.issued, 0);
+    REQUIRE(!cache_lookup(cache, (uintptr_t) &data[512], false, NULL));
+    cache_prefetcher_free(prefetcher);
+    cache_free(cache);
+}
+
+/*
+ * Check that no copy of the blocks of a region contradicts another: a
+ * Modified or Exclusive copy is the only one, and there is at most one Owned copy.
+ */
+static void check_coherence_invariants(cache_coherence_t *system, uintptr_t start, size_t num_blocks)
+{
+    for (size_t b = 0; b < num_blocks; b++) {
+        uintptr_t address = start + b * 64;
+        size_t copies = 0, exclusive = 0, owned = 0;
+        for (size_t c = 0; c < system->num_cores; c++) {
+            uint8_t state = cache_coherence_state(system, c, address);
+            copies += state != CACHE_COHERENCE_INVALID;
+            exclusive += state == CACHE_COHERENCE_MODIFIED || state == CACHE_COHERENCE_EXCLUSIVE;
+            owned += state == CACHE_COHERENCE_OWNED;
+        }
+        REQUIRE(exclusive <= 1);
+        REQUIRE(owned <= 1);
+        if (exclusive == 1)
+            ASSERT_EQUAL(copies, 1);
+    }
+}
+
+static cache_coherence_t *new_coherence(size_t num_cores, uint8_t protocol)
+{
+    cache_t *l1s[8];
+    for (size_t c = 0; c < num_cores; c++)
+        l1s[c] = cache_new(4096, 64, 4, CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK | CACHE_DATA_TAG_ONLY);
+    cache_t *llc = cache_new(65536, 64, 8, CACHE_REPLACEMENTPOLICY_LRU | CACHE_WRITEPOLICY_WRITEBACK | CACHE_DATA_TAG_ONLY);
+    return cache_coherence_new(l1s, num_cores, llc, protocol);
+}
+
+TEST_CASE("cache_coherence", "[weight=1][part=test]")
+{
+    uintptr_t a = 0x100000;
+
+    // MESI transitions between two cores.
+    cache_coherence_t *system = new_coherence(2, CACHE_PROTOCOL_MESI);
+    REQUIRE(system != NULL);
+    cache_coherence_read(system, 0, a);
+    ASSERT_EQUAL(cache_coherence_state(system, 0, a), CACHE_COHERENCE_EXCLUSIVE);
+    ASSERT_EQUAL(system->memory_reads, 1);
+    cache_coherence_read(system, 1, a + 8);
+    ASSERT_EQUAL(cache_coherence_state(system, 0, a), CACHE_COHERENCE_SHARED);
+    ASSERT_EQUAL(cache_coherence_state(system, 1, a), CACHE_COHERENCE_SHARED);
+    ASSERT_EQUAL(system->core_stats[1].transfers, 1);
+    cache_coherence_write(system, 1, a + 8);
+    ASSERT_EQUAL(cache_coherence_state(system, 0, a), CACHE_COHERENCE_INVALID);
+    ASSERT_EQUAL(cache_coherence_state(system, 1, a), CACHE_COHERENCE_MODIFIED);
+    ASSERT_EQUAL(system->core_stats[1].upgrades, 1);
+    ASSERT_EQUAL(system->core_stats[1].invalidations_sent, 1);
+    ASSERT_EQUAL(system->core_stats[0].invalidations_received, 1);
+    cache_coherence_read(system, 0, a);
+    ASSERT_EQUAL(system->core_stats[0].coherence_misses, 1);
+    ASSERT_EQUAL(system->core_stats[1].writebacks, 1);
+    ASSERT_EQUAL(cache_coherence_state(system, 1, a), CACHE_COHERENCE_SHARED);
+    REQUIRE(system->l1s[1]->lines != NULL);
+    REQUIRE(!cache_find_line(system->l1s[1], a)->is_dirty);
+    cache_coherence_write(system, 0, a);
+    cache_coherence_write(system, 0, a);
+    ASSERT_EQUAL(system->core_stats[0].hits, 2);
+    ASSERT_EQUAL(system->memory_reads, 1);
+    cache_coherence_free(system);
+
+    // With MOESI the Modified copy becomes Owned instead of being written back.
+    system = new_coherence(2, CACHE_PROTOCOL_MOESI);
+    cache_coherence_write(system, 0, a);
+    cache_coherence_read(system, 1, a);
+    ASSERT_EQUAL(cache_coherence_state(system, 0, a), CACHE_COHERENCE_OWNED);
+    ASSERT_EQUAL(cache_coherence_state(system, 1, a), CACHE_COHERENCE_SHARED);
+    ASSERT_EQUAL(system->core_stats[0].writebacks, 0);
+    REQUIRE(cache_find_line(system->l1s[0], a)->is_dirty);
+    cache_coherence_write(system, 1, a);
+    ASSERT_EQUAL(cache_coherence_state(system, 0, a), CACHE_COHERENCE_INVALID);
+    check_coherence_invariants(system, a, 1);
+    cache_coherence_free(system);
+
+    // Caches that are not TAG_ONLY are refused.
+    cache_t *l1 = cache_new(4096, 64, 4, CACHE_REPLACEMENTPOLICY_LRU);
+    cache_t *llc = cache_new(65536, 64, 8, CACHE_REPLACEMENTPOLICY_LRU | CACHE_DATA_TAG_ONLY);
+    REQUIRE(cache_coherence_new(&l1, 1, llc, CACHE_PROTOCOL_MESI) == NULL);
+    cache_free(l1);
+    cache_free(llc);
+
+    // Threads writing their own words of shared blocks (false sharing) mostly have coherence misses,
+    // while threads working on their own blocks have none.
+    const size_t n = 20000, num_cores = 4;
+    std::vector<uintptr_t> shared[4], own[4];
+    std::vector<uint8_t> writes[4];
+    srand(41);
+    for (size_t c = 0; c < num_cores; c++)
+        for (size_t i = 0; i < n; i++) {
+            size_t block = rand() % 32;
+            shared[c].push_back(a + block * 64 + c * 8);
+            own[c].push_back(a + 0x10000 * (c + 1) + block * 64);
+            writes[c].push_back(rand() % 2);
+        }
+    const uintptr_t *addresses[4];
+    const uint8_t *is_write[4];
+    size_t counts[4];
+
+    for (uint8_t protocol = CACHE_PROTOCOL_MESI; protocol <= CACHE_PROTOCOL_MOESI; protocol++) {
+        system = new_coherence(num_cores, protocol);
+        for (size_t c = 0; c < num_cores; c++) {
+            addresses[c] = own[c].data();
+            is_write[c] = writes[c].data();
+            counts[c] = n;
+        }
+        cache_coherence_run(system, addresses, is_write, counts);
+        for (size_t c = 0; c < num_cores; c++) {
+            cache_core_stats_t *stats = &system->core_stats[c];
+            ASSERT_EQUAL(stats->reads + stats->writes, n);
+            ASSERT_EQUAL(stats->hits + stats->misses, n);
+            ASSERT_EQUAL(stats->misses, 32);
+            ASSERT_EQUAL(stats->coherence_misses, 0);
+            ASSERT_EQUAL(stats->invalidations_received, 0);
+        }
+        cache_coherence_free(system);
+
+        system = new_coherence(num_cores, protocol);
+        for (size_t c = 0; c < num_cores; c++)
+            addresses[c] = shared[c].data();
+        cache_coherence_run(system, addresses, is_write, counts);
+        uint64_t sent = 0, received = 0;
+        for (size_t c = 0; c < num_cores; c++) {
+            cache_core_stats_t *stats = &system->core_stats[c];
+            ASSERT_EQUAL(stats->hits + stats->misses, n);
+            REQUIRE(stats->coherence_misses <= stats->misses);
+            sent += stats->invalidations_sent;
+            received += stats->invalidations_received;
+        }
+        ASSERT_EQUAL(sent, received);
+        REQUIRE(received > 0);
+        ASSERT_EQUAL(system->llc_misses, 32);
+        check_coherence_invariants(system, a, 32);
+        cache_coherence_free(system);
+    }
+}
@@ -0,0 +1,325 @@
+#include "trace.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define CACHE_TRACE_HEADER_SIZE       8
+#define CACHE_TRACE_CHUNK_HEADER_SIZE 16
+
+/*
+ * Most bytes a record takes once encoded, and a chunk once decoded.
+ */
+#define CACHE_TRACE_MAX_RECORD_SIZE 10
+#define CACHE_TRACE_MAX_CHUNK_SIZE  (CACHE_TRACE_CHUNK_RECORDS * CACHE_TRACE_MAX_RECORD_SIZE)
+
+/*
+ * Store and load little-endian 32-bit words.
+ */
+static inline void put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Write a buffer to the trace file, remembering any failure.
+ */
+static void writer_output(cache_trace_writer_t *writer, const void *data, size_t size) {
+    if (fwrite(data, 1, size, writer->file) != size)
+        writer->failed = true;
+}
+
+/*
+ * Create a trace file.
+ */
+cache_trace_writer_t *cache_trace_writer_open(const char *path, uint32_t encoding) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return NULL;
+
+    cache_trace_writer_t *writer = (cache_trace_writer_t *)calloc(1, sizeof(cache_trace_writer_t));
+    writer->file = file;
+    writer->encoding = encoding;
+    writer->chunk = (uint8_t *)malloc(CACHE_TRACE_CHUNK_RECORDS * CACHE_TRACE_MAX_RECORD_SIZE);
+    if (encoding == CACHE_TRACE_ZLIB) {
+        writer->deflated_capacity = compressBound(CACHE_TRACE_CHUNK_RECORDS * CACHE_TRACE_MAX_RECORD_SIZE);
+        writer->deflated = (uint8_t *)malloc(writer->deflated_capacity);
+    }
+
+    uint8_t header[CACHE_TRACE_HEADER_SIZE];
+    put_u32(header, CACHE_TRACE_MAGIC);
+    put_u32(header + 4, CACHE_TRACE_VERSION);
+    writer_output(writer, header, sizeof(header));
+
+    return writer;
+}
+
+/*
+ * Write the chunk being built, if it holds any record, and start a new one.
+ */
+static void writer_flush_chunk(cache_trace_writer_t *writer) {
+    if (writer->num_records == 0)
+        return;
+
+    const uint8_t *payload = writer->chunk;
+    uLongf payload_size = writer->chunk_size;
+    uint32_t encoding = writer->encoding;
+
+    // Keep the chunk raw if it does not compress.
+    if (encoding == CACHE_TRACE_ZLIB) {
+        payload_size = writer->deflated_capacity;
+        if (compress2(writer->deflated, &payload_size, writer->chunk, writer->chunk_size, Z_BEST_SPEED) == Z_OK &&
+            payload_size < writer->chunk_size)
+            payload = writer->deflated;
+        else {
+            encoding = CACHE_TRACE_RAW;
+            payload_size = writer->chunk_size;
+        }
+    }
+
+    uint8_t header[CACHE_TRACE_CHUNK_HEADER_SIZE];
+    put_u32(header, writer->num_records);
+    put_u32(header + 4, encoding);
+    put_u32(header + 8, payload_size);
+    put_u32(header + 12, writer->chunk_size);
+    writer_output(writer, header, sizeof(header));
+    writer_output(writer, payload, payload_size);
+
+    writer->chunk_size = 0;
+    writer->num_records = 0;
+    writer->previous = 0;
+}
+
+/*
+ * Append an access to a trace.
+ */
+void cache_trace_writer_append(cache_trace_writer_t *writer, uintptr_t address, bool is_write) {
+    int64_t delta = (int64_t)(address - writer->previous);
+    uint64_t record = ((uint64_t)delta << 1 ^ (uint64_t)(delta >> 63)) << 1 | is_write;
+    uint8_t *p = writer->chunk + writer->chunk_size;
+
+    while (record >= 0x80) {
+        *p++ = (uint8_t)record | 0x80;
+        record >>= 7;
+    }
+    *p++ = (uint8_t)record;
+
+    writer->chunk_size = p - writer->chunk;
+    writer->previous = address;
+    if (++writer->num_records == CACHE_TRACE_CHUNK_RECORDS)
+        writer_flush_chunk(writer);
+}
+
+/*
+ * Finish a trace.
+ */
+int cache_trace_writer_close(cache_trace_writer_t *writer) {
+    writer_flush_chunk(writer);
+    if (fclose(writer->file) != 0)
+        writer->failed = true;
+
+    int result = writer->failed ? -1 : 0;
+    free(writer->chunk);
+    free(writer->deflated);
+    free(writer);
+    return result;
+}
+
+/*
+ * Map a trace file.
+ */
+cache_trace_t *cache_trace_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < CACHE_TRACE_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+
+    // The mapping stays valid once the descriptor is closed.
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const uint8_t *bytes = (const uint8_t *)map;
+    if (get_u32(bytes) != CACHE_TRACE_MAGIC || get_u32(bytes + 4) != CACHE_TRACE_VERSION) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    cache_trace_t *trace = (cache_trace_t *)calloc(1, sizeof(cache_trace_t));
+    if (trace == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    trace->map = bytes;
+    trace->size = st.st_size;
+    trace->next_chunk = CACHE_TRACE_HEADER_SIZE;
+    return trace;
+}
+
+/*
+ * Start decoding the next chunk. Returns false at the end of the trace, if
+ * the chunk is malformed or if it cannot be inflated for lack of memory.
+ */
+static bool trace_load_chunk(cache_trace_t *trace) {
+    if (trace->next_chunk == trace->size)
+        return false;
+    if (trace->size - trace->next_chunk < CACHE_TRACE_CHUNK_HEADER_SIZE) {
+        trace->failed = true;
+        return false;
+    }
+
+    const uint8_t *header = trace->map + trace->next_chunk;
+    uint32_t num_records = get_u32(header);
+    uint32_t encoding = get_u32(header + 4);
+    uint32_t payload_size = get_u32(header + 8);
+    uint32_t decoded_size = get_u32(header + 12);
+    const uint8_t *payload = header + CACHE_TRACE_CHUNK_HEADER_SIZE;
+
+    if (trace->size - trace->next_chunk - CACHE_TRACE_CHUNK_HEADER_SIZE < payload_size ||
+        num_records > CACHE_TRACE_CHUNK_RECORDS || decoded_size > CACHE_TRACE_MAX_CHUNK_SIZE) {
+        trace->failed = true;
+        return false;
+    }
+    trace->next_chunk += CACHE_TRACE_CHUNK_HEADER_SIZE + payload_size;
+
+    if (encoding == CACHE_TRACE_RAW && payload_size == decoded_size) {
+        trace->cursor = payload;
+    } else if (encoding == CACHE_TRACE_ZLIB) {
+        if (decoded_size > trace->inflated_capacity) {
+            free(trace->inflated);
+            trace->inflated = (uint8_t *)malloc(decoded_size);
+            trace->inflated_capacity = trace->inflated != NULL ? decoded_size : 0;
+            if (trace->inflated == NULL) {
+                trace->failed = trace->out_of_memory = true;
+                return false;
+            }
+        }
+        uLongf inflated_size = decoded_size;
+        if (uncompress(trace->inflated, &inflated_size, payload, payload_size) != Z_OK || inflated_size != decoded_size) {
+            trace->failed = true;
+            return false;
+        }
+        trace->cursor = trace->inflated;
+    } else {
+        trace->failed = true;
+        return false;
+    }
+
+    trace->end = trace->cursor + decoded_size;
+    trace->records_left = num_records;
+    trace->previous = 0;
+    return true;
+}
+
+/*
+ * Decode records of a trace.
+ */
+size_t cache_trace_next(cache_trace_t *trace, uintptr_t *addresses, uint8_t *is_write, size_t max) {
+    size_t n = 0;
+
+    while (n < max) {
+        if (trace->records_left == 0 && !trace_load_chunk(trace))
+            break;
+
+        const uint8_t *p = trace->cursor, *end = trace->end;
+        uintptr_t previous = trace->previous;
+        size_t count = max - n < trace->records_left ? max - n : trace->records_left;
+
+        for (size_t i = 0; i < count; i++) {
+            uint64_t record = 0;
+            unsigned int shift = 0;
+            uint8_t byte;
+
+            do {
+                if (p == end || shift > 63) {
+                    trace->failed = true;
+                    trace->records_left = 0;
+                    trace->next_chunk = trace->size;
+                    return n;
+                }
+                byte = *p++;
+                record |= (uint64_t)(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+
+            uint64_t zigzag = record >> 1;
+            previous += (uintptr_t)(zigzag >> 1 ^ -(zigzag & 1));
+            addresses[n] = previous;
+            if (is_write != NULL)
+                is_write[n] = record & 1;
+            n++;
+        }
+
+        trace->cursor = p;
+        trace->previous = previous;
+        trace->records_left -= count;
+    }
+
+    return n;
+}
+
+/*
+ * Return whether a malformed chunk was found, or memory ran out.
+ */
+bool cache_trace_failed(cache_trace_t *trace) {
+    return trace->failed;
+}
+
+/*
+ * Return whether memory ran out.
+ */
+bool cache_trace_out_of_memory(cache_trace_t *trace) {
+    return trace->out_of_memory;
+}
+
+/*
+ * Unmap a trace file.
+ */
+void cache_trace_close(cache_trace_t *trace) {
+    if (trace == NULL)
+        return;
+
+    munmap((void *)trace->map, trace->size);
+    free(trace->inflated);
+    free(trace);
+}
+
+/*
+ * Simulate every access of a trace.
+ */
+size_t cache_trace_replay(cache_trace_t *trace, cache_t *cache, func_t generate_random_number) {
+    uintptr_t *addresses = (uintptr_t *)malloc(CACHE_TRACE_CHUNK_RECORDS * sizeof(uintptr_t));
+    uint8_t *is_write = (uint8_t *)malloc(CACHE_TRACE_CHUNK_RECORDS);
+    size_t total = 0, n;
+
+    if (addresses == NULL || is_write == NULL) {
+        trace->failed = trace->out_of_memory = true;
+        free(addresses);
+        free(is_write);
+        return 0;
+    }
+
+    while ((n = cache_trace_next(trace, addresses, is_write, CACHE_TRACE_CHUNK_RECORDS)) > 0) {
+        cache_access_batch(cache, addresses, is_write, n, NULL, generate_random_number);
+        total += n;
+    }
+
+    free(addresses);
+    free(is_write);
+    return total;
+}
@@ -0,0 +1,141 @@
+/*
+ * trace.h
+ *
+ * Definition of the binary trace format replayed by the simulator, and of
+ * its writer and memory-mapped reader.
+ *
+ * A trace file starts with a header (the magic "CTRC" and a version, as two
+ * little-endian 32-bit words) followed by chunks. Each chunk has a header of
+ * four little-endian 32-bit words: the number of records, the encoding of the
+ * payload, the size of the payload in the file and its size once decoded.
+ * The payload is then stored as is (CACHE_TRACE_RAW) or deflated with zlib
+ * (CACHE_TRACE_ZLIB).
+ *
+ * A decoded payload is a sequence of unsigned LEB128 varints, one per
+ * record. A record holds the zigzag-encoded difference between its address
+ * and the previous record's, shifted left by one, with the low bit set for
+ * writes. The first record of each chunk is relative to address 0, so chunks
+ * can be decoded independently. Addresses must fit in 62 bits. A chunk holds
+ * at most CACHE_TRACE_CHUNK_RECORDS records, and readers reject larger ones.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "cache.h"
+
+#define CACHE_TRACE_MAGIC   0x43525443
+#define CACHE_TRACE_VERSION 1
+
+/*
+ * Chunk encodings.
+ */
+#define CACHE_TRACE_RAW  0
+#define CACHE_TRACE_ZLIB 1
+
+/*
+ * Number of records per chunk written by a trace writer.
+ */
+#define CACHE_TRACE_CHUNK_RECORDS 65536
+
+/*
+ * Structure used to write a trace file.
+ */
+typedef struct cache_trace_writer_s {
+    FILE *file;
+
+    /* Encoding of the chunks. */
+    uint32_t encoding;
+
+    /* The chunk being built: its records, their size, and the last address. */
+    uint8_t *chunk;
+    size_t chunk_size;
+    uint32_t num_records;
+    uintptr_t previous;
+
+    /* Buffer for the deflated chunk (ZLIB only). */
+    uint8_t *deflated;
+    size_t deflated_capacity;
+
+    /* Whether a write to the file failed. */
+    bool failed;
+} cache_trace_writer_t;
+
+/*
+ * Structure used to read a trace file. The file is mapped in memory, and
+ * records are decoded straight from the mapping (or from the inflated chunk).
+ */
+typedef struct cache_trace_s {
+    /* The mapped file. */
+    const uint8_t *map;
+    size_t size;
+
+    /* Offset of the next chunk header in the file. */
+    size_t next_chunk;
+
+    /* The chunk being decoded: its next record, its end, the records left and the last address. */
+    const uint8_t *cursor, *end;
+    uint32_t records_left;
+    uintptr_t previous;
+
+    /* Buffer for the inflated chunk (ZLIB only). */
+    uint8_t *inflated;
+    size_t inflated_capacity;
+
+    /* Whether the file is malformed, or memory ran out, and which. */
+    bool failed, out_of_memory;
+} cache_trace_t;
+
+/*
+ * Create a trace file at path, with chunks stored in the given encoding.
+ * Returns NULL if the file cannot be created.
+ */
+cache_trace_writer_t *cache_trace_writer_open(const char *path, uint32_t encoding);
+
+/*
+ * Append an access to a trace.
+ */
+void cache_trace_writer_append(cache_trace_writer_t *writer, uintptr_t address, bool is_write);
+
+/*
+ * Write the last chunk, close the file and free the writer. Returns 0 on
+ * success, or -1 if any part of the trace could not be written.
+ */
+int cache_trace_writer_close(cache_trace_writer_t *writer);
+
+/*
+ * Map the trace file at path. Returns NULL if it cannot be opened or mapped,
+ * or if it does not start with a valid header.
+ */
+cache_trace_t *cache_trace_open(const char *path);
+
+/*
+ * Decode up to max records of a trace into addresses and is_write (which may
+ * be NULL). Returns the number of records decoded, which is only less than
+ * max at the end of the trace, if the file is malformed or if a chunk cannot
+ * be inflated for lack of memory; check cache_trace_failed to tell them
+ * apart, and cache_trace_out_of_memory for the last.
+ */
+size_t cache_trace_next(cache_trace_t *trace, uintptr_t *addresses, uint8_t *is_write, size_t max);
+
+/*
+ * Return whether a malformed chunk was found, or memory ran out.
+ */
+bool cache_trace_failed(cache_trace_t *trace);
+
+/*
+ * Return whether memory ran out while decoding or replaying the trace.
+ */
+bool cache_trace_out_of_memory(cache_trace_t *trace);
+
+/*
+ * Unmap the trace file and free the reader.
+ */
+void cache_trace_close(cache_trace_t *trace);
+
+/*
+ * Simulate every access of a trace on the given cache, in batches of
+ * CACHE_TRACE_CHUNK_RECORDS. Returns the number of accesses simulated.
+ */
+size_t cache_trace_replay(cache_trace_t *trace, cache_t *cache, func_t generate_random_number);
+
+#endif
@@ -0,0 +1,44 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "coro.hpp"
+
+#define NUM_PROCESSORS 4
+
+unsigned int sum = 0;
+coro::mutex  sum_mutex;
+
+/**
+ * Read one block and add it to sum; the coroutine waits for the read, instead of a uthread
+ */
+coro::task read_block (int blockno) {
+  int result;
+  co_await coro::read (blockno, &result);
+  co_await sum_mutex.lock();
+    sum += result;
+  sum_mutex.unlock();
+}
+
+int main (int argc, char** argv) {
+
+  // Command Line Arguments
+  static const char* usage = "usage: cRead num_blocks";
+  int num_blocks;
+  char *endptr;
+  if (argc == 2)
+    num_blocks = strtol (argv [1], &endptr, 10);
+  if (argc != 2 || *endptr != 0) {
+    printf ("argument error - %s \n", usage);
+    return EXIT_FAILURE;
+  }
+
+  // Initialize
+  uthread_init (NUM_PROCESSORS);
+  disk_start (NULL);
+
+  // Sum Blocks, with every read in flight at once
+  coro::group readers;
+  for (int blockno = 0; blockno < num_blocks; blockno++)
+    readers.spawn (read_block (blockno), blockno % NUM_PROCESSORS);
+  readers.wait();
+  printf ("%d\n", sum);
+}
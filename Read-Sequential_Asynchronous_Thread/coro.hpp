@@ -0,0 +1,328 @@
+#ifndef __coro_hpp__
+#define __coro_hpp__
+
+//
+// Stackless coroutines (C++20) over the uthread virtual processors and the disk
+//
+// A coroutine returns coro::task and is started by coro::spawn on a virtual processor.
+// It runs there, as work of the processor (see uthread_run_on), until it co_awaits a read,
+// a mutex or a semaphore; when that completes, it is resumed on the same processor. Its
+// frame is the only memory it needs, instead of the stack of a uthread, so any number of
+// coroutines may be waiting at once. Coroutines must not call anything that blocks the
+// uthread they run on (uthread_block, uthread_join, uthread_mutex_lock ...): co_await
+// the mutexes and semaphores of this file instead.
+//
+
+#include <coroutine>
+#include <exception>
+
+extern "C" {
+#include "uthread.h"
+#include "uthread_util.h"
+#include "spinlock.h"
+#include "disk.h"
+}
+
+namespace coro {
+
+class group;
+
+/**
+ * Resume a suspended coroutine on a virtual processor
+ */
+inline void resume_work (void* address) {
+  std::coroutine_handle<>::from_address (address).resume();
+}
+
+inline void resume_on (int processor, struct uthread_work* work, std::coroutine_handle<> handle) {
+  work->proc = resume_work;
+  work->arg  = handle.address();
+  uthread_run_on (processor, work);
+}
+
+/**
+ * The processor of the caller, or 0 if it is not a virtual processor
+ */
+inline int this_processor () {
+  int processor = uthread_processor();
+  return processor < 0 ? 0 : processor;
+}
+
+/**
+ * A coroutine started by spawn, whose frame is freed when it returns
+ */
+class task {
+public:
+  struct promise_type {
+    struct uthread_work work;
+    group*              owner = nullptr;
+
+    task                get_return_object   () { return task (std::coroutine_handle<promise_type>::from_promise (*this)); }
+    std::suspend_always initial_suspend     () noexcept { return {}; }
+    void                return_void         () {}
+    void                unhandled_exception () { std::terminate(); }
+
+    struct final_awaiter {
+      bool await_ready  () noexcept { return false; }
+      void await_suspend (std::coroutine_handle<promise_type> handle) noexcept;
+      void await_resume () noexcept {}
+    };
+    final_awaiter       final_suspend       () noexcept { return {}; }
+  };
+
+  task (task&& other) noexcept : handle (other.handle) { other.handle = nullptr; }
+  ~task () { if (handle) handle.destroy(); }
+
+private:
+  explicit task (std::coroutine_handle<promise_type> h) : handle (h) {}
+  std::coroutine_handle<promise_type> handle;
+
+  friend void spawn (task t, int processor);
+  friend class group;
+};
+
+/**
+ * Start a coroutine on virtual processor processor (-1 for the caller's)
+ */
+inline void spawn (task t, int processor = -1) {
+  auto handle  = t.handle;
+  t.handle     = nullptr;
+  resume_on (processor < 0 ? this_processor() : processor, &handle.promise().work, handle);
+}
+
+/**
+ * Coroutines that a uthread waits for
+ *    wait blocks the calling uthread until every coroutine spawned in the group has returned;
+ *    it is called once, by the uthread that spawns them
+ */
+class group {
+public:
+  void spawn (task t, int processor = -1) {
+    __atomic_add_fetch (&pending, 1, __ATOMIC_RELAXED);
+    t.handle.promise().owner = this;
+    coro::spawn (static_cast<task&&> (t), processor);
+  }
+
+  void wait () {
+    waiter = uthread_self();
+    if (__atomic_sub_fetch (&pending, 1, __ATOMIC_ACQ_REL) == 0)
+      return;
+    // a wake-up that is not done's returns from uthread_block too
+    while (! __atomic_load_n (&finished, __ATOMIC_ACQUIRE))
+      uthread_block();
+  }
+
+  void done () {
+    if (__atomic_sub_fetch (&pending, 1, __ATOMIC_ACQ_REL) == 0) {
+      // wait may return, and the group go, as soon as finished is set
+      uthread_t thread = waiter;
+      __atomic_store_n (&finished, true, __ATOMIC_RELEASE);
+      uthread_unblock (thread);
+    }
+  }
+
+private:
+  volatile long pending  = 1;  // and one until wait
+  volatile bool finished = false;
+  uthread_t     waiter   = nullptr;
+};
+
+inline void task::promise_type::final_awaiter::await_suspend (std::coroutine_handle<promise_type> handle) noexcept {
+  group* owner = handle.promise().owner;
+  handle.destroy();
+  if (owner)
+    owner->done();
+}
+
+/**
+ * co_await read (blockno, buf) reads the integer in block blockno into *buf
+ */
+class read {
+public:
+  read (int blockno, int* buf) : request {buf, blockno} {}
+
+  bool await_ready   () { return false; }
+  void await_suspend (std::coroutine_handle<> h) {
+    handle    = h;
+    processor = this_processor();
+    disk_schedule_readv (&request, 1, done, nullptr, this);
+  }
+  void await_resume  () {}
+
+private:
+  static void done (const struct disk_read*, void* arg) {
+    read* self = static_cast<read*> (arg);
+    resume_on (self->processor, &self->work, self->handle);
+  }
+
+  struct disk_read        request;
+  struct uthread_work     work;
+  std::coroutine_handle<> handle;
+  int                     processor;
+};
+
+/**
+ * co_await switch_to (processor) moves the coroutine to virtual processor processor
+ */
+class switch_to {
+public:
+  explicit switch_to (int p) : processor (p) {}
+
+  bool await_ready   () { return processor == uthread_processor(); }
+  void await_suspend (std::coroutine_handle<> h) { resume_on (processor, &work, h); }
+  void await_resume  () {}
+
+private:
+  struct uthread_work work;
+  int                 processor;
+};
+
+/**
+ * A coroutine waiting for a mutex or a semaphore, which resumes it on its own processor
+ */
+struct waiter {
+  struct uthread_work     work;
+  std::coroutine_handle<> handle;
+  int                     processor;
+  waiter*                 next;
+};
+
+/**
+ * Waiters in the order they started waiting
+ */
+struct waiter_list {
+  waiter* head = nullptr;
+  waiter* tail = nullptr;
+
+  void push (waiter* w) {
+    w->next = nullptr;
+    if (tail) tail->next = w;
+    else      head       = w;
+    tail = w;
+  }
+
+  waiter* pop () {
+    waiter* w = head;
+    if (w && ! (head = w->next))
+      tail = nullptr;
+    return w;
+  }
+};
+
+/**
+ * A mutex that coroutines co_await: co_await m.lock(), then m.unlock()
+ *    unlock hands the mutex to the coroutine that has waited longest, if any
+ *
+ * This and semaphore do not wrap uthread_mutex_t and uthread_sem_t: those queue the
+ * uthread that waits, and block it, and a coroutine has none of its own. The processor
+ * work it runs as must not block, and a mutex is held by the uthread that locked it, so
+ * an awaitable over them would need a uthread, and its stack, per waiter or holder.
+ * These queue the coroutine's frame instead; they are not shared with uthread code.
+ */
+class mutex {
+public:
+  mutex () { spinlock_create (&spinlock); }
+
+  class lock_awaiter : waiter {
+  public:
+    bool await_ready   () { return m.try_lock(); }
+    bool await_suspend (std::coroutine_handle<> h) {
+      handle    = h;
+      processor = this_processor();
+      spinlock_lock (&m.spinlock);
+        bool wait = m.locked;
+        if (wait) m.waiters.push (this);
+        else      m.locked = true;
+      spinlock_unlock (&m.spinlock);
+      return wait;
+    }
+    void await_resume  () {}
+
+  private:
+    explicit lock_awaiter (mutex& mx) : m (mx) {}
+    mutex& m;
+    friend class mutex;
+  };
+
+  lock_awaiter lock () { return lock_awaiter (*this); }
+
+  bool try_lock () {
+    spinlock_lock (&spinlock);
+      bool acquired = ! locked;
+      locked        = true;
+    spinlock_unlock (&spinlock);
+    return acquired;
+  }
+
+  void unlock () {
+    spinlock_lock (&spinlock);
+      waiter* w = waiters.pop();
+      if (! w) locked = false;
+    spinlock_unlock (&spinlock);
+    if (w)
+      resume_on (w->processor, &w->work, w->handle);
+  }
+
+private:
+  spinlock_t  spinlock;
+  bool        locked = false;
+  waiter_list waiters;
+};
+
+/**
+ * A counting semaphore that coroutines co_await: co_await s.acquire(), and s.release()
+ *    release hands its unit to the coroutine that has waited longest, if any
+ */
+class semaphore {
+public:
+  explicit semaphore (int initial) : count (initial) { spinlock_create (&spinlock); }
+
+  class acquire_awaiter : waiter {
+  public:
+    bool await_ready   () { return s.try_acquire(); }
+    bool await_suspend (std::coroutine_handle<> h) {
+      handle    = h;
+      processor = this_processor();
+      spinlock_lock (&s.spinlock);
+        bool wait = s.count == 0;
+        if (wait) s.waiters.push (this);
+        else      s.count -= 1;
+      spinlock_unlock (&s.spinlock);
+      return wait;
+    }
+    void await_resume  () {}
+
+  private:
+    explicit acquire_awaiter (semaphore& sm) : s (sm) {}
+    semaphore& s;
+    friend class semaphore;
+  };
+
+  acquire_awaiter acquire () { return acquire_awaiter (*this); }
+
+  bool try_acquire () {
+    spinlock_lock (&spinlock);
+      bool acquired = count > 0;
+      if (acquired) count -= 1;
+    spinlock_unlock (&spinlock);
+    return acquired;
+  }
+
+  void release () {
+    spinlock_lock (&spinlock);
+      waiter* w = waiters.pop();
+      if (! w) count += 1;
+    spinlock_unlock (&spinlock);
+    if (w)
+      resume_on (w->processor, &w->work, w->handle);
+  }
+
+private:
+  spinlock_t  spinlock;
+  int         count;
+  waiter_list waiters;
+};
+
+}
+
+#endif
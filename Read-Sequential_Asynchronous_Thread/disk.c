@@ -5,6 +5,18 @@
 #include <string.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#if __linux__
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "spinlock.h"
 #include "uthread.h"
 #include "uthread_util.h"
@@ -16,80 +28,370 @@
 const int TIMER_SIGNO = SIGALRM;
 sigset_t  TIMER_SIGSET;
 
-spinlock_t prq_mutex = 0;
+void (*isr)       (void);
+void (*isrTagged) (int*, int);
 
-void (*isr) (void);
+struct disk_config config = {0, 0, DISK_LATENCY_FIXED, READ_LATENCY_USEC, 0, 0.0, 0, DISK_COMPLETION_SIGNAL, NULL, 0};
 
-void tm_add (struct timeval* tm, int usec) {
-  tm->tv_usec += usec;
-  if (tm->tv_usec > 1000*1000) {
-    tm->tv_sec  += 1;
-    tm->tv_usec -= 1000*1000;
-  } else if (tm->tv_usec < 0) {
-    tm->tv_sec  -= 1;
-    tm->tv_usec += 1000*1000;
+uint64_t now_nsec () {
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+//
+// MEMORY
+//
+// Completions run in a signal handler with DISK_COMPLETION_SIGNAL, and their routines
+// may schedule more reads, so neither path may call malloc or free. Batches, pending
+// reads and waits for buffers are carved from regions that are mmapped, which is a
+// system call and so may be made in a handler, and are recycled on free lists, under
+// spinlocks that defer the handler while they are held; they are never unmapped.
+//
+
+#define DISK_REGION_BYTES (64 * 1024)
+#define BATCH_CLASSES     32         // batches of class c hold up to 1 << c reads
+
+void* diskAlloc (size_t size) {
+  void* p = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    printf ("DISK mmap: %s\n", strerror (errno));
+    exit (EXIT_FAILURE);
   }
+  return p;
 }
 
-int tm_compare (struct timeval* a, struct timeval* b) {
-  if (a->tv_sec < b->tv_sec)
-    return -1;
-  else if (a->tv_sec > b->tv_sec)
-    return 1;
-  else if (a->tv_usec < b->tv_usec)
-    return -1;
-  else if (a->tv_usec > b->tv_usec)
-    return 1;
-  else
-    return 0;
+/**
+ * Move the used bytes of an mmapped array to a new one of size bytes, and unmap the old one
+ */
+void* diskGrow (void* old, size_t used, size_t oldSize, size_t size) {
+  void* p = diskAlloc (size);
+  if (old != NULL) {
+    memcpy (p, old, used);
+    munmap (old, oldSize);
+  }
+  return p;
 }
 
+/**
+ * Carve a region into objects of size bytes, linked through their first word, onto *free
+ */
+void diskCarve (void** free, size_t size) {
+  size_t length = size > DISK_REGION_BYTES ? size : DISK_REGION_BYTES;
+  char*  region = diskAlloc (length);
+  for (size_t offset = 0; offset + size <= length; offset += size) {
+    *(void**) (region + offset) = *free;
+    *free                       = region + offset;
+  }
+}
+
+struct ReadBatch {
+  struct ReadBatch* next;            // on a free list
+  int               sizeClass;
+  int               pendingRuns;
+  void            (*requestDone) (const struct disk_read*, void*);
+  void            (*batchDone)   (void*);
+  void*             arg;
+  struct iovec*     iov;             // for the vectored reads of a file, after the reads
+  struct disk_read  reads [];
+};
+
+spinlock_t        batchMutex;
+struct ReadBatch* batchFree [BATCH_CLASSES];
+
+size_t batchSize (int sizeClass) {
+  return sizeof (struct ReadBatch) + ((size_t) 1 << sizeClass) * (sizeof (struct disk_read) + sizeof (struct iovec));
+}
+
+struct ReadBatch* batchAlloc (int n) {
+  struct ReadBatch* batch;
+  int               sizeClass = 0;
+  while (((size_t) 1 << sizeClass) < (size_t) n)
+    sizeClass += 1;
+  spinlock_lock (&batchMutex);
+    if (batchFree [sizeClass] == NULL)
+      diskCarve ((void**) &batchFree [sizeClass], batchSize (sizeClass));
+    batch                 = batchFree [sizeClass];
+    batchFree [sizeClass] = batch->next;
+  spinlock_unlock (&batchMutex);
+  batch->sizeClass = sizeClass;
+  batch->iov       = (struct iovec*) &batch->reads [(size_t) 1 << sizeClass];
+  return batch;
+}
+
+void batchFreeOne (struct ReadBatch* batch) {
+  spinlock_lock (&batchMutex);
+    batch->next                  = batchFree [batch->sizeClass];
+    batchFree [batch->sizeClass] = batch;
+  spinlock_unlock (&batchMutex);
+}
+
+/**
+ * A pending read is one block, or a run of consecutive blocks of a batch
+ */
 struct PendingRead {
+  struct PendingRead* next;          // first, to be linked on a free list
   int*                buf;
   int                 blockNo;
-  struct timeval      completeTime;
-  struct PendingRead* prev,
-                    * next;
-} *prq_front = NULL,
-  *prq_back  = NULL,
-  *prq_free  = NULL;
-
-void prq_enqueue (int* buf, int blockNo) {
-  spinlock_lock (&prq_mutex);
-    struct PendingRead* pr;
-    if (prq_free != NULL) {
-      pr       = prq_free;
-      prq_free = prq_free->next;
-    } else
-      pr = malloc (sizeof (struct PendingRead));
-    pr->buf      = buf;
-    pr->blockNo  = blockNo;
-    gettimeofday (& pr ->completeTime, NULL);
-    tm_add       (& pr ->completeTime, READ_LATENCY_USEC);
-    pr->prev     = NULL;
-    pr->next     = prq_back;
-    if (prq_back == NULL)
-      prq_back = (prq_front = pr);
-    else {
-      prq_back->prev = pr;
-      prq_back       = pr;
+  struct ReadBatch*   batch;         // NULL for a single read
+  int                 first,         // the run is batch->reads [first .. first+count-1]
+                      count;
+  uint64_t            completeTime;
+  unsigned long       seq;           // orders reads that complete at the same time
+};
+
+/**
+ * A pending read from a free list, which is refilled from a new region when empty
+ */
+struct PendingRead* prAlloc (struct PendingRead** free) {
+  struct PendingRead* pr;
+  if (*free == NULL)
+    diskCarve ((void**) free, sizeof (struct PendingRead));
+  pr    = *free;
+  *free = pr->next;
+  return pr;
+}
+
+/**
+ * Each hardware queue has its own lock, and a virtual processor submits to its own queue
+ *    reads in flight are kept in a min-heap ordered by completion time, which has room for
+ *    queue_depth from the start; once that many are in flight, further reads wait in the
+ *    submission ring, in order, until completions make room. The heap stands in for a
+ *    completion ring: an interrupt takes all the reads that are due off it at once.
+ */
+struct DiskQueue {
+  spinlock_t           mutex;
+  struct PendingRead** heap;
+  int                  length,
+                       capacity;
+  struct PendingRead** ring;         // submission ring
+  unsigned long        ringHead,
+                       ringTail;
+  unsigned long        ringCapacity; // a power of two
+  struct PendingRead*  free;
+  unsigned long        seq;
+  uint64_t             busyUntil;    // when the transfers queued so far end, with a bandwidth cap
+  int                  head,         // where the head stopped, and the direction it sweeps in,
+                       direction;    // for DISK_ELEVATOR
+  unsigned int         seed;
+} __attribute__ ((aligned (64)));
+
+struct DiskQueue* queues;
+int               numQueues;
+int               disk_policy = DISK_FIFO;
+uint64_t          nsecPerBlock;      // of a queue's share of the bandwidth cap
+volatile uint64_t nextDue = UINT64_MAX;
+#if __linux__
+timer_t           timer;
+int               timerFd = -1;      // with DISK_COMPLETION_THREAD
+#endif
+
+int prq_before (struct PendingRead* a, struct PendingRead* b) {
+  return a->completeTime < b->completeTime || (a->completeTime == b->completeTime && a->seq < b->seq);
+}
+
+void prq_swap (struct DiskQueue* q, int i, int j) {
+  struct PendingRead* pr = q->heap [i];
+  q->heap [i] = q->heap [j];
+  q->heap [j] = pr;
+}
+
+/**
+ * A latency drawn from the configured distribution
+ */
+uint64_t sample_latency_nsec (struct DiskQueue* q) {
+  double latency = config.latency_usec;
+  double u1, u2;
+  switch (config.latency_model) {
+    case DISK_LATENCY_UNIFORM:
+      latency += ((double) rand_r (&q->seed) / RAND_MAX * 2 - 1) * config.latency_spread_usec;
+      break;
+    case DISK_LATENCY_LOGNORMAL:
+      // Box-Muller for a standard normal, around the median latency_usec
+      u1 = ((double) rand_r (&q->seed) + 1) / ((double) RAND_MAX + 1);
+      u2 = (double) rand_r (&q->seed) / RAND_MAX;
+      latency *= exp (config.latency_sigma * sqrt (-2 * log (u1)) * cos (2 * M_PI * u2));
+      break;
+  }
+  return latency > 0 ? (uint64_t) (latency * 1000) : 0;
+}
+
+/**
+ * Put a read in flight, now
+ */
+void prq_start_lock_held (struct DiskQueue* q, struct PendingRead* pr, uint64_t now) {
+  uint64_t ready = now + sample_latency_nsec (q);
+  if (nsecPerBlock) {
+    if (ready < q->busyUntil)
+      ready = q->busyUntil;
+    ready        += pr->count * nsecPerBlock;
+    q->busyUntil  = ready;
+  }
+  pr->completeTime = ready;
+  // only without a queue depth, as the heap starts with room for it
+  if (q->length == q->capacity) {
+    q->heap      = diskGrow (q->heap, q->length * sizeof (struct PendingRead*), q->capacity * sizeof (struct PendingRead*),
+                             q->capacity * 2 * sizeof (struct PendingRead*));
+    q->capacity *= 2;
+  }
+  int i = q->length++;
+  q->heap [i] = pr;
+  for (; i > 0 && prq_before (q->heap [i], q->heap [(i - 1) / 2]); i = (i - 1) / 2)
+    prq_swap (q, i, (i - 1) / 2);
+}
+
+void prq_enqueue_lock_held (struct DiskQueue* q, int* buf, int blockNo, struct ReadBatch* batch, int first, int count, uint64_t now) {
+  struct PendingRead* pr = prAlloc (&q->free);
+  pr->buf     = buf;
+  pr->blockNo = blockNo;
+  pr->batch   = batch;
+  pr->first   = first;
+  pr->count   = count;
+  pr->seq     = q->seq++;
+  pr->next    = NULL;
+  if (config.queue_depth == 0 || (q->length < config.queue_depth && q->ringHead == q->ringTail))
+    prq_start_lock_held (q, pr, now);
+  else {
+    if (q->ringTail - q->ringHead == q->ringCapacity) {
+      struct PendingRead** ring = diskAlloc (q->ringCapacity * 2 * sizeof (struct PendingRead*));
+      for (unsigned long i = q->ringHead; i < q->ringTail; i++)
+        ring [i & (q->ringCapacity * 2 - 1)] = q->ring [i & (q->ringCapacity - 1)];
+      munmap (q->ring, q->ringCapacity * sizeof (struct PendingRead*));
+      q->ring          = ring;
+      q->ringCapacity *= 2;
     }
-  spinlock_unlock (&prq_mutex);
+    q->ring [q->ringTail++ & (q->ringCapacity - 1)] = pr;
+  }
 }
 
-void prq_dequeue_lock_held () {
-  if (prq_front != NULL) {
-    struct PendingRead* pr = prq_front;
-    prq_front = pr->prev;
-    if (prq_front == NULL)
-      prq_back = NULL;
-    pr->next = prq_free;
-    prq_free = pr;
+struct PendingRead* prq_dequeue_lock_held (struct DiskQueue* q) {
+  struct PendingRead* pr = q->heap [0];
+  q->heap [0] = q->heap [--q->length];
+  for (int i = 0, child; (child = 2 * i + 1) < q->length; i = child) {
+    if (child + 1 < q->length && prq_before (q->heap [child + 1], q->heap [child]))
+      child += 1;
+    if (! prq_before (q->heap [child], q->heap [i]))
+      break;
+    prq_swap (q, i, child);
   }
+  return pr;
+}
+
+/**
+ * The distance the head travels to reach blockNo in its sweep, turning around once
+ */
+long elevator_distance (struct DiskQueue* q, int blockNo) {
+  long ahead = (long) (blockNo - q->head) * q->direction;
+  return ahead >= 0 ? ahead : (long) INT32_MAX * 2 - ahead;
+}
+
+/**
+ * Remove the reads that are due at now, linked in the order they are to be served:
+ * by completion time, or along the sweep of the head with DISK_ELEVATOR; then start
+ * waiting reads in the room they leave
+ */
+struct PendingRead* prq_dequeue_due_lock_held (struct DiskQueue* q, uint64_t now) {
+  struct PendingRead* due = NULL, ** link = &due;
+  while (q->length > 0 && q->heap [0]->completeTime <= now) {
+    struct PendingRead* pr = prq_dequeue_lock_held (q);
+    if (disk_policy == DISK_ELEVATOR)
+      for (link = &due; *link && elevator_distance (q, (*link)->blockNo) <= elevator_distance (q, pr->blockNo); link = &(*link)->next) ;
+    pr->next = *link;
+    *link    = pr;
+    link     = &pr->next;
+  }
+  if (disk_policy == DISK_ELEVATOR && due != NULL) {
+    struct PendingRead* last;
+    for (last = due; last->next; last = last->next) ;
+    if ((long) (last->blockNo - q->head) * q->direction < 0)
+      q->direction = - q->direction;
+    q->head = last->blockNo;
+  }
+  while (q->ringHead != q->ringTail && q->length < config.queue_depth)
+    prq_start_lock_held (q, q->ring [q->ringHead++ & (q->ringCapacity - 1)], now);
+  return due;
+}
+
+/**
+ * Make sure that the timer goes off by time due
+ */
+void timer_arm (uint64_t due) {
+  uint64_t armed = nextDue;
+  while (due < armed)
+    if (__atomic_compare_exchange_n (&nextDue, &armed, due, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+#if __linux__
+      // if an earlier time was set meanwhile, set it again after us
+      do {
+        struct itimerspec when = {{0, 0}, {due / 1000000000, due % 1000000000}};
+        if (timerFd >= 0)
+          timerfd_settime (timerFd, TFD_TIMER_ABSTIME, &when, NULL);
+        else
+          timer_settime (timer, TIMER_ABSTIME, &when, NULL);
+      } while ((armed = nextDue) < due && (due = armed));
+#endif
+      return;
+    }
+}
+
+int    fileFd = -1;
+size_t blockSize;
+void   fileSchedule (int* buf, int blockNo, struct ReadBatch* batch, int n);
+
+struct DiskQueue* queue_self () {
+  int processor = uthread_processor();
+  // a completion thread, that schedules reads from its routines, is not a processor
+  return &queues [processor < 0 ? 0 : processor % numQueues];
 }
 
 void disk_schedule_read (int* resultBuf, int blockNo) {
-  prq_enqueue (resultBuf, blockNo);
+  struct DiskQueue* q;
+  uint64_t          now, due;
+  uthread_trace ("disk read", 'b', (unsigned long) resultBuf);
+  if (fileFd >= 0) {
+    fileSchedule (resultBuf, blockNo, NULL, 1);
+    return;
+  }
+  q   = queue_self();
+  now = now_nsec();
+  spinlock_lock (&q->mutex);
+    prq_enqueue_lock_held (q, resultBuf, blockNo, NULL, 0, 1, now);
+    due = q->heap [0]->completeTime;
+  spinlock_unlock (&q->mutex);
+  timer_arm (due);
+}
+
+void disk_schedule_readv (const struct disk_read* reads, int n,
+                          void (*requestDone) (const struct disk_read*, void*),
+                          void (*batchDone)   (void*),
+                          void* arg) {
+  struct DiskQueue* q;
+  struct ReadBatch* batch;
+  uint64_t          now, due;
+  int               first, count;
+  if (n <= 0)
+    return;
+  batch = batchAlloc (n);
+  memcpy (batch->reads, reads, n * sizeof (struct disk_read));
+  batch->requestDone = requestDone;
+  batch->batchDone   = batchDone;
+  batch->arg         = arg;
+  batch->pendingRuns = 0;
+  uthread_trace ("disk readv", 'b', (unsigned long) batch);
+  if (fileFd >= 0) {
+    fileSchedule (NULL, 0, batch, n);
+    return;
+  }
+  q   = queue_self();
+  now = now_nsec();
+  spinlock_lock (&q->mutex);
+    for (first = 0; first < n; first += count) {
+      for (count = 1; first + count < n && reads [first + count].blockno == reads [first + count - 1].blockno + 1; count++) ;
+      prq_enqueue_lock_held (q, NULL, reads [first].blockno, batch, first, count, now);
+      batch->pendingRuns += 1;  // no run completes before the queue's mutex is released
+    }
+    due = q->heap [0]->completeTime;
+  spinlock_unlock (&q->mutex);
+  timer_arm (due);
 }
 
 int story[] = {10,22,40,30,17,3,19,20,15,31,3,4,5,7,2,7,5,15,12,8,13,17,19,20,41,32,41,12,1,0,30};
@@ -98,30 +400,459 @@ void performDMA (int* buf, int blockno) {
   *buf = story [blockno % (sizeof(story) / sizeof(story[0]))];
 }
 
-void deliverInterrupt() {
+/**
+ * One DMA for a run of reads of consecutive blocks
+ */
+void performDMAv (const struct disk_read* reads, int count) {
+  for (int i = 0; i < count; i++)
+    performDMA (reads [i].buf, reads [i].blockno);
+}
+
+void deliverInterrupt (int* buf, int blockNo) {
   uthread_setInterrupt (1);
-  if (isr) isr();
+  if (isrTagged) isrTagged (buf, blockNo);
+  else if (isr)  isr();
   uthread_setInterrupt (0);
 }
 
+/**
+ * Complete the reads of a run of a batch, after its DMA
+ */
+void deliverBatchInterrupt (struct ReadBatch* batch, int first, int count) {
+  if (batch->requestDone == NULL && batch->batchDone == NULL) {
+    for (int i = first; i < first + count; i++)
+      deliverInterrupt (batch->reads [i].buf, batch->reads [i].blockno);
+  } else {
+    uthread_setInterrupt (1);
+    if (batch->requestDone)
+      for (int i = first; i < first + count; i++)
+        batch->requestDone (&batch->reads [i], batch->arg);
+    uthread_setInterrupt (0);
+  }
+  if (__atomic_sub_fetch (&batch->pendingRuns, 1, __ATOMIC_ACQ_REL) == 0) {
+    uthread_trace ("disk readv", 'e', (unsigned long) batch);
+    if (batch->batchDone) {
+      uthread_setInterrupt (1);
+      batch->batchDone (batch->arg);
+      uthread_setInterrupt (0);
+    }
+    batchFreeOne (batch);
+  }
+}
+
+/**
+ * Complete the reads of a queue that are due at now, and lower *next to the time of its next one
+ */
+void completeQueue (struct DiskQueue* q, uint64_t now, uint64_t* next) {
+  struct PendingRead* due, * last = NULL;
+  spinlock_lock (&q->mutex);
+    due = prq_dequeue_due_lock_held (q, now);
+  spinlock_unlock (&q->mutex);
+  for (struct PendingRead* pr = due; pr != NULL; pr = pr->next) {
+    if (pr->batch == NULL) {
+      performDMA       (pr->buf, pr->blockNo);
+      uthread_trace    ("disk read", 'e', (unsigned long) pr->buf);
+      deliverInterrupt (pr->buf, pr->blockNo);
+    } else {
+      performDMAv           (&pr->batch->reads [pr->first], pr->count);
+      deliverBatchInterrupt (pr->batch, pr->first, pr->count);
+    }
+    last = pr;
+  }
+  spinlock_lock (&q->mutex);
+    if (last != NULL) {
+      last->next = q->free;
+      q->free    = due;
+    }
+    if (q->length > 0 && q->heap [0]->completeTime < *next)
+      *next = q->heap [0]->completeTime;
+  spinlock_unlock (&q->mutex);
+}
+
+/**
+ * Complete the reads that are due, and set the timer for the next one
+ */
+void completeDue () {
+  uint64_t now, next = UINT64_MAX;
+  // reads scheduled from now on set the timer themselves
+  __atomic_store_n (&nextDue, UINT64_MAX, __ATOMIC_SEQ_CST);
+  now = now_nsec();
+  for (int i = 0; i < numQueues; i++)
+    completeQueue (&queues [i], now, &next);
+  timer_arm (next);
+}
+
 void handleTimerInterrupt (int signo, siginfo_t* info, void* uap) {
-  struct timeval now;
-  gettimeofday (&now, NULL);
-  
-  spinlock_lock (&prq_mutex);
-    while (prq_front != NULL && tm_compare (&prq_front->completeTime, &now) <= 0) {
-      performDMA       (prq_front->buf, prq_front->blockNo);
-      prq_dequeue_lock_held();
-      spinlock_unlock (&prq_mutex);
-      deliverInterrupt ();
-      spinlock_lock (&prq_mutex);
+  if (spinlock_signal_deferred (signo))
+    return;
+  completeDue();
+}
+
+#if __linux__
+/**
+ * The completion thread, with DISK_COMPLETION_THREAD
+ *    sleeps on the timer file until the next completion is due; it is not one of the
+ *    uthread processors, so the threads its interrupt service routines unblock run on them
+ */
+void* completionThread (void* arg) {
+  uint64_t expirations;
+  while (1)
+    if (read (timerFd, &expirations, sizeof (expirations)) == sizeof (expirations))
+      completeDue();
+  return NULL;
+}
+
+#endif
+
+/**
+ * Start a pthread that completes reads
+ *    it takes no signals, so that the processors' handlers stay on the processors
+ */
+void threadStart (void* (*proc) (void*), void* arg) {
+  pthread_t thread;
+  sigset_t  all, old;
+  sigfillset      (&all);
+  pthread_sigmask (SIG_BLOCK, &all, &old);
+  int err = pthread_create (&thread, NULL, proc, arg);
+  pthread_sigmask (SIG_SETMASK, &old, NULL);
+  if (err) {
+    printf ("DISK pthread_create: %s\n", strerror (err));
+    exit (EXIT_FAILURE);
+  }
+  pthread_detach (thread);
+}
+
+#if __linux__
+void completionThreadStart () {
+  timerFd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timerFd == -1) {
+    printf ("DISK timerfd_create: %s\n", strerror (errno));
+    exit (EXIT_FAILURE);
+  }
+  threadStart (completionThread, NULL);
+}
+#endif
+
+//
+// FILE BACKEND
+//
+// With a path, a block is block_size bytes of the file at blockno * block_size,
+// and past its end reads zeros. On Linux reads go through an io_uring: they are
+// added to its submission queue under fileMutex and started with one system
+// call per schedule, and a completion thread reaps all the completions it finds
+// at each wake-up. Reads that find the queue full wait on a backlog that the
+// completion thread submits as room frees up, so that no one ever waits for a
+// slot, not even a routine that schedules a read from a completion. Elsewhere,
+// or without io_uring in the kernel, a pool of threads serves the reads with
+// preadv. A run of consecutive blocks of a batch is one vectored read.
+//
+
+#define FILE_MAX_RUN          1024   // iovecs in one read
+#define FILE_DEFAULT_ENTRIES  256
+#define FILE_DEFAULT_THREADS  4
+
+spinlock_t          fileMutex;
+struct PendingRead* fileFree;
+
+/**
+ * Complete a read of the file, that returned bytes or -errno
+ */
+void fileComplete (struct PendingRead* pr, long bytes) {
+  struct iovec  one = {pr->buf, blockSize};
+  struct iovec* iov = pr->batch ? &pr->batch->iov [pr->first] : &one;
+  if (bytes < 0) {
+    printf ("DISK read of block %d: %s\n", pr->blockNo, strerror (- bytes));
+    exit (EXIT_FAILURE);
+  }
+  for (int i = 0; i < pr->count; i++) {
+    if ((size_t) bytes < iov [i].iov_len)
+      memset ((char*) iov [i].iov_base + bytes, 0, iov [i].iov_len - bytes);
+    bytes = (size_t) bytes > iov [i].iov_len ? bytes - (long) iov [i].iov_len : 0;
+  }
+  if (pr->batch == NULL) {
+    uthread_trace    ("disk read", 'e', (unsigned long) pr->buf);
+    deliverInterrupt (pr->buf, pr->blockNo);
+  } else
+    deliverBatchInterrupt (pr->batch, pr->first, pr->count);
+  spinlock_lock (&fileMutex);
+    pr->next = fileFree;
+    fileFree = pr;
+  spinlock_unlock (&fileMutex);
+}
+
+#if __linux__
+struct {
+  int                  fd;
+  unsigned             entries;
+  volatile unsigned*   sqHead, * sqTail, * cqHead, * cqTail;
+  unsigned*            sqMask, * sqArray, * cqMask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+  unsigned             inFlight;     // submitted and not reaped, at most entries
+  struct PendingRead*  backlog, ** backlogTail;
+  void*                fixed;        // the registered buffers
+  size_t               fixedLength;
+} uring = {-1};
+
+/**
+ * Add the read to the submission queue, or to the backlog if it is full
+ *    returns the number of reads added to the queue
+ */
+int uringQueue_lock_held (struct PendingRead* pr) {
+  if (uring.inFlight == uring.entries) {
+    pr->next           = NULL;
+    *uring.backlogTail = pr;
+    uring.backlogTail  = &pr->next;
+    return 0;
+  }
+  unsigned             tail = *uring.sqTail, index = tail & *uring.sqMask;
+  struct io_uring_sqe* sqe  = &uring.sqes [index];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->fd        = fileFd;
+  sqe->off       = (uint64_t) pr->blockNo * blockSize;
+  sqe->user_data = (uintptr_t) pr;
+  if (pr->count > 1) {
+    sqe->opcode = IORING_OP_READV;
+    sqe->addr   = (uintptr_t) &pr->batch->iov [pr->first];
+    sqe->len    = pr->count;
+  } else {
+    char* buf = pr->batch ? pr->batch->iov [pr->first].iov_base : (char*) pr->buf;
+    sqe->addr   = (uintptr_t) buf;
+    sqe->len    = blockSize;
+    if (buf >= (char*) uring.fixed && buf + blockSize <= (char*) uring.fixed + uring.fixedLength)
+      sqe->opcode = IORING_OP_READ_FIXED;  // buf_index 0
+    else
+      sqe->opcode = IORING_OP_READ;
+  }
+  uring.sqArray [index] = index;
+  uring.inFlight       += 1;
+  __atomic_store_n (uring.sqTail, tail + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+long uringEnter (unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  return syscall (__NR_io_uring_enter, uring.fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+/**
+ * The completion thread of the io_uring
+ */
+void* uringReaper (void* arg) {
+  unsigned toSubmit = 0, head, tail, reaped;
+  while (1) {
+    uringEnter (toSubmit, 1, IORING_ENTER_GETEVENTS);
+    head = *uring.cqHead;
+    tail = __atomic_load_n (uring.cqTail, __ATOMIC_ACQUIRE);
+    for (reaped = 0; head != tail; head++, reaped++) {
+      struct io_uring_cqe* cqe = &uring.cqes [head & *uring.cqMask];
+      fileComplete ((struct PendingRead*) (uintptr_t) cqe->user_data, cqe->res);
+    }
+    __atomic_store_n (uring.cqHead, head, __ATOMIC_RELEASE);
+    toSubmit = 0;
+    spinlock_lock (&fileMutex);
+      uring.inFlight -= reaped;
+      while (uring.backlog != NULL && uring.inFlight < uring.entries) {
+        struct PendingRead* pr = uring.backlog;
+        if ((uring.backlog = pr->next) == NULL)
+          uring.backlogTail = &uring.backlog;
+        toSubmit += uringQueue_lock_held (pr);
+      }
+    spinlock_unlock (&fileMutex);
+  }
+  return NULL;
+}
+
+/**
+ * Set up an io_uring for the file; returns 0 if the kernel has none
+ */
+int uringStart () {
+  struct io_uring_params params;
+  memset (&params, 0, sizeof (params));
+  uring.fd = syscall (__NR_io_uring_setup, config.queue_depth ? config.queue_depth : FILE_DEFAULT_ENTRIES, &params);
+  if (uring.fd < 0)
+    return 0;
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  size_t cqSize = params.cq_off.cqes  + params.cq_entries * sizeof (struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+  char* sq = mmap (NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQ_RING);
+  char* cq = sq;
+  if (sq != MAP_FAILED && ! (params.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap (NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+  uring.sqes = mmap (NULL, params.sq_entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED) {
+    printf ("DISK io_uring mmap: %s\n", strerror (errno));
+    exit (EXIT_FAILURE);
+  }
+  uring.entries     = params.sq_entries;
+  uring.sqHead      = (unsigned*) (sq + params.sq_off.head);
+  uring.sqTail      = (unsigned*) (sq + params.sq_off.tail);
+  uring.sqMask      = (unsigned*) (sq + params.sq_off.ring_mask);
+  uring.sqArray     = (unsigned*) (sq + params.sq_off.array);
+  uring.cqHead      = (unsigned*) (cq + params.cq_off.head);
+  uring.cqTail      = (unsigned*) (cq + params.cq_off.tail);
+  uring.cqMask      = (unsigned*) (cq + params.cq_off.ring_mask);
+  uring.cqes        = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+  uring.backlogTail = &uring.backlog;
+  threadStart (uringReaper, NULL);
+  return 1;
+}
+#endif
+
+pthread_mutex_t     poolMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      poolCond  = PTHREAD_COND_INITIALIZER;
+struct PendingRead* poolHead, ** poolTail = &poolHead;
+
+/**
+ * A thread of the preadv pool
+ */
+void* poolWorker (void* arg) {
+  struct PendingRead* pr;
+  while (1) {
+    pthread_mutex_lock (&poolMutex);
+      while (poolHead == NULL)
+        pthread_cond_wait (&poolCond, &poolMutex);
+      pr = poolHead;
+      if ((poolHead = pr->next) == NULL)
+        poolTail = &poolHead;
+    pthread_mutex_unlock (&poolMutex);
+    struct iovec one   = {pr->buf, blockSize};
+    ssize_t      bytes = preadv (fileFd, pr->batch ? &pr->batch->iov [pr->first] : &one, pr->count, (off_t) pr->blockNo * blockSize);
+    fileComplete (pr, bytes < 0 ? - errno : bytes);
+  }
+  return NULL;
+}
+
+void poolStart () {
+  int threads = config.num_queues ? config.num_queues : FILE_DEFAULT_THREADS;
+  for (int i = 0; i < threads; i++)
+    threadStart (poolWorker, NULL);
+}
+
+/**
+ * Read a block into buf, or the n reads of a batch
+ */
+void fileSchedule (int* buf, int blockNo, struct ReadBatch* batch, int n) {
+  struct PendingRead* reads = NULL, ** link = &reads;
+  int                 first, count, toSubmit = 0;
+  if (batch) {
+    for (int i = 0; i < n; i++) {
+      batch->iov [i].iov_base = batch->reads [i].buf;
+      batch->iov [i].iov_len  = blockSize;
+    }
+  }
+  spinlock_lock (&fileMutex);
+    for (first = 0; first < n; first += count) {
+      count = 1;
+      if (batch)
+        for (; first + count < n && count < FILE_MAX_RUN && batch->reads [first + count].blockno == batch->reads [first + count - 1].blockno + 1; count++) ;
+      struct PendingRead* pr = prAlloc (&fileFree);
+      pr->buf     = buf;
+      pr->blockNo = batch ? batch->reads [first].blockno : blockNo;
+      pr->batch   = batch;
+      pr->first   = first;
+      pr->count   = count;
+      pr->next    = NULL;
+      if (batch)
+        batch->pendingRuns += 1;  // no run completes before it is submitted
+      *link = pr;
+      link  = &pr->next;
+    }
+#if __linux__
+    if (uring.fd >= 0) {
+      for (struct PendingRead* pr = reads, * next; pr != NULL; pr = next) {
+        next      = pr->next;
+        toSubmit += uringQueue_lock_held (pr);
+      }
+      reads = NULL;
+    }
+#endif
+  spinlock_unlock (&fileMutex);
+#if __linux__
+  if (toSubmit)
+    uringEnter (toSubmit, 0, 0);
+#endif
+  if (reads != NULL) {
+    pthread_mutex_lock (&poolMutex);
+      *poolTail = reads;
+      poolTail  = link;
+    pthread_cond_broadcast (&poolCond);
+    pthread_mutex_unlock (&poolMutex);
+  }
+}
+
+void fileStart () {
+  fileFd = open (config.path, O_RDONLY | O_CLOEXEC);
+  if (fileFd == -1) {
+    printf ("DISK open %s: %s\n", config.path, strerror (errno));
+    exit (EXIT_FAILURE);
+  }
+  spinlock_create (&fileMutex);
+#if __linux__
+  if (uringStart())
+    return;
+#endif
+  poolStart();
+}
+
+void disk_register_buffers (void* base, unsigned long length) {
+#if __linux__
+  struct iovec iov = {base, length};
+  if (uring.fd >= 0) {
+    if (uring.fixed != NULL)
+      syscall (__NR_io_uring_register, uring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    if (syscall (__NR_io_uring_register, uring.fd, IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+      printf ("DISK io_uring_register: %s\n", strerror (errno));
+      exit (EXIT_FAILURE);
     }
-  spinlock_unlock (&prq_mutex);
+    uring.fixed       = base;
+    uring.fixedLength = length;
+  }
+#endif
+}
+
+void disk_configure (const struct disk_config* c) {
+  config = *c;
+}
+
+void disk_start_tagged (void (*interruptServiceRoutine) (int*, int)) {
+  isrTagged = interruptServiceRoutine;
+  disk_start (NULL);
+}
+
+void disk_set_policy (int policy) {
+  disk_policy = policy;
 }
 
 void disk_start (void (*interruptServiceRoutine) ()) {
-  isr = interruptServiceRoutine;
-  spinlock_create (&prq_mutex);
+  isr       = interruptServiceRoutine;
+  blockSize = config.block_size ? config.block_size : sizeof (int);
+  spinlock_create (&batchMutex);
+  if (config.path != NULL) {
+    fileStart();
+    return;
+  }
+  numQueues = config.num_queues ? config.num_queues : uthread_num_processors();
+  queues    = aligned_alloc (sizeof (struct DiskQueue), numQueues * sizeof (struct DiskQueue));
+  for (int i = 0; i < numQueues; i++) {
+    struct DiskQueue* q = &queues [i];
+    memset (q, 0, sizeof (*q));
+    spinlock_create (&q->mutex);
+    q->capacity     = config.queue_depth ? config.queue_depth : 64;
+    q->heap         = diskAlloc (q->capacity * sizeof (struct PendingRead*));
+    q->ringCapacity = 64;
+    q->ring         = diskAlloc (q->ringCapacity * sizeof (struct PendingRead*));
+    q->direction    = 1;
+    q->seed         = i + 1;
+  }
+  if (config.bandwidth_blocks_per_sec)
+    nsecPerBlock = 1000000000ull * numQueues / config.bandwidth_blocks_per_sec;
+#if __linux__
+  if (config.completion == DISK_COMPLETION_THREAD) {
+    completionThreadStart();
+    return;
+  }
+#endif
   sigemptyset (& TIMER_SIGSET);
   sigaddset   (& TIMER_SIGSET, TIMER_SIGNO);
   struct sigaction sa;
@@ -133,6 +864,165 @@ void disk_start (void (*interruptServiceRoutine) ()) {
     printf ("DISK sigaction: %s\n", strerror (errno));
     exit (EXIT_FAILURE);
   }
-  ualarm (READ_LATENCY_USEC / 10, READ_LATENCY_USEC / 10);
+#if __linux__
+  // a one-shot timer, set for the next completion
+  struct sigevent event;
+  memset (&event, 0, sizeof (event));
+  event .sigev_notify = SIGEV_SIGNAL;
+  event .sigev_signo  = TIMER_SIGNO;
+  ok = timer_create (CLOCK_MONOTONIC, &event, &timer);
+  if (ok == -1) {
+    printf ("DISK timer_create: %s\n", strerror (errno));
+    exit (EXIT_FAILURE);
+  }
+#else
+  // no one-shot timers: poll at a tenth of the latency
+  unsigned int interval = config.latency_usec / 10 > 100 ? config.latency_usec / 10 : 100;
+  ualarm (interval, interval);
+#endif
+}
+
+/**
+ * A read of uthread_disk_read, on its thread's stack
+ */
+struct UthreadRead {
+  uthread_t    thread;
+  volatile int done;
+};
+
+/**
+ * Completes a read of uthread_disk_read: marks it done and wakes its thread, which may
+ * return as soon as it sees done, so the thread is read first
+ */
+void uthreadReadDone (const struct disk_read* read, void* arg) {
+  struct UthreadRead* r      = arg;
+  uthread_t           thread = r->thread;
+  __atomic_store_n (&r->done, 1, __ATOMIC_RELEASE);
+  uthread_unblock (thread);
+}
+
+void uthread_disk_read (int blockno, int* buf) {
+  struct disk_read   read = {buf, blockno};
+  struct UthreadRead r    = {uthread_self(), 0};
+  disk_schedule_readv (&read, 1, uthreadReadDone, NULL, &r);
+  // a wake-up that is not the read's own returns from uthread_block too
+  while (! __atomic_load_n (&r.done, __ATOMIC_ACQUIRE))
+    uthread_block();
+}
+
+//
+// BUFFER POOL
+//
+// The buffers are one region, that is registered with the io_uring and locked in
+// memory (if the limits allow it). A read taken out of the pool is a vectored read
+// of one block, so that it completes through its own routine; when no buffer is
+// free, it waits in order for one to be released. The simulated disk only writes
+// the block's integer at the start of the buffer.
+//
+
+struct Buffer {
+  struct disk_buffer buffer;
+  volatile int       refs;
+  void             (*done) (struct disk_buffer*, void*);
+  void*              arg;
+  struct Buffer*     next;
+};
+
+struct BufferWait {
+  struct BufferWait* next;           // first, to be linked on a free list
+  int                blockNo;
+  void             (*done) (struct disk_buffer*, void*);
+  void*              arg;
+};
+
+spinlock_t          bufferMutex;
+struct Buffer*      bufferFree;
+struct BufferWait*  bufferWaitFree;
+struct BufferWait*  bufferWaiting, ** bufferWaitingTail = &bufferWaiting;
+
+void bufferDone (const struct disk_read* read, void* arg) {
+  struct Buffer* b = arg;
+  b->done (&b->buffer, b->arg);
+}
+
+void bufferRead (struct Buffer* b, int blockNo, void (*done) (struct disk_buffer*, void*), void* arg) {
+  struct disk_read read = {b->buffer.data, blockNo};
+  b->buffer.blockno = blockNo;
+  b->refs           = 1;
+  b->done           = done;
+  b->arg            = arg;
+  disk_schedule_readv (&read, 1, bufferDone, NULL, b);
+}
+
+void disk_buffers_create (int count) {
+  size_t size = (blockSize + sizeof (int) - 1) / sizeof (int) * sizeof (int);
+  char*  data;
+  if (posix_memalign ((void**) &data, 4096, count * size)) {
+    printf ("DISK buffers: %s\n", strerror (ENOMEM));
+    exit (EXIT_FAILURE);
+  }
+  memset (data, 0, count * size);
+  mlock (data, count * size);
+  disk_register_buffers (data, count * size);
+  spinlock_create (&bufferMutex);
+  for (int i = 0; i < count; i++) {
+    struct Buffer* b = malloc (sizeof (struct Buffer));
+    b->buffer.data = data + i * size;
+    b->next        = bufferFree;
+    bufferFree     = b;
+  }
+}
+
+void disk_schedule_read_buffer (int blockno, void (*done) (struct disk_buffer*, void*), void* arg) {
+  struct Buffer*     b;
+  struct BufferWait* w = NULL;
+  spinlock_lock (&bufferMutex);
+    if ((b = bufferFree) != NULL)
+      bufferFree = b->next;
+    else {
+      if (bufferWaitFree == NULL)
+        diskCarve ((void**) &bufferWaitFree, sizeof (struct BufferWait));
+      w              = bufferWaitFree;
+      bufferWaitFree = w->next;
+      w->blockNo         = blockno;
+      w->done            = done;
+      w->arg             = arg;
+      w->next            = NULL;
+      *bufferWaitingTail = w;
+      bufferWaitingTail  = &w->next;
+    }
+  spinlock_unlock (&bufferMutex);
+  if (b != NULL)
+    bufferRead (b, blockno, done, arg);
+}
+
+void disk_buffer_retain (struct disk_buffer* buffer) {
+  struct Buffer* b = (struct Buffer*) buffer;
+  __atomic_add_fetch (&b->refs, 1, __ATOMIC_RELAXED);
 }
 
+void disk_buffer_release (struct disk_buffer* buffer) {
+  struct Buffer*     b = (struct Buffer*) buffer;
+  struct BufferWait* w;
+  int                blockNo;
+  void             (*done) (struct disk_buffer*, void*);
+  void*              arg;
+  if (__atomic_sub_fetch (&b->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  spinlock_lock (&bufferMutex);
+    if ((w = bufferWaiting) != NULL) {
+      if ((bufferWaiting = w->next) == NULL)
+        bufferWaitingTail = &bufferWaiting;
+      blockNo        = w->blockNo;
+      done           = w->done;
+      arg            = w->arg;
+      w->next        = bufferWaitFree;
+      bufferWaitFree = w;
+    } else {
+      b->next    = bufferFree;
+      bufferFree = b;
+    }
+  spinlock_unlock (&bufferMutex);
+  if (w != NULL)
+    bufferRead (b, blockNo, done, arg);
+}
@@ -1,16 +1,162 @@
 #ifndef __disk_h__
 #define __disk_h__
 
+/**
+ * Latency models: every read takes latency_usec, or is drawn uniformly from
+ * latency_usec +/- latency_spread_usec, or from a lognormal distribution whose median
+ * is latency_usec and whose log has standard deviation latency_sigma
+ */
+#define DISK_LATENCY_FIXED     0
+#define DISK_LATENCY_UNIFORM   1
+#define DISK_LATENCY_LOGNORMAL 2
+
+/**
+ * Completion engines: with DISK_COMPLETION_SIGNAL, the default, interrupt service routines
+ * run in a SIGALRM handler, on whichever processor takes the signal; with DISK_COMPLETION_THREAD,
+ * they run on a dedicated pthread that sleeps on a timerfd set for the next completion, and
+ * that wakes uthreads with uthread_unblock. The completion thread is not a uthread, so its
+ * routines must not block; elsewhere than on Linux the signal engine is always used.
+ */
+#define DISK_COMPLETION_SIGNAL 0
+#define DISK_COMPLETION_THREAD 1
+
+/**
+ * Configuration of the disk model
+ *    num_queues               hardware queues; each virtual processor submits to one of them,
+ *                             under that queue's own lock (0 for one per virtual processor)
+ *    queue_depth              reads in flight at once on a queue; more wait for room, in order
+ *                             (0 for no limit)
+ *    bandwidth_blocks_per_sec cap on the blocks the disk transfers per second, shared evenly
+ *                             by the queues (0 for no cap)
+ *    completion               the completion engine
+ *    path                     a file or block device to read the blocks from, instead of
+ *                             simulating the disk (NULL)
+ *    block_size               with a path, the bytes of a block, and of the buffer of each
+ *                             read (0 for sizeof (int), so that each block holds one integer)
+ *
+ * With a path, block blockno is read from offset blockno * block_size, and reads past the
+ * end of the file read zeros; the latency, bandwidth and completion options do not apply.
+ * On Linux, reads are submitted to an io_uring with queue_depth entries (0 for 256) and
+ * reaped in batches by a completion thread; elsewhere, or if the kernel has no io_uring,
+ * num_queues threads (0 for 4) serve them with preadv. Either way, interrupt service
+ * routines run on a thread that is not a uthread, as with DISK_COMPLETION_THREAD.
+ */
+struct disk_config {
+  int           num_queues;
+  int           queue_depth;
+  int           latency_model;
+  unsigned int  latency_usec;
+  unsigned int  latency_spread_usec;
+  double        latency_sigma;
+  unsigned long bandwidth_blocks_per_sec;
+  int           completion;
+  const char*   path;
+  unsigned int  block_size;
+};
+
+/**
+ * Configure the disk model; call before disk_start
+ *    the default is one queue per virtual processor, no depth limit or bandwidth cap,
+ *    and a fixed latency of 10 ms
+ */
+void disk_configure     (const struct disk_config* config);
+
 /**
  * Start the disk subsystem
  *    interrupt_service_routine is the procedure that the subsystem calls when a read completes
  */
 void disk_start         (void (*interrupt_service_routine) ());
 
+/**
+ * Start the disk subsystem, with an interrupt service routine that is told which read completed
+ *    interrupt_service_routine (resultBuf, blockno) is called with the arguments the read was scheduled with
+ */
+void disk_start_tagged  (void (*interrupt_service_routine) (int* resultBuf, int blockno));
+
+/**
+ * With a path and io_uring, register the length bytes at base with the kernel, so that the
+ * reads of single blocks into them need not map their buffers each time; call after disk_start
+ */
+void disk_register_buffers (void* base, unsigned long length);
+
+/**
+ * Scheduling policies
+ *    with DISK_FIFO, the default, reads complete in the order they were scheduled;
+ *    with DISK_ELEVATOR, the reads that are ready at an interrupt complete in the order the
+ *    head reaches their blocks as it sweeps up and down the disk, so they complete out of order,
+ *    and the interrupt service routine should be started with disk_start_tagged to tell them apart
+ */
+#define DISK_FIFO     0
+#define DISK_ELEVATOR 1
+
+void disk_set_policy    (int policy);
+
 /**
  * Schedule a disk read for block number blockno
  *    the integer contained in that block is copied into *resultBuf when the read completes
  */
 void disk_schedule_read (int* resultBuf, int blockno);
 
+/**
+ * One read of a vectored request: the integer in block blockno is copied into *buf
+ */
+struct disk_read {
+  int* buf;
+  int  blockno;
+};
+
+/**
+ * Schedule n reads at once
+ *    the reads are queued under a single lock acquisition, and runs of consecutive
+ *    block numbers are read by one DMA; reads is copied, so it need not outlive the call
+ *    if request_done and batch_done are both NULL, the interrupt service routine is called
+ *    once for each read, as if it had been scheduled by disk_schedule_read; otherwise,
+ *    when an interrupt completes a read, request_done (read, arg) is called for it, and when
+ *    all n have completed, batch_done (arg) is called; either may be NULL
+ */
+void disk_schedule_readv (const struct disk_read* reads, int n,
+                          void (*request_done) (const struct disk_read*, void*),
+                          void (*batch_done)   (void*),
+                          void* arg);
+
+/**
+ * Read block blockno into *buf, blocking the calling uthread until the read completes
+ *    the thread is unblocked by the completion, instead of the interrupt service routine,
+ *    so its processor runs other threads meanwhile; any number of threads may be reading
+ */
+void uthread_disk_read (int blockno, int* buf);
+
+/**
+ * A block read into a buffer of the pool
+ *    data is block_size bytes; the buffer is lent to the consumers of the block, and reads
+ *    do not copy it anywhere else
+ */
+struct disk_buffer {
+  void* data;
+  int   blockno;
+};
+
+/**
+ * Create the pool of count buffers; call once, after disk_start
+ *    the buffers are locked in memory, if the limits allow it, and with io_uring they are
+ *    registered with disk_register_buffers, which they then replace
+ */
+void disk_buffers_create       (int count);
+
+/**
+ * Read block blockno into a buffer of the pool
+ *    when the read completes, done (buffer, arg) is called instead of the interrupt service
+ *    routine, and the buffer has one reference, which done (or whoever it gives it to) must
+ *    release; if every buffer is in use, the read waits, in order, until one is released
+ */
+void disk_schedule_read_buffer (int blockno, void (*done) (struct disk_buffer*, void*), void* arg);
+
+/**
+ * Add a reference to a buffer, to share it with one more consumer, or drop one
+ *    the buffer goes back to the pool, or to the next read waiting for one, when its last
+ *    reference is released; these may be called on any thread
+ */
+void disk_buffer_retain        (struct disk_buffer* buffer);
+void disk_buffer_release       (struct disk_buffer* buffer);
+
 #endif
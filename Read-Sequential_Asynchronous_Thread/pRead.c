@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "uthread.h"
+#include "disk.h"
+#include "promise.h"
+
+#define NUM_PROCESSORS 4
+
+promise_t* reads;
+
+/**
+ * Called when a read of the batch completes: resolves that block's promise with the integer read
+ */
+void read_done (const struct disk_read* read, void* not_used) {
+  promise_t p = reads [read->blockno];
+  promise_resolve (p, (void*) (long) *read->buf);
+  promise_free    (p);
+}
+
+/**
+ * Add up the values of the reads, once promise_all has them all
+ */
+void* add_values (void* valuesv, void* num_blocksv) {
+  void** values     = valuesv;
+  long   num_blocks = (long) num_blocksv, sum = 0;
+  for (int i = 0; i < num_blocks; i++)
+    sum += (long) values [i];
+  return (void*) sum;
+}
+
+int main (int argc, char** argv) {
+
+  // Command Line Arguments
+  static const char* usage = "usage: pRead num_blocks";
+  int num_blocks;
+  char *endptr;
+  if (argc == 2)
+    num_blocks = strtol (argv [1], &endptr, 10);
+  if (argc != 2 || *endptr != 0) {
+    printf ("argument error - %s \n", usage);
+    return EXIT_FAILURE;
+  }
+
+  // Initialize
+  uthread_init (NUM_PROCESSORS);
+  disk_start (NULL);
+
+  // One promise per block, and one for their sum
+  int*              results = malloc (num_blocks * sizeof (int));
+  void**            values  = malloc (num_blocks * sizeof (void*));
+  struct disk_read* batch   = malloc (num_blocks * sizeof (struct disk_read));
+  promise_t*        sources = malloc (num_blocks * sizeof (promise_t));
+  reads = malloc (num_blocks * sizeof (promise_t));
+  for (int blockno = 0; blockno < num_blocks; blockno++) {
+    reads   [blockno] = promise_new (NULL);
+    sources [blockno] = reads [blockno];
+    promise_retain (reads [blockno]);   // for read_done
+    batch   [blockno] = (struct disk_read) {&results [blockno], blockno};
+  }
+  promise_t sum = promise_then_f (promise_all (sources, num_blocks, values), add_values, (void*) (long) num_blocks);
+
+  // Sum Blocks, with every read in flight at once
+  disk_schedule_readv (batch, num_blocks, read_done, NULL, NULL);
+  while (! promise_is_resolved (sum))
+    uthread_yield();
+  printf ("%ld\n", (long) promise_value (sum));
+  promise_free (sum);
+}
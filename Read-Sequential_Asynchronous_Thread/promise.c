@@ -1,43 +1,319 @@
 #include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/mman.h>
+#if __BLOCKS__
+#include <Block.h>
+#endif
+#include "uthread.h"
+#include "uthread_util.h"
+#include "spinlock.h"
 #include "promise.h"
 
+//
+// A promise keeps its continuations on a lock-free list, which resolving it
+// replaces with RESOLVED, so continuations can be added while it is resolved.
+// Resolving runs them oldest first and puts the promises they resolve on a
+// work list, instead of recursing. Promises and continuations are nodes taken
+// from a cache of the processor (or one shared by the other pthreads), that is
+// refilled a slab at a time; slabs are mapped with a system call, which an
+// interrupt service routine may make, and are never unmapped.
+//
+
+#define NODE_SLAB_BYTES (16 * 1024)
+
+#define CONTINUATION_THEN 0
+#define CONTINUATION_ALL  1
+#define CONTINUATION_ANY  2
+
+struct continuation {
+  int                  kind;
+  void*              (*on_fulfilled) (void*, void*);
+  void*                arg;
+  int                  index;       // of source, in promise_all
+  int                  processor;   // to run on, or -1
+  promise_t            source;      // with a reference, for promise_all and promise_any
+  promise_t            result;      // with a reference
+  void*                value;       // of source, while sent to its processor
+  struct uthread_work  work;
+  struct continuation* next;
+};
+
+#define RESOLVED ((struct continuation*) 1)
+
 struct promise {
-  int       is_resolved;
-  void*     value;
-  void*     (^on_fulfilled) (void*);
-  promise_t fulfilled_promise, parent;
+  volatile int                  refs;
+  void*                         value;
+  struct continuation* volatile continuations;
+  promise_t                     parent;
+  void**                        values;         // of promise_all
+  volatile int                  remaining;      // sources of promise_all, or 1 until promise_any is resolved
+  promise_t                     work_next;      // on the work list of promise_settle
 };
 
+union node {
+  struct promise      promise;
+  struct continuation continuation;
+  union node*         next;
+};
+
+struct node_cache {
+  spinlock_t  mutex;
+  union node* free;
+  int         processors;  // that have a cache of their own, the same in every cache
+} __attribute__ ((aligned (64)));
+
+static struct node_cache* volatile caches;
+
+/**
+ * The cache of the caller's processor; the last one is for other pthreads
+ *    the caches are made at the first call, which may come before uthread_init, or from an
+ *    interrupt service routine: processors that did not exist then use the last one too
+ */
+static struct node_cache* node_cache () {
+  struct node_cache* c = __atomic_load_n (&caches, __ATOMIC_ACQUIRE), * new_caches;
+  int                n, processor;
+  if (c == NULL) {
+    n          = uthread_num_processors();
+    n          = n > 0 ? n : 0;
+    new_caches = mmap (NULL, (n + 1) * sizeof (struct node_cache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert (new_caches != MAP_FAILED);
+    for (int i = 0; i <= n; i++) {
+      spinlock_create (&new_caches [i].mutex);
+      new_caches [i].free       = NULL;
+      new_caches [i].processors = n;
+    }
+    if (__atomic_compare_exchange_n (&caches, &c, new_caches, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      c = new_caches;
+    else
+      munmap (new_caches, (n + 1) * sizeof (struct node_cache));
+  }
+  n         = c->processors;
+  processor = uthread_processor();
+  return &c [processor >= 0 && processor < n ? processor : n];
+}
+
+static void* node_alloc () {
+  struct node_cache* c = node_cache();
+  union node*        node;
+  spinlock_lock (&c->mutex);
+    if (c->free == NULL) {
+      union node* slab = mmap (NULL, NODE_SLAB_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      assert (slab != MAP_FAILED);
+      for (int i = NODE_SLAB_BYTES / sizeof (union node) - 1; i >= 0; i--) {
+        slab [i].next = c->free;
+        c->free       = &slab [i];
+      }
+    }
+    node    = c->free;
+    c->free = node->next;
+  spinlock_unlock (&c->mutex);
+  return node;
+}
+
+static void node_free (void* n) {
+  struct node_cache* c    = node_cache();
+  union node*        node = n;
+  spinlock_lock (&c->mutex);
+    node->next = c->free;
+    c->free    = node;
+  spinlock_unlock (&c->mutex);
+}
+
 promise_t promise_new (promise_t parent) {
-  promise_t p          = malloc (sizeof (struct promise));
-  p->is_resolved       = 0;
+  promise_t p          = node_alloc();
+  p->refs              = 1;
   p->value             = NULL;
-  p->on_fulfilled      = NULL;
-  p->fulfilled_promise = NULL;
+  p->continuations     = NULL;
   p->parent            = parent;
+  p->values            = NULL;
+  p->remaining         = 0;
   return p;
 }
 
+void promise_retain (promise_t p) {
+  __atomic_add_fetch (&p->refs, 1, __ATOMIC_RELAXED);
+}
+
 void promise_free (promise_t p) {
-  if (p->parent)
-    promise_free (p->parent);
-  free (p);
+  promise_t parent;
+  for (; p && __atomic_sub_fetch (&p->refs, 1, __ATOMIC_ACQ_REL) == 0; p = parent) {
+    parent = p->parent;
+    node_free (p);
+  }
+}
+
+int promise_is_resolved (promise_t p) {
+  return __atomic_load_n (&p->continuations, __ATOMIC_ACQUIRE) == RESOLVED;
+}
+
+void* promise_value (promise_t p) {
+  return p->value;
+}
+
+static struct continuation* continuation_new (int kind, promise_t result, int processor) {
+  struct continuation* c = node_alloc();
+  c->kind      = kind;
+  c->processor = processor;
+  c->source    = NULL;
+  c->result    = result;
+  promise_retain (result);
+  return c;
+}
+
+/**
+ * Run a continuation of a source resolved with value, and free it
+ *    returns its result, with its value set and the continuation's reference, if it is to be
+ *    resolved now
+ */
+static promise_t continuation_run (struct continuation* c, void* value) {
+  promise_t r      = c->result;
+  int       settle = 1;
+  switch (c->kind) {
+    case CONTINUATION_THEN:
+      r->value = c->on_fulfilled (value, c->arg);
+      break;
+    case CONTINUATION_ALL:
+      r->values [c->index] = value;
+      if ((settle = __atomic_sub_fetch (&r->remaining, 1, __ATOMIC_ACQ_REL) == 0))
+        r->value = r->values;
+      break;
+    case CONTINUATION_ANY:
+      if ((settle = __atomic_exchange_n (&r->remaining, 0, __ATOMIC_ACQ_REL) == 1))
+        r->value = value;
+      break;
+  }
+  promise_free (c->source);
+  node_free (c);
+  if (settle)
+    return r;
+  promise_free (r);
+  return NULL;
+}
+
+static void continuation_send (struct continuation* c, void* value);
+
+/**
+ * Resolve p, whose value is set, and everything that it resolves; releases a reference to p
+ */
+static void promise_settle (promise_t p) {
+  promise_t work = p;
+  p->work_next = NULL;
+  while (work != NULL) {
+    struct continuation* c, * next, * oldest = NULL;
+    p    = work;
+    work = p->work_next;
+    c    = __atomic_exchange_n (&p->continuations, RESOLVED, __ATOMIC_ACQ_REL);
+    assert (c != RESOLVED);
+    for (; c != NULL; c = next) {
+      next      = c->next;
+      c->next   = oldest;
+      oldest    = c;
+    }
+    for (c = oldest; c != NULL; c = next) {
+      next = c->next;
+      if (c->processor >= 0 && c->processor != uthread_processor())
+        continuation_send (c, p->value);
+      else {
+        promise_t r = continuation_run (c, p->value);
+        if (r != NULL) {
+          r->work_next = work;
+          work         = r;
+        }
+      }
+    }
+    promise_free (p);
+  }
+}
+
+static void continuation_work (void* cv) {
+  struct continuation* c = cv;
+  promise_t            r = continuation_run (c, c->value);
+  if (r != NULL)
+    promise_settle (r);
+}
+
+static void continuation_send (struct continuation* c, void* value) {
+  c->value     = value;
+  c->work.proc = continuation_work;
+  c->work.arg  = c;
+  uthread_run_on (c->processor, &c->work);
+}
+
+/**
+ * Add a continuation to p, or run it if p is resolved
+ */
+static void continuation_add (promise_t p, struct continuation* c) {
+  struct continuation* head = __atomic_load_n (&p->continuations, __ATOMIC_ACQUIRE);
+  do {
+    if (head == RESOLVED) {
+      if (c->processor >= 0 && c->processor != uthread_processor())
+        continuation_send (c, p->value);
+      else {
+        promise_t r = continuation_run (c, p->value);
+        if (r != NULL)
+          promise_settle (r);
+      }
+      return;
+    }
+    c->next = head;
+  } while (! __atomic_compare_exchange_n (&p->continuations, &head, c, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 }
 
 void promise_resolve (promise_t p, void* value) {
-  p->is_resolved = 1;
-  p->value       = value;
-  if (p->on_fulfilled)
-    promise_resolve (p->fulfilled_promise, p->on_fulfilled (value));
-}
-
-promise_t promise_then (promise_t p, void* (^on_fulfilled)(void*)) {
-  promise_t tp = promise_new (p);
-  if (p->is_resolved)
-    promise_resolve (tp, on_fulfilled (p->value));
-  else {
-    p->on_fulfilled      = on_fulfilled;
-    p->fulfilled_promise = tp;
+  promise_retain (p);
+  p->value = value;
+  promise_settle (p);
+}
+
+promise_t promise_then_on (promise_t p, int processor, void* (*on_fulfilled) (void*, void*), void* arg) {
+  promise_t            r = promise_new (p);
+  struct continuation* c = continuation_new (CONTINUATION_THEN, r, processor);
+  c->on_fulfilled = on_fulfilled;
+  c->arg          = arg;
+  continuation_add (p, c);
+  return r;
+}
+
+promise_t promise_then_f (promise_t p, void* (*on_fulfilled) (void*, void*), void* arg) {
+  return promise_then_on (p, -1, on_fulfilled, arg);
+}
+
+promise_t promise_all (promise_t* ps, int n, void** values) {
+  promise_t r = promise_new (NULL);
+  r->values    = values;
+  r->remaining = n;
+  if (n == 0)
+    promise_resolve (r, values);
+  for (int i = 0; i < n; i++) {
+    struct continuation* c = continuation_new (CONTINUATION_ALL, r, -1);
+    c->index  = i;
+    c->source = ps [i];
+    continuation_add (ps [i], c);
   }
-  return tp;
+  return r;
+}
+
+promise_t promise_any (promise_t* ps, int n) {
+  promise_t r = promise_new (NULL);
+  r->remaining = 1;
+  for (int i = 0; i < n; i++) {
+    struct continuation* c = continuation_new (CONTINUATION_ANY, r, -1);
+    c->source = ps [i];
+    continuation_add (ps [i], c);
+  }
+  return r;
+}
+
+#if __BLOCKS__
+static void* block_call (void* value, void* arg) {
+  void* (^on_fulfilled) (void*) = (void* (^) (void*)) arg;
+  void* result = on_fulfilled (value);
+  Block_release (on_fulfilled);
+  return result;
+}
+
+promise_t promise_then (promise_t p, void* (^on_fulfilled) (void*)) {
+  return promise_then_f (p, block_call, (void*) Block_copy (on_fulfilled));
 }
+#endif
@@ -4,9 +4,63 @@
 struct promise;
 typedef struct promise* promise_t;
 
+/**
+ * Create an unresolved promise
+ *    the caller gets a reference to it; the caller's reference to parent, if not NULL, is handed
+ *    to the new promise, which releases it when it is freed, so that freeing the last promise of
+ *    a chain frees the chain
+ */
 promise_t promise_new     (promise_t parent);
+
+/**
+ * Add a reference to a promise, or release one
+ *    a promise is freed when its last reference is released; a continuation holds references
+ *    to what it needs until it has run
+ */
+void      promise_retain  (promise_t p);
 void      promise_free    (promise_t p);
+
+/**
+ * Resolve p with value, and the promises that depend on it, one after the other rather than
+ * recursively, so that a chain of any length resolves on a small stack
+ *    a promise is resolved only once; this may be called by an interrupt service routine
+ */
 void      promise_resolve (promise_t p, void* value);
+
+int       promise_is_resolved (promise_t p);
+void*     promise_value       (promise_t p);
+
+/**
+ * A promise resolved with on_fulfilled (value, arg) once p is resolved with value
+ *    on_fulfilled runs on the thread that resolves p, or at once if p is resolved already;
+ *    the caller's reference to p is handed to the new promise: to add more continuations
+ *    to p, which may have any number of them, retain it first
+ */
+promise_t promise_then_f  (promise_t p, void* (*on_fulfilled) (void* value, void* arg), void* arg);
+
+/**
+ * Like promise_then_f, but on_fulfilled runs on virtual processor processor (with uthread_run_on,
+ * so it must not block), unless p is resolved there
+ */
+promise_t promise_then_on (promise_t p, int processor, void* (*on_fulfilled) (void* value, void* arg), void* arg);
+
+/**
+ * A promise resolved with values once all n promises of ps are, when values [i] is the value of ps [i]
+ *    the caller's references to the promises of ps are handed to the new promise
+ */
+promise_t promise_all     (promise_t* ps, int n, void** values);
+
+/**
+ * A promise resolved with the value of the first of the n promises of ps to be resolved
+ *    the caller's references to the promises of ps are handed to the new promise
+ */
+promise_t promise_any     (promise_t* ps, int n);
+
+#if __BLOCKS__
+/**
+ * Like promise_then_f, with a block (which is copied)
+ */
 promise_t promise_then    (promise_t p, void* (^on_fulfilled) (void*));
+#endif
 
-#endif
\ No newline at end of file
+#endif
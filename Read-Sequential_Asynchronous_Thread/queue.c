@@ -1,80 +1,309 @@
 #include <stdlib.h>
 #include <signal.h>
+#include <sys/mman.h>
 #include "uthread.h"
-#include "spinlock.h"
+#include "uthread_util.h"
 #include "queue.h"
 
-struct queue_e {
-  void *val, *arg;
-  void (*callback) (void*, void*);
-  struct queue_e *prev, *next;
+//
+// Both kinds of queue are lock-free, so that an interrupt service routine can use
+// a queue that the thread it interrupted is using, without masking signals; neither
+// allocates memory with malloc after it is created.
+//
+// A bounded queue is a ring of cells, each with a sequence number that tells
+// whether it is ready to be filled or to be emptied at a given position
+// (Vyukov's MPMC queue).
+//
+// An unbounded queue is a list of segments of slots. Enqueuers and dequeuers take
+// the next slot of the tail and head segments with an atomic increment; a dequeuer
+// that gets to a slot before its enqueuer marks it taken, and the enqueuer tries
+// the next one. Used-up segments are unlinked and retired, and an operation that
+// ends while no other is in progress on the queue frees the retired ones (but
+// keeps one, to reuse). Segments are mapped and unmapped with system calls, which
+// handlers may make.
+//
+
+struct queue_cell {
+  volatile unsigned long seq;
+  void*                  val, * arg;
+  void                 (*callback) (void*, void*);
+};
+
+#define SLOT_EMPTY 0
+#define SLOT_FULL  1
+#define SLOT_TAKEN 2
+
+struct queue_slot {
+  volatile int val_state;
+  void*        val, * arg;
+  void       (*callback) (void*, void*);
+};
+
+#define SEGMENT_BYTES (16 * 1024)
+#define SEGMENT_SLOTS ((SEGMENT_BYTES - 64) / sizeof (struct queue_slot))
+
+struct queue_segment {
+  volatile unsigned long          enqueued, dequeued;  // the next slots to fill and to take
+  struct queue_segment* volatile  next;
+  struct queue_segment*           retired_next;
+  struct queue_slot               slots [SEGMENT_SLOTS];
 };
 
 struct queue {
-  struct queue_e *front, *back, *free;
-  spinlock_t      mutex;
+  int                            bounded;
+  struct queue_cell*             cells;
+  unsigned long                  mask;
+  volatile unsigned long         enqueue_pos __attribute__ ((aligned (64)));
+  volatile unsigned long         dequeue_pos __attribute__ ((aligned (64)));
+  struct queue_segment* volatile head        __attribute__ ((aligned (64)));
+  struct queue_segment* volatile tail        __attribute__ ((aligned (64)));
+  volatile int                   active      __attribute__ ((aligned (64)));
+  struct queue_segment* volatile retired;
+  struct queue_segment* volatile spare;
 };
 
+static struct queue_segment* segment_new (queue_t q) {
+  struct queue_segment* s = __atomic_exchange_n (&q->spare, NULL, __ATOMIC_ACQ_REL);
+  if (s == NULL) {
+    s = mmap (NULL, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED)
+      abort();
+  } else
+    for (unsigned long i = 0; i < SEGMENT_SLOTS; i++)
+      s->slots [i].val_state = SLOT_EMPTY;
+  s->enqueued = 0;
+  s->dequeued = 0;
+  s->next     = NULL;
+  return s;
+}
+
+/**
+ * Free a segment that no operation can reach
+ */
+static void segment_free (queue_t q, struct queue_segment* s) {
+  struct queue_segment* none = NULL;
+  if (! __atomic_compare_exchange_n (&q->spare, &none, s, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    munmap (s, SEGMENT_BYTES);
+}
+
+static void segment_retire (queue_t q, struct queue_segment* s) {
+  s->retired_next = __atomic_load_n (&q->retired, __ATOMIC_ACQUIRE);
+  while (! __atomic_compare_exchange_n (&q->retired, &s->retired_next, s, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) ;
+}
+
+static void queue_enter (queue_t q) {
+  if (! q->bounded)
+    __atomic_add_fetch (&q->active, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * End an operation, freeing the retired segments if no other is in progress
+ *    an operation that started after they were taken off the list can not reach them
+ */
+static void queue_exit (queue_t q) {
+  if (q->bounded)
+    return;
+  if (__atomic_load_n (&q->retired, __ATOMIC_ACQUIRE)) {
+    struct queue_segment* retired = __atomic_exchange_n (&q->retired, NULL, __ATOMIC_SEQ_CST), * next;
+    if (__atomic_load_n (&q->active, __ATOMIC_SEQ_CST) == 1)
+      for (; retired != NULL; retired = next) {
+        next = retired->retired_next;
+        segment_free (q, retired);
+      }
+    else
+      for (; retired != NULL; retired = next) {
+        next = retired->retired_next;
+        segment_retire (q, retired);
+      }
+  }
+  __atomic_sub_fetch (&q->active, 1, __ATOMIC_SEQ_CST);
+}
+
+static int ring_enqueue (queue_t q, void* val, void* arg, void (*callback) (void*, void*)) {
+  unsigned long      pos = __atomic_load_n (&q->enqueue_pos, __ATOMIC_RELAXED);
+  struct queue_cell* cell;
+  while (1) {
+    cell = &q->cells [pos & q->mask];
+    long diff = (long) (__atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n (&q->enqueue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0)
+      return 0;
+    else
+      pos = __atomic_load_n (&q->enqueue_pos, __ATOMIC_RELAXED);
+  }
+  cell->val      = val;
+  cell->arg      = arg;
+  cell->callback = callback;
+  __atomic_store_n (&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static int ring_dequeue (queue_t q, void** val, void** arg, void (**callback) (void*, void*)) {
+  unsigned long      pos = __atomic_load_n (&q->dequeue_pos, __ATOMIC_RELAXED);
+  struct queue_cell* cell;
+  while (1) {
+    cell = &q->cells [pos & q->mask];
+    long diff = (long) (__atomic_load_n (&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n (&q->dequeue_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0)
+      return 0;
+    else
+      pos = __atomic_load_n (&q->dequeue_pos, __ATOMIC_RELAXED);
+  }
+  *val = cell->val;
+  if (arg)
+    *arg = cell->arg;
+  if (callback)
+    *callback = cell->callback;
+  __atomic_store_n (&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void segment_enqueue (queue_t q, void* val, void* arg, void (*callback) (void*, void*)) {
+  while (1) {
+    struct queue_segment* tail = __atomic_load_n (&q->tail, __ATOMIC_ACQUIRE);
+    unsigned long         i    = __atomic_fetch_add (&tail->enqueued, 1, __ATOMIC_ACQ_REL);
+    if (i < SEGMENT_SLOTS) {
+      struct queue_slot* slot  = &tail->slots [i];
+      int                empty = SLOT_EMPTY;
+      slot->val      = val;
+      slot->arg      = arg;
+      slot->callback = callback;
+      if (__atomic_compare_exchange_n (&slot->val_state, &empty, SLOT_FULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return;
+      continue;  // a dequeuer gave up on it
+    }
+    // the tail segment is full
+    struct queue_segment* next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+      __atomic_compare_exchange_n (&q->tail, &tail, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+      continue;
+    }
+    struct queue_segment* s = segment_new (q);
+    s->slots [0].val       = val;
+    s->slots [0].arg       = arg;
+    s->slots [0].callback  = callback;
+    s->slots [0].val_state = SLOT_FULL;
+    s->enqueued            = 1;
+    if (__atomic_compare_exchange_n (&tail->next, &next, s, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      __atomic_compare_exchange_n (&q->tail, &tail, s, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+      return;
+    }
+    segment_free (q, s);
+  }
+}
+
+static int segment_dequeue (queue_t q, void** val, void** arg, void (**callback) (void*, void*)) {
+  while (1) {
+    struct queue_segment* head = __atomic_load_n (&q->head, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&head->dequeued, __ATOMIC_ACQUIRE) >= __atomic_load_n (&head->enqueued, __ATOMIC_ACQUIRE)
+        && __atomic_load_n (&head->next, __ATOMIC_ACQUIRE) == NULL)
+      return 0;
+    unsigned long i = __atomic_fetch_add (&head->dequeued, 1, __ATOMIC_ACQ_REL);
+    if (i < SEGMENT_SLOTS) {
+      struct queue_slot* slot = &head->slots [i];
+      if (__atomic_exchange_n (&slot->val_state, SLOT_TAKEN, __ATOMIC_ACQ_REL) == SLOT_FULL) {
+        *val = slot->val;
+        if (arg)
+          *arg = slot->arg;
+        if (callback)
+          *callback = slot->callback;
+        return 1;
+      }
+      continue;  // taken before its enqueuer filled it
+    }
+    // the head segment is used up
+    struct queue_segment* next = __atomic_load_n (&head->next, __ATOMIC_ACQUIRE);
+    if (next == NULL)
+      return 0;
+    struct queue_segment* tail = head;
+    __atomic_compare_exchange_n (&q->tail, &tail, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n (&q->head, &head, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      segment_retire (q, head);
+  }
+}
+
 queue_t queue_create() {
-  queue_t q = malloc (sizeof (struct queue));
-  q->front = NULL;
-  q->back  = NULL;
-  q->free  = NULL;
-  spinlock_create (&q->mutex);
+  queue_t q = calloc (1, sizeof (struct queue));
+  q->head = q->tail = segment_new (q);
+  return q;
+}
+
+queue_t queue_create_bounded (unsigned long capacity) {
+  queue_t q = calloc (1, sizeof (struct queue));
+  unsigned long size;
+  for (size = 2; size < capacity; size *= 2) ;
+  q->bounded = 1;
+  q->mask    = size - 1;
+  q->cells   = malloc (size * sizeof (struct queue_cell));
+  for (unsigned long i = 0; i < size; i++)
+    q->cells [i].seq = i;
   return q;
 }
 
 void queue_destroy (queue_t q) {
-  void* val;
-  do {
-    queue_dequeue (q, &val, NULL, NULL);
-  } while (val);
-  for (struct queue_e* e = q->free; e; e = e->next)
-    free (e);
+  struct queue_segment* s, * next;
+  if (q->bounded)
+    free (q->cells);
+  else {
+    for (s = q->head; s != NULL; s = next) {
+      next = s->next;
+      munmap (s, SEGMENT_BYTES);
+    }
+    for (s = q->retired; s != NULL; s = next) {
+      next = s->retired_next;
+      munmap (s, SEGMENT_BYTES);
+    }
+    if (q->spare)
+      munmap (q->spare, SEGMENT_BYTES);
+  }
   free (q);
 }
 
+int queue_try_enqueue (queue_t q, void* val, void* arg, void (*callback) (void*, void*)) {
+  if (q->bounded)
+    return ring_enqueue (q, val, arg, callback);
+  queue_enter     (q);
+  segment_enqueue (q, val, arg, callback);
+  queue_exit      (q);
+  return 1;
+}
+
 void queue_enqueue (queue_t q, void* val, void* arg, void (*callback) (void*, void*)) {
-  spinlock_lock (&q->mutex);
-    struct queue_e* qe;
-    if (q->free != NULL) {
-      qe      = q->free;
-      q->free = q->free->next;
-    } else
-      qe = malloc (sizeof (struct queue_e));
-    qe->val = val;
-    qe->arg = arg;
-    qe->callback = callback;
-    qe->prev = NULL;
-    qe->next = q->back;
-    if (q->back != NULL)
-      q->back->prev = qe;
-    else
-      q->front = qe;
-    q->back = qe;
-  spinlock_unlock (&q->mutex);
-}
-
-void queue_dequeue (queue_t q, void** val, void ** arg, void (**callback) (void*, void*)) {
-  spinlock_lock (&q->mutex);
-    if (q->front != NULL) {
-      *val = q->front->val;
-      if (arg)
-        *arg = q->front->arg;
-      if (callback)
-        *callback = q->front->callback;
-      struct queue_e* new_front = q->front->prev;
-      q->front->next = q->free;
-      q->free        = q->front;
-      if (new_front != NULL)
-        new_front->next = NULL;
-      else
-        q->back = NULL;
-      q->front = new_front;
-    } else {
-      *val = NULL;
-      if (callback)
-        *callback = NULL;
-    }
-  spinlock_unlock (&q->mutex);
+  while (! queue_try_enqueue (q, val, arg, callback))
+    if (! uthread_isInterrupt())
+      uthread_yield();
+}
+
+int queue_try_dequeue (queue_t q, void** val, void** arg, void (**callback) (void*, void*)) {
+  int dequeued;
+  if (q->bounded)
+    return ring_dequeue (q, val, arg, callback);
+  queue_enter (q);
+  dequeued = segment_dequeue (q, val, arg, callback);
+  queue_exit  (q);
+  return dequeued;
+}
+
+void queue_dequeue (queue_t q, void** val, void** arg, void (**callback) (void*, void*)) {
+  if (! queue_try_dequeue (q, val, arg, callback)) {
+    *val = NULL;
+    if (callback)
+      *callback = NULL;
+  }
+}
+
+int queue_dequeue_n (queue_t q, void** vals, void** args, void (**callbacks) (void*, void*), int n) {
+  int i;
+  queue_enter (q);
+  for (i = 0; i < n; i++)
+    if (! (q->bounded ? ring_dequeue    (q, &vals [i], args ? &args [i] : NULL, callbacks ? &callbacks [i] : NULL)
+                      : segment_dequeue (q, &vals [i], args ? &args [i] : NULL, callbacks ? &callbacks [i] : NULL)))
+      break;
+  queue_exit (q);
+  return i;
 }
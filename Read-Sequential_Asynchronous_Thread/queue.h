@@ -4,17 +4,51 @@
 struct queue;
 typedef struct queue* queue_t;
 
+/**
+ * Create a queue that grows as needed
+ * Every operation is lock-free, so a queue can be used by interrupt service routines
+ * without masking signals
+ */
 queue_t queue_create  ();
 
+/**
+ * Create a queue that holds at most capacity tuples (rounded up to a power of two)
+ */
+queue_t queue_create_bounded (unsigned long capacity);
+
+/**
+ * Free a queue; nothing must be using it
+ */
+void queue_destroy (queue_t q);
+
 /**
  * Enqueue the tuple (val, arg, callback)
+ * If a bounded queue is full, this waits for room, yielding if called by a uthread;
+ * an interrupt service routine should use queue_try_enqueue instead
  */
 void queue_enqueue (queue_t q, void*  val, void* arg,   void (*callback)  (void*, void*));
 
+/**
+ * Enqueue the tuple (val, arg, callback), unless the queue is full; returns 1 if it was enqueued
+ */
+int  queue_try_enqueue (queue_t q, void*  val, void* arg,   void (*callback)  (void*, void*));
+
 /**
  * Delete and place results into *val, *arg, and *callback
  * Note that arg is optional (and only used in treasureHunt); if arg == NULL then it is ignored
  */
 void queue_dequeue (queue_t q, void** val, void ** arg, void (**callback) (void*, void*));
 
+/**
+ * Like queue_dequeue, but return 0 if the queue is empty, and 1 otherwise
+ * (so that a NULL val can be told apart from an empty queue)
+ */
+int  queue_try_dequeue (queue_t q, void** val, void ** arg, void (**callback) (void*, void*));
+
+/**
+ * Dequeue up to n tuples into vals [i], args [i] and callbacks [i], and return how many;
+ * args and callbacks may be NULL
+ */
+int  queue_dequeue_n   (queue_t q, void** vals, void** args, void (**callbacks) (void*, void*), int n);
+
 #endif
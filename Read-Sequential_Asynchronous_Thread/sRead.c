@@ -13,7 +13,7 @@ volatile int is_read_pending;  // flag that indicates whether a read is pending
 
 /**
  * Called by disk subsystem each time that a read completes.
- * You may assume that reads complete in request order.
+ * Only one read is pending at a time, so it is the one that completed.
  */
 void interrupt_service_routine() {
   is_read_pending = 0; // clear flag to indicate that read is no longer pending
@@ -6,4 +6,22 @@ void       spinlock_create (spinlock_t* lock);
 void       spinlock_lock   (spinlock_t* lock);
 void       spinlock_unlock (spinlock_t* lock);
 
+typedef struct {
+  volatile unsigned int next, owner;
+} ticketlock_t;
+void       ticketlock_create (ticketlock_t* lock);
+void       ticketlock_lock   (ticketlock_t* lock);
+void       ticketlock_unlock (ticketlock_t* lock);
+
+typedef struct mcslock_node {
+  struct mcslock_node* volatile next;
+  volatile int                  locked;
+} mcslock_node_t;
+typedef mcslock_node_t* volatile mcslock_t;
+void       mcslock_create (mcslock_t* lock);
+void       mcslock_lock   (mcslock_t* lock, mcslock_node_t* node);
+void       mcslock_unlock (mcslock_t* lock, mcslock_node_t* node);
+
+int        spinlock_signal_deferred (int signo);
+
 #endif
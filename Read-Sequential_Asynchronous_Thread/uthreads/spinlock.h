@@ -17,4 +17,33 @@ void       spinlock_lock   (spinlock_t* lock);
 /* Unlock the spinlock. This completes immediately without spinning. */
 void       spinlock_unlock (spinlock_t* lock);
 
+/* Ticket locks are fair: threads acquire them in the order they started waiting.
+As a lock can only be handed to the next waiter, ticket and MCS locks are slow
+when there are more processors than CPUs. */
+typedef struct {
+  volatile unsigned int next, owner;
+} ticketlock_t;
+
+void       ticketlock_create (ticketlock_t* lock);
+void       ticketlock_lock   (ticketlock_t* lock);
+void       ticketlock_unlock (ticketlock_t* lock);
+
+/* MCS locks scale under high contention: each waiter spins on its own node,
+which it passes to both lock and unlock and must not reuse until then. */
+typedef struct mcslock_node {
+  struct mcslock_node* volatile next;
+  volatile int                  locked;
+} mcslock_node_t;
+typedef mcslock_node_t* volatile mcslock_t;
+
+void       mcslock_create (mcslock_t* lock);
+void       mcslock_lock   (mcslock_t* lock, mcslock_node_t* node);
+void       mcslock_unlock (mcslock_t* lock, mcslock_node_t* node);
+
+/* Call first in a handler of a protected signal (SIGALRM) that uses any of
+these locks or unblocks threads. If the interrupted code holds a lock, the
+signal is deferred until it releases its last one and this returns 1: the
+handler must then return at once. Otherwise it returns 0. */
+int        spinlock_signal_deferred (int signo);
+
 #endif
@@ -1,27 +1,8 @@
 // (C) Mike Feeley, University of BC 2018
 
-#if __CYGWIN__
-#ifndef NATIVE_STACK_SIZE
-#define NATIVE_STACK_SIZE (1*1024*1024)
-#endif
-#ifndef PTHREAD_SUPPORT
-#define PTHREAD_SUPPORT 1
-#endif
-#ifndef PTHREAD_SETSTACK_SUPPORT
-#define PTHREAD_SETSTACK_SUPPORT 0
-#endif
-
-#else
-#ifndef NATIVE_STACK_SIZE
-#define NATIVE_STACK_SIZE (8*1024*1024)
-#endif
 #ifndef PTHREAD_SUPPORT
 #define PTHREAD_SUPPORT  1
 #endif
-#ifndef PTHREAD_SETSTACK_SUPPORT
-#define PTHREAD_SETSTACK_SUPPORT 1
-#endif
-#endif
 
 #ifndef PTHREAD_IDLE_SLEEP
 #define PTHREAD_IDLE_SLEEP 1
@@ -30,17 +11,53 @@
 #define SIG_PROTECTED 1
 #endif
 
+#ifndef PREEMPT_SUPPORT
+#define PREEMPT_SUPPORT (SIG_PROTECTED && PTHREAD_SUPPORT && __linux__)
+#endif
+#ifndef STATS_SUPPORT
+#define STATS_SUPPORT 1
+#endif
+
+#ifndef TRACE_SUPPORT
+#define TRACE_SUPPORT 1
+#endif
+
+#ifndef NUMA_SUPPORT
+#define NUMA_SUPPORT (PTHREAD_SUPPORT && __linux__)
+#endif
+#if (PREEMPT_SUPPORT || NUMA_SUPPORT) && ! defined (_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #if PTHREAD_SUPPORT
 #include <pthread.h>
+#include <sched.h>
 #endif
-#if SIG_PROTECTED
+#if SIG_PROTECTED || PTHREAD_SUPPORT
 #include <signal.h>
 #endif
+#if PTHREAD_IDLE_SLEEP && __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#if PREEMPT_SUPPORT || STATS_SUPPORT || TRACE_SUPPORT
+#include <time.h>
+#endif
+#if PREEMPT_SUPPORT
+#include <ucontext.h>
+#include <sys/syscall.h>
+#endif
+#if NUMA_SUPPORT
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
 #include "spinlock.h"
 #include "uthread.h"
 #include "uthread_util.h"
@@ -52,7 +69,12 @@
 #define TS_DYING   4
 #define TS_DEAD    5
 
-#define STACK_SIZE     (8*1024*1024)
+#define READY_UNBLOCKED 1
+#define READY_YIELDED   2
+
+#ifndef UTHREAD_DEFAULT_STACK_SIZE
+#define UTHREAD_DEFAULT_STACK_SIZE (8*1024*1024)
+#endif
 
 #if SIG_PROTECTED
 sigset_t uthread_protected_sigset;
@@ -60,225 +82,1519 @@ sigset_t uthread_protected_sigset;
 
 #if SIG_PROTECTED
 void uthread_setInterrupt (int isInterrupt);
-int  uthread_isInterrupt  ();
+int  uthread_isInterrupt  (void);
 int  init_complete = 0;
 #endif
 
 //
-// SPINLOCKS
+// CRITICAL SECTIONS
+//
+// Code holding a spinlock (or pushing onto its ready deque) must not be
+// interrupted by a handler that takes the same locks. Rather than masking the
+// protected signals, which costs two system calls per lock, each pthread
+// counts the critical sections it is in; a handler that finds the count
+// non-zero defers its signal (spinlock_signal_deferred), and the signal is
+// raised again when the last critical section ends.
+//
+
+#if SIG_PROTECTED
+static __thread int                   critical_depth;
+static __thread volatile sig_atomic_t critical_deferred_signo;
+#endif
+
+static void critical_enter () {
+#if SIG_PROTECTED
+  critical_depth++;
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+#endif
+}
+
+static void critical_exit () {
+#if SIG_PROTECTED
+  __atomic_signal_fence (__ATOMIC_SEQ_CST);
+  if (--critical_depth == 0 && critical_deferred_signo) {
+    int signo = critical_deferred_signo;
+    critical_deferred_signo = 0;
+    raise (signo);
+  }
+#endif
+}
+
+/**
+ * spinlock_signal_deferred
+ */
+
+int spinlock_signal_deferred (int signo) {
+#if SIG_PROTECTED
+  if (critical_depth > 0 && sigismember (&uthread_protected_sigset, signo) == 1) {
+    critical_deferred_signo = signo;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+static void stats_spun (unsigned long spins);
+
+/**
+ * spinlock_pause
+ *    Tell the CPU that we are spinning.
+ */
+
+static inline void spinlock_pause () {
+#if __i386__ || __x86_64__
+  asm volatile ("pause");
+#endif
+}
+
+/**
+ * spinlock_relax
+ *    Spin once more while waiting for a lock handed over in order, and give up
+ *    the processor every SPINLOCK_SPINS_PER_YIELD spins in case the next owner
+ *    is a pthread that the kernel has descheduled.
+ */
+
+#define SPINLOCK_SPINS_PER_YIELD 4096
+
+static inline void spinlock_relax (unsigned int* spins) {
+  spinlock_pause();
+#if PTHREAD_SUPPORT
+  if (++*spins % SPINLOCK_SPINS_PER_YIELD == 0)
+    sched_yield();
+#endif
+}
+
+//
+// SPINLOCKS
+//
+// Test-and-test-and-set: spin reading the lock, and back off exponentially
+// after each failed exchange so that waiters do not all retry at once.
+//
+
+#define SPINLOCK_MAX_BACKOFF 1024
+
+/**
+ * spinlock_create
+ */
+
+void spinlock_create (spinlock_t* lock) {
+  *lock = 0;
+}
+
+/**
+ * spinlock_lock
+ */
+
+void spinlock_lock (spinlock_t* lock) {
+  unsigned int  backoff = 1;
+  unsigned long spins   = 0;
+  critical_enter();
+  while (__atomic_exchange_n (lock, 1, __ATOMIC_ACQUIRE)) {
+    do {
+      for (unsigned int i = 0; i < backoff; i++)
+        spinlock_pause();
+      spins += backoff;
+      if (backoff < SPINLOCK_MAX_BACKOFF)
+        backoff <<= 1;
+    } while (__atomic_load_n (lock, __ATOMIC_RELAXED));
+  }
+  if (spins)
+    stats_spun (spins);
+}
+
+/**
+ * spinlock_unlock
+ */
+
+void spinlock_unlock (spinlock_t* lock) {
+  __atomic_store_n (lock, 0, __ATOMIC_RELEASE);
+  critical_exit();
+}
+
+//
+// TICKET LOCKS
+//
+// Waiters are served in arrival order; each waits in proportion to the
+// number of tickets ahead of it.
+//
+
+/**
+ * ticketlock_create
+ */
+
+void ticketlock_create (ticketlock_t* lock) {
+  lock->next  = 0;
+  lock->owner = 0;
+}
+
+/**
+ * ticketlock_lock
+ */
+
+void ticketlock_lock (ticketlock_t* lock) {
+  critical_enter();
+  unsigned int ticket = __atomic_fetch_add (&lock->next, 1, __ATOMIC_RELAXED);
+  unsigned int owner, spins = 0;
+  while ((owner = __atomic_load_n (&lock->owner, __ATOMIC_ACQUIRE)) != ticket)
+    for (unsigned int i = 0; i < (ticket - owner) * 32; i++)
+      spinlock_relax (&spins);
+  if (spins)
+    stats_spun (spins);
+}
+
+/**
+ * ticketlock_unlock
+ */
+
+void ticketlock_unlock (ticketlock_t* lock) {
+  __atomic_store_n (&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+  critical_exit();
+}
+
+//
+// MCS LOCKS
+//
+// Waiters form a queue of the nodes they pass in, and each spins on its own
+// node, so a release only disturbs the cache of the next waiter.
+//
+
+/**
+ * mcslock_create
+ */
+
+void mcslock_create (mcslock_t* lock) {
+  *lock = 0;
+}
+
+/**
+ * mcslock_lock
+ */
+
+void mcslock_lock (mcslock_t* lock, mcslock_node_t* node) {
+  critical_enter();
+  node->next   = 0;
+  node->locked = 1;
+  mcslock_node_t* predecessor = __atomic_exchange_n (lock, node, __ATOMIC_ACQ_REL);
+  if (predecessor) {
+    unsigned int spins = 0;
+    __atomic_store_n (&predecessor->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n (&node->locked, __ATOMIC_ACQUIRE))
+      spinlock_relax (&spins);
+    stats_spun (spins);
+  }
+}
+
+/**
+ * mcslock_unlock
+ */
+
+void mcslock_unlock (mcslock_t* lock, mcslock_node_t* node) {
+  mcslock_node_t* successor = __atomic_load_n (&node->next, __ATOMIC_ACQUIRE);
+  if (! successor) {
+    mcslock_node_t* expected = node;
+    if (__atomic_compare_exchange_n (lock, &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      critical_exit();
+      return;
+    }
+    // a waiter is linking itself behind us
+    unsigned int spins = 0;
+    while (! (successor = __atomic_load_n (&node->next, __ATOMIC_ACQUIRE)))
+      spinlock_relax (&spins);
+  }
+  __atomic_store_n (&successor->locked, 0, __ATOMIC_RELEASE);
+  critical_exit();
+}
+
+//
+// THREAD CONTROL BLOCK
+//
+
+struct uthread_TCB {
+  volatile int         state;                 
+  unsigned long        id;
+  volatile uintptr_t   saved_sp;              
+  void*              (*start_proc) (void*);
+  void*                start_arg;
+  void*                return_val;
+  void*                stack;
+  size_t               stack_size;
+  int                  stack_node;
+  spinlock_t           join_spinlock;
+  uthread_t            joiner;
+  volatile int         is_ready;
+  volatile int         unblock_pending;
+  volatile int         priority;
+  int                  base_priority;
+  void*                held_mutexes;          // exclusively, for the mutexes to recompute lent priority
+  uint64_t             deadline;
+  struct uthread_TCB*  remote_next;           // on the list of remote unblocks
+  struct uthread_stats stats;
+  uint64_t             stats_started;         // when it last started running
+  uint64_t             stats_stopped;         // when it last stopped running
+  uint64_t             stats_switched;        // when it is being switched to
+  volatile uint64_t    stats_readied;         // when it was last unblocked
+  int                  stats_blocked;         // it last stopped to block
+  volatile int         stats_preempted;       // it is yielding at the end of its quantum
+#if SIG_PROTECTED
+  int                  isInterrupt;
+#endif
+  struct uthread_TCB*  next;
+};
+
+//
+// CURRENT THREAD
+//
+// Each processor (pthread) keeps the uthread it is running in current_thread,
+// which uthread_switch sets. A uthread can resume on another pthread than the
+// one it stopped on, so the address of current_thread must not be kept across
+// a switch: it is only accessed by these two functions, which are not inlined.
+//
+
+static __thread uthread_t current_thread;
+
+/**
+ * uthread_set_current
+ */
+
+static __attribute__ ((noinline)) void uthread_set_current (uthread_t thread) {
+  current_thread = thread;
+}
+
+/**
+ * uthread_self
+ */
+
+__attribute__ ((noinline)) uthread_t uthread_self() {
+  return current_thread;
+}
+
+/**
+ * uthread_initqueue
+ */
+
+void uthread_initqueue (uthread_queue_t* queue) {
+  queue->head = 0;
+  queue->tail = 0;
+}
+
+/**
+ * uthread_enqueue
+ */
+
+void uthread_enqueue (uthread_queue_t* queue, uthread_t thread) {
+  if(thread->next || thread == queue->tail) {
+    /* already enqueued! */
+    return;
+  }
+  thread->next = 0;
+  if (queue->tail)
+    queue->tail->next = thread;
+  queue->tail = thread;
+  if (queue->head==0)
+    queue->head = queue->tail;
+}
+
+/**
+ * uthread_dequeue
+ */
+
+uthread_t uthread_dequeue (uthread_queue_t* queue) {
+  uthread_t thread;
+  if (queue->head) {
+    thread = queue->head;
+    queue->head = thread->next;
+    thread->next = 0;
+    if (queue->head==0)
+      queue->tail=0;
+  } else 
+    thread=0;
+  return thread;
+}
+
+/**
+ * uthread_dequeue_highest
+ *    Remove the first of the threads with the highest priority.
+ */
+
+uthread_t uthread_dequeue_highest (uthread_queue_t* queue) {
+  uthread_t best = queue->head, best_prev = 0;
+  for (uthread_t prev = queue->head; prev && prev->next; prev = prev->next)
+    if (prev->next->priority > best->priority) {
+      best      = prev->next;
+      best_prev = prev;
+    }
+  if (best == queue->head)
+    return uthread_dequeue (queue);
+  best_prev->next = best->next;
+  if (queue->tail == best)
+    queue->tail = best_prev;
+  best->next = 0;
+  return best;
+}
+
+/**
+ * uthread_queue_highest_priority
+ *    The highest priority of the threads on a queue, or -1 if it is empty.
+ */
+
+int uthread_queue_highest_priority (uthread_queue_t* queue) {
+  int highest = -1;
+  for (uthread_t thread = queue->head; thread; thread = thread->next)
+    if (thread->priority > highest)
+      highest = thread->priority;
+  return highest;
+}
+
+/**
+ * uthread_queue_is_empty
+ */
+
+int uthread_queue_is_empty (uthread_queue_t* queue) {
+  return queue->head == 0;
+}
+
+/**
+ * uthread_priority
+ *    The priority a thread runs at, which a waiter may have raised above its own.
+ */
+
+int uthread_priority (uthread_t thread) {
+  return thread->priority;
+}
+
+/**
+ * uthread_lend_priority
+ *    Raise the priority of the holder of a lock to the caller's, until it
+ *    calls uthread_restore_priority; it takes effect when the holder is next
+ *    made ready.
+ */
+
+void uthread_lend_priority (uthread_t holder) {
+  uthread_raise_priority (holder, uthread_self()->priority);
+}
+
+/**
+ * uthread_raise_priority
+ *    Raise the priority of a thread to priority, if it is lower.
+ */
+
+void uthread_raise_priority (uthread_t thread, int priority) {
+  int current = thread->priority;
+  while (current < priority && ! __atomic_compare_exchange_n (&thread->priority, &current, priority, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/**
+ * uthread_restore_priority
+ *    Drop the priority lent to the caller; the caller then lends itself the
+ *    priority of the waiters of the locks it still holds, with
+ *    uthread_raise_priority, so that a waiter that lends it more meanwhile
+ *    is not overwritten.
+ */
+
+void uthread_restore_priority () {
+  uthread_t self = uthread_self();
+  self->priority = self->base_priority;
+}
+
+/**
+ * uthread_held_mutexes
+ *    The caller's list of the mutexes it holds, which only the mutexes use.
+ */
+
+void** uthread_held_mutexes () {
+  return &uthread_self()->held_mutexes;
+}
+
+/**
+ * uthread_is_running
+ *    Whether a thread is running on a processor; only a hint, as it can stop at any time.
+ */
+
+int uthread_is_running (uthread_t thread) {
+  return thread->state == TS_RUNNING;
+}
+
+//
+// NUMA PLACEMENT
+//
+// Once the processors are pinned to CPUs, memory that one processor mostly
+// uses, its ready rings and the stacks of the threads it creates, is bound
+// to the node of its CPU. Without pinning a processor has no node (-1) and
+// memory goes wherever the kernel puts it. Binding is only a hint: where the
+// kernel refuses it, the memory is still usable.
+//
+
+#define NUMA_MAX_NODES 1024
+
+static int numa_pinned;
+
+/**
+ * numa_node_self
+ *    The node of the calling processor, or -1 if it is not pinned.
+ */
+
+static int numa_node_self () {
+#if NUMA_SUPPORT
+  unsigned int cpu, node;
+  if (numa_pinned && syscall (SYS_getcpu, &cpu, &node, 0) == 0 && node < NUMA_MAX_NODES)
+    return node;
+#endif
+  return -1;
+}
+
+/**
+ * numa_bind
+ *    Prefer node for the pages of a mapping that are not touched yet.
+ */
+
+static void numa_bind (void* addr, size_t length, int node) {
+#if NUMA_SUPPORT
+  unsigned long nodemask [NUMA_MAX_NODES / (8 * sizeof (unsigned long))] = {0};
+  if (node < 0)
+    return;
+  nodemask [node / (8 * sizeof (unsigned long))] = 1ul << (node % (8 * sizeof (unsigned long)));
+  syscall (SYS_mbind, addr, length, MPOL_PREFERRED, nodemask, NUMA_MAX_NODES, 0);
+#endif
+}
+
+/**
+ * numa_alloc
+ *    Memory that is never freed, on node if it is not -1.
+ */
+
+static void* numa_alloc (int node, size_t size) {
+  if (node < 0)
+    return malloc (size);
+  size_t page_size = sysconf (_SC_PAGESIZE);
+  size = (size + page_size - 1) & ~(page_size - 1);
+  void* memory = mmap (0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert (memory != MAP_FAILED);
+  numa_bind (memory, size, node);
+  return memory;
+}
+
+//
+// READY QUEUE
+//
+// Each virtual processor (pthread) has its own ready deque, in the style of
+// Chase-Lev, to which only that processor pushes, without locks; it has one
+// per priority, and a bitmap of the priorities that may have threads, so the
+// highest one is found with one instruction. Threads are taken from the
+// top, oldest first, both by the owner and by idle processors stealing from
+// a random victim, with a compare-and-swap on top; so a yielding thread
+// still goes behind the other threads of its priority on its processor. A
+// processor runs a thread of a higher priority than its own best from
+// another processor first. A full ring is replaced by one twice as large;
+// outgrown rings are never freed, as a thief may still be reading them.
+//
+// Threads with a deadline are kept apart, in a heap under a spinlock, and
+// all run before the others, earliest deadline first.
+//
+// A pthread that is not a processor, such as an I/O completion thread, has
+// no deque to push onto; the threads it unblocks go on a shared FIFO list,
+// also under a spinlock, that processors take from before their deques.
+//
+// When the processors are pinned to CPUs, each deque knows its NUMA node;
+// its rings are allocated there, and thieves try the deques of their own
+// node before the others.
+//
+
+#define READY_QUEUE_INITIAL_CAPACITY 64
+#define NUM_PRIORITIES               (UTHREAD_PRIORITY_MAX + 1)
+
+struct ready_ring {
+  long      capacity;
+  uthread_t slots[];
+};
+
+struct ready_level {
+  volatile long      top;
+  volatile long      bottom;
+  struct ready_ring* ring;
+} __attribute__ ((aligned (64)));
+
+struct ready_deque {
+  struct ready_level levels [NUM_PRIORITIES];
+  volatile unsigned  levels_mask;
+  unsigned int       steal_seed;
+  int                node;
+  struct uthread_processor_stats stats;
+  struct trace_event*    trace_events;
+  volatile unsigned long trace_next;
+  struct uthread_work* volatile work;          // to run here, pushed by anyone
+#if PTHREAD_IDLE_SLEEP
+  volatile int       parked;
+#if ! __linux__
+  pthread_mutex_t    park_mutex;
+  pthread_cond_t     park_cond;
+#endif
+#endif
+} __attribute__ ((aligned (64)));
+
+static struct ready_deque* ready_deques;
+static int                 num_ready_deques;
+static int                 num_registered_deques;
+#if PTHREAD_SUPPORT
+static pthread_key_t       pthread_ready_deque;
+#endif
+#if PTHREAD_IDLE_SLEEP
+int                    pthread_num_sleeping = 0;
+pthread_key_t          pthread_base_thread;
+#endif
+
+static spinlock_t   deadline_spinlock;
+static uthread_t*   deadline_heap;
+static volatile int deadline_heap_length;
+static int          deadline_heap_capacity;
+
+static spinlock_t   remote_spinlock;
+static uthread_t    remote_head, remote_tail;     // linked by remote_next
+static volatile int remote_length;
+
+/**
+ * ready_ring_new
+ *    Called by the processor that owns the ring.
+ */
+
+static struct ready_ring* ready_ring_new (int node, long capacity) {
+  struct ready_ring* ring = numa_alloc (node, sizeof (struct ready_ring) + capacity * sizeof (uthread_t));
+  assert (ring);
+  ring->capacity = capacity;
+  return ring;
+}
+
+/**
+ * ready_queue_self
+ *    The ready deque of the processor (pthread) running the caller.
+ */
+
+static struct ready_deque* ready_queue_self () {
+#if PTHREAD_SUPPORT
+  struct ready_deque* deque = pthread_getspecific (pthread_ready_deque);
+  assert (deque);
+  return deque;
+#else
+  return &ready_deques [0];
+#endif
+}
+
+/**
+ * ready_queue_registered
+ *    The ready deque of the calling pthread, or 0 if it has none (yet).
+ */
+
+static struct ready_deque* ready_queue_registered () {
+  if (! __atomic_load_n (&num_registered_deques, __ATOMIC_RELAXED))
+    return 0;
+#if PTHREAD_SUPPORT
+  return pthread_getspecific (pthread_ready_deque);
+#else
+  return &ready_deques [0];
+#endif
+}
+
+static void trace_register (struct ready_deque*);
+
+/**
+ * ready_queue_register
+ *    Give the calling pthread the next ready deque, and allocate its rings
+ *    on the pthread's node.
+ */
+
+static void ready_queue_register () {
+  int i = __atomic_fetch_add (&num_registered_deques, 1, __ATOMIC_RELAXED);
+  assert (i < num_ready_deques);
+  struct ready_deque* deque = &ready_deques [i];
+  deque->node = numa_node_self();
+  for (int priority = 0; priority < NUM_PRIORITIES; priority++)
+    deque->levels [priority].ring = ready_ring_new (deque->node, READY_QUEUE_INITIAL_CAPACITY);
+  trace_register (deque);
+#if PTHREAD_SUPPORT
+  pthread_setspecific (pthread_ready_deque, deque);
+#endif
+}
+
+/**
+ * uthread_processor
+ *    The index of the processor running the caller, below uthread_num_processors,
+ *    or -1 on a pthread that is not a processor.
+ */
+
+int uthread_processor () {
+  struct ready_deque* deque = ready_queue_registered();
+  return deque ? deque - ready_deques : -1;
+}
+
+/**
+ * uthread_num_processors
+ */
+
+int uthread_num_processors () {
+  return num_ready_deques;
+}
+
+/**
+ * ready_queue_push
+ *    Only called by the owner of the queue, in a critical section.
+ */
+
+static void ready_queue_push (struct ready_deque* deque, uthread_t thread) {
+  int                 priority = thread->priority;
+  struct ready_level* level    = &deque->levels [priority];
+  long                bottom   = level->bottom;
+  long                top      = __atomic_load_n (&level->top, __ATOMIC_ACQUIRE);
+  struct ready_ring*  ring     = level->ring;
+
+  if (bottom - top >= ring->capacity) {
+    struct ready_ring* larger = ready_ring_new (deque->node, ring->capacity * 2);
+    for (long i = top; i < bottom; i++)
+      larger->slots [i & (larger->capacity - 1)] = ring->slots [i & (ring->capacity - 1)];
+    __atomic_store_n (&level->ring, larger, __ATOMIC_RELEASE);
+    ring = larger;
+  }
+  __atomic_store_n (&ring->slots [bottom & (ring->capacity - 1)], thread, __ATOMIC_RELAXED);
+  // ordered before the load of the mask, which a taker clears before it looks at bottom
+  __atomic_store_n (&level->bottom, bottom + 1, __ATOMIC_SEQ_CST);
+  if (! (__atomic_load_n (&deque->levels_mask, __ATOMIC_SEQ_CST) & (1u << priority)))
+    __atomic_fetch_or (&deque->levels_mask, 1u << priority, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * ready_level_take
+ *    Take the oldest thread of a level, or return 0 if it is empty.
+ */
+
+static uthread_t ready_level_take (struct ready_level* level) {
+  while (1) {
+    long top = __atomic_load_n (&level->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n (&level->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+      return 0;
+    struct ready_ring* ring   = __atomic_load_n (&level->ring, __ATOMIC_ACQUIRE);
+    uthread_t          thread = __atomic_load_n (&ring->slots [top & (ring->capacity - 1)], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n (&level->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return thread;
+  }
+}
+
+/**
+ * ready_queue_highest
+ *    The highest priority that may have threads in a deque, or -1.
+ */
+
+static int ready_queue_highest (struct ready_deque* deque) {
+  unsigned mask = __atomic_load_n (&deque->levels_mask, __ATOMIC_SEQ_CST);
+  return mask ? 31 - __builtin_clz (mask) : -1;
+}
+
+/**
+ * ready_queue_take
+ *    Take the oldest thread of the highest priority of a queue that is at
+ *    least min_priority, or return 0 if there is none. Clears the bits of the
+ *    levels it finds empty.
+ */
+
+static uthread_t ready_queue_take (struct ready_deque* deque, int min_priority) {
+  unsigned mask = __atomic_load_n (&deque->levels_mask, __ATOMIC_SEQ_CST) >> min_priority << min_priority;
+
+  while (mask) {
+    int       priority = 31 - __builtin_clz (mask);
+    uthread_t thread   = ready_level_take (&deque->levels [priority]);
+    if (thread)
+      return thread;
+    __atomic_fetch_and (&deque->levels_mask, ~(1u << priority), __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&deque->levels [priority].top, __ATOMIC_SEQ_CST) < __atomic_load_n (&deque->levels [priority].bottom, __ATOMIC_SEQ_CST))
+      __atomic_fetch_or (&deque->levels_mask, 1u << priority, __ATOMIC_SEQ_CST);
+    mask &= ~(1u << priority);
+  }
+  return 0;
+}
+
+/**
+ * ready_queue_steal
+ *    Take a thread of at least min_priority from the other processors,
+ *    starting at a random one, those on the caller's node first.
+ */
+
+static uthread_t ready_queue_steal (struct ready_deque* self, int min_priority) {
+  uthread_t thread = 0;
+  self->steal_seed ^= self->steal_seed << 13;
+  self->steal_seed ^= self->steal_seed >> 17;
+  self->steal_seed ^= self->steal_seed << 5;
+  int start = self->steal_seed % num_ready_deques;
+  for (int same_node = 1; same_node >= 0 && ! thread; same_node--)
+    for (int i = 0, victim = start; i < num_ready_deques && ! thread; i++, victim = (victim + 1) % num_ready_deques)
+      if (&ready_deques [victim] != self && (ready_deques [victim].node == self->node) == same_node
+          && ready_queue_highest (&ready_deques [victim]) >= min_priority)
+        thread = ready_queue_take (&ready_deques [victim], min_priority);
+  return thread;
+}
+
+/**
+ * deadline_heap_push
+ *    Called with deadline_spinlock held.
+ */
+
+static void deadline_heap_push (uthread_t thread) {
+  int i = deadline_heap_length;
+
+  if (i == deadline_heap_capacity) {
+    deadline_heap_capacity = deadline_heap_capacity ? deadline_heap_capacity * 2 : 64;
+    deadline_heap          = realloc (deadline_heap, deadline_heap_capacity * sizeof (uthread_t));
+    assert (deadline_heap);
+  }
+  for (; i > 0 && deadline_heap [(i - 1) / 2]->deadline > thread->deadline; i = (i - 1) / 2)
+    deadline_heap [i] = deadline_heap [(i - 1) / 2];
+  deadline_heap [i] = thread;
+  __atomic_store_n (&deadline_heap_length, deadline_heap_length + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * deadline_heap_pop
+ *    The thread with the earliest deadline, or 0.
+ */
+
+static uthread_t deadline_heap_pop () {
+  uthread_t thread = 0;
+
+  if (__atomic_load_n (&deadline_heap_length, __ATOMIC_SEQ_CST) == 0)
+    return 0;
+  spinlock_lock (&deadline_spinlock);
+  if (deadline_heap_length > 0) {
+    int       length = deadline_heap_length - 1;
+    uthread_t last   = deadline_heap [length];
+    int       i      = 0;
+    thread = deadline_heap [0];
+    while (2 * i + 1 < length) {
+      int child = 2 * i + 1;
+      if (child + 1 < length && deadline_heap [child + 1]->deadline < deadline_heap [child]->deadline)
+        child += 1;
+      if (last->deadline <= deadline_heap [child]->deadline)
+        break;
+      deadline_heap [i] = deadline_heap [child];
+      i = child;
+    }
+    deadline_heap [i] = last;
+    __atomic_store_n (&deadline_heap_length, length, __ATOMIC_SEQ_CST);
+  }
+  spinlock_unlock (&deadline_spinlock);
+  return thread;
+}
+
+/**
+ * remote_queue_push
+ *    Called by a pthread that is not a processor.
+ */
+
+static void remote_queue_push (uthread_t thread) {
+  thread->remote_next = 0;
+  spinlock_lock (&remote_spinlock);
+  if (remote_tail)
+    remote_tail->remote_next = thread;
+  else
+    remote_head = thread;
+  remote_tail = thread;
+  __atomic_store_n (&remote_length, remote_length + 1, __ATOMIC_SEQ_CST);
+  spinlock_unlock (&remote_spinlock);
+}
+
+/**
+ * remote_queue_pop
+ *    The thread unblocked first by a pthread that is not a processor, or 0.
+ */
+
+static uthread_t remote_queue_pop () {
+  uthread_t thread;
+
+  if (__atomic_load_n (&remote_length, __ATOMIC_SEQ_CST) == 0)
+    return 0;
+  spinlock_lock (&remote_spinlock);
+  thread = remote_head;
+  if (thread) {
+    remote_head = thread->remote_next;
+    if (! remote_head)
+      remote_tail = 0;
+    __atomic_store_n (&remote_length, remote_length - 1, __ATOMIC_SEQ_CST);
+  }
+  spinlock_unlock (&remote_spinlock);
+  return thread;
+}
+
+/**
+ * ready_queue_run_work
+ *    Run the work added to the processor, oldest first, in a critical section.
+ */
+
+static void ready_queue_run_work (struct ready_deque* self) {
+  struct uthread_work* work = 0, * next;
+
+  if (! __atomic_load_n (&self->work, __ATOMIC_ACQUIRE))
+    return;
+  for (struct uthread_work* w = __atomic_exchange_n (&self->work, 0, __ATOMIC_ACQ_REL); w; w = next) {
+    next    = w->next;
+    w->next = work;
+    work    = w;
+  }
+  for (; work; work = next) {
+    next = work->next;
+    work->proc (work->arg);
+  }
+}
+
+/**
+ * ready_queue_is_empty
+ */
+
+static int ready_queue_is_empty () {
+  if (__atomic_load_n (&deadline_heap_length, __ATOMIC_SEQ_CST) || __atomic_load_n (&remote_length, __ATOMIC_SEQ_CST))
+    return 0;
+  for (int i = 0; i < num_ready_deques; i++)
+    if (__atomic_load_n (&ready_deques [i].levels_mask, __ATOMIC_SEQ_CST))
+      return 0;
+  return 1;
+}
+
+//
+// STATISTICS
+//
+// A thread counts in its TCB, and a processor in its deque, with plain
+// stores. A switch reads the clock once, when the thread is switched out,
+// and charges the time since the previous switch to running, waiting ready
+// or being blocked. A thread that is unblocked before it is done stopping
+// was not blocked at all.
+//
+
+/**
+ * stats_now
+ */
+
+static uint64_t stats_now () {
+#if STATS_SUPPORT
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+#else
+  return 0;
+#endif
+}
+
+/**
+ * stats_processor
+ *    The statistics of the calling processor, or 0 if it has no deque yet.
+ */
+
+static struct uthread_processor_stats* stats_processor () {
+  struct ready_deque* deque = ready_queue_registered();
+  return deque ? &deque->stats : 0;
+}
+
+/**
+ * stats_spun
+ *    Called by a spinlock acquired after spinning.
+ */
+
+static void stats_spun (unsigned long spins) {
+#if STATS_SUPPORT
+  struct uthread_processor_stats* processor = stats_processor();
+  if (processor)
+    processor->spinlock_spins += spins;
+#endif
+}
+
+/**
+ * stats_switch_out
+ *    Called in a critical section by from_thread, about to stop in from_thread_state.
+ */
+
+static void stats_switch_out (uthread_t from_thread, uthread_t to_thread, int from_thread_state) {
+#if STATS_SUPPORT
+  struct uthread_processor_stats* processor = stats_processor();
+  uint64_t now = stats_now();
+  uint64_t run = now - from_thread->stats_started;
+
+  from_thread->stats.run_nsec += run;
+  processor->threads.run_nsec += run;
+  if (from_thread_state == TS_RUNABLE && from_thread->stats_preempted) {
+    from_thread->stats.preemptions += 1;
+    processor->threads.preemptions += 1;
+  } else if (from_thread_state == TS_RUNABLE) {
+    from_thread->stats.yields += 1;
+    processor->threads.yields += 1;
+  } else if (from_thread_state == TS_BLOCKED) {
+    from_thread->stats.blocks += 1;
+    processor->threads.blocks += 1;
+  }
+  from_thread->stats_preempted = 0;
+  from_thread->stats_blocked   = from_thread_state == TS_BLOCKED;
+  from_thread->stats_stopped   = now;
+  to_thread->stats_switched    = now;
+#endif
+}
+
+/**
+ * stats_switch_in
+ *    Called in a critical section by a thread that was just switched to.
+ */
+
+static void stats_switch_in (uthread_t thread) {
+#if STATS_SUPPORT
+  struct uthread_processor_stats* processor = stats_processor();
+  uint64_t now     = thread->stats_switched;
+  uint64_t since   = thread->stats_stopped;
+  uint64_t blocked = 0;
+  uint64_t ready;
+  int      bucket;
+
+  if (thread->stats_blocked && thread->stats_readied > since) {
+    blocked = thread->stats_readied - since;
+    since   = thread->stats_readied;
+  }
+  ready  = now > since ? now - since : 0;
+  bucket = ready ? 63 - __builtin_clzll (ready) : 0;
+  if (bucket >= UTHREAD_STATS_BUCKETS)
+    bucket = UTHREAD_STATS_BUCKETS - 1;
+  thread->stats.switches        += 1;
+  thread->stats.ready_nsec      += ready;
+  thread->stats.blocked_nsec    += blocked;
+  thread->stats_started          = now;
+  processor->threads.switches     += 1;
+  processor->threads.ready_nsec   += ready;
+  processor->threads.blocked_nsec += blocked;
+  processor->ready_histogram [bucket] += 1;
+#endif
+}
+
+//
+// TRACING
+//
+// With a trace file set, each processor records events in a ring of its
+// own, dropping the oldest when it is full, and the rings are written out
+// as Chrome trace JSON at exit, one track per processor. A slot is claimed
+// with an atomic increment, which an interrupt on the same processor can
+// not tear, so recording takes no lock. A switch is one event, which ends
+// the slice of the thread switched out and begins the slice of the next.
+//
+
+#define TRACE_SWITCH 's'
+
+struct trace_event {
+  uint64_t      time;
+  const char*   name;
+  unsigned long id;
+  unsigned long to_id;
+  char          phase;
+  char          state;
+};
+
+static const char*   trace_path;
+static unsigned long trace_capacity;          // a power of two, or 0 if not tracing
+static unsigned long next_thread_id;
+
+/**
+ * trace_record
+ */
+
+static void trace_record (const char* name, char phase, unsigned long id, unsigned long to_id, int state) {
+#if TRACE_SUPPORT
+  struct ready_deque* deque = trace_capacity ? ready_queue_registered() : 0;
+  struct timespec     now;
+  if (! deque)
+    return;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  unsigned long       i     = __atomic_fetch_add (&deque->trace_next, 1, __ATOMIC_RELAXED);
+  struct trace_event* event = &deque->trace_events [i & (trace_capacity - 1)];
+  event->time  = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  event->name  = name;
+  event->id    = id;
+  event->to_id = to_id;
+  event->phase = phase;
+  event->state = state;
+#endif
+}
+
+/**
+ * trace_state_name
+ */
+
+static const char* trace_state_name (int state) {
+  switch (state) {
+    case TS_RUNABLE: return "yielded";
+    case TS_BLOCKED: return "blocked";
+    case TS_DYING:   return "exited";
+    default:         return "stopped";
+  }
+}
+
+/**
+ * trace_write
+ *    Called at exit: write every processor's ring to trace_path.
+ */
+
+static void trace_write () {
+  FILE* file = fopen (trace_path, "w");
+  if (! file) {
+    perror (trace_path);
+    return;
+  }
+  fprintf (file, "{\"traceEvents\": [\n");
+  for (int p = 0; p < num_ready_deques; p++) {
+    struct ready_deque* deque = &ready_deques [p];
+    unsigned long       next  = deque->trace_events ? deque->trace_next : 0;
+    fprintf (file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"processor %d\"}}", p, p);
+    for (unsigned long i = next > trace_capacity ? next - trace_capacity : 0; i < next; i++) {
+      struct trace_event* event = &deque->trace_events [i & (trace_capacity - 1)];
+      double              usec  = event->time / 1000.0;
+      if (event->phase == TRACE_SWITCH) {
+        fprintf (file, ",\n{\"name\": \"uthread %lu\", \"ph\": \"E\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {\"state\": \"%s\"}}",
+                 event->id, usec, p, trace_state_name (event->state));
+        fprintf (file, ",\n{\"name\": \"uthread %lu\", \"ph\": \"B\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}",
+                 event->to_id, usec, p);
+      } else if (event->phase == 'b' || event->phase == 'e')
+        fprintf (file, ",\n{\"name\": \"%s\", \"cat\": \"uthread\", \"ph\": \"%c\", \"id\": \"%#lx\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d}",
+                 event->name, event->phase, event->id, usec, p);
+      else
+        fprintf (file, ",\n{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {\"id\": \"%#lx\"}}",
+                 event->name, usec, p, event->id);
+    }
+    fprintf (file, p + 1 < num_ready_deques ? ",\n" : "\n");
+  }
+  fprintf (file, "]}\n");
+  fclose (file);
+}
+
+/**
+ * trace_register
+ *    Give a processor's deque its ring.
+ */
+
+static void trace_register (struct ready_deque* deque) {
+  if (trace_capacity)
+    deque->trace_events = numa_alloc (deque->node, trace_capacity * sizeof (struct trace_event));
+}
+
+#if PTHREAD_IDLE_SLEEP
+//
+// IDLE PARKING
+//
+// An idle processor parks on its own deque's parked word and counts itself
+// in pthread_num_sleeping; an enqueue that sees a sleeper claims one parked
+// processor, starting with the next one after its own, by clearing its
+// parked word, and wakes only that one. With no sleepers an enqueue costs
+// a fence and a load. The parked word is a futex on Linux.
+//
+
+/**
+ * ready_deque_park_wait
+ *    Sleep until deque->parked is no longer 1 (or spuriously).
+ */
+
+static void ready_deque_park_wait (struct ready_deque* deque) {
+#if __linux__
+  syscall (SYS_futex, &deque->parked, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+#else
+  pthread_mutex_lock (&deque->park_mutex);
+  if (deque->parked)
+    pthread_cond_wait (&deque->park_cond, &deque->park_mutex);
+  pthread_mutex_unlock (&deque->park_mutex);
+#endif
+}
+
+/**
+ * ready_deque_park_wake
+ *    Wake the processor sleeping on deque, once its parked word is cleared.
+ */
+
+static void ready_deque_park_wake (struct ready_deque* deque) {
+#if __linux__
+  syscall (SYS_futex, &deque->parked, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+  pthread_mutex_lock   (&deque->park_mutex);
+  pthread_cond_signal  (&deque->park_cond);
+  pthread_mutex_unlock (&deque->park_mutex);
+#endif
+}
+
+/**
+ * ready_deque_unpark
+ *    Claim a parked processor; returns 0 if it already left.
+ */
+
+static int ready_deque_unpark (struct ready_deque* deque) {
+  int parked = 1;
+  if (! __atomic_compare_exchange_n (&deque->parked, &parked, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return 0;
+  __atomic_fetch_sub (&pthread_num_sleeping, 1, __ATOMIC_SEQ_CST);
+  return 1;
+}
+
+/**
+ * ready_deque_park
+ *    Sleep until an enqueue wakes this processor, unless the deques are not empty.
+ */
+
+static void ready_deque_park (struct ready_deque* self) {
+  uint64_t start = stats_now();
+  __atomic_store_n   (&self->parked, 1, __ATOMIC_SEQ_CST);
+  __atomic_fetch_add (&pthread_num_sleeping, 1, __ATOMIC_SEQ_CST);
+  if ((! ready_queue_is_empty() || __atomic_load_n (&self->work, __ATOMIC_SEQ_CST)) && ready_deque_unpark (self))
+    return;
+  while (__atomic_load_n (&self->parked, __ATOMIC_SEQ_CST))
+    ready_deque_park_wait (self);
+  self->stats.parks     += 1;
+  self->stats.idle_nsec += stats_now() - start;
+}
+
+/**
+ * ready_queue_wakeup
+ *    Wake one parked processor, if there is one.
+ */
+
+static void ready_queue_wakeup (struct ready_deque* self) {
+  int start = self - ready_deques;
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  for (int i = 1; i <= num_ready_deques && __atomic_load_n (&pthread_num_sleeping, __ATOMIC_RELAXED); i++) {
+    struct ready_deque* deque = &ready_deques [(start + i) % num_ready_deques];
+    if (__atomic_load_n (&deque->parked, __ATOMIC_RELAXED) && ready_deque_unpark (deque)) {
+      ready_deque_park_wake (deque);
+      return;
+    }
+  }
+}
+#endif
+
+/**
+ * ready_queue_enqueue
+ *    reason is READY_UNBLOCKED or READY_YIELDED. A thread is only queued once;
+ *    when an unblock finds it queued by a yield, or a yield finds it queued by
+ *    an unblock, the single entry resumes it from the yield, and the unblock
+ *    is kept for its next uthread_block.
+ */
+
+static void ready_queue_enqueue (uthread_t thread, int reason) {
+  int was_ready = __atomic_exchange_n (&thread->is_ready, reason, __ATOMIC_ACQ_REL);
+  if (was_ready) {
+    /* already enqueued! */
+    if (was_ready != reason)
+      __atomic_store_n (&thread->unblock_pending, 1, __ATOMIC_RELEASE);
+    return;
+  }
+  struct ready_deque* self = ready_queue_registered();
+  if (reason == READY_UNBLOCKED)
+    thread->stats_readied = stats_now();
+  if (thread->deadline) {
+    spinlock_lock      (&deadline_spinlock);
+    deadline_heap_push (thread);
+    spinlock_unlock    (&deadline_spinlock);
+  } else if (! self) {
+    // not a processor
+    remote_queue_push (thread);
+    self = ready_deques;
+  } else {
+    // an interrupt must not push onto the queue while its owner is pushing
+    critical_enter();
+    ready_queue_push (self, thread);
+    critical_exit();
+  }
+#if PTHREAD_IDLE_SLEEP
+  ready_queue_wakeup (self);
+#endif
+}
+
+/**
+ * ready_queue_dequeue
+ */
+
+static uthread_t ready_queue_dequeue() {
+  struct ready_deque* self   = ready_queue_self();
+  uthread_t           thread = 0;
+  
+  while (! thread) {
+    ready_queue_run_work (self);
+    int highest = ready_queue_highest (self);
+    thread = deadline_heap_pop();
+    if (! thread)
+      thread = remote_queue_pop();
+    if (! thread && highest >= 0 && num_ready_deques > 1)
+      thread = ready_queue_steal (self, highest + 1);
+    if (! thread)
+      thread = ready_queue_take (self, 0);
+    if (! thread)
+      thread = ready_queue_steal (self, 0);
+    if (thread) {
+      __atomic_store_n (&thread->is_ready, 0, __ATOMIC_RELEASE);
+      break;
+    }
+#if PTHREAD_IDLE_SLEEP
+    thread = (uthread_t) pthread_getspecific (pthread_base_thread);
+    assert (thread);
+    if (thread == uthread_self()) {
+      // pthread_base is running ... park the pthread, taking signals while asleep
+      critical_exit();
+      ready_deque_park (self);
+      critical_enter();
+      thread = 0;
+    }
+#endif
+  }
+  return thread;
+}
+
+static void ready_queue_init (int num_processors) {
+  num_ready_deques = num_processors;
+  ready_deques     = calloc (num_processors, sizeof (struct ready_deque));
+  assert (ready_deques);
+  for (int i = 0; i < num_processors; i++) {
+    ready_deques [i].steal_seed = 2463534242u + i;
+    ready_deques [i].node       = -1;
+#if PTHREAD_IDLE_SLEEP && ! __linux__
+    pthread_mutex_init (&ready_deques [i].park_mutex, NULL);
+    pthread_cond_init  (&ready_deques [i].park_cond, NULL);
+#endif
+  }
+#if PTHREAD_SUPPORT
+  pthread_key_create (&pthread_ready_deque, 0);
+#endif
+  ready_queue_register();
+}
+
+//
+// UTHREAD PRIVATE IMPLEMENTATION
+//
+
+static void uthread_stop    (int);
+static void uthread_start   (uthread_t);
+static void uthread_free    (uthread_t);
+
+//
+// STACK POOL
+//
+// A stack is mapped with a guard page below it, so that an overflow faults,
+// and its TCB at its top. Freed threads keep their stack and TCB in the
+// pool; uthread_new_thread looks for one of the size it needs among the
+// first STACK_POOL_SCAN, so that creating a thread usually needs no system
+// call. A stack is bound to the node of the processor that creates the
+// thread, which is where it first runs, and is only reused on that node.
+// Beyond STACK_POOL_MAX pooled threads, the memory of a freed stack is
+// given back, but its TCB is never unmapped: a stale uthread_t can still be
+// read (as the mutex does with its holder's).
 //
 
+#define STACK_POOL_MAX   1024
+#define STACK_POOL_SCAN  8
+
+static spinlock_t stack_pool_spinlock = 0;
+static uthread_t  stack_pool;                 // freed threads, linked by next
+static int        stack_pool_length;
+static size_t     stack_page_size;
+
 /**
- * spinlock_create
+ * stack_round
+ *    The size of a stack of at least size bytes (the default if 0).
  */
 
-void spinlock_create (spinlock_t* lock) {
-  *lock = 0;
+static size_t stack_round (size_t size) {
+  if (! size)
+    size = UTHREAD_DEFAULT_STACK_SIZE;
+  size = (size + stack_page_size - 1) & ~(stack_page_size - 1);
+  if (size < 4 * stack_page_size)
+    size = 4 * stack_page_size;
+  return size;
 }
 
 /**
- * spinlock_lock
+ * stack_alloc
+ *    A thread with a stack of the given size, from the pool if it has one.
  */
 
-void spinlock_lock (spinlock_t* lock) {
-#if SIG_PROTECTED
-  if (!uthread_isInterrupt())
-    sigprocmask (SIG_BLOCK, &uthread_protected_sigset, NULL);
-#endif
-  int already_held=1;
-  do {
-    while (*lock);
-    asm volatile ("xchg  %0, %1\n" : "=m" (*lock), "=r" (already_held) : "1" (already_held));
-  } while (already_held);
+static uthread_t stack_alloc (size_t size) {
+  uthread_t  thread;
+  uthread_t* link;
+  int        i;
+  int        node = ready_queue_self()->node;
+
+  spinlock_lock (&stack_pool_spinlock);
+  for (link = &stack_pool, i = 0; *link && i < STACK_POOL_SCAN; link = &(*link)->next, i++)
+    if ((*link)->stack_size == size && (*link)->stack_node == node)
+      break;
+  thread = i < STACK_POOL_SCAN ? *link : 0;
+  if (thread) {
+    *link = thread->next;
+    stack_pool_length -= 1;
+  }
+  spinlock_unlock (&stack_pool_spinlock);
+
+  if (! thread) {
+    size_t tcb_size = (sizeof (struct uthread_TCB) + 63) & ~63;
+    void*  stack    = mmap (0, stack_page_size + size + tcb_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert (stack != MAP_FAILED);
+    int err = mprotect (stack, stack_page_size, PROT_NONE);
+    assert (! err);
+    numa_bind ((void*) ((uintptr_t) stack + stack_page_size), size + tcb_size, node);
+    thread             = (uthread_t) ((uintptr_t) stack + stack_page_size + size);
+    thread->stack      = stack;
+    thread->stack_size = size;
+    thread->stack_node = node;
+  }
+  return thread;
 }
 
 /**
- * spinlock_unlock
+ * stack_free
+ *    Give a thread and its stack back to the pool.
  */
 
-void spinlock_unlock (spinlock_t* lock) {
-  *lock = 0;
-#if SIG_PROTECTED
-  if (!uthread_isInterrupt())
-    sigprocmask (SIG_UNBLOCK, &uthread_protected_sigset, NULL);
-#endif
+static void stack_free (uthread_t thread) {
+  if (stack_pool_length >= STACK_POOL_MAX)
+    madvise ((void*) ((uintptr_t) thread->stack + stack_page_size), thread->stack_size, MADV_DONTNEED);
+  spinlock_lock (&stack_pool_spinlock);
+  thread->next       = stack_pool;
+  stack_pool         = thread;
+  stack_pool_length += 1;
+  spinlock_unlock (&stack_pool_spinlock);
 }
 
 //
-// THREAD CONTROL BLOCK
+// PREEMPTION
+//
+// With a quantum set, each pthread has a timer on its own CPU-time clock, so
+// an idle pthread gets no ticks, that sends it PREEMPT_SIGNO every quantum;
+// the handler makes the running uthread yield. It only switches at a safe
+// point: outside critical sections (the signal is deferred until they end)
+// and interrupts, when the signal did not interrupt another handler or code
+// outside the program itself (such as the C library, which may hold locks),
+// and when another thread is ready. A tick that finds no safe point is
+// dropped; the thread is preempted one quantum later.
 //
 
-struct uthread_TCB {
-  volatile int         state;                 
-  volatile uintptr_t   saved_sp;              
-  void*              (*start_proc) (void*);
-  void*                start_arg;
-  void*                return_val;
-  void*                stack;
-  spinlock_t           join_spinlock;
-  uthread_t            joiner;
-#if SIG_PROTECTED
-  int                  isInterrupt;
+#if PREEMPT_SUPPORT
+#ifndef PREEMPT_SIGNO
+#define PREEMPT_SIGNO SIGVTALRM
+#endif
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
 #endif
-  struct uthread_TCB*  next;
-};
 
-/**
- * uthread_initqueue
- */
+extern char __executable_start [], etext [];
 
-void uthread_initqueue (uthread_queue_t* queue) {
-  queue->head = 0;
-  queue->tail = 0;
-}
+static unsigned int preempt_quantum_usec;
 
 /**
- * uthread_enqueue
+ * preempt_pc
+ *    The address of the instruction a signal interrupted.
  */
 
-void uthread_enqueue (uthread_queue_t* queue, uthread_t thread) {
-  if(thread->next || thread == queue->tail) {
-    /* already enqueued! */
-    return;
-  }
-  thread->next = 0;
-  if (queue->tail)
-    queue->tail->next = thread;
-  queue->tail = thread;
-  if (queue->head==0)
-    queue->head = queue->tail;
+static uintptr_t preempt_pc (ucontext_t* context) {
+#if __x86_64__
+  return context->uc_mcontext.gregs [REG_RIP];
+#else
+  return context->uc_mcontext.gregs [REG_EIP];
+#endif
 }
 
 /**
- * uthread_dequeue
+ * preempt_handler
  */
 
-uthread_t uthread_dequeue (uthread_queue_t* queue) {
-  uthread_t thread;
-  if (queue->head) {
-    thread = queue->head;
-    queue->head = thread->next;
-    thread->next = 0;
-    if (queue->head==0)
-      queue->tail=0;
-  } else 
-    thread=0;
-  return thread;
+static void preempt_handler (int signo, siginfo_t* info, void* uap) {
+  ucontext_t* context = uap;
+  uintptr_t   pc      = preempt_pc (context);
+  uthread_t   self;
+
+  if (spinlock_signal_deferred (signo) || ! init_complete)
+    return;
+  // raised again at the end of a critical section, which is a safe point
+  if (info->si_code != SI_TKILL && (pc < (uintptr_t) __executable_start || pc >= (uintptr_t) etext))
+    return;
+  if (sigismember (&context->uc_sigmask, PREEMPT_SIGNO) == 1 || sigismember (&context->uc_sigmask, SIGALRM) == 1)
+    return;
+  self = uthread_self();
+  if (self->state != TS_RUNNING || self->isInterrupt || ready_queue_is_empty())
+    return;
+#if PTHREAD_IDLE_SLEEP
+  if (self == pthread_getspecific (pthread_base_thread))
+    return;
+#endif
+  // the next thread must not run with this signal blocked
+  pthread_sigmask (SIG_SETMASK, &context->uc_sigmask, NULL);
+  self->stats_preempted = 1;
+  uthread_yield();
 }
 
 /**
- * uthread_queue_is_empty
+ * preempt_start
+ *    Start the timer of the calling pthread.
  */
 
-int uthread_queue_is_empty (uthread_queue_t* queue) {
-  return queue->head == 0;
-}
-
-//
-// READY QUEUE
-//
+static void preempt_start () {
+  struct sigevent   event;
+  struct itimerspec quantum;
+  timer_t           timer;
 
-static spinlock_t      ready_queue_spinlock;
-static uthread_queue_t ready_queue;
-#if PTHREAD_IDLE_SLEEP
-pthread_mutex_t        pthread_mutex;
-pthread_cond_t         pthread_wakeup;
-int                    pthread_num_sleeping = 0;
-pthread_key_t          pthread_base_thread;
-#endif
+  if (preempt_quantum_usec == 0)
+    return;
+  event.sigev_notify           = SIGEV_THREAD_ID;
+  event.sigev_signo            = PREEMPT_SIGNO;
+  event.sigev_value.sival_ptr  = NULL;
+  event.sigev_notify_thread_id = syscall (SYS_gettid);
+  quantum.it_interval.tv_sec   = preempt_quantum_usec / 1000000;
+  quantum.it_interval.tv_nsec  = (preempt_quantum_usec % 1000000) * 1000;
+  quantum.it_value             = quantum.it_interval;
+  if (timer_create (CLOCK_THREAD_CPUTIME_ID, &event, &timer) != 0 || timer_settime (timer, 0, &quantum, NULL) != 0)
+    perror ("uthread: preemption timer");
+}
 
 /**
- * ready_queue_enqueue
+ * preempt_init
  */
 
-static void ready_queue_enqueue (uthread_t thread) {
-  spinlock_lock (&ready_queue_spinlock);
-  uthread_enqueue (&ready_queue, thread);
-#if PTHREAD_IDLE_SLEEP
-  pthread_mutex_lock (&pthread_mutex);
-  if (pthread_num_sleeping) {
-    pthread_cond_signal (&pthread_wakeup);
-  }
-  pthread_mutex_unlock (&pthread_mutex);
-#endif
-  spinlock_unlock (&ready_queue_spinlock);
+static void preempt_init () {
+  struct sigaction action;
+
+  if (preempt_quantum_usec == 0)
+    return;
+  sigaddset (&uthread_protected_sigset, PREEMPT_SIGNO);
+  action.sa_sigaction = preempt_handler;
+  action.sa_flags     = SA_SIGINFO | SA_RESTART;
+  sigemptyset (&action.sa_mask);
+  sigaction   (PREEMPT_SIGNO, &action, NULL);
 }
+#endif
 
 /**
- * ready_queue_dequeue
+ * uthread_set_quantum
  */
 
-static uthread_t ready_queue_dequeue() {
-  uthread_t thread = 0;
-  
-  while (! thread) {
-    spinlock_lock (&ready_queue_spinlock);
-    thread = uthread_dequeue (&ready_queue);
-#if PTHREAD_IDLE_SLEEP
-    if (! thread) {
-      thread = (uthread_t) pthread_getspecific (pthread_base_thread);
-      assert (thread);
-      if (thread == uthread_self()) {
-        // pthread_base is running ... stop the pthread
-        pthread_mutex_lock   (&pthread_mutex);
-        spinlock_unlock      (&ready_queue_spinlock);
-        pthread_num_sleeping ++;
-        pthread_cond_wait    (&pthread_wakeup, &pthread_mutex);
-        pthread_num_sleeping --;
-        pthread_mutex_unlock (&pthread_mutex);
-        thread = 0;
-        continue;
-      }
-    }
+void uthread_set_quantum (unsigned int quantum_usec) {
+#if PREEMPT_SUPPORT
+  preempt_quantum_usec = quantum_usec;
 #endif
-    spinlock_unlock (&ready_queue_spinlock);
-  }
-  return thread;
 }
 
-static void ready_queue_init () {
-  spinlock_create   (&ready_queue_spinlock);
-  uthread_initqueue (&ready_queue);
-}
-
-//
-// UTHREAD PRIVATE IMPLEMENTATION
-//
-
-static void uthread_stop    (int);
-static void uthread_start   (uthread_t);
-static void uthread_free    (uthread_t);
-
 //
 // INITIALIZATION 
 //
 
 static uthread_t uthread_alloc      ();
-static uthread_t uthread_new_thread (void* (*)(void*), void*);
+static void      uthread_clear      (uthread_t);
+static uthread_t uthread_new_thread (void* (*)(void*), void*, size_t);
 
 static uthread_t base_thread;
-static uintptr_t base_sp_lower_bound, base_sp_upper_bound;
-
-#if PTHREAD_SETSTACK_SUPPORT==0
-#define MAX_PTHREADS 100
-static spinlock_t num_pthreads_spinlock = 0;
-static int        num_pthreads = 0;
-static uthread_t  pthread_base_threads[MAX_PTHREADS];
-static uintptr_t  pthread_base_sp_lower_bound[MAX_PTHREADS], pthread_base_sp_upper_bound[MAX_PTHREADS];
-#endif
 
 static void* pthread_base (void* arg) {
-#if PTHREAD_SETSTACK_SUPPORT==0
   if (arg) {
-    spinlock_lock (&num_pthreads_spinlock);
-    assert (num_pthreads < MAX_PTHREADS);
-    pthread_base_threads        [num_pthreads] = (uthread_t) arg;
-    pthread_base_sp_upper_bound [num_pthreads] = (((uintptr_t)&arg) + 1024);
-    pthread_base_sp_lower_bound [num_pthreads] = (((uintptr_t)&arg) - NATIVE_STACK_SIZE);
-    num_pthreads += 1;
-    spinlock_unlock (&num_pthreads_spinlock);
-  }
+    uthread_set_current ((uthread_t) arg);
+    ready_queue_register();
+#if SIG_PROTECTED
+    // a handler may run on this pthread now that it has a current thread
+    pthread_sigmask (SIG_UNBLOCK, &uthread_protected_sigset, NULL);
 #endif
+#if PREEMPT_SUPPORT
+    preempt_start();
+#endif
+  }
 #if PTHREAD_IDLE_SLEEP
   pthread_setspecific (pthread_base_thread, uthread_self());
 #endif
@@ -297,54 +1613,86 @@ static void* pthread_base (void* arg) {
  */
 
 void uthread_init (int num_processors) {
-  int dummy_local, i;
+  uthread_init_with_cpus (num_processors, 0);
+}
+
+/**
+ * uthread_init_with_cpus
+ */
+
+void uthread_init_with_cpus (int num_processors, const int* cpus) {
+  int i;
   uthread_t uthread;
 #if PTHREAD_SUPPORT
   pthread_t pthread;
   pthread_attr_t attr;
+#if SIG_PROTECTED
+  sigset_t old_sigset;
+#endif
 #else
   assert (num_processors==1);
 #endif
+#if NUMA_SUPPORT
+  cpu_set_t cpu_set;
+  if (cpus) {
+    // pinned before its deque is registered, so that it gets the right node
+    CPU_ZERO (&cpu_set);
+    CPU_SET  (cpus [0], &cpu_set);
+    int err = pthread_setaffinity_np (pthread_self(), sizeof (cpu_set), &cpu_set);
+    assert (! err);
+    numa_pinned = 1;
+  }
+#endif
   
 #if SIG_PROTECTED
   sigemptyset (& uthread_protected_sigset);
   sigaddset   (& uthread_protected_sigset, SIGALRM);
 #endif
-  base_sp_upper_bound = (((uintptr_t)&dummy_local) + 1024);
-  base_sp_lower_bound = (((uintptr_t)&dummy_local) - NATIVE_STACK_SIZE);
+#if PREEMPT_SUPPORT
+  preempt_init();
+#endif
+  stack_page_size     = sysconf (_SC_PAGESIZE);
   base_thread         = uthread_alloc ();
   base_thread->state  = TS_RUNNING;
-  base_thread->stack  = 0;
-  ready_queue_init      ();
+  uthread_set_current (base_thread);
+  ready_queue_init      (num_processors);
 #if PTHREAD_IDLE_SLEEP
-  pthread_mutex_init           (&pthread_mutex, NULL);
-  pthread_cond_init            (&pthread_wakeup, NULL);
   pthread_key_create           (&pthread_base_thread, 0);
-  uthread = uthread_new_thread (pthread_base, 0);
+  uthread = uthread_new_thread (pthread_base, 0, 0);
   pthread_setspecific          (pthread_base_thread, uthread);
 #else
   uthread = uthread_create     (pthread_base, 0);
 #endif
 #if PTHREAD_SUPPORT
+#if SIG_PROTECTED
+  // new pthreads inherit this mask, until they have a current thread
+  pthread_sigmask (SIG_BLOCK, &uthread_protected_sigset, &old_sigset);
+#endif
   for (i=0; i<num_processors-1; i++) {
-    uthread = uthread_new_thread (pthread_base, 0);
+    // the base thread of a pthread runs on the pthread's own stack
+    uthread = uthread_alloc ();
     uthread->state = TS_RUNNING;
     pthread_attr_init (&attr);
-#if PTHREAD_SETSTACK_SUPPORT
-    int err = pthread_attr_setstack (&attr, (void*) ((((uintptr_t) uthread->stack) + STACK_SIZE - 1) & ~(STACK_SIZE - 1)), STACK_SIZE);
-    assert (! err);
+#if NUMA_SUPPORT
+    if (cpus) {
+      CPU_ZERO (&cpu_set);
+      CPU_SET  (cpus [i + 1], &cpu_set);
+      pthread_attr_setaffinity_np (&attr, sizeof (cpu_set), &cpu_set);
+    }
 #endif
     pthread_create (&pthread, &attr, pthread_base, uthread);
+    pthread_attr_destroy (&attr);
   }
-#if !PTHREAD_SETSTACK_SUPPORT
-  while(num_pthreads < num_processors - 1)
-    ;
+#if SIG_PROTECTED
+  pthread_sigmask (SIG_SETMASK, &old_sigset, NULL);
 #endif
-
 #endif
 #if SIG_PROTECTED
   init_complete = 1;
 #endif
+#if PREEMPT_SUPPORT
+  preempt_start();
+#endif
 }
 
 /**
@@ -352,32 +1700,56 @@ void uthread_init (int num_processors) {
  */
 
 static uthread_t uthread_alloc () {
-  uthread_t thread   = malloc (sizeof (struct uthread_TCB));
+  uthread_t thread = malloc (sizeof (struct uthread_TCB));
+  assert (thread);
+  thread->stack      = 0;
+  thread->stack_size = 0;
+  thread->stack_node = -1;
+  uthread_clear (thread);
+  return thread;
+}
+
+/**
+ * uthread_clear
+ *    Reset every field of a TCB but its stack.
+ */
+
+static void uthread_clear (uthread_t thread) {
   thread->state      = TS_NASCENT;
+  thread->id         = __atomic_add_fetch (&next_thread_id, 1, __ATOMIC_RELAXED);
   thread->start_proc = 0;
   thread->start_arg  = 0;
-  thread->stack      = 0;
   thread->saved_sp   = 0;
   thread->joiner     = 0;
+  thread->is_ready   = 0;
+  thread->unblock_pending = 0;
+  thread->priority        = UTHREAD_PRIORITY_DEFAULT;
+  thread->base_priority   = UTHREAD_PRIORITY_DEFAULT;
+  thread->held_mutexes    = 0;
+  thread->deadline        = 0;
+  thread->stats           = (struct uthread_stats) {0};
+  thread->stats_started   = stats_now();
+  thread->stats_stopped   = thread->stats_started;
+  thread->stats_readied   = thread->stats_started;
+  thread->stats_blocked   = 0;
+  thread->stats_preempted = 0;
   thread->next       = NULL;
+#if SIG_PROTECTED
   thread->isInterrupt = 0;
+#endif
   spinlock_create (&thread->join_spinlock);
-  return thread;
 }
 
 /**
  * uthread_new_thread
  */
 
-static uthread_t uthread_new_thread (void* (*start_proc)(void*), void* start_arg) {
-  uthread_t thread   = uthread_alloc ();
-  thread->state      = TS_NASCENT;
+static uthread_t uthread_new_thread (void* (*start_proc)(void*), void* start_arg, size_t stack_size) {
+  uthread_t thread   = stack_alloc (stack_round (stack_size));
+  uthread_clear (thread);
   thread->start_proc = start_proc;
   thread->start_arg  = start_arg;
-  thread->stack      = malloc (STACK_SIZE * 2);
-  assert (thread->stack);
-  thread->saved_sp   = ((((uintptr_t) thread->stack) + STACK_SIZE - 1) & ~(STACK_SIZE - 1)) + STACK_SIZE;
-  *(uthread_t*) (thread->saved_sp -1 & ~(STACK_SIZE -1)) = thread;
+  thread->saved_sp   = (uintptr_t) thread & ~(uintptr_t) 15;
   asm volatile (
 #if __LP64__
 // IA32-64
@@ -435,7 +1807,10 @@ static uthread_t uthread_new_thread (void* (*start_proc)(void*), void* start_arg
 
 static void uthread_switch (uthread_t to_thread, int from_thread_state) {
   uthread_t from_thread = uthread_self();
-  
+
+  stats_switch_out (from_thread, to_thread, from_thread_state);
+  trace_record     (0, TRACE_SWITCH, from_thread->id, to_thread->id, from_thread_state);
+  uthread_set_current (to_thread);
   asm volatile (
 #if __LP64__
 // IA32-64
@@ -539,25 +1914,28 @@ static void uthread_switch (uthread_t to_thread, int from_thread_state) {
                 /* 4 */  "i" (TS_RUNNING),
                 /* 5 */  "i" (offsetof (struct uthread_TCB, state)),
                 /* 6 */  "i" (offsetof (struct uthread_TCB, saved_sp))
-                : "%eax", "%ebx");
-  
+                : "%eax", "%ebx", "memory");
+
   if (from_thread->state == TS_DYING) {
     spinlock_lock (&from_thread->join_spinlock);
-    if (from_thread->joiner == (uthread_t) -1)
+    if (from_thread->joiner == (uthread_t) -1) {
+      spinlock_unlock (&from_thread->join_spinlock);
       uthread_free (from_thread);
-    else {
+    } else {
       from_thread->state = TS_DEAD;
       spinlock_unlock (&from_thread->join_spinlock);
       // at this point uthread_detach could free from_thread, so don't touch it after setting it to DEAD
     }
   } else if (from_thread->state == TS_RUNABLE) {
-    ready_queue_enqueue (from_thread);
+    ready_queue_enqueue (from_thread, READY_YIELDED);
     // at this point another thread could dequeue from_thread and run it, so don't touch it after enqueuing
   }
   
   to_thread = uthread_self();
+  stats_switch_in (to_thread);
   if (to_thread->state == TS_NASCENT) {
     to_thread->state      = TS_RUNNING;
+    critical_exit();
     to_thread->return_val = to_thread->start_proc (to_thread->start_arg);
     spinlock_lock (&to_thread->join_spinlock);
     to_thread->state = TS_DYING;
@@ -565,20 +1943,35 @@ static void uthread_switch (uthread_t to_thread, int from_thread_state) {
       uthread_start (to_thread->joiner);
     spinlock_unlock (&to_thread->join_spinlock);
     uthread_stop (TS_DYING);
-  } else
+  } else {
     to_thread->state = TS_RUNNING;
+    critical_exit();
+  }
 }
 
 /**
- * uthread_stop
+ * uthread_stop_critical
+ *    Called in a critical section, which the thread that runs next leaves at
+ *    the end of uthread_switch: a handler must not switch threads while the
+ *    current one is being stopped, nor find to_thread current while still on
+ *    from_thread's stack.
  */
 
-static void uthread_stop (int stopping_thread_state) {
+static void uthread_stop_critical (int stopping_thread_state) {
   uthread_t to_thread = ready_queue_dequeue();
   assert (to_thread);
   uthread_switch (to_thread, stopping_thread_state);
 }
 
+/**
+ * uthread_stop
+ */
+
+static void uthread_stop (int stopping_thread_state) {
+  critical_enter();
+  uthread_stop_critical (stopping_thread_state);
+}
+
 /**
  * uthread_start
  *    Note that start does not set thread->state to TS_RUNNABLE because the thread might
@@ -588,7 +1981,8 @@ static void uthread_stop (int stopping_thread_state) {
  */
 
 static void uthread_start (uthread_t thread) {
-  ready_queue_enqueue (thread);
+  trace_record ("unblock", 'i', thread->id, 0, 0);
+  ready_queue_enqueue (thread, READY_UNBLOCKED);
 }
 
 /**
@@ -597,8 +1991,9 @@ static void uthread_start (uthread_t thread) {
 
 static void uthread_free (uthread_t thread) {
   if (thread->stack)
-    free (thread->stack);
-  free (thread);
+    stack_free (thread);
+  else
+    free (thread);
 }
 
 
@@ -611,28 +2006,58 @@ static void uthread_free (uthread_t thread) {
  */
 
 uthread_t uthread_create (void* (*start_proc)(void*), void* start_arg) {
-  uthread_t thread = uthread_new_thread (start_proc, start_arg);
-  ready_queue_enqueue (thread);
+  return uthread_create_with_stack_size (start_proc, start_arg, 0);
+}
+
+/**
+ * uthread_create_with_stack_size
+ */
+
+uthread_t uthread_create_with_stack_size (void* (*start_proc)(void*), void* start_arg, size_t stack_size) {
+  uthread_t thread = uthread_new_thread (start_proc, start_arg, stack_size);
+  trace_record ("create", 'i', thread->id, 0, 0);
+  ready_queue_enqueue (thread, READY_UNBLOCKED);
   return thread;
 }
 
 /**
- * uthread_self
+ * uthread_create_with_priority
  */
 
-uthread_t uthread_self() {
-  int dummy_local, i;
+uthread_t uthread_create_with_priority (void* (*start_proc)(void*), void* start_arg, int priority) {
+  uthread_t thread = uthread_new_thread (start_proc, start_arg, 0);
+  assert (priority >= UTHREAD_PRIORITY_MIN && priority <= UTHREAD_PRIORITY_MAX);
+  thread->priority      = priority;
+  thread->base_priority = priority;
+  trace_record ("create", 'i', thread->id, 0, 0);
+  ready_queue_enqueue (thread, READY_UNBLOCKED);
+  return thread;
+}
 
-  if ((uintptr_t)&dummy_local >= base_sp_lower_bound && (uintptr_t) &dummy_local <= base_sp_upper_bound)
-    return base_thread;
-  else {
-#if PTHREAD_SETSTACK_SUPPORT==0
-    for (i=0; i<num_pthreads; i++)
-      if ((uintptr_t)&dummy_local >= pthread_base_sp_lower_bound[i] && (uintptr_t) &dummy_local <= pthread_base_sp_upper_bound[i])
-        return pthread_base_threads[i];
-#endif
-    return *(uthread_t*) (void*) (((uintptr_t) &dummy_local) & ~(STACK_SIZE-1));
-  }
+/**
+ * uthread_set_priority
+ */
+
+void uthread_set_priority (uthread_t thread, int priority) {
+  assert (priority >= UTHREAD_PRIORITY_MIN && priority <= UTHREAD_PRIORITY_MAX);
+  thread->base_priority = priority;
+  thread->priority      = priority;
+}
+
+/**
+ * uthread_get_priority
+ */
+
+int uthread_get_priority (uthread_t thread) {
+  return thread->base_priority;
+}
+
+/**
+ * uthread_set_deadline
+ */
+
+void uthread_set_deadline (uthread_t thread, const struct timespec* deadline) {
+  thread->deadline = deadline ? (uint64_t) deadline->tv_sec * 1000000000 + deadline->tv_nsec : 0;
 }
 
 /**
@@ -651,17 +2076,22 @@ void uthread_yield() {
 int uthread_join (uthread_t thread, void** value_ptr) {
   if (thread->joiner == 0) {
     spinlock_lock (&thread->join_spinlock);
+    // block, rather than stop, so that a wake-up is not lost if the joiner is preempted
+    // after releasing the lock, and check again for any other early wake-up
     if (thread->state != TS_DYING && thread->state != TS_DEAD) {
       thread->joiner = uthread_self();
-      spinlock_unlock (&thread->join_spinlock);
-      uthread_stop    (TS_BLOCKED);
-      spinlock_lock   (&thread->join_spinlock);
+      do {
+        spinlock_unlock (&thread->join_spinlock);
+        uthread_block   ();
+        spinlock_lock   (&thread->join_spinlock);
+      } while (thread->state != TS_DYING && thread->state != TS_DEAD);
     }
     if (value_ptr)
       *value_ptr = thread->return_val;
-    if (thread->state == TS_DEAD)
+    if (thread->state == TS_DEAD) {
+      spinlock_unlock (&thread->join_spinlock);
       uthread_free (thread);
-    else {
+    } else {
       thread->joiner = (uthread_t) -1;
       spinlock_unlock (&thread->join_spinlock);
     }
@@ -680,8 +2110,10 @@ void uthread_detach (uthread_t thread) {
     if (thread->state != TS_DEAD) {
       thread->joiner = (uthread_t) -1;
       spinlock_unlock (&thread->join_spinlock);
-    } else 
+    } else {
+      spinlock_unlock (&thread->join_spinlock);
       uthread_free (thread);
+    }
   }
 }
 
@@ -691,8 +2123,9 @@ void uthread_detach (uthread_t thread) {
  */
 
 void uthread_setInterrupt (int isInterrupt) {
-  if (init_complete)
-    uthread_self() ->isInterrupt = isInterrupt;
+  uthread_t self = uthread_self();
+  if (init_complete && self)
+    self->isInterrupt = isInterrupt;
 }
 
 /**
@@ -700,10 +2133,12 @@ void uthread_setInterrupt (int isInterrupt) {
  */
 
 int uthread_isInterrupt () {
-  return ! init_complete || uthread_self() ->isInterrupt;
+  uthread_t self = uthread_self();
+  return ! init_complete || ! self || self->isInterrupt;
 }
 #else
 void uthread_setInterrupt (int isInterrupt) {}
+int  uthread_isInterrupt  () { return 0; }
 #endif
 
 /**
@@ -711,7 +2146,12 @@ void uthread_setInterrupt (int isInterrupt) {}
  */
 
 void uthread_block () {
-  uthread_stop (TS_BLOCKED);
+  critical_enter();
+  if (__atomic_exchange_n (&uthread_self()->unblock_pending, 0, __ATOMIC_ACQ_REL)) {
+    critical_exit();
+    return;
+  }
+  uthread_stop_critical (TS_BLOCKED);
 }
 
 /**
@@ -721,3 +2161,131 @@ void uthread_block () {
 void uthread_unblock (uthread_t thread) {
   uthread_start (thread);
 }
+
+/**
+ * uthread_run_on
+ */
+
+void uthread_run_on (int processor, struct uthread_work* work) {
+  assert (processor >= 0 && processor < num_ready_deques);
+  struct ready_deque* deque = &ready_deques [processor];
+  work->next = __atomic_load_n (&deque->work, __ATOMIC_RELAXED);
+  while (! __atomic_compare_exchange_n (&deque->work, &work->next, work, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) ;
+#if PTHREAD_IDLE_SLEEP
+  if (__atomic_load_n (&deque->parked, __ATOMIC_SEQ_CST) && ready_deque_unpark (deque))
+    ready_deque_park_wake (deque);
+#endif
+}
+
+/**
+ * uthread_get_stats
+ */
+
+void uthread_get_stats (uthread_t thread, struct uthread_stats* stats) {
+  *stats = thread->stats;
+}
+
+/**
+ * uthread_get_processor_stats
+ */
+
+void uthread_get_processor_stats (int processor, struct uthread_processor_stats* stats) {
+  assert (processor >= 0 && processor < num_ready_deques);
+  *stats = ready_deques [processor].stats;
+}
+
+/**
+ * uthread_dump_stats
+ */
+
+void uthread_dump_stats () {
+  struct uthread_processor_stats stats;
+
+  for (int processor = 0; processor < num_ready_deques; processor++) {
+    uthread_get_processor_stats (processor, &stats);
+    fprintf (stderr, "uthread: processor %d: %lu switches, %lu yields, %lu preemptions, %lu blocks, "
+             "run %llu us, ready %llu us, blocked %llu us, %lu spins, %lu parks, idle %llu us\n",
+             processor, stats.threads.switches, stats.threads.yields, stats.threads.preemptions,
+             stats.threads.blocks, stats.threads.run_nsec / 1000, stats.threads.ready_nsec / 1000,
+             stats.threads.blocked_nsec / 1000, stats.spinlock_spins, stats.parks, stats.idle_nsec / 1000);
+    fprintf (stderr, "uthread: processor %d: ready waits:", processor);
+    for (int bucket = 0; bucket < UTHREAD_STATS_BUCKETS; bucket++)
+      if (stats.ready_histogram [bucket])
+        fprintf (stderr, " %d:%lu", bucket, stats.ready_histogram [bucket]);
+    fprintf (stderr, "\n");
+  }
+}
+
+#if PTHREAD_SUPPORT
+static volatile unsigned int stats_interval_msec;
+static volatile int          stats_dumping;
+
+/**
+ * stats_dump_loop
+ *    Runs in a pthread of its own, with all signals blocked, until the
+ *    interval is set to 0.
+ */
+
+static void* stats_dump_loop (void* arg) {
+  do {
+    unsigned int interval_msec;
+    while ((interval_msec = stats_interval_msec)) {
+      struct timespec interval = {interval_msec / 1000, (interval_msec % 1000) * 1000000};
+      nanosleep (&interval, 0);
+      if (stats_interval_msec)
+        uthread_dump_stats();
+    }
+    __atomic_store_n (&stats_dumping, 0, __ATOMIC_SEQ_CST);
+    // a new interval may have been set before we stopped
+  } while (stats_interval_msec && ! __atomic_exchange_n (&stats_dumping, 1, __ATOMIC_SEQ_CST));
+  return NULL;
+}
+#endif
+
+/**
+ * uthread_set_stats_interval
+ */
+
+void uthread_set_stats_interval (unsigned int interval_msec) {
+#if PTHREAD_SUPPORT
+  pthread_t      pthread;
+  pthread_attr_t attr;
+  sigset_t       all_signals, old_signals;
+
+  stats_interval_msec = interval_msec;
+  if (interval_msec && ! __atomic_exchange_n (&stats_dumping, 1, __ATOMIC_SEQ_CST)) {
+    sigfillset       (&all_signals);
+    pthread_sigmask  (SIG_BLOCK, &all_signals, &old_signals);
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create   (&pthread, &attr, stats_dump_loop, NULL);
+    pthread_attr_destroy (&attr);
+    pthread_sigmask  (SIG_SETMASK, &old_signals, NULL);
+  }
+#endif
+}
+
+/**
+ * uthread_set_trace
+ */
+
+void uthread_set_trace (const char* path, unsigned long events_per_processor) {
+#if TRACE_SUPPORT
+  assert (! num_registered_deques);
+  trace_path     = path;
+  trace_capacity = 0;
+  if (path && events_per_processor) {
+    for (trace_capacity = 1; trace_capacity < events_per_processor; trace_capacity <<= 1)
+      ;
+    atexit (trace_write);
+  }
+#endif
+}
+
+/**
+ * uthread_trace
+ */
+
+void uthread_trace (const char* name, char phase, unsigned long id) {
+  trace_record (name, phase, id, 0, 0);
+}
@@ -0,0 +1,44 @@
+//
+// Written by Mike Feeley, University of BC, 2010-2014
+// Do not redistribute any portion of this code without permission.
+//
+
+#ifndef __uthread_barrier_h__
+#define __uthread_barrier_h__
+
+struct uthread_barrier;
+typedef struct uthread_barrier* uthread_barrier_t;
+
+struct uthread_latch;
+typedef struct uthread_latch* uthread_latch_t;
+
+/* Returned by uthread_barrier_wait to exactly one of the threads of each phase. */
+#define UTHREAD_BARRIER_SERIAL_THREAD 1
+
+/* Create a barrier for count threads. It can be reused for any number of phases. */
+uthread_barrier_t uthread_barrier_create  (int count);
+
+/* Block until count threads have called this in the current phase. The last one to
+arrive returns UTHREAD_BARRIER_SERIAL_THREAD, the others 0. Waiters are released
+along a binary tree, each waking two more, so releasing count threads takes
+O(log count) rounds instead of one thread waking them all. */
+int               uthread_barrier_wait    (uthread_barrier_t);
+
+/* Destroy a barrier. Only do this if no thread is waiting on it. */
+void              uthread_barrier_destroy (uthread_barrier_t);
+
+/* Create a count-down latch: threads that wait on it block until it has been counted
+down count times. It opens only once. */
+uthread_latch_t   uthread_latch_create     (int count);
+
+/* Count the latch down, opening it the count-th time. This never blocks. */
+void              uthread_latch_count_down (uthread_latch_t);
+
+/* Block until the latch is open; return at once if it is. Like at a barrier, waiters
+are released along a tree. */
+void              uthread_latch_wait       (uthread_latch_t);
+
+/* Destroy a latch. Only do this if no thread is waiting on it. */
+void              uthread_latch_destroy    (uthread_latch_t);
+
+#endif
@@ -14,13 +14,34 @@
 //
 // MONITORS (MUTEX) AND CONDITIONAL VARIABLES
 //
+// The state of a mutex is one word: MUTEX_LOCKED while a thread holds it
+// exclusively, MUTEX_WAITERS while a waiter queue may not be empty, and the
+// number of readers in units of MUTEX_READER. Without waiters, locking and
+// unlocking are a single compare-and-swap. Otherwise they go through the
+// spinlock, which guards the queues and the MUTEX_WAITERS bit: an exclusive
+// waiter is handed the mutex directly by unlock, so it cannot be overtaken
+// once it blocked, and readers are woken to try again; waiters are unblocked
+// after the spinlock is released. Before blocking, a locker spins up to
+// MUTEX_SPIN_LIMIT times, but only while the holder is running.
+//
+// Exclusive waiters are handed the mutex highest priority first, and lend
+// their priority to the holder until it unlocks a mutex with waiters. Each
+// thread keeps a list of the mutexes it holds exclusively, so that it then
+// keeps the priority lent by the waiters of the others.
+//
+
+#define MUTEX_LOCKED     1
+#define MUTEX_WAITERS    2
+#define MUTEX_READER     4
+#define MUTEX_SPIN_LIMIT 1000
 
 struct uthread_mutex {
-  uthread_t       holder;
-  int             reader_count;
-  spinlock_t      spinlock;
-  uthread_queue_t waiter_queue;
-  uthread_queue_t reader_waiter_queue;
+  volatile int       state;
+  uthread_t volatile holder;
+  spinlock_t         spinlock;
+  uthread_queue_t    waiter_queue;
+  uthread_queue_t    reader_waiter_queue;
+  uthread_mutex_t    held_next;           // on the holder's list of held mutexes
 };
 
 struct uthread_cond {
@@ -28,14 +49,140 @@ struct uthread_cond {
   uthread_queue_t waiter_queue;
 };
 
+/**
+ * mutex_cas
+ */
+
+static inline int mutex_cas (uthread_mutex_t mutex, int expected, int desired) {
+  return __atomic_compare_exchange_n (&mutex->state, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/**
+ * mutex_pause
+ */
+
+static inline void mutex_pause () {
+#if __i386__ || __x86_64__
+  asm volatile ("pause");
+#endif
+}
+
+/**
+ * mutex_spin
+ *    Spin while the mutex is held by a running thread and nobody is queued;
+ *    returns 1 if the mutex could then be locked exclusively.
+ */
+
+static int mutex_spin (uthread_mutex_t mutex) {
+  for (int i = 0; i < MUTEX_SPIN_LIMIT; i++) {
+    int       state  = __atomic_load_n (&mutex->state, __ATOMIC_RELAXED);
+    uthread_t holder = mutex->holder;
+    if (state == 0 && mutex_cas (mutex, 0, MUTEX_LOCKED))
+      return 1;
+    if ((state & MUTEX_WAITERS) || (holder && ! uthread_is_running (holder)))
+      return 0;
+    mutex_pause();
+  }
+  return 0;
+}
+
+/**
+ * mutex_queue
+ *    Called with mutex->spinlock held. Set MUTEX_WAITERS unless state is 0
+ *    (the mutex is free) or has one of the free bits; returns the state it saw.
+ */
+
+static int mutex_queue (uthread_mutex_t mutex, int free_bits) {
+  int state = __atomic_load_n (&mutex->state, __ATOMIC_RELAXED);
+  while (state != 0 && ! (state & free_bits) && ! (state & MUTEX_WAITERS)
+         && ! __atomic_compare_exchange_n (&mutex->state, &state, state | MUTEX_WAITERS, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    ;
+  return state;
+}
+
+/**
+ * mutex_wakeup
+ *    Called with mutex->spinlock held, after the last holder left: hand the
+ *    mutex to the first exclusive waiter, or else release every reader. The
+ *    threads to unblock are moved to wakeup_queue, so that the caller can
+ *    unblock them once it released the spinlock.
+ */
+
+static void mutex_wakeup (uthread_mutex_t mutex, uthread_queue_t* wakeup_queue) {
+  uthread_t waiter_thread = uthread_dequeue_highest (&mutex->waiter_queue);
+  if (waiter_thread) {
+    int more = ! uthread_queue_is_empty (&mutex->waiter_queue) || ! uthread_queue_is_empty (&mutex->reader_waiter_queue);
+    mutex->holder = waiter_thread;
+    __atomic_store_n (&mutex->state, MUTEX_LOCKED | (more ? MUTEX_WAITERS : 0), __ATOMIC_RELEASE);
+    uthread_enqueue (wakeup_queue, waiter_thread);
+  } else {
+    __atomic_store_n (&mutex->state, 0, __ATOMIC_RELEASE);
+    while ((waiter_thread = uthread_dequeue (&mutex->reader_waiter_queue)))
+      uthread_enqueue (wakeup_queue, waiter_thread);
+  }
+}
+
+/**
+ * mutex_held_add
+ *    Add a mutex that the caller just locked exclusively to its list of held mutexes.
+ */
+
+static void mutex_held_add (uthread_mutex_t mutex) {
+  uthread_mutex_t* held = (uthread_mutex_t*) uthread_held_mutexes();
+  mutex->held_next = *held;
+  *held            = mutex;
+}
+
+/**
+ * mutex_held_remove
+ *    Remove a mutex from the caller's list; mutexes are mostly unlocked last locked first.
+ */
+
+static void mutex_held_remove (uthread_mutex_t mutex) {
+  uthread_mutex_t* held = (uthread_mutex_t*) uthread_held_mutexes();
+  while (*held != mutex)
+    held = &(*held)->held_next;
+  *held = mutex->held_next;
+}
+
+/**
+ * mutex_restore_priority
+ *    Drop the priority lent to the caller, but for what the waiters of the mutexes
+ *    it still holds lend it.
+ */
+
+static void mutex_restore_priority () {
+  uthread_t self = uthread_self();
+  uthread_restore_priority();
+  for (uthread_mutex_t held = *(uthread_mutex_t*) uthread_held_mutexes(); held; held = held->held_next)
+    if (__atomic_load_n (&held->state, __ATOMIC_RELAXED) & MUTEX_WAITERS) {
+      spinlock_lock (&held->spinlock);
+      int priority = uthread_queue_highest_priority (&held->waiter_queue);
+      spinlock_unlock (&held->spinlock);
+      uthread_raise_priority (self, priority);
+    }
+}
+
+/**
+ * mutex_unblock
+ */
+
+static void mutex_unblock (uthread_queue_t* wakeup_queue) {
+  uthread_t waiter_thread;
+
+  while ((waiter_thread = uthread_dequeue (wakeup_queue)))
+    uthread_unblock (waiter_thread);
+}
+
 /**
  * uthread_mutex_create
  */
 
 uthread_mutex_t uthread_mutex_create () {
   uthread_mutex_t mutex = malloc (sizeof (struct uthread_mutex));
+  mutex->state  = 0;
   mutex->holder = 0;
-  mutex->reader_count = 0;
+  mutex->held_next = 0;
   spinlock_create   (&mutex->spinlock);
   uthread_initqueue (&mutex->waiter_queue);
   uthread_initqueue (&mutex->reader_waiter_queue);
@@ -55,15 +202,35 @@ void uthread_mutex_destroy (uthread_mutex_t mutex) {
  */
 
 void uthread_mutex_lock (uthread_mutex_t mutex) {
-  spinlock_lock (&mutex->spinlock);
-  while (mutex->holder || mutex->reader_count > 0) {
-    uthread_enqueue (&mutex->waiter_queue, uthread_self());
-    spinlock_unlock (&mutex->spinlock);
-    uthread_block();
+  uthread_t self = uthread_self();
+  uthread_t holder;
+
+  if (! mutex_cas (mutex, 0, MUTEX_LOCKED) && ! mutex_spin (mutex)) {
     spinlock_lock (&mutex->spinlock);
+    while (mutex_queue (mutex, 0) == 0) {
+      if (mutex_cas (mutex, 0, MUTEX_LOCKED)) {
+        spinlock_unlock (&mutex->spinlock);
+        mutex->holder = self;
+        mutex_held_add (mutex);
+        return;
+      }
+    }
+    uthread_enqueue (&mutex->waiter_queue, self);
+    // the holder clears holder without the spinlock
+    holder = mutex->holder;
+    if (holder)
+      uthread_lend_priority (holder);
+    spinlock_unlock (&mutex->spinlock);
+    uthread_trace ("mutex contend", 'i', (unsigned long) mutex);
+    // unlock sets holder before it unblocks us
+    do
+      uthread_block();
+    while (mutex->holder != self);
+    mutex_held_add (mutex);
+    return;
   }
-  mutex->holder = uthread_self();
-  spinlock_unlock (&mutex->spinlock);
+  mutex->holder = self;
+  mutex_held_add (mutex);
 }
 
 /**
@@ -71,15 +238,22 @@ void uthread_mutex_lock (uthread_mutex_t mutex) {
  */
 
 void uthread_mutex_lock_readonly (uthread_mutex_t mutex) {
-  spinlock_lock (&mutex->spinlock);
-  while (mutex->holder || !uthread_queue_is_empty (&mutex->waiter_queue)) {
-    uthread_enqueue (&mutex->reader_waiter_queue, uthread_self());
-    spinlock_unlock (&mutex->spinlock);
-    uthread_block();
-    spinlock_lock   (&mutex->spinlock);
+  while (1) {
+    int state = __atomic_load_n (&mutex->state, __ATOMIC_RELAXED);
+    if (! (state & (MUTEX_LOCKED | MUTEX_WAITERS))) {
+      if (mutex_cas (mutex, state, state + MUTEX_READER))
+        return;
+      continue;
+    }
+    spinlock_lock (&mutex->spinlock);
+    state = mutex_queue (mutex, ~(MUTEX_LOCKED | MUTEX_WAITERS));
+    if (state & (MUTEX_LOCKED | MUTEX_WAITERS)) {
+      uthread_enqueue (&mutex->reader_waiter_queue, uthread_self());
+      spinlock_unlock (&mutex->spinlock);
+      uthread_block();
+    } else
+      spinlock_unlock (&mutex->spinlock);
   }
-  mutex->reader_count += 1;
-  spinlock_unlock (&mutex->spinlock);
 }
 
 /**
@@ -87,26 +261,37 @@ void uthread_mutex_lock_readonly (uthread_mutex_t mutex) {
  */
 
 void uthread_mutex_unlock (uthread_mutex_t mutex) {
-  uthread_t waiter_thread;
-  
-  spinlock_lock (&mutex->spinlock);
+  uthread_queue_t wakeup_queue;
+  int             state, exclusive = 0;
+
   if (mutex->holder) {
     assert (mutex->holder == uthread_self());
+    mutex_held_remove (mutex);
     mutex->holder = 0;
+    if (mutex_cas (mutex, MUTEX_LOCKED, 0))
+      return;
+    exclusive = 1;
   } else {
-    assert (mutex->reader_count > 0);
-    mutex->reader_count -= 1;
-  }
-  if (mutex->reader_count == 0) {
-    waiter_thread = uthread_dequeue (&mutex->waiter_queue);
-    if (waiter_thread)
-      uthread_unblock (waiter_thread);
-    else {
-      while ((waiter_thread = uthread_dequeue (&mutex->reader_waiter_queue)))
-        uthread_unblock (waiter_thread);
+    state = __atomic_load_n (&mutex->state, __ATOMIC_RELAXED);
+    while (! (state & MUTEX_WAITERS)) {
+      assert (state >= MUTEX_READER);
+      if (__atomic_compare_exchange_n (&mutex->state, &state, state - MUTEX_READER, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        return;
     }
   }
+
+  // with MUTEX_WAITERS set, the state only changes with the spinlock held
+  uthread_initqueue (&wakeup_queue);
+  spinlock_lock (&mutex->spinlock);
+  state = __atomic_load_n (&mutex->state, __ATOMIC_RELAXED);
+  if (state & MUTEX_LOCKED || (state = __atomic_sub_fetch (&mutex->state, MUTEX_READER, __ATOMIC_ACQ_REL)) < MUTEX_READER)
+    mutex_wakeup (mutex, &wakeup_queue);
   spinlock_unlock (&mutex->spinlock);
+  mutex_unblock (&wakeup_queue);
+  // a waiter lends to holder under the spinlock, and may have read it before we cleared
+  // it, so restore only once we have held the spinlock since, and woken the waiters
+  if (exclusive)
+    mutex_restore_priority();
 }
 
 /**
@@ -0,0 +1,41 @@
+//
+// Written by Mike Feeley, University of BC, 2010-2014
+// Do not redistribute any portion of this code without permission.
+//
+
+#ifndef __uthread_rwlock_h__
+#define __uthread_rwlock_h__
+
+struct uthread_rwlock;
+typedef struct uthread_rwlock* uthread_rwlock_t;
+
+/* Fairness policies. With PREFER_WRITERS a waiting writer keeps new readers out,
+so readers can starve; with PREFER_READERS readers keep entering while a writer
+waits, so writers can starve; with FAIR readers and writers alternate: a writer
+waits for the readers that came before it, and readers that waited for a writer
+go before the next one. */
+#define UTHREAD_RWLOCK_PREFER_WRITERS 0
+#define UTHREAD_RWLOCK_PREFER_READERS 1
+#define UTHREAD_RWLOCK_FAIR           2
+
+/* Create a new reader-writer lock with a fairness policy; it is initially unlocked.
+Readers only touch a counter of their processor, so read locking scales with the
+number of processors, but locking for writing visits every counter.
+Must be called after uthread_init. */
+uthread_rwlock_t uthread_rwlock_create       (int policy);
+
+/* Lock for shared, read-only access. Any number of threads may hold a read lock
+while no thread holds the write lock. */
+void             uthread_rwlock_lock_read    (uthread_rwlock_t);
+
+/* Lock for exclusive access. This will block until no other thread holds the lock. */
+void             uthread_rwlock_lock_write   (uthread_rwlock_t);
+
+/* Unlock a read or a write lock. This signals waiters as appropriate and never blocks. */
+void             uthread_rwlock_unlock_read  (uthread_rwlock_t);
+void             uthread_rwlock_unlock_write (uthread_rwlock_t);
+
+/* Destroy a reader-writer lock. Only do this if nothing is waiting or using the lock. */
+void             uthread_rwlock_destroy      (uthread_rwlock_t);
+
+#endif
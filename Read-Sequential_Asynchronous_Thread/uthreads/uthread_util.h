@@ -15,11 +15,23 @@ struct uthread_queue {
 };
 typedef struct uthread_queue uthread_queue_t;
 
-void      uthread_initqueue      (uthread_queue_t*);
-void      uthread_enqueue        (uthread_queue_t*, uthread_t);
-uthread_t uthread_dequeue        (uthread_queue_t*);
-int       uthread_queue_is_empty (uthread_queue_t* queue);
+void      uthread_initqueue        (uthread_queue_t*);
+void      uthread_enqueue          (uthread_queue_t*, uthread_t);
+uthread_t uthread_dequeue          (uthread_queue_t*);
+uthread_t uthread_dequeue_highest  (uthread_queue_t*);
+int       uthread_queue_is_empty   (uthread_queue_t* queue);
+int       uthread_queue_highest_priority (uthread_queue_t* queue);
+
+int       uthread_is_running       (uthread_t);
+int       uthread_priority         (uthread_t);
+void      uthread_lend_priority    (uthread_t holder);
+void      uthread_raise_priority   (uthread_t thread, int priority);
+void      uthread_restore_priority (void);
+void**    uthread_held_mutexes     (void);
+int       uthread_processor        (void);
+int       uthread_num_processors   (void);
 
 void uthread_setInterrupt (int);
+int  uthread_isInterrupt  (void);
 
 #endif
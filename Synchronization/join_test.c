@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "uthread.h"
+
+//
+// Regression test: uthread_join with time-slice preemption on. A joiner preempted between
+// registering itself and blocking must still be woken by the thread it joins.
+//
+
+#define NUM_ITERATIONS 200000
+
+volatile long spin_count;
+
+void* spin (void* v) {
+  long n = (long) v;
+  for (long i = 0; i < n; i++)
+    spin_count++;
+  return v;
+}
+
+int main (int argc, char** argv) {
+  int num_processors = argc > 1 ? atoi (argv [1]) : 2;
+  int quantum_usec   = argc > 2 ? atoi (argv [2]) : 200;
+  uthread_set_quantum (quantum_usec);
+  uthread_init (num_processors);
+  for (long i = 0; i < NUM_ITERATIONS; i++) {
+    void*     result;
+    uthread_t t = uthread_create (spin, (void*) (i % 1000));
+    if (uthread_join (t, &result) != 0 || result != (void*) (i % 1000)) {
+      printf ("join %ld failed\n", i);
+      return EXIT_FAILURE;
+    }
+  }
+  printf ("ok\n");
+  return EXIT_SUCCESS;
+}
@@ -1,40 +1,549 @@
 #include <stdlib.h>
+#include <assert.h>
 #include "uthread.h"
 #include "uthread_mutex_cond.h"
+#include "spinlock.h"
 #include "threadpool.h"
 
+//
+// Every worker owns a deque of tasks (Chase and Lev): it pushes and pops at the
+// bottom, and idle workers steal from the top. Tasks scheduled from outside the
+// pool go on a shared injection list, from which workers take slices. Each worker
+// has its own struct tpool, that it passes to its tasks, so that the tasks they
+// schedule go on its deque. Task nodes are recycled rather than freed: a handle
+// holds the node's sequence number, which completing the task advances, so that
+// waiting for a completed task never blocks.
+//
+
+#define DEQUE_INITIAL_SIZE 256
+#define INJECT_SLICE       32
+#define FREE_CACHE_MAX     256
+#define TASK_CHUNK         64
+
+struct pool;
+
+struct task_waiter {
+  uthread_t           thread;
+  volatile int        done;         // set once the task has completed, before thread is unblocked
+  struct task_waiter *next;
+};
+
+struct tpool_task {
+  void                 (*f)(tpool_t, void *);
+  void                  *arg;
+  struct pool           *pool;
+  volatile unsigned long seq;
+  spinlock_t             lock;      // of seq and waiters
+  struct task_waiter    *waiters;
+  struct tpool_task     *next;      // on the injection list, or a free list
+};
+
+struct task_chunk {
+  struct task_chunk *next;
+  struct tpool_task  tasks[TASK_CHUNK];
+};
+
+struct deque_array {
+  long                size;
+  struct deque_array *prev;         // replaced, but thieves may still read it
+  struct tpool_task  *buf[];
+};
+
+struct deque {
+  volatile long                top;
+  volatile long                bottom __attribute__ ((aligned (64)));
+  struct deque_array *volatile array;
+};
+
+struct worker;
+
+/**
+ * What tasks and callers schedule with: the pool, and the worker running the task if any
+ */
 struct tpool {
-    // TODO
+  struct pool   *pool;
+  struct worker *worker;
 };
 
+struct worker {
+  struct tpool       view;
+  struct deque       deque;
+  uthread_t          thread;
+  struct tpool_task *free;
+  int                free_length;
+  unsigned int       random;
+} __attribute__ ((aligned (64)));
+
+struct pool {
+  struct tpool       outside;
+  unsigned int       num_workers;
+  struct worker     *workers;
+  spinlock_t         inject_lock;
+  struct tpool_task *inject_head, *inject_tail;
+  volatile long      inject_length;
+  spinlock_t         free_lock;
+  struct tpool_task *free;
+  struct task_chunk *chunks;
+  volatile long      pending;       // tasks scheduled but not completed
+  volatile int       idle;          // workers asleep, or checking for work before they sleep
+  volatile int       joining;
+  int                shutdown;
+  uthread_mutex_t    mutex;
+  uthread_cond_t     work_available;
+  uthread_cond_t     all_done;
+};
+
+//
+// DEQUE
+//
+
+static void deque_init(struct deque *d) {
+  struct deque_array *a = malloc(sizeof(struct deque_array) + DEQUE_INITIAL_SIZE * sizeof(struct tpool_task *));
+  a->size   = DEQUE_INITIAL_SIZE;
+  a->prev   = NULL;
+  d->top    = 0;
+  d->bottom = 0;
+  d->array  = a;
+}
+
+static struct deque_array *deque_grow(struct deque *d, struct deque_array *a, long top, long bottom) {
+  struct deque_array *b = malloc(sizeof(struct deque_array) + 2 * a->size * sizeof(struct tpool_task *));
+  b->size = 2 * a->size;
+  b->prev = a;
+  for (long i = top; i < bottom; i++)
+    b->buf[i & (b->size - 1)] = __atomic_load_n(&a->buf[i & (a->size - 1)], __ATOMIC_RELAXED);
+  __atomic_store_n(&d->array, b, __ATOMIC_RELEASE);
+  return b;
+}
+
+/**
+ * Push a task at the bottom; only the deque's worker does this
+ */
+static void deque_push(struct deque *d, struct tpool_task *t) {
+  long                bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  long                top    = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  struct deque_array *a      = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  if (bottom - top > a->size - 1)
+    a = deque_grow(d, a, top, bottom);
+  __atomic_store_n(&a->buf[bottom & (a->size - 1)], t, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Pop the task at the bottom, the most recently pushed; only the deque's worker does this
+ */
+static struct tpool_task *deque_pop(struct deque *d) {
+  long                bottom = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  struct deque_array *a      = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  struct tpool_task  *t      = NULL;
+  long                top;
+  __atomic_store_n(&d->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+  if (top <= bottom) {
+    t = __atomic_load_n(&a->buf[bottom & (a->size - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      // the last task: race thieves for it
+      if (! __atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        t = NULL;
+      __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else
+    __atomic_store_n(&d->bottom, bottom + 1, __ATOMIC_RELAXED);
+  return t;
+}
+
+/**
+ * Steal the task at the top, the least recently pushed; returns NULL if the deque is empty,
+ * or if another thread took that task first
+ */
+static struct tpool_task *deque_steal(struct deque *d) {
+  long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE), bottom;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  bottom = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (top < bottom) {
+    struct deque_array *a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+    struct tpool_task  *t = __atomic_load_n(&a->buf[top & (a->size - 1)], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&d->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return t;
+  }
+  return NULL;
+}
+
+static int deque_is_empty(struct deque *d) {
+  return __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST) <= __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+}
+
+//
+// TASKS
+//
+
+static struct tpool_task *task_alloc(struct pool *pool, struct worker *w) {
+  struct tpool_task *t;
+  if (w && w->free) {
+    t              = w->free;
+    w->free        = t->next;
+    w->free_length -= 1;
+    return t;
+  }
+  spinlock_lock(&pool->free_lock);
+    t = pool->free;
+    if (t)
+      pool->free = t->next;
+    else {
+      struct task_chunk *c = malloc(sizeof(struct task_chunk));
+      assert(c);
+      c->next      = pool->chunks;
+      pool->chunks = c;
+      for (int i = 0; i < TASK_CHUNK; i++) {
+        c->tasks[i].pool    = pool;
+        c->tasks[i].seq     = 0;
+        c->tasks[i].waiters = NULL;
+        spinlock_create(&c->tasks[i].lock);
+        if (i > 0) {
+          c->tasks[i].next = pool->free;
+          pool->free       = &c->tasks[i];
+        }
+      }
+      t = &c->tasks[0];
+    }
+  spinlock_unlock(&pool->free_lock);
+  return t;
+}
+
+static void task_free(struct pool *pool, struct worker *w, struct tpool_task *t) {
+  if (w && w->free_length < FREE_CACHE_MAX) {
+    t->next         = w->free;
+    w->free         = t;
+    w->free_length += 1;
+  } else {
+    spinlock_lock(&pool->free_lock);
+      t->next    = pool->free;
+      pool->free = t;
+    spinlock_unlock(&pool->free_lock);
+  }
+}
+
+/**
+ * Run a task on worker w, then wake whoever waits for it, or for the pool to be idle
+ */
+static void task_run(struct pool *pool, struct worker *w, struct tpool_task *t) {
+  struct task_waiter *waiter, *next;
+  uthread_t           thread;
+  t->f(&w->view, t->arg);
+  spinlock_lock(&t->lock);
+    t->seq    += 1;
+    waiter     = t->waiters;
+    t->waiters = NULL;
+  spinlock_unlock(&t->lock);
+  task_free(pool, w, t);
+  // a waiter may return as soon as it sees done, so read it all before setting that
+  for (; waiter; waiter = next) {
+    next   = waiter->next;
+    thread = waiter->thread;
+    __atomic_store_n(&waiter->done, 1, __ATOMIC_RELEASE);
+    uthread_unblock(thread);
+  }
+  if (__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) == 0 && __atomic_load_n(&pool->joining, __ATOMIC_SEQ_CST)) {
+    uthread_mutex_lock(pool->mutex);
+      uthread_cond_broadcast(pool->all_done);
+    uthread_mutex_unlock(pool->mutex);
+  }
+}
+
+//
+// WORKERS
+//
+
+/**
+ * Put the list of n tasks from head to tail at the end of the injection list
+ */
+static void inject(struct pool *pool, struct tpool_task *head, struct tpool_task *tail, int n) {
+  tail->next = NULL;
+  spinlock_lock(&pool->inject_lock);
+    if (pool->inject_tail)
+      pool->inject_tail->next = head;
+    else
+      pool->inject_head = head;
+    pool->inject_tail = tail;
+    __atomic_add_fetch(&pool->inject_length, n, __ATOMIC_SEQ_CST);
+  spinlock_unlock(&pool->inject_lock);
+}
+
+/**
+ * Take a slice of the injection list: return its first task and push the others on w's deque,
+ * where other workers may steal them
+ */
+static struct tpool_task *inject_take(struct pool *pool, struct worker *w) {
+  struct tpool_task *t, *rest;
+  long               n;
+  if (__atomic_load_n(&pool->inject_length, __ATOMIC_ACQUIRE) == 0)
+    return NULL;
+  spinlock_lock(&pool->inject_lock);
+    n = pool->inject_length / pool->num_workers + 1;
+    if (n > INJECT_SLICE)
+      n = INJECT_SLICE;
+    if (n > pool->inject_length)
+      n = pool->inject_length;
+    t = pool->inject_head;
+    for (long i = 0; i < n; i++)
+      pool->inject_head = pool->inject_head->next;
+    if (! pool->inject_head)
+      pool->inject_tail = NULL;
+    __atomic_sub_fetch(&pool->inject_length, n, __ATOMIC_SEQ_CST);
+  spinlock_unlock(&pool->inject_lock);
+  if (n == 0)
+    return NULL;
+  // once pushed, a task may be stolen, run and freed, which reuses its next
+  rest = t->next;
+  for (long i = 1; i < n; i++) {
+    struct tpool_task *next = rest->next;
+    deque_push(&w->deque, rest);
+    rest = next;
+  }
+  return t;
+}
+
+static struct tpool_task *steal(struct pool *pool, struct worker *w) {
+  struct tpool_task *t;
+  unsigned int       start;
+  if (pool->num_workers < 2)
+    return NULL;
+  w->random ^= w->random << 13;
+  w->random ^= w->random >> 17;
+  w->random ^= w->random << 5;
+  start = w->random % pool->num_workers;
+  for (unsigned int i = 0; i < pool->num_workers; i++) {
+    struct worker *victim = &pool->workers[(start + i) % pool->num_workers];
+    if (victim != w && (t = deque_steal(&victim->deque)))
+      return t;
+  }
+  return NULL;
+}
+
+/**
+ * A task for w to run: its own newest, else a slice of the injection list, else a stolen one
+ */
+static struct tpool_task *find_task(struct pool *pool, struct worker *w) {
+  struct tpool_task *t;
+  if ((t = deque_pop(&w->deque)) || (t = inject_take(pool, w)) || (t = steal(pool, w)))
+    return t;
+  return NULL;
+}
+
+static int work_available(struct pool *pool) {
+  if (__atomic_load_n(&pool->inject_length, __ATOMIC_SEQ_CST))
+    return 1;
+  for (unsigned int i = 0; i < pool->num_workers; i++)
+    if (! deque_is_empty(&pool->workers[i].deque))
+      return 1;
+  return 0;
+}
+
+/**
+ * Wake idle workers, one for one task or all of them for more
+ *    the workers count themselves idle before they look for work a last time, and the
+ *    caller has published its tasks before this reads the count, so none sleeps through them
+ */
+static void wake(struct pool *pool, int n) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) == 0)
+    return;
+  uthread_mutex_lock(pool->mutex);
+    if (n == 1)
+      uthread_cond_signal(pool->work_available);
+    else
+      uthread_cond_broadcast(pool->work_available);
+  uthread_mutex_unlock(pool->mutex);
+}
+
 /**
  * Base procedure of every worker thread.  Calls available tasks
  * or blocks until a task becomes available.
  */
-void *worker_thread(void *pool_v) {
-  tpool_t pool = pool_v;
+void *worker_thread(void *worker_v) {
+  struct worker     *w    = worker_v;
+  struct pool       *pool = w->view.pool;
+  struct tpool_task *t;
+  int                shutdown;
 
-  // TODO
-  return NULL; // TODO: replace this placehold return value
+  for (;;) {
+    if ((t = find_task(pool, w))) {
+      task_run(pool, w, t);
+      continue;
+    }
+    uthread_mutex_lock(pool->mutex);
+      __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      while (! pool->shutdown && ! work_available(pool))
+        uthread_cond_wait(pool->work_available);
+      __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      shutdown = pool->shutdown;
+    uthread_mutex_unlock(pool->mutex);
+    if (shutdown)
+      return NULL;
+  }
 }
 
 /**
  * Create a new thread pool with max_threads thread-count limit.
  */
 tpool_t tpool_create(unsigned int max_threads) {
-    // TODO
+  struct pool *pool;
+  assert(max_threads > 0);
+  pool = calloc(1, sizeof(struct pool));
+  pool->outside.pool   = pool;
+  pool->outside.worker = NULL;
+  pool->num_workers    = max_threads;
+  spinlock_create(&pool->inject_lock);
+  spinlock_create(&pool->free_lock);
+  pool->mutex          = uthread_mutex_create();
+  pool->work_available = uthread_cond_create(pool->mutex);
+  pool->all_done       = uthread_cond_create(pool->mutex);
+  if (posix_memalign((void **) &pool->workers, 64, max_threads * sizeof(struct worker)))
+    assert(0);
+  for (unsigned int i = 0; i < max_threads; i++) {
+    struct worker *w = &pool->workers[i];
+    w->view.pool   = pool;
+    w->view.worker = w;
+    w->free        = NULL;
+    w->free_length = 0;
+    w->random      = 2463534242u + i;
+    deque_init(&w->deque);
+  }
+  // the workers must all exist before any can steal
+  for (unsigned int i = 0; i < max_threads; i++)
+    pool->workers[i].thread = uthread_create(worker_thread, &pool->workers[i]);
+  return &pool->outside;
 }
 
 /**
  * Sechedule task f(arg) to be executed.
  */
-void tpool_schedule_task(tpool_t pool, void (*f)(tpool_t, void *), void *arg) {
-    // TODO
+tpool_task_t tpool_schedule_task(tpool_t view, void (*f)(tpool_t, void *), void *arg) {
+  struct pool       *pool = view->pool;
+  struct worker     *w    = view->worker && view->worker->thread == uthread_self() ? view->worker : NULL;
+  struct tpool_task *t    = task_alloc(pool, w);
+  tpool_task_t       handle;
+  t->f        = f;
+  t->arg      = arg;
+  handle.task = t;
+  handle.seq  = t->seq;
+  __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+  if (w)
+    deque_push(&w->deque, t);
+  else
+    inject(pool, t, t, 1);
+  wake(pool, 1);
+  return handle;
+}
+
+void tpool_schedule_batch(tpool_t view, void (*f)(tpool_t, void *), void **args, int n) {
+  struct pool       *pool = view->pool;
+  struct worker     *w    = view->worker && view->worker->thread == uthread_self() ? view->worker : NULL;
+  struct tpool_task *head = NULL, *tail = NULL;
+  if (n <= 0)
+    return;
+  __atomic_add_fetch(&pool->pending, n, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < n; i++) {
+    struct tpool_task *t = task_alloc(pool, w);
+    t->f   = f;
+    t->arg = args[i];
+    if (w)
+      deque_push(&w->deque, t);
+    else {
+      if (tail)
+        tail->next = t;
+      else
+        head = t;
+      tail = t;
+    }
+  }
+  if (! w)
+    inject(pool, head, tail, n);
+  wake(pool, n);
+}
+
+/**
+ * The worker whose thread is the caller, or NULL
+ */
+static struct worker *self_worker(struct pool *pool) {
+  uthread_t self = uthread_self();
+  for (unsigned int i = 0; i < pool->num_workers; i++)
+    if (pool->workers[i].thread == self)
+      return &pool->workers[i];
+  return NULL;
+}
+
+/**
+ * Wait for a task
+ *    a worker runs other tasks while it waits, since the one it waits for may be on its own
+ *    deque, or be waiting, through others, for tasks that no idle worker is left to run;
+ *    it blocks only once there is none to find
+ */
+void tpool_task_wait(tpool_task_t handle) {
+  struct tpool_task  *t      = handle.task;
+  struct pool        *pool   = t->pool;
+  struct worker      *w      = self_worker(pool);
+  struct task_waiter  waiter = {uthread_self(), 0, NULL};
+  struct tpool_task  *other;
+  for (;;) {
+    if (__atomic_load_n(&t->seq, __ATOMIC_ACQUIRE) != handle.seq)
+      return;
+    if (w && (other = find_task(pool, w))) {
+      task_run(pool, w, other);
+      continue;
+    }
+    spinlock_lock(&t->lock);
+      if (t->seq != handle.seq) {
+        spinlock_unlock(&t->lock);
+        return;
+      }
+      waiter.next = t->waiters;
+      t->waiters  = &waiter;
+    spinlock_unlock(&t->lock);
+    while (! __atomic_load_n(&waiter.done, __ATOMIC_ACQUIRE))
+      uthread_block();
+    return;
+  }
 }
 
 /**
  * Wait (by blocking) until all tasks have completed and thread pool is thus idle
  */
-void tpool_join(tpool_t pool) {
-    // TODO
+void tpool_join(tpool_t view) {
+  struct pool *pool = view->pool;
+  uthread_mutex_lock(pool->mutex);
+    __atomic_add_fetch(&pool->joining, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+      uthread_cond_wait(pool->all_done);
+    __atomic_sub_fetch(&pool->joining, 1, __ATOMIC_SEQ_CST);
+  uthread_mutex_unlock(pool->mutex);
+}
+
+void tpool_destroy(tpool_t view) {
+  struct pool *pool = view->pool;
+  tpool_join(view);
+  uthread_mutex_lock(pool->mutex);
+    pool->shutdown = 1;
+    uthread_cond_broadcast(pool->work_available);
+  uthread_mutex_unlock(pool->mutex);
+  for (unsigned int i = 0; i < pool->num_workers; i++) {
+    struct deque_array *a, *prev;
+    uthread_join(pool->workers[i].thread, NULL);
+    for (a = pool->workers[i].deque.array; a; a = prev) {
+      prev = a->prev;
+      free(a);
+    }
+  }
+  while (pool->chunks) {
+    struct task_chunk *c = pool->chunks;
+    pool->chunks = c->next;
+    free(c);
+  }
+  uthread_cond_destroy(pool->work_available);
+  uthread_cond_destroy(pool->all_done);
+  uthread_mutex_destroy(pool->mutex);
+  free(pool->workers);
+  free(pool);
 }
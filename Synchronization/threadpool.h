@@ -2,6 +2,43 @@
 
 typedef struct tpool *tpool_t;
 
+/**
+ * A scheduled task, that can be waited for by itself
+ *    handles need not be released: a handle whose task has completed stays valid
+ *    until the pool is destroyed, and waiting for it returns at once
+ */
+typedef struct {
+  struct tpool_task *task;
+  unsigned long      seq;
+} tpool_task_t;
+
 tpool_t tpool_create(unsigned int max_threads);
-void tpool_schedule_task(tpool_t pool, void (*f)(tpool_t, void *), void *arg);
+
+/**
+ * Schedule f(pool, arg)
+ *    a task that schedules more tasks with the pool it is passed puts them on its
+ *    own worker's deque, from which idle workers steal
+ */
+tpool_task_t tpool_schedule_task(tpool_t pool, void (*f)(tpool_t, void *), void *arg);
+
+/**
+ * Schedule f(pool, args[i]) for the n args, with one wake-up of the idle workers
+ */
+void tpool_schedule_batch(tpool_t pool, void (*f)(tpool_t, void *), void **args, int n);
+
+/**
+ * Wait until task has completed
+ *    a task may wait for another: its worker runs other tasks meanwhile, and blocks only
+ *    when it finds none, so tasks that spawn and wait for children cannot run out of workers
+ */
+void tpool_task_wait(tpool_task_t task);
+
+/**
+ * Wait (by blocking) until all tasks have completed and thread pool is thus idle
+ */
 void tpool_join(tpool_t pool);
+
+/**
+ * Join the pool, stop its threads and free it
+ */
+void tpool_destroy(tpool_t pool);
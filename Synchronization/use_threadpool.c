@@ -1,10 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "uthread.h"
 #include "threadpool.h"
 
+#define BATCH_SIZE      1024
+#define LATENCY_SAMPLES 10000
+
 void my_task(tpool_t pool, void *arg) {
   long i = (long) arg;
   printf("Task %ld started\n", i);
@@ -12,19 +17,118 @@ void my_task(tpool_t pool, void *arg) {
   printf("Task %ld ended\n", i);
 }
 
+static long now_nsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void empty_task(tpool_t pool, void *arg) {
+}
+
+/**
+ * Spawn a binary tree of tasks of depth arg, through the worker's pool so the children stay local
+ */
+void tree_task(tpool_t pool, void *arg) {
+  long depth = (long) arg;
+  if (depth > 0) {
+    tpool_schedule_task(pool, tree_task, (void *) (depth - 1));
+    tpool_schedule_task(pool, tree_task, (void *) (depth - 1));
+  }
+}
+
+/**
+ * Spawn a child and wait for it, as a task
+ */
+void wait_task(tpool_t pool, void *arg) {
+  tpool_task_wait(tpool_schedule_task(pool, empty_task, NULL));
+}
+
+static long scheduled_at[LATENCY_SAMPLES], latency[LATENCY_SAMPLES];
+
+void latency_task(tpool_t pool, void *arg) {
+  long i = (long) arg;
+  latency[i] = now_nsec() - scheduled_at[i];
+}
+
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *) a, y = *(const long *) b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Measure the pool with num_threads workers: empty tasks per second scheduled one at a time,
+ * in batches, and spawned by tasks, tasks per second that each wait for a child, and the time
+ * from scheduling a task to its start, when the pool is otherwise idle
+ */
+static void bench(int num_threads, int num_tasks) {
+  static void *args[BATCH_SIZE];
+  tpool_t pool = tpool_create(num_threads);
+  long    start, single, batch, nested, depth, nested_tasks, waiting;
+  int     samples = num_tasks < LATENCY_SAMPLES ? num_tasks : LATENCY_SAMPLES;
+
+  start = now_nsec();
+  for (long i = 0; i < num_tasks; i++)
+    tpool_schedule_task(pool, empty_task, NULL);
+  tpool_join(pool);
+  single = now_nsec() - start;
+
+  start = now_nsec();
+  for (long i = 0; i < num_tasks; i += BATCH_SIZE)
+    tpool_schedule_batch(pool, empty_task, args, num_tasks - i < BATCH_SIZE ? num_tasks - i : BATCH_SIZE);
+  tpool_join(pool);
+  batch = now_nsec() - start;
+
+  for (depth = 0; (2L << (depth + 1)) - 1 <= num_tasks; depth++) ;
+  nested_tasks = (2L << depth) - 1;
+  start = now_nsec();
+  tpool_schedule_task(pool, tree_task, (void *) depth);
+  tpool_join(pool);
+  nested = now_nsec() - start;
+
+  start = now_nsec();
+  for (long i = 0; i < num_tasks; i++)
+    tpool_schedule_task(pool, wait_task, NULL);
+  tpool_join(pool);
+  waiting = now_nsec() - start;
+
+  for (long i = 0; i < samples; i++) {
+    scheduled_at[i] = now_nsec();
+    tpool_task_wait(tpool_schedule_task(pool, latency_task, (void *) i));
+  }
+  qsort(latency, samples, sizeof(long), compare_long);
+
+  printf("%7d %14.0f %14.0f %14.0f %14.0f %10.1f %10.1f\n", num_threads,
+         num_tasks * 1e9 / single, num_tasks * 1e9 / batch, nested_tasks * 1e9 / nested,
+         num_tasks * 1e9 / waiting,
+         latency[samples / 2] / 1e3, latency[samples * 99 / 100] / 1e3);
+  tpool_destroy(pool);
+}
+
 int main(int argc, char *argv[]) {
 
   tpool_t pool;
   int num_threads, num_tasks;
 
+  if (argc == 4 && strcmp(argv[1], "bench") == 0) {
+    num_threads = strtol(argv[2], NULL, 10);
+    num_tasks = strtol(argv[3], NULL, 10);
+    uthread_init(8);
+    printf("threads    single/sec      batch/sec     nested/sec       wait/sec    p50(us)    p99(us)\n");
+    for (int n = 1; n <= num_threads; n *= 2)
+      bench(n, num_tasks);
+    return 0;
+  }
+
   if (argc != 3) {
     fprintf(stderr, "Usage: %s NUM_THREADS NUM_TASKS\n", argv[0]);
+    fprintf(stderr, "       %s bench MAX_THREADS NUM_TASKS\n", argv[0]);
     return -1;
   }
-  
+
   num_threads = strtol(argv[1], NULL, 10);
   num_tasks = strtol(argv[2], NULL, 10);
-  
+
   uthread_init(8);
   pool = tpool_create(num_threads);
 
@@ -32,6 +136,6 @@ int main(int argc, char *argv[]) {
     tpool_schedule_task(pool, my_task, (void *) i);
 
   tpool_join(pool);
-  
+
   return 0;
 }
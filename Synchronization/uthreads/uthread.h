@@ -1,6 +1,8 @@
 #ifndef __uthread_h__
 #define __uthread_h__
 
+#include <stddef.h>
+
 /* Basic definitions for the uthread_t type. (Ignore uthread_TCB, that's an implementation detail) */
 struct uthread_TCB;
 typedef struct uthread_TCB* uthread_t;
@@ -11,10 +13,49 @@ num_processors specifies the number of virtual cores in the CPU (number of
 simultaneously-executing uthreads). */
 void      uthread_init    (int num_processors);
 
+/* Initialize the uthread library like uthread_init, but run each virtual core on
+one CPU only, one of cpus[0] to cpus[num_processors-1] each. Each core then allocates its ready queue, and the stacks of the
+threads it creates, on the NUMA node of its CPU, and takes work from cores on
+the same node before the others. Pinning is only done on Linux. */
+void      uthread_init_with_cpus (int num_processors, const int* cpus);
+
+/* Set the time-slice quantum: a running uthread is preempted for the other
+ready threads once it ran for quantum_usec microseconds of CPU time. A thread is
+only preempted in the program's own code, never in the C library, in a handler
+or in a critical section of the uthread library. Call before uthread_init; 0, the
+default, disables preemption. */
+void      uthread_set_quantum (unsigned int quantum_usec);
+
 /* Create a uthread. The created uthread will call start_proc(start_arg), and
 its return value will be made available via uthread_join. */
 uthread_t uthread_create  (void* (*start_proc)(void*), void* start_arg);
 
+/* Create a uthread with a stack of stack_size bytes (0 for the default of
+8 MB). The stack is followed by a guard page, so an overflow faults instead
+of corrupting memory. Small stacks make threads cheaper to create and keep;
+the stacks and TCBs of exited threads are reused. */
+uthread_t uthread_create_with_stack_size (void* (*start_proc)(void*), void* start_arg, size_t stack_size);
+
+/* Priorities: a ready thread of a higher priority runs before those of lower
+ones. Threads run at UTHREAD_PRIORITY_DEFAULT unless created with or set to another. */
+#define UTHREAD_PRIORITY_MIN     0
+#define UTHREAD_PRIORITY_DEFAULT 3
+#define UTHREAD_PRIORITY_MAX     7
+
+/* Create a uthread that runs at a priority from UTHREAD_PRIORITY_MIN to UTHREAD_PRIORITY_MAX. */
+uthread_t uthread_create_with_priority (void* (*start_proc)(void*), void* start_arg, int priority);
+
+/* Change the priority of a thread, or get it. A change takes effect the next time the thread
+is made ready. A thread holding a mutex runs at the priority of its highest waiter, if higher. */
+void      uthread_set_priority (uthread_t thread, int priority);
+int       uthread_get_priority (uthread_t thread);
+
+/* Give a thread a deadline, an absolute CLOCK_MONOTONIC time, or remove it with NULL.
+Ready threads with a deadline run before all others, earliest deadline first. Only
+change the deadline of a thread that is running or blocked. */
+struct timespec;
+void      uthread_set_deadline (uthread_t thread, const struct timespec* deadline);
+
 /* Detach a uthread. This prevents the thread from being joined. When the detached
 thread exits, it will automatically be freed. join and detach are mutually exclusive. */
 void      uthread_detach  (uthread_t thread);
@@ -35,7 +76,66 @@ void      uthread_block(void);
 
 /* Unblock another thread, allowing it to run again.
 Note: if the target thread is not currently blocked, the target's next
-call to uthread_block will return immediately, effectively unblocking it. */
+call to uthread_block will return immediately, effectively unblocking it.
+This may also be called from a pthread that the library did not create, such as
+an I/O completion thread; the thread then runs on the first processor free. */
 void      uthread_unblock (uthread_t thread);
 
+/* Work for a given virtual core: proc (arg) is called there, in the order the work was
+added, the next time the core switches threads, or at once if it is idle. proc runs between
+threads, so it must not block or yield, but it may unblock threads. The caller provides the
+node, which must stay valid until proc is called; this may be called from any pthread. */
+struct uthread_work {
+  void               (*proc) (void*);
+  void*                arg;
+  struct uthread_work* next;
+};
+void      uthread_run_on  (int processor, struct uthread_work* work);
+
+/* Scheduling statistics of a thread: how often it was switched to and why it gave up
+its processor, and how long it ran, waited ready for a processor and was blocked. */
+struct uthread_stats {
+  unsigned long      switches;
+  unsigned long      yields;
+  unsigned long      preemptions;
+  unsigned long      blocks;
+  unsigned long long run_nsec;
+  unsigned long long ready_nsec;
+  unsigned long long blocked_nsec;
+};
+
+/* Statistics of a virtual core: the totals of the threads it ran, the iterations it
+spun waiting for spinlocks, how often and how long it was parked idle, and a histogram
+of the time threads waited ready, where bucket i counts waits of 2^i to 2^(i+1) ns. */
+#define UTHREAD_STATS_BUCKETS 32
+struct uthread_processor_stats {
+  struct uthread_stats threads;
+  unsigned long        spinlock_spins;
+  unsigned long        parks;
+  unsigned long long   idle_nsec;
+  unsigned long        ready_histogram [UTHREAD_STATS_BUCKETS];
+};
+
+/* Take a snapshot of the statistics of a thread, which must not be freed, or of a virtual
+core from 0 to num_processors-1. Counters are updated without synchronization, so a
+snapshot taken while threads run is only approximately consistent. */
+void      uthread_get_stats           (uthread_t thread, struct uthread_stats* stats);
+void      uthread_get_processor_stats (int processor, struct uthread_processor_stats* stats);
+
+/* Print the statistics of every virtual core to stderr, now or, after a call with a
+non-zero interval_msec, every interval_msec milliseconds. Call after uthread_init. */
+void      uthread_dump_stats          (void);
+void      uthread_set_stats_interval  (unsigned int interval_msec);
+
+/* Record a trace of the last events_per_processor events of each virtual core, and
+write it to the file at path at exit, in the Chrome trace JSON format that chrome://tracing
+and Perfetto load. The trace shows which thread ran on each core, when threads were
+created and unblocked, and the events passed to uthread_trace. Call before uthread_init. */
+void      uthread_set_trace (const char* path, unsigned long events_per_processor);
+
+/* Record an event in the trace, if there is one; name must stay valid until exit. phase
+is 'i' for an instant, or 'b' at the start and 'e' at the end of an interval, such as an
+I/O, that can begin and end on different cores; both carry the same id. */
+void      uthread_trace     (const char* name, char phase, unsigned long id);
+
 #endif
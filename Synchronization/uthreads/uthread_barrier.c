@@ -0,0 +1,199 @@
+//
+// Written by Mike Feeley, University of BC, 2010-2014
+// Do not redistribute any portion of this code without permission.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "uthread.h"
+#include "uthread_barrier.h"
+
+//
+// BARRIERS
+//
+// An arriving thread takes the next index with an atomic increment and
+// stores itself at that index in the waiter array of the current phase;
+// the last one to arrive starts the next phase, so that arrivals of the
+// next phase use the other array, and wakes the waiters at 0 and 1. The
+// waiter at i, once woken, wakes those at 2i+2 and 2i+3. A phase can only
+// end once every thread of the previous one returned, so two arrays are
+// enough.
+//
+
+struct uthread_barrier {
+  int                 count;
+  volatile int        arrived;
+  volatile unsigned   phase;
+  uthread_t volatile* waiters [2];
+};
+
+/**
+ * barrier_wake
+ *    Wake the waiter at i, if the phase had one there.
+ */
+
+static void barrier_wake (uthread_barrier_t barrier, uthread_t volatile* waiters, int i) {
+  uthread_t waiter_thread;
+
+  if (i >= barrier->count - 1)
+    return;
+  // it may have counted itself in but not stored itself yet
+  while (! (waiter_thread = __atomic_exchange_n (&waiters [i], 0, __ATOMIC_ACQ_REL)))
+    uthread_yield();
+  uthread_unblock (waiter_thread);
+}
+
+/**
+ * uthread_barrier_create
+ */
+
+uthread_barrier_t uthread_barrier_create (int count) {
+  uthread_barrier_t barrier = malloc (sizeof (struct uthread_barrier));
+
+  assert (count > 0);
+  barrier->count   = count;
+  barrier->arrived = 0;
+  barrier->phase   = 0;
+  for (int i = 0; i < 2; i++) {
+    barrier->waiters [i] = calloc (count, sizeof (uthread_t));
+    assert (barrier->waiters [i]);
+  }
+  return barrier;
+}
+
+/**
+ * uthread_barrier_destroy
+ */
+
+void uthread_barrier_destroy (uthread_barrier_t barrier) {
+  free ((void*) barrier->waiters [0]);
+  free ((void*) barrier->waiters [1]);
+  free (barrier);
+}
+
+/**
+ * uthread_barrier_wait
+ */
+
+int uthread_barrier_wait (uthread_barrier_t barrier) {
+  unsigned            phase   = __atomic_load_n (&barrier->phase, __ATOMIC_ACQUIRE);
+  uthread_t volatile* waiters = barrier->waiters [phase & 1];
+  int                 i       = __atomic_fetch_add (&barrier->arrived, 1, __ATOMIC_ACQ_REL);
+
+  if (i == barrier->count - 1) {
+    // no thread arrives for the next phase before it starts
+    barrier->arrived = 0;
+    __atomic_store_n (&barrier->phase, phase + 1, __ATOMIC_RELEASE);
+    barrier_wake (barrier, waiters, 0);
+    barrier_wake (barrier, waiters, 1);
+    return UTHREAD_BARRIER_SERIAL_THREAD;
+  }
+  __atomic_store_n (&waiters [i], uthread_self(), __ATOMIC_RELEASE);
+  // the phase changes before we are woken
+  do
+    uthread_block();
+  while (__atomic_load_n (&barrier->phase, __ATOMIC_ACQUIRE) == phase);
+  barrier_wake (barrier, waiters, 2 * i + 2);
+  barrier_wake (barrier, waiters, 2 * i + 3);
+  return 0;
+}
+
+//
+// LATCHES
+//
+// Waiters push a node from their stack onto a list, until the last count
+// down replaces the list with LATCH_OPEN and moves it to released. Each
+// released thread pops and wakes two more. Nothing is pushed onto released,
+// so popping it with a compare-and-swap is safe from ABA.
+//
+
+struct latch_waiter {
+  uthread_t            thread;
+  struct latch_waiter* next;
+  volatile int         woken;
+};
+
+#define LATCH_OPEN ((struct latch_waiter*) 1)
+
+struct uthread_latch {
+  volatile int                  count;
+  struct latch_waiter* volatile waiters;
+  struct latch_waiter* volatile released;
+};
+
+/**
+ * latch_wake
+ *    Wake the next released waiter, if there is one.
+ */
+
+static void latch_wake (uthread_latch_t latch) {
+  struct latch_waiter* waiter = __atomic_load_n (&latch->released, __ATOMIC_ACQUIRE);
+  uthread_t            waiter_thread;
+
+  while (waiter && ! __atomic_compare_exchange_n (&latch->released, &waiter, waiter->next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    ;
+  if (waiter) {
+    // once woken is set the waiter may return, and its node is gone
+    waiter_thread = waiter->thread;
+    __atomic_store_n (&waiter->woken, 1, __ATOMIC_RELEASE);
+    uthread_unblock (waiter_thread);
+  }
+}
+
+/**
+ * uthread_latch_create
+ */
+
+uthread_latch_t uthread_latch_create (int count) {
+  uthread_latch_t latch = malloc (sizeof (struct uthread_latch));
+
+  assert (count >= 0);
+  latch->count    = count;
+  latch->waiters  = count ? 0 : LATCH_OPEN;
+  latch->released = 0;
+  return latch;
+}
+
+/**
+ * uthread_latch_destroy
+ */
+
+void uthread_latch_destroy (uthread_latch_t latch) {
+  free (latch);
+}
+
+/**
+ * uthread_latch_count_down
+ */
+
+void uthread_latch_count_down (uthread_latch_t latch) {
+  int count = __atomic_fetch_sub (&latch->count, 1, __ATOMIC_ACQ_REL);
+
+  assert (count > 0);
+  if (count == 1) {
+    __atomic_store_n (&latch->released, __atomic_exchange_n (&latch->waiters, LATCH_OPEN, __ATOMIC_ACQ_REL), __ATOMIC_RELEASE);
+    latch_wake (latch);
+    latch_wake (latch);
+  }
+}
+
+/**
+ * uthread_latch_wait
+ */
+
+void uthread_latch_wait (uthread_latch_t latch) {
+  struct latch_waiter  waiter = {uthread_self(), 0, 0};
+  struct latch_waiter* head   = __atomic_load_n (&latch->waiters, __ATOMIC_ACQUIRE);
+
+  do {
+    if (head == LATCH_OPEN)
+      return;
+    waiter.next = head;
+  } while (! __atomic_compare_exchange_n (&latch->waiters, &head, &waiter, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  do
+    uthread_block();
+  while (! __atomic_load_n (&waiter.woken, __ATOMIC_ACQUIRE));
+  latch_wake (latch);
+  latch_wake (latch);
+}
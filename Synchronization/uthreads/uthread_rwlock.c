@@ -0,0 +1,276 @@
+//
+// Written by Mike Feeley, University of BC, 2010-2014
+// Do not redistribute any portion of this code without permission.
+//
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include "spinlock.h"
+#include "uthread.h"
+#include "uthread_util.h"
+#include "uthread_rwlock.h"
+
+//
+// READER-WRITER LOCKS
+//
+// Each processor has its own counter of readers, on its own cache line. A
+// reader increments the counter of its processor and, if the writer flag is
+// clear, holds the lock; a reader may unlock on another processor than it
+// locked on, so counters can go negative and only their sum is the number
+// of readers. A writer sets the writer flag, which sends new readers to the
+// slow path, and waits for the sum to drop to zero. All increments that got
+// in happen before the flag is seen set, so a sum read afterwards never
+// misses a reader. The spinlock guards everything but the counters.
+//
+// Only one writer at a time (the holder) drains the readers; the others
+// wait for unlock to hand them the lock. Readers that wait are counted by
+// whoever releases them, so they return holding the lock; the queue is
+// released all at once, and advancing released tells them it has been.
+//
+
+struct rwlock_counter {
+  volatile long readers;
+} __attribute__ ((aligned (64)));
+
+struct uthread_rwlock {
+  volatile int           writer;
+  int                    policy;
+  int                    num_counters;
+  struct rwlock_counter* counters;
+  spinlock_t             spinlock;
+  uthread_t volatile     holder;
+  uthread_t volatile     draining;
+  int                    writers;
+  unsigned long volatile released;
+  uthread_queue_t        writer_queue;
+  uthread_queue_t        reader_queue;
+};
+
+/**
+ * rwlock_counter
+ *    The reader counter of the caller's processor, or the first one on a
+ *    pthread that is not a processor.
+ */
+
+static inline struct rwlock_counter* rwlock_counter (uthread_rwlock_t rwlock) {
+  int processor = uthread_processor();
+  return &rwlock->counters [processor < 0 ? 0 : processor % rwlock->num_counters];
+}
+
+/**
+ * rwlock_readers
+ */
+
+static long rwlock_readers (uthread_rwlock_t rwlock) {
+  long readers = 0;
+  for (int i = 0; i < rwlock->num_counters; i++)
+    readers += __atomic_load_n (&rwlock->counters [i].readers, __ATOMIC_SEQ_CST);
+  return readers;
+}
+
+/**
+ * rwlock_release_readers
+ *    Called with rwlock->spinlock held. Count the waiting readers in and move
+ *    them to wakeup_queue.
+ */
+
+static void rwlock_release_readers (uthread_rwlock_t rwlock, uthread_queue_t* wakeup_queue) {
+  uthread_t reader_thread;
+
+  while ((reader_thread = uthread_dequeue (&rwlock->reader_queue))) {
+    __atomic_fetch_add (&rwlock_counter (rwlock)->readers, 1, __ATOMIC_SEQ_CST);
+    uthread_enqueue (wakeup_queue, reader_thread);
+  }
+  __atomic_store_n (&rwlock->released, rwlock->released + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * rwlock_unblock
+ */
+
+static void rwlock_unblock (uthread_queue_t* wakeup_queue) {
+  uthread_t waiter_thread;
+
+  while ((waiter_thread = uthread_dequeue (wakeup_queue)))
+    uthread_unblock (waiter_thread);
+}
+
+/**
+ * rwlock_wake_drained
+ *    Called by a reader that left while a writer drains: wake the writer if
+ *    there are no readers left.
+ */
+
+static void rwlock_wake_drained (uthread_rwlock_t rwlock) {
+  uthread_t writer_thread;
+
+  spinlock_lock (&rwlock->spinlock);
+  writer_thread = rwlock->draining;
+  if (writer_thread && rwlock_readers (rwlock) == 0)
+    rwlock->draining = 0;
+  else
+    writer_thread = 0;
+  spinlock_unlock (&rwlock->spinlock);
+  if (writer_thread)
+    uthread_unblock (writer_thread);
+}
+
+/**
+ * rwlock_drain
+ *    Called by the holder with rwlock->spinlock held, which is held again on
+ *    return: wait until there are no readers. With PREFER_READERS, readers
+ *    keep coming in until the writer finds none.
+ */
+
+static void rwlock_drain (uthread_rwlock_t rwlock, uthread_t self) {
+  uthread_queue_t wakeup_queue;
+
+  uthread_initqueue (&wakeup_queue);
+  while (1) {
+    __atomic_store_n (&rwlock->writer, 1, __ATOMIC_SEQ_CST);
+    if (rwlock_readers (rwlock) == 0)
+      return;
+    __atomic_store_n (&rwlock->draining, self, __ATOMIC_SEQ_CST);
+    if (rwlock->policy == UTHREAD_RWLOCK_PREFER_READERS) {
+      __atomic_store_n (&rwlock->writer, 0, __ATOMIC_SEQ_CST);
+      rwlock_release_readers (rwlock, &wakeup_queue);
+    }
+    // a reader leaving from now on sees draining and wakes us if it was the last
+    if (rwlock_readers (rwlock) == 0) {
+      rwlock->draining = 0;
+      continue;
+    }
+    spinlock_unlock (&rwlock->spinlock);
+    rwlock_unblock (&wakeup_queue);
+    do
+      uthread_block();
+    while (rwlock->draining == self);
+    spinlock_lock (&rwlock->spinlock);
+  }
+}
+
+/**
+ * uthread_rwlock_create
+ */
+
+uthread_rwlock_t uthread_rwlock_create (int policy) {
+  uthread_rwlock_t rwlock = malloc (sizeof (struct uthread_rwlock));
+
+  assert (policy >= UTHREAD_RWLOCK_PREFER_WRITERS && policy <= UTHREAD_RWLOCK_FAIR);
+  rwlock->writer       = 0;
+  rwlock->policy       = policy;
+  rwlock->num_counters = uthread_num_processors();
+  assert (rwlock->num_counters > 0);
+  rwlock->counters     = aligned_alloc (sizeof (struct rwlock_counter), rwlock->num_counters * sizeof (struct rwlock_counter));
+  for (int i = 0; i < rwlock->num_counters; i++)
+    rwlock->counters [i].readers = 0;
+  spinlock_create (&rwlock->spinlock);
+  rwlock->holder       = 0;
+  rwlock->draining     = 0;
+  rwlock->writers      = 0;
+  rwlock->released     = 0;
+  uthread_initqueue (&rwlock->writer_queue);
+  uthread_initqueue (&rwlock->reader_queue);
+  return rwlock;
+}
+
+/**
+ * uthread_rwlock_destroy
+ */
+
+void uthread_rwlock_destroy (uthread_rwlock_t rwlock) {
+  free (rwlock->counters);
+  free (rwlock);
+}
+
+/**
+ * uthread_rwlock_lock_read
+ */
+
+void uthread_rwlock_lock_read (uthread_rwlock_t rwlock) {
+  unsigned long released;
+
+  __atomic_fetch_add (&rwlock_counter (rwlock)->readers, 1, __ATOMIC_SEQ_CST);
+  if (! __atomic_load_n (&rwlock->writer, __ATOMIC_SEQ_CST))
+    return;
+  __atomic_fetch_sub (&rwlock_counter (rwlock)->readers, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&rwlock->draining, __ATOMIC_SEQ_CST))
+    rwlock_wake_drained (rwlock);
+
+  spinlock_lock (&rwlock->spinlock);
+  if (! rwlock->writer) {
+    __atomic_fetch_add (&rwlock_counter (rwlock)->readers, 1, __ATOMIC_SEQ_CST);
+    spinlock_unlock (&rwlock->spinlock);
+  } else {
+    // whoever releases us counts us in, and advances released
+    released = rwlock->released;
+    uthread_enqueue (&rwlock->reader_queue, uthread_self());
+    spinlock_unlock (&rwlock->spinlock);
+    do
+      uthread_block();
+    while (__atomic_load_n (&rwlock->released, __ATOMIC_ACQUIRE) == released);
+  }
+}
+
+/**
+ * uthread_rwlock_unlock_read
+ */
+
+void uthread_rwlock_unlock_read (uthread_rwlock_t rwlock) {
+  __atomic_fetch_sub (&rwlock_counter (rwlock)->readers, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n (&rwlock->draining, __ATOMIC_SEQ_CST))
+    rwlock_wake_drained (rwlock);
+}
+
+/**
+ * uthread_rwlock_lock_write
+ */
+
+void uthread_rwlock_lock_write (uthread_rwlock_t rwlock) {
+  uthread_t self = uthread_self();
+
+  spinlock_lock (&rwlock->spinlock);
+  rwlock->writers += 1;
+  if (rwlock->policy != UTHREAD_RWLOCK_PREFER_READERS)
+    __atomic_store_n (&rwlock->writer, 1, __ATOMIC_SEQ_CST);
+  if (rwlock->holder) {
+    // unlock sets holder before it unblocks us
+    uthread_enqueue (&rwlock->writer_queue, self);
+    spinlock_unlock (&rwlock->spinlock);
+    do
+      uthread_block();
+    while (rwlock->holder != self);
+    spinlock_lock (&rwlock->spinlock);
+  } else
+    rwlock->holder = self;
+  rwlock_drain (rwlock, self);
+  spinlock_unlock (&rwlock->spinlock);
+}
+
+/**
+ * uthread_rwlock_unlock_write
+ *    With PREFER_WRITERS the waiting readers are released only if no writer
+ *    waits; otherwise they go before the next writer, which then drains them.
+ */
+
+void uthread_rwlock_unlock_write (uthread_rwlock_t rwlock) {
+  uthread_queue_t wakeup_queue;
+  uthread_t       writer_thread;
+
+  uthread_initqueue (&wakeup_queue);
+  spinlock_lock (&rwlock->spinlock);
+  assert (rwlock->holder == uthread_self());
+  rwlock->writers -= 1;
+  if (rwlock->policy != UTHREAD_RWLOCK_PREFER_WRITERS || rwlock->writers == 0) {
+    if (rwlock->policy == UTHREAD_RWLOCK_PREFER_READERS || rwlock->writers == 0)
+      __atomic_store_n (&rwlock->writer, 0, __ATOMIC_SEQ_CST);
+    rwlock_release_readers (rwlock, &wakeup_queue);
+  }
+  writer_thread  = uthread_dequeue (&rwlock->writer_queue);
+  rwlock->holder = writer_thread;
+  if (writer_thread)
+    uthread_enqueue (&wakeup_queue, writer_thread);
+  spinlock_unlock (&rwlock->spinlock);
+  rwlock_unblock (&wakeup_queue);
+}